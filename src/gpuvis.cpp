@@ -21,13 +21,20 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
+#include <sys/stat.h>
+
 #include <string>
 #include <vector>
 #include <algorithm>
 #include <future>
 #include <set>
 #include <unordered_map>
+#include <list>
 #include <functional>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 
 #define SDL_MAIN_HANDLED
 #include <SDL.h>
@@ -43,9 +50,11 @@
 #include "trace-cmd/trace-read.h"
 
 #include "gpuvis_macros.h"
+#include "gpuvis_prof.h"
 #include "stlini.h"
 #include "gpuvis_utils.h"
 #include "gpuvis.h"
+#include "gpuvis_remote.h"
 
 // https://github.com/ocornut/imgui/issues/88
 #if defined( USE_GTK3 )
@@ -172,25 +181,164 @@ static bool imgui_begin_columns( const char *title,
 /*
  * StrPool
  */
-const char *StrPool::getstr( const char *str, size_t len )
+StrPool::StrPool()
+{
+    table_t *table = new table_t;
+
+    table->mask = 4096 - 1;
+    table->slots = new std::atomic< uint64_t >[ table->mask + 1 ]();
+    m_table = table;
+}
+
+StrPool::~StrPool()
+{
+    m_old_tables.push_back( m_table );
+
+    for ( table_t *table : m_old_tables )
+    {
+        delete [] table->slots;
+        delete table;
+    }
+
+    for ( uint32_t i = 0; i < s_id_chunks_max && m_id_chunks[ i ]; i++ )
+        delete [] m_id_chunks[ i ];
+}
+
+const char *StrPool::find( const table_t *table, const char *str, size_t len,
+                           uint32_t hashval, uint32_t *id )
+{
+    for ( uint32_t i = hashval & table->mask; ; i = ( i + 1 ) & table->mask )
+    {
+        uint64_t slot = table->slots[ i ].load( std::memory_order_acquire );
+
+        if ( !slot )
+            return NULL;
+
+        if ( ( uint32_t )( slot >> 32 ) == hashval )
+        {
+            uint32_t slotid = ( uint32_t )slot - 1;
+            const char *slotstr = idtostr( slotid );
+
+            if ( !memcmp( slotstr, str, len ) && !slotstr[ len ] )
+            {
+                if ( id )
+                    *id = slotid;
+                return slotstr;
+            }
+        }
+    }
+}
+
+void StrPool::insert( table_t *table, uint32_t hashval, uint32_t id )
+{
+    uint32_t i = hashval & table->mask;
+
+    while ( table->slots[ i ].load( std::memory_order_relaxed ) )
+        i = ( i + 1 ) & table->mask;
+
+    table->slots[ i ].store( ( ( uint64_t )hashval << 32 ) | ( id + 1 ), std::memory_order_release );
+}
+
+StrPool::table_t *StrPool::grow_table( table_t *table )
+{
+    table_t *newtable = new table_t;
+
+    newtable->mask = table->mask * 2 + 1;
+    newtable->slots = new std::atomic< uint64_t >[ newtable->mask + 1 ]();
+
+    for ( uint32_t i = 0; i <= table->mask; i++ )
+    {
+        uint64_t slot = table->slots[ i ].load( std::memory_order_relaxed );
+
+        if ( slot )
+            insert( newtable, ( uint32_t )( slot >> 32 ), ( uint32_t )slot - 1 );
+    }
+
+    m_table.store( newtable, std::memory_order_release );
+    m_old_tables.push_back( table );
+    return newtable;
+}
+
+const char *StrPool::getstr( const char *str, size_t len, uint32_t *id )
 {
+    PROF_SCOPE( PROF_StrPoolIntern );
+
+    if ( len == ( size_t )-1 )
+        len = strlen( str );
+
     uint32_t hashval = fnv_hashstr32( str, len );
-    const std::string *ret = m_pool.get_val( hashval );
+    const char *ret = find( m_table.load( std::memory_order_acquire ), str, len, hashval, id );
 
-    if ( !ret )
+    if ( ret )
+        return ret;
+
+    std::lock_guard< std::mutex > lock( m_mutex );
+    table_t *table = m_table.load( std::memory_order_relaxed );
+
+    // Check again - someone may have added it while we waited on the lock.
+    ret = find( table, str, len, hashval, id );
+    if ( ret )
+        return ret;
+
+    // Keep the load factor under 1/2.
+    if ( ( m_count + 1 ) * 2 > table->mask + 1 )
+        table = grow_table( table );
+
+    uint32_t newid = m_count;
+    uint32_t chunk = newid >> s_id_chunk_shift;
+
+    if ( chunk >= s_id_chunks_max )
     {
-        if ( len == ( size_t )-1 )
-            len = strlen( str );
-        ret = m_pool.get_val( hashval, std::string( str, len ) );
+        logf( "[Error] %s: Too many strings.", __func__ );
+        return "";
     }
-    return ret->c_str();
+
+    char *newstr = m_chars.alloc( len + 1 );
+
+    memcpy( newstr, str, len );
+    newstr[ len ] = 0;
+
+    if ( !m_id_chunks[ chunk ] )
+        m_id_chunks[ chunk ] = new const char *[ s_id_chunk_size ];
+    m_id_chunks[ chunk ][ newid & ( s_id_chunk_size - 1 ) ] = newstr;
+
+    // Publish the slot after the string and id entry are written.
+    insert( table, hashval, newid );
+    m_count++;
+
+    if ( id )
+        *id = newid;
+    return newstr;
 }
 
 const char *StrPool::findstr( uint32_t hashval )
 {
-    std::string *str = m_pool.get_val( hashval );
+    const table_t *table = m_table.load( std::memory_order_acquire );
+
+    for ( uint32_t i = hashval & table->mask; ; i = ( i + 1 ) & table->mask )
+    {
+        uint64_t slot = table->slots[ i ].load( std::memory_order_acquire );
+
+        if ( !slot )
+            return NULL;
+
+        if ( ( uint32_t )( slot >> 32 ) == hashval )
+            return idtostr( ( uint32_t )slot - 1 );
+    }
+}
+
+size_t StrPool::bytes_allocated()
+{
+    std::lock_guard< std::mutex > lock( m_mutex );
+    size_t bytes = m_chars.bytes_allocated();
 
-    return str ? str->c_str() : NULL;
+    bytes += ( m_table.load()->mask + 1 ) * sizeof( uint64_t );
+    for ( table_t *table : m_old_tables )
+        bytes += ( table->mask + 1 ) * sizeof( uint64_t );
+    for ( uint32_t i = 0; i < s_id_chunks_max && m_id_chunks[ i ]; i++ )
+        bytes += s_id_chunk_size * sizeof( const char * );
+
+    return bytes;
 }
 
 /*
@@ -237,6 +385,17 @@ void Opts::init()
     init_opt( OPT_EventListRowCount, "Event List Size: %.0f", "eventlist_rows", 0, 0, 100, OPT_Int | OPT_Hidden );
     init_opt( OPT_Scale, "Font Scale: %.1f", "scale", 2.0f, 0.25f, 6.0f, OPT_Float | OPT_Hidden );
     init_opt_bool( OPT_UseFreetype, "Use Freetype", "use_freetype", true, OPT_Hidden );
+    init_opt_bool( OPT_ParallelLoad, "Decode trace cpu buffers in parallel", "parallel_load", true );
+    init_opt_bool( OPT_UseTraceCache, "Cache decoded traces (.gpuviscache)", "use_trace_cache", true );
+    init_opt_bool( OPT_LazyFields, "Format event fields on demand (skips writing trace cache)", "lazy_fields", false );
+    init_opt_bool( OPT_PagedFields, "Read lazy event fields from trace file instead of memory", "paged_fields", false );
+    init_opt( OPT_PageCacheSize, "Field Page Cache: %.0fMB", "page_cache_mb", 256, 16, 4096, OPT_Int );
+    init_opt_bool( OPT_GraphInstancing, "Draw graph events with GL instancing", "graph_instancing", true );
+    init_opt_bool( OPT_IdleWait, "Wait for input when idle", "idle_wait", true );
+    init_opt_bool( OPT_Profile, "Time hot paths", "profile", false, OPT_Hidden );
+    init_opt( OPT_LiveBufferSize, "Live Capture Buffer: %.0fMB", "live_buffer_mb", 128, 4, 4096, OPT_Int );
+    init_opt( OPT_LiveWindow, "Live Capture Window: %.1fs", "live_window", 2.0f, 0.0f, 60.0f, OPT_Float );
+    init_opt_bool( OPT_LiveFollow, "Keep loading live capture snapshots", "live_follow", false );
 
     for ( uint32_t i = OPT_RenderCrtc0; i <= OPT_RenderCrtc9; i++ )
     {
@@ -307,6 +466,7 @@ option_id_t Opts::add_opt_graph_rowsize( const char *row_name, int defval )
     m_options.push_back( opt );
     m_graph_rowname_optid_map.m_map[ fullname ] = optid;
 
+    m_generation++;
     return optid;
 }
 
@@ -347,6 +507,9 @@ bool Opts::getcrtc( int crtc )
 
 void Opts::setf( option_id_t optid, float valf, float valf_min, float valf_max )
 {
+    if ( m_options[ optid ].valf != valf )
+        m_generation++;
+
     m_options[ optid ].valf = valf;
 
     if ( valf_min != FLT_MAX )
@@ -360,6 +523,9 @@ void Opts::setb( option_id_t optid, bool valb )
 {
     assert( m_options[ optid ].flags & OPT_Bool );
 
+    if ( getb( optid ) != valb )
+        m_generation++;
+
     m_options[ optid ].valf = valb ? 1.0f : 0.0f;
 }
 
@@ -387,6 +553,9 @@ bool Opts::render_imgui_opt( option_id_t optid, float w )
 
     ImGui::PopID();
 
+    if ( changed )
+        m_generation++;
+
     return changed;
 }
 
@@ -410,6 +579,21 @@ void Opts::render_imgui_options( uint32_t crtc_max )
 /*
  * TraceLoader
  */
+// Where live capture looks for tracefs unless told otherwise. Older kernels
+//  only mount it under debugfs.
+static const char *get_default_tracefs()
+{
+    struct stat st;
+
+    if ( stat( "/sys/kernel/tracing/events", &st ) &&
+         !stat( "/sys/kernel/debug/tracing/events", &st ) )
+    {
+        return "/sys/kernel/debug/tracing";
+    }
+
+    return "/sys/kernel/tracing";
+}
+
 TraceLoader::state_t TraceLoader::get_state()
 {
     return ( state_t )SDL_AtomicGet( &m_state );
@@ -420,9 +604,35 @@ bool TraceLoader::is_loading()
     return ( get_state() == State_Loading || get_state() == State_CancelLoading );
 }
 
+bool TraceLoader::needs_redraw()
+{
+    if ( is_loading() || fonts_loading() )
+        return true;
+
+    // Keep checking for the next live snapshot
+    if ( m_live_capture.is_running() && s_opts().getb( OPT_LiveFollow ) )
+        return true;
+
+    for ( TraceWin *win : m_trace_windows_list )
+    {
+        if ( win->needs_redraw() )
+            return true;
+    }
+
+    for ( RemoteTraceWin *win : m_remote_windows_list )
+    {
+        if ( win->needs_redraw() )
+            return true;
+    }
+
+    return false;
+}
+
 void TraceLoader::set_state( state_t state )
 {
     m_filename = "";
+    m_filenames.clear();
+    m_live_snapshot = false;
     m_trace_events = NULL;
     m_thread = NULL;
 
@@ -435,8 +645,48 @@ void TraceLoader::cancel_load_file()
     SDL_AtomicCAS( &m_state, State_Loading, State_CancelLoading );
 }
 
+// If filename looks like part of a split trace (trace.dat.0, trace.dat.1, ...)
+//  return all the parts, otherwise just filename.
+static std::vector< std::string > get_split_trace_files( const char *filename )
+{
+    std::vector< std::string > files;
+    const char *dot = strrchr( filename, '.' );
+
+    if ( dot && dot[ 1 ] && ( strspn( dot + 1, "0123456789" ) == strlen( dot + 1 ) ) )
+    {
+        std::string prefix( filename, dot + 1 - filename );
+
+        for ( int i = 0;; i++ )
+        {
+            std::string file = prefix + std::to_string( i );
+
+            if ( !get_file_size( file.c_str() ) )
+                break;
+            files.push_back( file );
+        }
+    }
+
+    if ( std::find( files.begin(), files.end(), filename ) == files.end() )
+    {
+        files.clear();
+        files.push_back( filename );
+    }
+
+    return files;
+}
+
 bool TraceLoader::load_file( const char *filename )
 {
+    return load_files( get_split_trace_files( filename ) );
+}
+
+bool TraceLoader::load_files( const std::vector< std::string > &filenames, bool live_snapshot )
+{
+    if ( filenames.empty() )
+        return false;
+
+    const char *filename = filenames[ 0 ].c_str();
+
     if ( filename != m_trace_file )
         strcpy_safe( m_trace_file, filename );
 
@@ -446,14 +696,24 @@ bool TraceLoader::load_file( const char *filename )
         return false;
     }
 
-    size_t filesize = get_file_size( filename );
-    if ( !filesize )
+    size_t filesize = 0;
+    for ( const std::string &file : filenames )
     {
-        logf( "[Error] %s (%s) failed: %s", __func__, filename, strerror( errno ) );
-        return false;
+        size_t size = get_file_size( file.c_str() );
+
+        if ( !size )
+        {
+            logf( "[Error] %s (%s) failed: %s", __func__, file.c_str(), strerror( errno ) );
+            return false;
+        }
+
+        filesize += size;
     }
 
-    std::string title = string_format( "%s (%.2f MB)", filename, filesize / ( 1024.0f * 1024.0f ) );
+    std::string title = filename;
+    if ( filenames.size() > 1 )
+        title += string_format( " +%zu", filenames.size() - 1 );
+    title += string_format( " (%.2f MB)", filesize / ( 1024.0f * 1024.0f ) );
 
     // Check if we've already loaded this trace file.
     for ( TraceEvents *events : m_trace_events_list )
@@ -468,9 +728,13 @@ bool TraceLoader::load_file( const char *filename )
 
     set_state( State_Loading );
     m_filename = filename;
+    m_filenames = filenames;
+    m_live_snapshot = live_snapshot;
+    m_graph_plot_entries = s_ini().GetSectionEntries( "$graph_plots$" );
 
     m_trace_events = new TraceEvents;
     m_trace_events->m_filename = filename;
+    m_trace_events->m_filenames = filenames;
     m_trace_events->m_filesize = filesize;
     m_trace_events->m_title = title;
 
@@ -493,6 +757,55 @@ bool TraceLoader::load_file( const char *filename )
     return false;
 }
 
+bool TraceLoader::start_live_capture( const char *tracefs )
+{
+    size_t max_bytes = ( size_t )s_opts().geti( OPT_LiveBufferSize ) * 1024 * 1024;
+    int64_t window_ns = ( int64_t )( s_opts().getf( OPT_LiveWindow ) * NSECS_PER_SEC );
+
+    if ( !m_live_capture.start( tracefs, max_bytes, window_ns ) )
+        return false;
+
+    m_live_snapshot_time = util_get_time();
+    return true;
+}
+
+void TraceLoader::stop_live_capture()
+{
+    if ( m_live_capture.is_running() )
+    {
+        m_live_capture.stop();
+        logf( "Live capture stopped" );
+    }
+}
+
+bool TraceLoader::load_live_snapshot()
+{
+    if ( !m_live_capture.is_running() || is_loading() )
+        return false;
+
+    std::string filename = m_live_capture.snapshot_filename( m_live_snapshot_count & 1 );
+
+    m_live_snapshot_time = util_get_time();
+
+    if ( filename.empty() || !m_live_capture.snapshot( filename.c_str() ) )
+        return false;
+
+    m_live_snapshot_count++;
+    return load_files( { filename }, true );
+}
+
+void TraceLoader::update_live_capture()
+{
+    // Minimum time between live snapshots when following
+    static const float s_follow_ms = 100.0f;
+
+    if ( m_live_capture.is_running() && s_opts().getb( OPT_LiveFollow ) && !is_loading() &&
+         ( util_time_to_ms( m_live_snapshot_time, util_get_time() ) >= s_follow_ms ) )
+    {
+        load_live_snapshot();
+    }
+}
+
 void TraceLoader::new_event_window( TraceEvents *trace_events )
 {
     size_t refcount = 0;
@@ -520,6 +833,10 @@ void TraceLoader::close_event_file( TraceEvents *trace_events, bool close_file )
 
         if ( win->m_open && ( &win->m_trace_events == trace_events ) )
             win->m_open = false;
+
+        // Stop any background scans before their events go away
+        if ( close_file && ( &win->m_trace_events == trace_events ) )
+            win->m_eventlist.filter_scan.cancel();
     }
 
     if ( close_file )
@@ -530,6 +847,8 @@ void TraceLoader::close_event_file( TraceEvents *trace_events, bool close_file )
             {
                 delete trace_events;
                 m_trace_events_list.erase( m_trace_events_list.begin() + i );
+
+                util_malloc_trim();
                 break;
             }
         }
@@ -542,23 +861,14 @@ static bool is_timeline_event( const trace_event_t &event )
     if ( !event.timeline || !event.seqno || !event.context )
         return false;
 
-    return ( event.is_fence_signaled() ||
-             !strcmp( event.name, "amdgpu_cs_ioctl" ) ||
-             !strcmp( event.name, "amdgpu_sched_run_job" ) );
+    return !!( event.flags & ( TRACE_FLAG_FENCE_SIGNALED |
+                               TRACE_FLAG_IS_SW_QUEUE |
+                               TRACE_FLAG_IS_HW_QUEUE ) );
 }
 
-int TraceLoader::init_new_event( trace_event_t &event, const trace_info_t &info )
+void TraceLoader::init_new_event( trace_event_t &event )
 {
-    if ( event.id == 0 )
-    {
-        m_trace_events->m_ts_min = event.ts;
-    }
-
-    if ( m_trace_events->m_cpucount.empty() )
-    {
-        m_trace_events->m_trace_info = info;
-        m_trace_events->m_cpucount.resize( info.cpus, 0 );
-    }
+    PROF_SCOPE( PROF_InitNewEvent );
 
     if ( event.cpu < m_trace_events->m_cpucount.size() )
         m_trace_events->m_cpucount[ event.cpu ]++;
@@ -568,56 +878,38 @@ int TraceLoader::init_new_event( trace_event_t &event, const trace_info_t &info
 
     event.ts -= m_trace_events->m_ts_min;
 
-    // Make sure our events are cleared
-    event.flags &= ~( TRACE_FLAG_FENCE_SIGNALED |
-                      TRACE_FLAG_FTRACE_PRINT |
-                      TRACE_FLAG_IS_VBLANK |
-                      TRACE_FLAG_IS_TIMELINE |
-                      TRACE_FLAG_IS_SW_QUEUE |
-                      TRACE_FLAG_IS_HW_QUEUE);
-
-    // fence_signaled was renamed to dma_fence_signaled post v4.9
-    if ( strstr( event.name, "fence_signaled" ) )
-        event.flags |= TRACE_FLAG_FENCE_SIGNALED;
-    else if ( !strcmp( event.system, "ftrace-print" ) )
-        event.flags |= TRACE_FLAG_FTRACE_PRINT;
-    else if ( !strcmp( event.name, "drm_vblank_event" ) )
-        event.flags |= TRACE_FLAG_IS_VBLANK;
-    else if ( strstr( event.name, "amdgpu_cs_ioctl" ) )
-        event.flags |= TRACE_FLAG_IS_SW_QUEUE;
-    else if ( strstr( event.name, "amdgpu_sched_run_job" ) )
-        event.flags |= TRACE_FLAG_IS_HW_QUEUE;
+    // The fence signaled, ftrace print, vblank, sched_switch and sw/hw queue
+    //  flags were set by the trace reader from its per event format table.
+    event.flags &= ~TRACE_FLAG_IS_TIMELINE;
 
     // Add this event name to our event locations map
     if ( event.is_vblank() )
         m_trace_events->m_tdopexpr_locations.add_location_str( "$name=drm_vblank_event", event.id );
+    else if ( event.is_sched_switch() )
+        m_trace_events->m_tdopexpr_locations.add_location_str( "$name=sched_switch", event.id );
 
     // Add this event comm to our comm locations map
-    m_trace_events->m_comm_locations.add_location_str( event.comm, event.id );
+    m_trace_events->m_comm_locations.add_location_str( m_trace_events->comm_str( event.comm_id ), event.id );
 
     if ( is_timeline_event( event ) )
     {
-        const std::string gfxcontext = get_event_gfxcontext_str( event );
+        const TraceGfxContexts &gfxcontexts = m_trace_events->m_gfxcontexts;
 
         // Add this event under the "gfx", "sdma0", etc timeline map
         m_trace_events->m_timeline_locations.add_location_str( event.timeline, event.id );
 
-        // Add this event under our "gfx_ctx_seq" or "sdma0_ctx_seq", etc. map
-        m_trace_events->m_gfxcontext_locations.add_location_str( gfxcontext.c_str(), event.id );
-
-        // Grab the event locations for this event context
-        const std::vector< uint32_t > *plocs = m_trace_events->get_gfxcontext_locs( gfxcontext.c_str() );
-        if ( plocs->size() > 1 )
+        // Add this event to its timeline/context/seqno job
+        const TraceGfxContexts::job_t &job = m_trace_events->m_gfxcontexts.add( event );
+        if ( job.count > 1 )
         {
             // First event.
-            const trace_event_t &event0 = m_trace_events->m_events[ plocs->front() ];
+            const trace_event_t &event0 = m_trace_events->m_events[ job.ids[ 0 ] ];
 
             // Event right before the event we just added.
-            auto it = plocs->rbegin() + 1;
-            const trace_event_t &event_prev = m_trace_events->m_events[ *it ];
+            const trace_event_t &event_prev = m_trace_events->m_events[ gfxcontexts.get_id( job, job.count - 2 ) ];
 
             // Assume the user comm is the first comm event in this set.
-            event.user_comm = event0.comm;
+            event.user_comm_id = event0.comm_id;
 
             // Point the event we just added to the previous event in this series
             event.id_start = event_prev.id;
@@ -625,32 +917,64 @@ int TraceLoader::init_new_event( trace_event_t &event, const trace_info_t &info
             if ( event.is_fence_signaled() )
             {
                 // Mark all the events in this series as timeline events
-                for ( uint32_t idx : *plocs )
+                for ( uint32_t i = 0; i < job.count; i++ )
                 {
-                    m_trace_events->m_events[ idx ].flags |= TRACE_FLAG_IS_TIMELINE;
+                    m_trace_events->m_events[ gfxcontexts.get_id( job, i ) ].flags |= TRACE_FLAG_IS_TIMELINE;
                 }
+
+                m_trace_events->update_fence_signaled_durations( event );
             }
         }
     }
 
     SDL_AtomicAdd( &m_trace_events->m_eventsloaded, 1 );
+}
 
-    if ( get_state() == State_CancelLoading )
-        return 1;
+void TraceLoader::publish_events()
+{
+    std::vector< trace_event_t > &events = m_trace_events->m_events;
+    std::lock_guard< std::mutex > lock( m_trace_events->m_events_mutex );
 
-    return 0;
+    for ( const trace_event_t &event : m_pending_events )
+    {
+        events.push_back( event );
+        init_new_event( events.back() );
+    }
+
+    m_pending_events.clear();
+    SDL_AtomicSet( &m_trace_events->m_events_published, events.size() );
 }
 
 int TraceLoader::new_event_cb( TraceLoader *loader, const trace_info_t &info,
                                const trace_event_t &event )
 {
+    // Events are published to the UI thread in batches of this size
+    static const size_t s_publish_count = 32 * 1024;
     TraceEvents *trace_events = loader->m_trace_events;
-    size_t id = trace_events->m_events.size();
+    size_t id = trace_events->m_events.size() + loader->m_pending_events.size();
+
+    if ( id == 0 )
+    {
+        trace_events->m_ts_min = event.ts;
+        trace_events->m_trace_info = info;
+        trace_events->m_cpucount.resize( info.cpus, 0 );
+    }
+
+    loader->m_pending_events.push_back( event );
+
+    trace_event_t &new_event = loader->m_pending_events.back();
 
-    trace_events->m_events.push_back( event );
-    trace_events->m_events.back().id = id;
+    new_event.id = id;
 
-    return loader->init_new_event( trace_events->m_events.back(), info );
+    // The reader owns event.fields and event.raw, so copy them into our arenas.
+    new_event.fields = trace_events->m_fields_arena.alloc( event.numfields );
+    std::copy( event.fields, event.fields + event.numfields, new_event.fields );
+    new_event.raw = trace_events->m_raw_events.store( event.raw );
+
+    if ( loader->m_pending_events.size() >= s_publish_count )
+        loader->publish_events();
+
+    return ( loader->get_state() == State_CancelLoading );
 }
 
 int SDLCALL TraceLoader::thread_func( void *data )
@@ -658,26 +982,118 @@ int SDLCALL TraceLoader::thread_func( void *data )
     TraceLoader *loader = ( TraceLoader * )data;
     TraceEvents *trace_events = loader->m_trace_events;
     const char *filename = loader->m_filename.c_str();
+    std::vector< std::string > filenames = loader->m_filenames;
+
+    // Caches are only validated against a single trace file
+    std::string cachefile = std::string( filename ) + ".gpuviscache";
+    bool use_cache = s_opts().getb( OPT_UseTraceCache ) && ( filenames.size() == 1 ) &&
+            !loader->m_live_snapshot;
+
+    if ( use_cache && trace_events->cache_load( cachefile.c_str(), filename ) )
+    {
+        logf( "Read trace cache file %s", cachefile.c_str() );
+
+        for ( const trace_event_t &event : trace_events->m_events )
+            loader->m_crtc_max = std::max< int >( loader->m_crtc_max, event.crtc );
+
+        loader->finish_load();
+        return 0;
+    }
 
-    logf( "Reading trace file %s...", filename );
+    for ( const std::string &file : filenames )
+        logf( "Reading trace file %s...", file.c_str() );
 
     EventCallback trace_cb = std::bind( new_event_cb, loader, _1, _2 );
-    if ( read_trace_file( filename, trace_events->m_strpool, trace_cb ) < 0 )
+    bool parallel = s_opts().getb( OPT_ParallelLoad );
+    bool lazy_fields = s_opts().getb( OPT_LazyFields );
+    TraceRawEvents *raw_events = lazy_fields ? &trace_events->m_raw_events : NULL;
+
+    // Leave record payloads in the trace file and page them in as fields are
+    //  formatted so big traces don't need a copy of every payload in memory.
+    if ( lazy_fields && s_opts().getb( OPT_PagedFields ) )
+        raw_events->set_paged( ( size_t )s_opts().geti( OPT_PageCacheSize ) * 1024 * 1024 );
+
+    int ret;
+    {
+        PROF_SCOPE( PROF_LoadTrace );
+
+        ret = read_trace_file( filenames, trace_events->m_strpool, trace_cb, parallel, raw_events );
+    }
+
+    if ( ret < 0 )
     {
         logf( "[Error]: read_trace_file(%s) failed.", filename );
 
+        loader->m_pending_events.clear();
         SDL_AtomicSet( &trace_events->m_eventsloaded, -1 );
         loader->set_state( State_Idle );
         return -1;
     }
 
+    loader->publish_events();
+
+    // Don't write caches for partially loaded traces. Lazy fields would all
+    //  have to be formatted to save them, which is the work they put off.
+    if ( use_cache && !lazy_fields && ( loader->get_state() == State_Loading ) )
+    {
+        util_time_t t0 = util_get_time();
+
+        if ( trace_events->cache_save( cachefile.c_str(), filename ) )
+            logf( "Wrote trace cache file %s (%.2fms)", cachefile.c_str(), util_time_to_ms( t0, util_get_time() ) );
+    }
+
     logf( "Events read: %lu", trace_events->m_events.size() );
 
-    SDL_AtomicSet( &trace_events->m_eventsloaded, 0 );
-    loader->set_state( State_Loaded );
+    loader->finish_load();
     return 0;
 }
 
+void TraceLoader::finish_load()
+{
+    // The UI stops drawing the events list while we hold the lock
+    SDL_AtomicSet( &m_trace_events->m_postloading, 1 );
+    {
+        std::lock_guard< std::mutex > lock( m_trace_events->m_events_mutex );
+        util_time_t t0 = util_get_time();
+
+        m_trace_events->init_postload( m_graph_plot_entries );
+
+        logf( "Processed events (%.2fms)", util_time_to_ms( t0, util_get_time() ) );
+    }
+    // Reader buffers and the spare capacity dropped by shrink_to_fit()
+    util_malloc_trim();
+
+    SDL_AtomicSet( &m_trace_events->m_postloading, 0 );
+
+    SDL_AtomicSet( &m_trace_events->m_eventsloaded, 0 );
+    set_state( State_Loaded );
+}
+
+bool TraceLoader::load_files_sync( TraceEvents *trace_events, const std::vector< std::string > &filenames,
+                                   bool parallel )
+{
+    EventCallback trace_cb = std::bind( new_event_cb, this, _1, _2 );
+    bool lazy_fields = s_opts().getb( OPT_LazyFields );
+    TraceRawEvents *raw_events = lazy_fields ? &trace_events->m_raw_events : NULL;
+
+    m_trace_events = trace_events;
+    m_crtc_max = 0;
+    set_state( State_Loading );
+
+    int ret = read_trace_file( filenames, trace_events->m_strpool, trace_cb, parallel, raw_events );
+
+    if ( ret < 0 )
+        logf( "[Error]: read_trace_file(%s) failed.", filenames[ 0 ].c_str() );
+    else
+        publish_events();
+
+    m_pending_events.clear();
+    SDL_AtomicSet( &trace_events->m_eventsloaded, ( ret < 0 ) ? -1 : 0 );
+    m_trace_events = NULL;
+    set_state( State_Idle );
+    return ( ret >= 0 );
+}
+
 void TraceLoader::init( int argc, char **argv )
 {
     ImGuiIO &io = ImGui::GetIO();
@@ -699,6 +1115,8 @@ void TraceLoader::init( int argc, char **argv )
 
 void TraceLoader::shutdown()
 {
+    stop_live_capture();
+
     if ( m_thread )
     {
         // Cancel any file loading going on.
@@ -715,9 +1133,27 @@ void TraceLoader::shutdown()
         delete win;
     m_trace_windows_list.clear();
 
+    for ( RemoteTraceWin *win : m_remote_windows_list )
+        delete win;
+    m_remote_windows_list.clear();
+
     for ( TraceEvents *events : m_trace_events_list )
         delete events;
     m_trace_events_list.clear();
+
+    if ( m_fonts_thread )
+    {
+        SDL_WaitThread( m_fonts_thread, NULL );
+        m_fonts_thread = NULL;
+    }
+    delete m_fonts_next;
+    m_fonts_next = NULL;
+
+    // ImGui clears io.Fonts when it shuts down
+    if ( m_fonts_default )
+        ImGui::GetIO().Fonts = m_fonts_default;
+    delete m_fonts;
+    m_fonts = NULL;
 }
 
 void TraceLoader::render()
@@ -752,6 +1188,21 @@ void TraceLoader::render()
         }
     }
 
+    for ( int i = ( int )m_remote_windows_list.size() - 1; i >= 0; i-- )
+    {
+        RemoteTraceWin *win = m_remote_windows_list[ i ];
+
+        if ( win->m_open )
+        {
+            win->render();
+        }
+        else
+        {
+            delete win;
+            m_remote_windows_list.erase( m_remote_windows_list.begin() + i );
+        }
+    }
+
     if ( m_show_gpuvis_console )
     {
         ImGui::SetNextWindowSize( ImVec2( 600, 800 ), ImGuiSetCond_FirstUseEver );
@@ -759,6 +1210,13 @@ void TraceLoader::render()
         render_console();
     }
 
+    if ( m_show_profile )
+    {
+        ImGui::SetNextWindowSize( ImVec2( 600, 400 ), ImGuiSetCond_FirstUseEver );
+
+        render_profile();
+    }
+
     if ( m_show_imgui_test_window )
     {
         ImGui::SetNextWindowSize( ImVec2( 800, 600 ), ImGuiSetCond_FirstUseEver );
@@ -873,21 +1331,73 @@ void TraceLoader::render()
     }
 }
 
-void TraceLoader::load_fonts()
+int SDLCALL TraceLoader::fonts_thread_func( void *data )
 {
-    // Clear all font texture data, ttf data, glyphs, etc.
-    ImGui::GetIO().Fonts->Clear();
+    TraceLoader *loader = ( TraceLoader * )data;
 
-    // Add main font
-    m_font_main.load_font( "$imgui_font_main$", "Roboto Regular", 14.0f );
+    font_atlas_build( loader->m_fonts_next, &loader->m_fonts_use_freetype );
 
-    // Add small font
-    m_font_small.load_font( "$imgui_font_small$", "Roboto Condensed", 14.0f );
+    SDL_AtomicSet( &loader->m_fonts_ready, 1 );
+    return 0;
+}
+
+void TraceLoader::update_fonts()
+{
+    if ( !m_fonts_next || !SDL_AtomicGet( &m_fonts_ready ) )
+        return;
+
+    if ( m_fonts_thread )
+    {
+        SDL_WaitThread( m_fonts_thread, NULL );
+        m_fonts_thread = NULL;
+    }
+
+    ImGuiIO &io = ImGui::GetIO();
+
+    if ( !m_fonts_default )
+        m_fonts_default = io.Fonts;
+
+    // Drop the old font texture. The next NewFrame() uploads the new one
+    //  from the atlas pixels we've already got.
+    ImGui_ImplSdlGL3_InvalidateDeviceObjects();
+
+    io.Fonts = m_fonts_next;
+    delete m_fonts;
+    m_fonts = m_fonts_next;
+    m_fonts_next = NULL;
+
+    s_opts().setb( OPT_UseFreetype, m_fonts_use_freetype );
 
     // Reset max rect size for the print events so they'll redo the CalcTextSize for the
     //  print graph row backgrounds (in graph_render_print_timeline).
     for ( TraceEvents *trace_event : m_trace_events_list )
         trace_event->invalidate_ftraceprint_colors();
+}
+
+void TraceLoader::load_fonts( bool async )
+{
+    ImFontAtlas *atlas = new ImFontAtlas();
+
+    // Add main font
+    m_font_main.load_font( atlas, "$imgui_font_main$", "Roboto Regular", 14.0f );
+
+    // Add small font
+    m_font_small.load_font( atlas, "$imgui_font_small$", "Roboto Condensed", 14.0f );
+
+    m_fonts_next = atlas;
+    m_fonts_use_freetype = s_opts().getb( OPT_UseFreetype );
+    SDL_AtomicSet( &m_fonts_ready, 0 );
+
+    // Keep drawing with the current fonts while new ones are rasterized
+    if ( async )
+        m_fonts_thread = SDL_CreateThread( fonts_thread_func, "load_fonts", this );
+
+    if ( !m_fonts_thread )
+    {
+        font_atlas_build( atlas, &m_fonts_use_freetype );
+        SDL_AtomicSet( &m_fonts_ready, 1 );
+        update_fonts();
+    }
 
     if ( s_ini().GetFloat( "scale", -1.0f ) == -1.0f )
     {
@@ -932,6 +1442,8 @@ const std::vector< GraphRows::graph_rows_info_t > GraphRows::get_hidden_rows_lis
 
 void GraphRows::show_row( const std::string &name, graph_rows_show_t show )
 {
+    m_generation++;
+
     if ( show == GraphRows::SHOW_ALL_ROWS )
     {
         m_graph_rows_hide.clear();
@@ -982,90 +1494,90 @@ void GraphRows::show_row( const std::string &name, graph_rows_show_t show )
     }
 }
 
-// Initialize m_graph_rows_list
-void GraphRows::init( TraceEvents &trace_events )
+// Timeline and print rows, in the order they go at the top of the graph:
+//  gfx -> compute -> gfx hw -> compute hw -> sdma -> sdma hw -> print
+static std::vector< std::string > graph_rows_timeline_names()
 {
-    if ( !m_graph_rows_list.empty() )
-        return;
+    std::vector< std::string > names;
 
-    // Order: gfx -> compute -> gfx hw -> compute hw -> sdma -> sdma hw
-    TraceEvents::loc_type_t type;
-    const std::vector< uint32_t > *plocs;
-
-    if ( ( plocs = trace_events.get_locs( "gfx", &type ) ) )
-        m_graph_rows_list.push_back( { type, plocs->size(), "gfx", false } );
-
-    // Andres: full list of compute rings is comp_[1-2].[0-3].[0-8]
-    for ( int c0 = 1; c0 < 3; c0++)
+    for ( const char *suffix : { "", " hw" } )
     {
-        for ( int c1 = 0; c1 < 4; c1++ )
+        names.push_back( std::string( "gfx" ) + suffix );
+
+        // Andres: full list of compute rings is comp_[1-2].[0-3].[0-8]
+        for ( int c0 = 1; c0 < 3; c0++)
         {
-            for ( int c2 = 0; c2 < 9; c2++ )
+            for ( int c1 = 0; c1 < 4; c1++ )
             {
-                std::string str = string_format( "comp_%d.%d.%d", c0, c1, c2 );
-
-                if ( ( plocs = trace_events.get_locs( str.c_str(), &type ) ) )
-                    m_graph_rows_list.push_back( { type, plocs->size(), str, false } );
+                for ( int c2 = 0; c2 < 9; c2++ )
+                    names.push_back( string_format( "comp_%d.%d.%d%s", c0, c1, c2, suffix ) );
             }
         }
     }
 
-    if ( ( plocs = trace_events.get_locs( "gfx hw", &type ) ) )
-        m_graph_rows_list.push_back( { type, plocs->size(), "gfx hw", false } );
+    names.push_back( "sdma0" );
+    names.push_back( "sdma1" );
+    names.push_back( "sdma0 hw" );
+    names.push_back( "sdma1 hw" );
+    names.push_back( "print" );
+    return names;
+}
 
-    for ( int c0 = 1; c0 < 3; c0++)
+// Init plots for $graph_plots$ entries ( name = "filter\tscanf" ) and call
+//  func with each one that has values.
+static void graph_plots_init( TraceEvents &trace_events, const std::vector< INIEntry > &entries,
+                              const std::function< void ( const GraphPlot &plot ) > &func )
+{
+    for ( const INIEntry &entry : entries )
     {
-        for ( int c1 = 0; c1 < 4; c1++ )
+        const std::string &plot_name = entry.first;
+        const std::vector< std::string > plot_args = string_explode( entry.second, '\t' );
+
+        if ( plot_args.size() == 2 )
         {
-            for ( int c2 = 0; c2 < 9; c2++ )
+            const std::string &plot_filter = plot_args[ 0 ];
+            const std::string &plot_scanf = plot_args[ 1 ];
+
+            if ( trace_events.get_locs( plot_filter.c_str() ) )
             {
-                std::string str = string_format( "comp_%d.%d.%d hw", c0, c1, c2 );
+                GraphPlot &plot = trace_events.get_plot( plot_name.c_str() );
 
-                if ( ( plocs = trace_events.get_locs( str.c_str(), &type ) ) )
-                    m_graph_rows_list.push_back( { type, plocs->size(), str, false } );
+                if ( plot.init( trace_events, plot_name, plot_filter, plot_scanf ) && func )
+                    func( plot );
             }
         }
     }
+}
 
-    if ( ( plocs = trace_events.get_locs( "sdma0", &type ) ) )
-        m_graph_rows_list.push_back( { type, plocs->size(), "sdma0", false } );
-    if ( ( plocs = trace_events.get_locs( "sdma1", &type ) ) )
-        m_graph_rows_list.push_back( { type, plocs->size(), "sdma1", false } );
+// Initialize m_graph_rows_list
+void GraphRows::init( TraceEvents &trace_events )
+{
+    if ( !m_graph_rows_list.empty() )
+        return;
 
-    if ( ( plocs = trace_events.get_locs( "sdma0 hw", &type ) ) )
-        m_graph_rows_list.push_back( { type, plocs->size(), "sdma0 hw", false } );
-    if ( ( plocs = trace_events.get_locs( "sdma1 hw", &type ) ) )
-        m_graph_rows_list.push_back( { type, plocs->size(), "sdma1 hw", false } );
+    m_generation++;
 
-    if ( ( plocs = trace_events.get_locs( "print", &type ) ) )
-        m_graph_rows_list.push_back( { type, plocs->size(), "print", false } );
+    TraceEvents::loc_type_t type;
+    const std::vector< uint32_t > *plocs;
 
+    for ( const std::string &name : graph_rows_timeline_names() )
     {
-        std::vector< INIEntry > entries = s_ini().GetSectionEntries( "$graph_plots$" );
-
-        for ( const INIEntry &entry : entries )
-        {
-            const std::string &plot_name = entry.first;
-            const std::vector< std::string > plot_args = string_explode( entry.second, '\t' );
+        if ( ( plocs = trace_events.get_locs( name.c_str(), &type ) ) )
+            m_graph_rows_list.push_back( { type, plocs->size(), name, false } );
+    }
 
-            if ( plot_args.size() == 2 )
-            {
-                const std::string &plot_filter = plot_args[ 0 ];
-                const std::string &plot_scanf = plot_args[ 1 ];
+    graph_plots_init( trace_events, s_ini().GetSectionEntries( "$graph_plots$" ),
+                      [&]( const GraphPlot &plot )
+    {
+        m_graph_rows_list.push_back( { TraceEvents::LOC_TYPE_Plot, plot.m_plotdata.size(), plot.m_name, false } );
+    } );
 
-                plocs = trace_events.get_locs( plot_filter.c_str() );
-                if ( plocs )
-                {
-                    GraphPlot &plot = trace_events.get_plot( plot_name.c_str() );
+    for ( size_t cpu = 0; cpu < trace_events.m_cpu_runs.m_lanes.size(); cpu++ )
+    {
+        std::string name = string_format( "cpu%zu", cpu );
 
-                    if ( plot.init( trace_events, plot_name, plot_filter, plot_scanf ) )
-                    {
-                        m_graph_rows_list.push_back(
-                                { TraceEvents::LOC_TYPE_Plot, plot.m_plotdata.size(), plot_name, false } );
-                    }
-                }
-            }
-        }
+        if ( ( plocs = trace_events.get_locs( name.c_str(), &type ) ) )
+            m_graph_rows_list.push_back( { type, plocs->size(), name, false } );
     }
 
     std::vector< graph_rows_info_t > comms;
@@ -1133,6 +1645,8 @@ void GraphRows::init( TraceEvents &trace_events )
 
 void GraphRows::rename_row( const char *comm_old, const char *comm_new )
 {
+    m_generation++;
+
     for ( graph_rows_info_t &row_info : m_graph_rows_list )
     {
         if ( row_info.row_name == comm_old )
@@ -1149,6 +1663,8 @@ void GraphRows::add_row( TraceEvents &trace_events, const std::string &name )
     const std::vector< uint32_t > *plocs = trace_events.get_locs( name.c_str(), &type );
     size_t size = plocs ? plocs->size() : 0;
 
+    m_generation++;
+
     // Add expression to our added rows list
     m_graph_rows_add.push_back( name );
 
@@ -1170,6 +1686,8 @@ void GraphRows::add_row( TraceEvents &trace_events, const std::string &name )
 
 void GraphRows::move_row( const std::string &name_src, const std::string &name_dest )
 {
+    m_generation++;
+
     size_t index_src = find_row( name_src );
     size_t index_dest = find_row( name_dest );
 
@@ -1245,6 +1763,18 @@ bool TraceWin::rename_comm_event( const char *comm_old, const char *comm_new )
     while ( isspace( *comm_new ) )
         comm_new++;
 
+    // Filter thread reads event comms, so stop it and rerun the filter afterwards
+    if ( m_eventlist.filter_scan.is_running() )
+    {
+        m_eventlist.filter_scan.cancel();
+        m_eventlist.do_filter = true;
+    }
+    // Current filter results may match the old comm
+    else if ( m_eventlist.filter_buf[ 0 ] )
+    {
+        m_eventlist.do_filter = true;
+    }
+
     if ( m_trace_events.rename_comm( comm_old, comm_new ) )
     {
         m_graph.rows.rename_row( comm_old, comm_new );
@@ -1258,29 +1788,7 @@ bool TraceWin::rename_comm_event( const char *comm_old, const char *comm_new )
 
 int TraceWin::ts_to_eventid( int64_t ts )
 {
-    // When running a debug build w/ ASAN on, the lower_bound function is
-    //  horribly slow so we cache the timestamp to event ids.
-    int *pid = m_ts_to_eventid_cache.get_val( ts );
-    if ( pid )
-        return *pid;
-
-    trace_event_t x;
-    const std::vector< trace_event_t > &events = m_trace_events.m_events;
-
-    x.ts = ts;
-
-    auto eventidx = std::lower_bound( events.begin(), events.end(), x,
-        []( const trace_event_t &f1, const trace_event_t &f2 ) {
-            return f1.ts < f2.ts;
-        } );
-
-    int id = eventidx - events.begin();
-
-    if ( ( size_t )id >= events.size() )
-        id = events.size() - 1;
-
-    m_ts_to_eventid_cache.set_val( ts, id );
-    return id;
+    return m_trace_events.ts_to_eventid( ts );
 }
 
 int TraceWin::timestr_to_eventid( const char *buf, int64_t tsoffset )
@@ -1290,381 +1798,1498 @@ int TraceWin::timestr_to_eventid( const char *buf, int64_t tsoffset )
     return ts_to_eventid( ts );
 }
 
-const char *filter_get_key_func( StrPool *strpool, const char *name, size_t len )
+// Filter variable ids. Event fields are FILTER_VAR_Field + strpool id of field name.
+enum filter_var_t
 {
-    return strpool->getstr( name, len );
-}
+    FILTER_VAR_Name,
+    FILTER_VAR_Comm,
+    FILTER_VAR_UserComm,
+    FILTER_VAR_Id,
+    FILTER_VAR_Pid,
+    FILTER_VAR_Ts,
+    FILTER_VAR_Duration,
+    FILTER_VAR_Field
+};
 
-const char *filter_get_keyval_func( const trace_event_t *event, const char *name, char ( &buf )[ 64 ] )
+int filter_get_key_func( StrPool *strpool, const char *name, size_t len )
 {
-    if ( !strcasecmp( name, "name" ) )
-    {
-        return event->name;
-    }
-    else if ( !strcasecmp( name, "comm" ) )
-    {
-        return event->comm;
-    }
-    else if ( !strcasecmp( name, "user_comm" ) )
-    {
-        return event->user_comm;
-    }
-    else if ( !strcasecmp( name, "id" ) )
+    static const char *s_vars[] =
     {
-        snprintf_safe( buf, "%u", event->id );
-        return buf;
-    }
-    else if ( !strcasecmp( name, "pid" ) )
-    {
-        snprintf_safe( buf, "%d", event->pid );
-        return buf;
-    }
-    else if ( !strcasecmp( name, "ts" ) )
-    {
-        snprintf_safe( buf, "%.6f", event->ts * ( 1.0 / NSECS_PER_MSEC ) );
-        return buf;
-    }
-    else if ( !strcasecmp( name, "duration" ) )
-    {
-        snprintf_safe( buf, "%.6f", event->duration * ( 1.0 / NSECS_PER_MSEC ) );
-        return buf;
-    }
+        "name", "comm", "user_comm", "id", "pid", "ts", "duration"
+    };
+    uint32_t id;
 
-    for ( const event_field_t &field : event->fields )
+    for ( size_t i = 0; i < ARRAY_SIZE( s_vars ); i++ )
     {
-        // We can compare pointers since they're from same string pool
-        if ( name == field.key )
-            return field.value;
+        if ( ( strlen( s_vars[ i ] ) == len ) && !strncasecmp( name, s_vars[ i ], len ) )
+            return ( int )i;
     }
 
-    return "";
+    strpool->getstr( name, len, &id );
+    return FILTER_VAR_Field + id;
 }
 
-const std::vector< uint32_t > *TraceEvents::get_tdopexpr_locs( const char *name, std::string *err )
+void filter_get_keyval_func( TraceEvents *trace_events, tdop_val_t &val, const void *data, int varid, bool want_str )
 {
-    std::vector< uint32_t > *plocs;
-    uint32_t hashval = fnv_hashstr32( name );
-
-    // Try to find whatever our name hashed to. Name should be something like:
-    //   $name=drm_vblank_event
-    plocs = m_tdopexpr_locations.get_locations_u32( hashval );
-    if ( plocs )
-        return plocs;
-
-    // Not found - check if we've tried and failed with this name before.
-    if ( m_failed_commands.find( hashval ) != m_failed_commands.end() )
-        return NULL;
+    const trace_event_t *event = ( const trace_event_t * )data;
 
-    // If the name has a tdop expression variable prefix, try compiling it
-    if ( strchr( name, '$' ) )
+    switch ( varid )
     {
-        std::string errstr;
-        tdop_get_key_func get_key_func = std::bind( filter_get_key_func, &m_strpool, _1, _2 );
-        class TdopExpr *tdop_expr = tdopexpr_compile( name, get_key_func, errstr );
-
-        if ( !tdop_expr )
+    case FILTER_VAR_Name:
+        val.str = event->name;
+        return;
+    case FILTER_VAR_Comm:
+        val.str = trace_events->comm_str( event->comm_id );
+        return;
+    case FILTER_VAR_UserComm:
+        val.str = trace_events->comm_str( event->user_comm_id );
+        return;
+    case FILTER_VAR_Id:
+        val.set_uint( event->id );
+        if ( want_str )
         {
-            if ( err )
-                *err = errstr;
-            else
-                logf( "[Error] compiling '%s': %s", name, errstr.c_str() );
+            snprintf_safe( val.buf, "%u", event->id );
+            val.str = val.buf;
         }
-        else
+        return;
+    case FILTER_VAR_Pid:
+        val.set_int( event->pid );
+        if ( want_str )
         {
-            for ( trace_event_t &event : m_events )
-            {
-                const char *ret;
-                tdop_get_keyval_func get_keyval_func = std::bind( filter_get_keyval_func, &event, _1, _2 );
+            snprintf_safe( val.buf, "%d", event->pid );
+            val.str = val.buf;
+        }
+        return;
+    case FILTER_VAR_Ts:
+    case FILTER_VAR_Duration:
+    {
+        int64_t ts = ( varid == FILTER_VAR_Ts ) ? event->ts : event->duration;
 
-                ret = tdopexpr_exec( tdop_expr, get_keyval_func );
-                if ( ret[ 0 ] )
-                    m_tdopexpr_locations.add_location_u32( hashval, event.id );
-            }
+        // Division gives the same double strtod() would for the "%.6f" string
+        val.set_float( ts / ( double )NSECS_PER_MSEC );
+        if ( want_str )
+        {
+            snprintf_safe( val.buf, "%.6f", ts * ( 1.0 / NSECS_PER_MSEC ) );
+            val.str = val.buf;
+        }
+        return;
+    }
+    }
 
-            tdopexpr_delete( tdop_expr );
+    // We can compare pointers since they're from same string pool
+    const char *name = trace_events->m_strpool.idtostr( varid - FILTER_VAR_Field );
+
+    for ( uint32_t i = 0; i < event->numfields; i++ )
+    {
+        if ( name == event->fields[ i ].key )
+        {
+            val.str = event->get_field_value( i );
+            return;
         }
     }
 
-    // Try to find this name/expression again and add to failed list if we miss again
-    plocs = m_tdopexpr_locations.get_locations_u32( hashval );
-    if ( !plocs )
-        m_failed_commands.insert( hashval );
+    val.str = "";
+}
 
-    return plocs;
+template < typename T >
+static size_t vec_bytes( const std::vector< T > &vec )
+{
+    return vec.capacity() * sizeof( T );
 }
 
-const std::vector< uint32_t > *TraceEvents::get_comm_locs( const char *name )
+// Bucket array plus a node (value and next / cached hash) per entry
+template < typename K, typename V >
+static size_t umap_bytes( const util_umap< K, V > &umap )
 {
-    return m_comm_locations.get_locations_str( name );
+    typedef typename util_umap< K, V >::map_t map_t;
+
+    return umap.m_map.bucket_count() * sizeof( void * ) +
+            umap.m_map.size() * ( sizeof( typename map_t::value_type ) + 2 * sizeof( void * ) );
 }
 
-const std::vector< uint32_t > *TraceEvents::get_timeline_locs( const char *name )
+size_t TraceLocations::bytes_allocated() const
 {
-    return m_timeline_locations.get_locations_str( name );
+    size_t bytes = umap_bytes( m_locs );
+
+    for ( const auto &item : m_locs.m_map )
+        bytes += vec_bytes( item.second );
+    return bytes;
 }
 
-// Pass a string like "gfx_249_91446"
-const std::vector< uint32_t > *TraceEvents::get_gfxcontext_locs( const char *name )
+void TraceLocations::shrink_to_fit()
 {
-    return m_gfxcontext_locations.get_locations_str( name );
+    for ( auto &item : m_locs.m_map )
+        item.second.shrink_to_fit();
 }
 
-bool TraceEvents::rename_comm( const char *comm_old, const char *comm_new )
+size_t TracePostings::bytes_allocated() const
 {
-    if ( !comm_old[ 0 ] ||
-         !comm_new[ 0 ] ||
-         !strcasecmp( comm_old, comm_new ) )
+    size_t bytes = umap_bytes( m_postings );
+
+    for ( const auto &item : m_postings.m_map )
+        bytes += vec_bytes( item.second.buf );
+    return bytes;
+}
+
+void TracePostings::shrink_to_fit()
+{
+    for ( auto &item : m_postings.m_map )
+        item.second.buf.shrink_to_fit();
+}
+
+void TracePostings::add_location_u32( uint32_t hashval, uint32_t loc )
+{
+    postings_t &postings = m_postings.m_map[ hashval ];
+    uint32_t delta = postings.count ? ( loc - postings.last ) : loc;
+
+    while ( delta >= 0x80 )
     {
-        return false;
+        postings.buf.push_back( ( uint8_t )( delta | 0x80 ) );
+        delta >>= 7;
     }
+    postings.buf.push_back( ( uint8_t )delta );
 
-    const std::vector< uint32_t > *plocs = get_comm_locs( comm_old );
+    postings.last = loc;
+    postings.count++;
+}
 
-    if ( plocs )
+bool TracePostings::get_locations_u32( uint32_t hashval, std::vector< uint32_t > &locs )
+{
+    postings_t *postings = m_postings.get_val( hashval );
+
+    locs.clear();
+    if ( !postings )
+        return false;
+
+    const uint8_t *buf = postings->buf.data();
+    uint32_t loc = 0;
+
+    locs.resize( postings->count );
+    for ( uint32_t i = 0; i < postings->count; i++ )
     {
-        const char *commstr_old = m_strpool.getstr( comm_old );
-        const char *commstr_new = m_strpool.getstr( comm_new );
+        uint32_t delta = 0;
 
-        for ( trace_event_t &event : m_events )
+        for ( uint32_t shift = 0;; shift += 7 )
         {
-            if ( event.comm == commstr_old )
-                event.comm = commstr_new;
-            if ( event.user_comm == commstr_old )
-                event.user_comm = commstr_new;
+            uint8_t byte = *buf++;
 
+            delta |= ( uint32_t )( byte & 0x7f ) << shift;
+            if ( !( byte & 0x80 ) )
+                break;
         }
 
-        uint32_t hashval_new = fnv_hashstr32( comm_new );
-        uint32_t hashval_old = fnv_hashstr32( comm_old );
-
-        m_comm_locations.m_locs.set_val( hashval_new, *plocs );
-        m_comm_locations.m_locs.m_map.erase( hashval_old );
-        return true;
+        loc += delta;
+        locs[ i ] = loc;
     }
 
-    return false;
+    return true;
 }
 
-/*
-[Compositor Client] Received Idx ###
-[Compositor Client] WaitGetPoses Begin ThreadId=####
-[Compositor Client] WaitGetPoses End ThreadId=####
+static bool gfxcontext_job_matches( const TraceGfxContexts::job_t &job, const trace_event_t &event )
+{
+    // Timelines are strpool strings, so this is almost always a pointer compare
+    return ( job.context == event.context ) && ( job.seqno == event.seqno ) &&
+           ( ( job.timeline == event.timeline ) || !strcmp( job.timeline, event.timeline ) );
+}
 
-[Compositor] Detected dropped frames: ###
-[Compositor] frameTimeout( ### ms )
-[Compositor] NewFrame idx=####
-[Compositor] Predicting( ##.###### ms )
-[Compositor] Re-predicting( ##.###### ms )
-[Compositor] TimeSinceLastVSync: #.######(#####)
+const TraceGfxContexts::job_t &TraceGfxContexts::add( const trace_event_t &event )
+{
+    uint32_t *pidx = m_map.get_val( get_key( event ), INVALID_ID );
+    uint32_t idx = *pidx;
 
-[Compositor Client] PostPresentHandoff Begin
-[Compositor Client] PostPresentHandoff End
+    while ( is_valid_id( idx ) && !gfxcontext_job_matches( m_jobs[ idx ], event ) )
+        idx = m_jobs[ idx ].next;
 
-[Compositor Client] Submit End
-[Compositor Client] Submit Left
-[Compositor Client] Submit Right
-*/
-static const char *s_buf_prefixes[] =
+    if ( !is_valid_id( idx ) )
+    {
+        job_t job;
+
+        job.timeline = event.timeline;
+        job.context = event.context;
+        job.seqno = event.seqno;
+        job.next = *pidx;
+        job.overflow = INVALID_ID;
+        job.count = 0;
+
+        idx = m_jobs.size();
+        m_jobs.push_back( job );
+        *pidx = idx;
+    }
+
+    job_t &job = m_jobs[ idx ];
+
+    if ( job.count < s_ids_max )
+    {
+        job.ids[ job.count ] = event.id;
+    }
+    else
+    {
+        if ( !is_valid_id( job.overflow ) )
+        {
+            job.overflow = m_overflow.size();
+            m_overflow.push_back( std::vector< uint32_t >() );
+        }
+        m_overflow[ job.overflow ].push_back( event.id );
+    }
+
+    job.count++;
+    return job;
+}
+
+const TraceGfxContexts::job_t *TraceGfxContexts::find( const trace_event_t &event ) const
 {
-    "[Compositor Client] Received Idx ",
-    "[Compositor Client] WaitGetPoses ",
-    "[Compositor] frameTimeout( ",
-    "[Compositor] NewFrame idx= ",
-    "[Compositor] Predicting( ",
-    "[Compositor] Re-predicting( ",
-    "[Compositor Client] PostPresentHandoff ",
-    "[Compositor Client] Submit ",
-    "[Compositor] Present() ",
-};
+    auto it = m_map.m_map.find( get_key( event ) );
+    uint32_t idx = ( it != m_map.m_map.end() ) ? it->second : INVALID_ID;
 
-void TraceEvents::calculate_event_print_info()
+    while ( is_valid_id( idx ) )
+    {
+        if ( gfxcontext_job_matches( m_jobs[ idx ], event ) )
+            return &m_jobs[ idx ];
+
+        idx = m_jobs[ idx ].next;
+    }
+
+    return NULL;
+}
+
+void TracePostings::rename( uint32_t hashval_old, uint32_t hashval_new )
 {
-    if ( !m_print_buf_info.m_map.empty() )
-        return;
+    std::vector< uint32_t > locs_old;
+    std::vector< uint32_t > locs_new;
+    std::vector< uint32_t > locs;
 
-    const std::vector< uint32_t > *plocs = get_tdopexpr_locs( "$name=print" );
-    if ( !plocs )
+    if ( ( hashval_old == hashval_new ) || !get_locations_u32( hashval_old, locs_old ) )
         return;
 
-    uint32_t row_id = 1;
-    util_umap< uint32_t, uint32_t > hash_row_map;
+    get_locations_u32( hashval_new, locs_new );
+    std::merge( locs_old.begin(), locs_old.end(), locs_new.begin(), locs_new.end(),
+                std::back_inserter( locs ) );
 
-    for ( uint32_t idx : *plocs )
+    m_postings.m_map.erase( hashval_old );
+    m_postings.m_map.erase( hashval_new );
+
+    for ( uint32_t loc : locs )
+        add_location_u32( hashval_new, loc );
+}
+
+// Hash of filter variable and lowercased value, since equality compares
+//  ignore case. Returns 0 for values too long to index.
+static uint32_t filter_index_hashval( int varid, const char *value )
+{
+    char buf[ 256 ];
+    size_t len = 0;
+
+    snprintf_safe( buf, "%d:", varid );
+    for ( len = strlen( buf ); value[ 0 ]; len++ )
     {
-        trace_event_t &event = m_events[ idx ];
-        const char *buf = get_event_field_val( event, "buf" );
+        if ( len >= sizeof( buf ) )
+            return 0;
+
+        buf[ len ] = tolower( *value++ );
+    }
+
+    return fnv_hashstr32( buf, len );
+}
 
-        // If we can find a colon, use everything before it
-        const char *buf_end = strrchr( buf, ':' );
+void TraceEvents::init_filter_index()
+{
+    std::unordered_map< const char *, uint32_t > hashvals[ 3 ];
+    std::unordered_map< int, uint32_t > pid_hashvals;
+    static const int s_str_vars[] = { FILTER_VAR_Name, FILTER_VAR_Comm, FILTER_VAR_UserComm };
+
+    m_filter_index.m_postings.m_map.clear();
+
+    for ( const trace_event_t &event : m_events )
+    {
+        const char *strs[] = { event.name, comm_str( event.comm_id ), comm_str( event.user_comm_id ) };
 
-        if ( !buf_end )
+        for ( size_t i = 0; i < ARRAY_SIZE( s_str_vars ); i++ )
         {
-            // No colon - try to find one of our buf prefixes
-            for ( size_t i = 0; i < ARRAY_SIZE( s_buf_prefixes ); i++ )
-            {
-                size_t len = strlen( s_buf_prefixes[ i ] );
-                if ( !strncasecmp( buf, s_buf_prefixes[ i ], len ) )
-                {
-                    buf_end = buf + len;
-                    break;
-                }
-            }
+            auto it = hashvals[ i ].emplace( strs[ i ], 0 );
+
+            // Strings are from our string pool, so only hash each one once
+            if ( it.second )
+                it.first->second = filter_index_hashval( s_str_vars[ i ], strs[ i ] ? strs[ i ] : "" );
+            if ( it.first->second )
+                m_filter_index.add_location_u32( it.first->second, event.id );
         }
 
-        if ( !buf_end )
+        auto it = pid_hashvals.emplace( event.pid, 0 );
+        if ( it.second )
         {
-            // Throw all unrecognized events on line 0
-            event.graph_row_id = 0;
+            char buf[ 32 ];
+
+            snprintf_safe( buf, "%d", event.pid );
+            it.first->second = filter_index_hashval( FILTER_VAR_Pid, buf );
         }
-        else
-        {
-            // hash our prefix and put em all on their own row with their own color
-            uint32_t hashval = fnv_hashstr32( buf, buf_end - buf );
-            uint32_t *prow_id = hash_row_map.get_val( hashval, 0 );
+        m_filter_index.add_location_u32( it.first->second, event.id );
+    }
 
-            if ( *prow_id == 0 )
-                *prow_id = row_id++;
+    m_filter_index_inited = true;
+}
 
-            event.graph_row_id = *prow_id;
-        }
+bool TraceEvents::get_filter_index_locs( int varid, const char *value, std::vector< uint32_t > &locs )
+{
+    if ( varid == FILTER_VAR_Id )
+    {
+        char *endptr;
+        unsigned long id = strtoul( value, &endptr, 10 );
+
+        // Event ids are unique and formatted with "%u"
+        locs.clear();
+        if ( !*endptr && ( id < m_events.size() ) && ( value[ 0 ] != '0' || !value[ 1 ] ) )
+            locs.push_back( ( uint32_t )id );
+        return isdigit( value[ 0 ] ) || !value[ 0 ];
+    }
 
-        // Add cached print info for this event
-        m_print_buf_info.get_val( event.id, { buf, buf_end } );
+    if ( ( varid != FILTER_VAR_Name ) && ( varid != FILTER_VAR_Comm ) &&
+         ( varid != FILTER_VAR_UserComm ) && ( varid != FILTER_VAR_Pid ) )
+    {
+        return false;
     }
 
-    m_rect_size_max_x = -1.0f;
+    uint32_t hashval = filter_index_hashval( varid, value );
+
+    if ( !hashval )
+        return false;
+
+    // Values no event has are indexed too: there are no matches
+    m_filter_index.get_locations_u32( hashval, locs );
+    return true;
 }
 
-void TraceEvents::update_ftraceprint_colors( float label_sat, float label_alpha )
+size_t TraceEvents::get_thread_count( size_t work_count ) const
 {
-    m_rect_size_max_x = -1.0f;
+    size_t max_threads = m_max_threads ? m_max_threads : std::thread::hardware_concurrency();
 
-    for ( auto &entry : m_print_buf_info.m_map )
+    return std::min< size_t >( max_threads, work_count );
+}
+
+bool TraceEvents::tdopexpr_scan( TdopExpr *tdop_expr, std::vector< uint32_t > &locs,
+                                SDL_atomic_t *progress, SDL_atomic_t *cancel,
+                                const std::vector< uint32_t > *ids )
+{
+    static const size_t s_chunk_size = 64 * 1024;
+    size_t scan_count = ids ? ids->size() : m_events.size();
+    size_t chunk_count = ( scan_count + s_chunk_size - 1 ) / s_chunk_size;
+    size_t thread_count = get_thread_count( chunk_count );
+    std::vector< std::vector< uint32_t > > chunk_locs( chunk_count );
+    std::vector< std::thread > threads;
+    std::atomic< size_t > next_chunk( 0 );
+    std::atomic< bool > cancelled( false );
+
+    // Each thread grabs the next chunk of events until they're all gone
+    auto scan_func = [&]()
+    {
+        tdop_get_keyval_func get_keyval_func = std::bind( filter_get_keyval_func, this, _1, _2, _3, _4 );
+
+        for ( ;; )
+        {
+            size_t chunk = next_chunk++;
+
+            if ( chunk >= chunk_count )
+                break;
+            if ( cancel && SDL_AtomicGet( cancel ) )
+            {
+                cancelled = true;
+                break;
+            }
+
+            size_t start = chunk * s_chunk_size;
+            size_t end = std::min< size_t >( start + s_chunk_size, scan_count );
+            std::vector< uint32_t > &chunk_ids = chunk_locs[ chunk ];
+
+            for ( size_t i = start; i < end; i++ )
+            {
+                const trace_event_t &event = m_events[ ids ? ( *ids )[ i ] : i ];
+
+                if ( tdopexpr_exec( tdop_expr, get_keyval_func, &event ) )
+                    chunk_ids.push_back( event.id );
+            }
+
+            if ( progress )
+                SDL_AtomicAdd( progress, ( int )( end - start ) );
+        }
+    };
+
+    for ( size_t i = 1; i < thread_count; i++ )
+        threads.push_back( std::thread( scan_func ) );
+    scan_func();
+
+    for ( std::thread &thread : threads )
+        thread.join();
+
+    if ( cancelled )
+        return false;
+
+    size_t count = 0;
+    for ( const std::vector< uint32_t > &chunk : chunk_locs )
+        count += chunk.size();
+
+    locs.clear();
+    locs.reserve( count );
+    for ( const std::vector< uint32_t > &chunk : chunk_locs )
+        locs.insert( locs.end(), chunk.begin(), chunk.end() );
+
+    return true;
+}
+
+// Drop whitespace which doesn't separate words, outside of quoted strings, so
+//  "$pid = 10" and "$pid=10" share cached results.
+static std::string tdopexpr_normalize( const char *expr )
+{
+    std::string ret;
+    bool quoted = false;
+    bool space = false;
+    auto lambda_isword = []( char c ) { return isalnum( c ) || ( c == '_' ) || ( c == '$' ) || ( c == '.' ); };
+
+    for ( const char *str = expr; *str; str++ )
+    {
+        char c = *str;
+
+        if ( !quoted && isspace( c ) )
+        {
+            space = true;
+            continue;
+        }
+
+        if ( space && !ret.empty() && lambda_isword( ret.back() ) && lambda_isword( c ) )
+            ret += ' ';
+        space = false;
+
+        if ( c == '"' )
+            quoted = !quoted;
+        ret += c;
+    }
+
+    return ret;
+}
+
+const std::vector< uint32_t > *TraceEvents::get_tdopexpr_subset( const std::string &expr )
+{
+    int depth = 0;
+    bool quoted = false;
+    std::vector< size_t > and_pos;
+
+    // Find the top level && operators. Bail if there's a top level ||.
+    for ( size_t i = 0; i < expr.size(); i++ )
+    {
+        if ( expr[ i ] == '"' )
+            quoted = !quoted;
+        else if ( quoted )
+            continue;
+        else if ( expr[ i ] == '(' )
+            depth++;
+        else if ( expr[ i ] == ')' )
+            depth--;
+        else if ( !depth && !expr.compare( i, 2, "||" ) )
+            return NULL;
+        else if ( !depth && !expr.compare( i, 2, "&&" ) )
+            and_pos.push_back( i++ );
+    }
+
+    if ( and_pos.empty() )
+        return NULL;
+
+    const std::vector< uint32_t > *subset = NULL;
+    auto lambda_check = [&]( std::string term )
+    {
+        // Strip parens around the whole term: "($pid=1)" -> "$pid=1"
+        while ( ( term.size() > 2 ) && ( term.front() == '(' ) && ( term.back() == ')' ) )
+        {
+            int level = 0;
+            bool inquote = false;
+            size_t close = 0;
+
+            for ( size_t i = 0; i < term.size() && !close; i++ )
+            {
+                if ( term[ i ] == '"' )
+                    inquote = !inquote;
+                else if ( !inquote && ( term[ i ] == '(' ) )
+                    level++;
+                else if ( !inquote && ( term[ i ] == ')' ) && !--level )
+                    close = i;
+            }
+
+            // "(a)&&(b)" isn't enclosed by a single pair
+            if ( close != term.size() - 1 )
+                break;
+            term = term.substr( 1, term.size() - 2 );
+        }
+
+        const std::vector< uint32_t > *plocs =
+                m_tdopexpr_locations.get_locations_u32( tdopexpr_hashval( term.c_str() ) );
+
+        if ( plocs && ( !subset || ( plocs->size() < subset->size() ) ) )
+            subset = plocs;
+    };
+
+    and_pos.push_back( expr.size() );
+    for ( size_t i = 0; i < and_pos.size(); i++ )
+    {
+        size_t start = i ? ( and_pos[ i - 1 ] + 2 ) : 0;
+
+        // Leading run of terms: "a&&b" for "a&&b&&c"
+        if ( i && ( i + 1 < and_pos.size() ) )
+            lambda_check( expr.substr( 0, and_pos[ i ] ) );
+        // Single term
+        lambda_check( expr.substr( start, and_pos[ i ] - start ) );
+    }
+
+    return subset;
+}
+
+bool TraceEvents::get_tdopexpr_candidates( TdopExpr *tdop_expr, const std::string &expr,
+                                           std::vector< uint32_t > &ids, bool &exact )
+{
+    tdop_get_index_func get_index_func = std::bind( &TraceEvents::get_filter_index_locs, this, _1, _2, _3 );
+    const std::vector< uint32_t > *subset = get_tdopexpr_subset( expr );
+    bool indexed = m_filter_index_inited && tdopexpr_index( tdop_expr, get_index_func, ids, exact );
+
+    if ( !subset || ( indexed && exact ) )
+        return indexed;
+
+    if ( !indexed )
+    {
+        ids = *subset;
+    }
+    else
+    {
+        std::vector< uint32_t > both;
+
+        std::set_intersection( ids.begin(), ids.end(), subset->begin(), subset->end(),
+                               std::back_inserter( both ) );
+        ids.swap( both );
+    }
+
+    exact = false;
+    return true;
+}
+
+const std::vector< uint32_t > *TraceEvents::get_tdopexpr_locs( const char *expr, std::string *err )
+{
+    std::vector< uint32_t > *plocs;
+    std::string normalized = tdopexpr_normalize( expr );
+    const char *name = normalized.c_str();
+    uint32_t hashval = tdopexpr_hashval( name );
+
+    // Try to find whatever our name hashed to. Name should be something like:
+    //   $name=drm_vblank_event
+    plocs = m_tdopexpr_locations.get_locations_u32( hashval );
+    if ( plocs )
+        return plocs;
+
+    // Not found - check if we've tried and failed with this name before.
+    if ( m_failed_commands.find( hashval ) != m_failed_commands.end() )
+        return NULL;
+
+    // If the name has a tdop expression variable prefix, try compiling it
+    if ( strchr( name, '$' ) )
+    {
+        std::string errstr;
+        tdop_get_key_func get_key_func = std::bind( filter_get_key_func, &m_strpool, _1, _2 );
+        class TdopExpr *tdop_expr = tdopexpr_compile( name, get_key_func, errstr );
+
+        if ( !tdop_expr )
+        {
+            if ( err )
+                *err = errstr;
+            else
+                logf( "[Error] compiling '%s': %s", name, errstr.c_str() );
+        }
+        else
+        {
+            std::vector< uint32_t > locs;
+
+            std::vector< uint32_t > ids;
+            bool exact = false;
+
+            if ( !get_tdopexpr_candidates( tdop_expr, normalized, ids, exact ) )
+                tdopexpr_scan( tdop_expr, locs );
+            else if ( exact )
+                locs.swap( ids );
+            else
+                tdopexpr_scan( tdop_expr, locs, NULL, NULL, &ids );
+
+            if ( !locs.empty() )
+                m_tdopexpr_locations.set_locations_u32( hashval, locs );
+
+            tdopexpr_delete( tdop_expr );
+        }
+    }
+
+    // Try to find this name/expression again and add to failed list if we miss again
+    plocs = m_tdopexpr_locations.get_locations_u32( hashval );
+    if ( !plocs )
+        m_failed_commands.insert( hashval );
+
+    return plocs;
+}
+
+/*
+ * SaveSelectionDlg
+ */
+void SaveSelectionDlg::init( TraceEvents &trace_events, int64_t ts_start, int64_t ts_end, const std::string &range_str )
+{
+    std::string base = trace_events.m_filename;
+    size_t pos = base.rfind( ".dat" );
+    std::string ext = ( pos != std::string::npos ) ? base.substr( pos + 4 ) : "";
+
+    // trace.dat, trace.dat.xz, trace.dat.0 -> trace_<start>-<end>ms.dat. Only
+    //  strip .dat at the end of the file name or right before its extension,
+    //  so directories like my.dataset/ are left alone.
+    if ( ( pos != std::string::npos ) &&
+         ( ext.empty() || ( ( ext[ 0 ] == '.' ) && ( ext.find_first_of( "./\\", 1 ) == std::string::npos ) ) ) )
+        base.erase( pos );
+
+    m_ts_start = ts_start;
+    m_ts_end = ts_end;
+    m_range_str = range_str;
+    m_err_str.clear();
+
+    snprintf_safe( m_filename_buf, "%s_%.0f-%.0fms.dat", base.c_str(),
+                   ts_start * ( 1.0 / NSECS_PER_MSEC ), ts_end * ( 1.0 / NSECS_PER_MSEC ) );
+
+    ImGui::OpenPopup( "Save Selection" );
+}
+
+void SaveSelectionDlg::render_dlg( TraceEvents &trace_events, const std::vector< uint32_t > &filtered_events )
+{
+    if ( !ImGui::BeginPopupModal( "Save Selection", NULL, ImGuiWindowFlags_AlwaysAutoResize ) )
+        return;
+
+    const ImVec2 button_size = { imgui_scale( 120.0f ), 0.0f };
+
+    ImGui::Text( "Range: %s", m_range_str.c_str() );
+
+    ImGui::PushItemWidth( imgui_scale( 400.0f ) );
+    ImGui::InputText( "File", m_filename_buf, sizeof( m_filename_buf ) );
+    ImGui::PopItemWidth();
+
+    if ( filtered_events.empty() )
+    {
+        m_only_filtered = false;
+    }
+    else
+    {
+        std::string label = string_format( "Only filtered events (%zu)", filtered_events.size() );
+
+        ImGui::Checkbox( label.c_str(), &m_only_filtered );
+    }
+
+    if ( m_err_str.size() )
+        ImGui::TextColored( ImVec4( 1, 0, 0, 1 ), "%s", m_err_str.c_str() );
+
+    ImGui::NewLine();
+
+    if ( ImGui::Button( "Save", button_size ) && m_filename_buf[ 0 ] )
+    {
+        // The reader works with trace file timestamps
+        int64_t ts_min = trace_events.m_ts_min;
+        std::vector< std::pair< uint32_t, int64_t > > keep;
+        TraceSliceFilter filter = [&keep]( uint32_t cpu, int64_t ts )
+        {
+            return std::binary_search( keep.begin(), keep.end(), std::make_pair( cpu, ts ) );
+        };
+
+        if ( m_only_filtered )
+        {
+            for ( uint32_t id : filtered_events )
+            {
+                const trace_event_t &event = trace_events.m_events[ id ];
+
+                if ( ( event.ts >= m_ts_start ) && ( event.ts <= m_ts_end ) )
+                    keep.push_back( std::make_pair( event.cpu, event.ts + ts_min ) );
+            }
+            std::sort( keep.begin(), keep.end() );
+        }
+
+        if ( m_only_filtered && keep.empty() )
+        {
+            m_err_str = "No filtered events in range.";
+        }
+        else if ( write_trace_slice( trace_events.m_filenames, m_filename_buf,
+                                     m_ts_start + ts_min, m_ts_end + ts_min,
+                                     m_only_filtered ? &filter : NULL ) )
+        {
+            logf( "Saved selection to %s (%zu bytes)", m_filename_buf, get_file_size( m_filename_buf ) );
+            ImGui::CloseCurrentPopup();
+        }
+        else
+        {
+            m_err_str = string_format( "Saving %s failed, see log for details.", m_filename_buf );
+        }
+    }
+
+    ImGui::SameLine();
+    if ( ImGui::Button( "Cancel", button_size ) || imgui_key_pressed( ImGuiKey_Escape ) )
+        ImGui::CloseCurrentPopup();
+
+    ImGui::EndPopup();
+}
+
+/*
+ * TdopExprScan
+ */
+bool TdopExprScan::start( TraceEvents &trace_events, const char *expr, std::string &errstr )
+{
+    cancel();
+
+    tdop_get_key_func get_key_func = std::bind( filter_get_key_func, &trace_events.m_strpool, _1, _2 );
+
+    m_tdop_expr = tdopexpr_compile( expr, get_key_func, errstr );
+    if ( !m_tdop_expr )
+        return false;
+
+    m_trace_events = &trace_events;
+    m_expr = tdopexpr_normalize( expr );
+    m_locs.clear();
+    m_time_start = util_get_time();
+
+    // Already have results for this expression?
+    const std::vector< uint32_t > *plocs =
+            trace_events.m_tdopexpr_locations.get_locations_u32( trace_events.tdopexpr_hashval( m_expr.c_str() ) );
+    if ( plocs )
+    {
+        m_locs = *plocs;
+        m_resolved = true;
+        return true;
+    }
+
+    // If indexes or cached terms narrow this down, only scan those events
+    bool exact = false;
+
+    m_candidates.clear();
+    m_use_candidates = trace_events.get_tdopexpr_candidates( m_tdop_expr, m_expr, m_candidates, exact );
+    if ( m_use_candidates && exact )
+    {
+        m_locs.swap( m_candidates );
+        m_resolved = true;
+        return true;
+    }
+
+    m_scan_count = m_use_candidates ? m_candidates.size() : trace_events.m_events.size();
+
+    SDL_AtomicSet( &m_progress, 0 );
+    SDL_AtomicSet( &m_cancel, 0 );
+    SDL_AtomicSet( &m_done, 0 );
+
+    m_thread = SDL_CreateThread( thread_func, "tdopexprscan", ( void * )this );
+    if ( !m_thread )
+    {
+        logf( "[Error] %s: SDL_CreateThread failed.", __func__ );
+        errstr = "ERROR: Failed to start filter thread";
+
+        tdopexpr_delete( m_tdop_expr );
+        m_tdop_expr = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+void TdopExprScan::cancel()
+{
+    SDL_AtomicSet( &m_cancel, 1 );
+
+    finish();
+    m_locs.clear();
+}
+
+float TdopExprScan::finish()
+{
+    if ( m_thread )
+    {
+        SDL_WaitThread( m_thread, NULL );
+        m_thread = NULL;
+    }
+
+    m_resolved = false;
+    m_candidates.clear();
+
+    tdopexpr_delete( m_tdop_expr );
+    m_tdop_expr = NULL;
+
+    return util_time_to_ms( m_time_start, util_get_time() );
+}
+
+float TdopExprScan::get_progress()
+{
+    return m_scan_count ? ( SDL_AtomicGet( &m_progress ) / ( float )m_scan_count ) : 1.0f;
+}
+
+int SDLCALL TdopExprScan::thread_func( void *data )
+{
+    TdopExprScan *scan = ( TdopExprScan * )data;
+
+    scan->m_trace_events->tdopexpr_scan( scan->m_tdop_expr, scan->m_locs,
+                                         &scan->m_progress, &scan->m_cancel,
+                                         scan->m_use_candidates ? &scan->m_candidates : NULL );
+
+    SDL_AtomicSet( &scan->m_done, 1 );
+    return 0;
+}
+
+const std::vector< uint32_t > *TraceEvents::get_comm_locs( const char *name )
+{
+    return m_comm_locations.get_locations_str( name );
+}
+
+const std::vector< uint32_t > *TraceEvents::get_timeline_locs( const char *name )
+{
+    return m_timeline_locations.get_locations_str( name );
+}
+
+void TraceEvents::init_gfxcontexts()
+{
+    m_gfxcontexts.clear();
+
+    for ( const trace_event_t &event : m_events )
+    {
+        if ( is_timeline_event( event ) )
+            m_gfxcontexts.add( event );
+    }
+}
+
+bool TraceEvents::rename_comm( const char *comm_old, const char *comm_new )
+{
+    if ( !comm_old[ 0 ] ||
+         !comm_new[ 0 ] ||
+         !strcasecmp( comm_old, comm_new ) )
+    {
+        return false;
+    }
+
+    std::vector< uint32_t > *plocs = m_comm_locations.get_locations_str( comm_old );
+
+    if ( plocs )
+    {
+        uint32_t id_old;
+        const char *commstr_old = m_strpool.getstr( comm_old, ( size_t )-1, &id_old );
+        const char *commstr_new = m_strpool.getstr( comm_new );
+
+        // Point every comm id currently showing comm_old at comm_new. That's
+        //  comm_old's own id unless it was renamed, plus anything renamed to it.
+        if ( !m_comm_renames.get_val( id_old ) )
+            m_comm_renames.m_map[ id_old ] = commstr_new;
+
+        for ( auto &item : m_comm_renames.m_map )
+        {
+            if ( item.second == commstr_old )
+                item.second = commstr_new;
+        }
+
+        uint32_t hashval_new = fnv_hashstr32( comm_new );
+        uint32_t hashval_old = fnv_hashstr32( comm_old );
+        std::vector< uint32_t > locs_old;
+        std::vector< uint32_t > *plocs_new = m_comm_locations.get_locations_u32( hashval_new );
+
+        locs_old.swap( *plocs );
+        m_comm_locations.m_locs.m_map.erase( hashval_old );
+
+        // Move the locations over, merging if comm_new already had some
+        if ( plocs_new )
+        {
+            std::vector< uint32_t > locs;
+
+            std::merge( locs_old.begin(), locs_old.end(), plocs_new->begin(), plocs_new->end(),
+                        std::back_inserter( locs ) );
+            plocs_new->swap( locs );
+        }
+        else
+        {
+            m_comm_locations.set_locations_u32( hashval_new, locs_old );
+        }
+
+        m_filter_index.rename( filter_index_hashval( FILTER_VAR_Comm, comm_old ),
+                               filter_index_hashval( FILTER_VAR_Comm, comm_new ) );
+        m_filter_index.rename( filter_index_hashval( FILTER_VAR_UserComm, comm_old ),
+                               filter_index_hashval( FILTER_VAR_UserComm, comm_new ) );
+
+        // Lods are keyed on locs addresses which may have moved
+        m_graph_lods.m_map.clear();
+
+        m_rename_generation++;
+        return true;
+    }
+
+    return false;
+}
+
+/*
+[Compositor Client] Received Idx ###
+[Compositor Client] WaitGetPoses Begin ThreadId=####
+[Compositor Client] WaitGetPoses End ThreadId=####
+
+[Compositor] Detected dropped frames: ###
+[Compositor] frameTimeout( ### ms )
+[Compositor] NewFrame idx=####
+[Compositor] Predicting( ##.###### ms )
+[Compositor] Re-predicting( ##.###### ms )
+[Compositor] TimeSinceLastVSync: #.######(#####)
+
+[Compositor Client] PostPresentHandoff Begin
+[Compositor Client] PostPresentHandoff End
+
+[Compositor Client] Submit End
+[Compositor Client] Submit Left
+[Compositor Client] Submit Right
+*/
+static const char *s_buf_prefixes[] =
+{
+    "[Compositor Client] Received Idx ",
+    "[Compositor Client] WaitGetPoses ",
+    "[Compositor] frameTimeout( ",
+    "[Compositor] NewFrame idx= ",
+    "[Compositor] Predicting( ",
+    "[Compositor] Re-predicting( ",
+    "[Compositor Client] PostPresentHandoff ",
+    "[Compositor Client] Submit ",
+    "[Compositor] Present() ",
+};
+
+void TraceEvents::calculate_event_print_info()
+{
+    if ( !m_print_buf_info.m_map.empty() )
+        return;
+
+    const std::vector< uint32_t > *plocs = get_tdopexpr_locs( "$name=print" );
+    if ( !plocs )
+        return;
+
+    util_umap< uint32_t, uint32_t > hash_row_map;
+
+    // Throw all unrecognized events on row 0
+    m_print_row_hashvals.clear();
+    m_print_row_hashvals.push_back( 0 );
+
+    for ( uint32_t idx : *plocs )
+    {
+        trace_event_t &event = m_events[ idx ];
+        const char *buf = get_event_field_val( event, "buf" );
+
+        // Print bufs are interned, so identical prints share one prefix scan
+        event_print_info_t *print_info = m_print_str_info.get_val( buf );
+
+        if ( !print_info )
+        {
+            // If we can find a colon, use everything before it
+            const char *buf_end = strrchr( buf, ':' );
+
+            if ( !buf_end )
+            {
+                // No colon - try to find one of our buf prefixes
+                for ( size_t i = 0; i < ARRAY_SIZE( s_buf_prefixes ); i++ )
+                {
+                    size_t len = strlen( s_buf_prefixes[ i ] );
+                    if ( !strncasecmp( buf, s_buf_prefixes[ i ], len ) )
+                    {
+                        buf_end = buf + len;
+                        break;
+                    }
+                }
+            }
+
+            print_info = m_print_str_info.get_val( buf, { buf, buf_end, ImVec2( -1.0f, -1.0f ) } );
+        }
+
+        if ( !print_info->buf_end )
+        {
+            event.graph_row_id = 0;
+        }
+        else
+        {
+            // hash our prefix and put em all on their own row with their own color
+            uint32_t hashval = fnv_hashstr32( print_info->buf, print_info->buf_end - print_info->buf );
+            uint32_t *prow_id = hash_row_map.get_val( hashval, 0 );
+
+            if ( *prow_id == 0 )
+            {
+                *prow_id = m_print_row_hashvals.size();
+                m_print_row_hashvals.push_back( hashval );
+            }
+
+            event.graph_row_id = *prow_id;
+        }
+
+        // Add cached print info for this event
+        m_print_buf_info.get_val( event.id, print_info );
+    }
+
+    m_rect_size_max_x = -1.0f;
+}
+
+void TraceEvents::update_ftraceprint_colors( float label_sat, float label_alpha )
+{
+    std::vector< ImU32 > row_colors( m_print_row_hashvals.size() );
+
+    // Colors are per prefix, so compute them once per row
+    for ( size_t row_id = 0; row_id < row_colors.size(); row_id++ )
+    {
+        if ( !row_id )
+            row_colors[ row_id ] = IM_COL32( 0xff, 0, 0, label_alpha * 255 );
+        else
+            row_colors[ row_id ] = imgui_col_from_hashval( m_print_row_hashvals[ row_id ], label_sat, label_alpha );
+    }
+
+    for ( auto &entry : m_print_buf_info.m_map )
+    {
+        trace_event_t &event = m_events[ entry.first ];
+
+        event.color = row_colors[ event.graph_row_id ];
+    }
+
+    // Measure each unique print string once here. Print rows look back
+    //  m_rect_size_max_x to the left of the view for labels that reach into
+    //  it, so it needs to cover every string and not just the ones drawn.
+    m_rect_size_max_x = 0.0f;
+    for ( auto &entry : m_print_str_info.m_map )
+    {
+        entry.second.rect_size = ImGui::CalcTextSize( entry.second.buf );
+
+        m_rect_size_max_x = std::max< float >( entry.second.rect_size.x, m_rect_size_max_x );
+    }
+}
+
+const TraceEvents::event_print_info_t *TraceEvents::get_print_info( uint32_t eventid )
+{
+    event_print_info_t **pprint_info = m_print_buf_info.get_val( eventid );
+
+    if ( !pprint_info )
+        return NULL;
+
+    event_print_info_t *print_info = *pprint_info;
+
+    if ( print_info->rect_size.x < 0.0f )
+    {
+        print_info->rect_size = ImGui::CalcTextSize( print_info->buf );
+
+        m_rect_size_max_x = std::max< float >( print_info->rect_size.x, m_rect_size_max_x );
+    }
+
+    return print_info;
+}
+
+void TraceEvents::invalidate_ftraceprint_colors()
+{
+    m_rect_size_max_x = -1.0f;
+}
+
+void TraceEvents::update_fence_signaled_timeline_colors( float label_sat, float label_alpha )
+{
+    for ( auto &timeline_locs : m_timeline_locations.m_locs.m_map )
+        update_fence_signaled_colors( timeline_locs.second, label_sat, label_alpha );
+}
+
+void TraceEvents::update_fence_signaled_colors( const std::vector< uint32_t > &locs,
+                                                float label_sat, float label_alpha )
+{
+    // A timeline's jobs come from a handful of user comms, so only hash and
+    //  convert each one's color once.
+    util_umap< uint32_t, ImU32 > comm_colors;
+
+    for ( uint32_t index : locs )
+    {
+        trace_event_t &fence_signaled = m_events[ index ];
+
+        if ( fence_signaled.is_fence_signaled() &&
+             is_valid_id( fence_signaled.id_start ) )
+        {
+            auto it = comm_colors.m_map.emplace( fence_signaled.user_comm_id, 0 );
+
+            if ( it.second )
+            {
+                uint32_t hashval = fnv_hashstr32( comm_str( fence_signaled.user_comm_id ) );
+
+                it.first->second = imgui_col_from_hashval( hashval, label_sat, label_alpha );
+            }
+            fence_signaled.color = it.first->second;
+        }
+    }
+}
+
+// Calculate event durations for the amdgpu_cs_ioctl, amdgpu_sched_run_job, fence_signaled
+//  sequence ending at this event. Called in load order for each gfx, sdma0, etc. timeline.
+void TraceEvents::update_fence_signaled_durations( trace_event_t &fence_signaled )
+{
+    std::vector< trace_event_t > &events = m_events;
+    timeline_durations_t *state = m_timeline_durations.get_val(
+                fnv_hashstr32( fence_signaled.timeline ), timeline_durations_t() );
+    trace_event_t &amdgpu_sched_run_job = events[ fence_signaled.id_start ];
+    int64_t start_ts = amdgpu_sched_run_job.ts;
+
+    // amdgpu_cs_ioctl   amdgpu_sched_run_job   fence_signaled
+    //       |-----------------|---------------------|
+    //       |user-->          |hw-->                |
+    //                                               |
+    //          amdgpu_cs_ioctl  amdgpu_sched_run_job|   fence_signaled
+    //                |-----------------|------------|--------|
+    //                |user-->          |hwqueue-->  |hw->    |
+    //                                                        |
+
+    // Our starting location will be the last fence signaled timestamp or
+    //  our amdgpu_sched_run_job timestamp, whichever is larger.
+    int64_t hw_start_ts = std::max< int64_t >( state->last_fence_signaled_ts, amdgpu_sched_run_job.ts );
+
+    // Set duration times
+    fence_signaled.duration = fence_signaled.ts - hw_start_ts;
+    amdgpu_sched_run_job.duration = hw_start_ts - amdgpu_sched_run_job.ts;
+
+    if ( is_valid_id( amdgpu_sched_run_job.id_start ) )
+    {
+        trace_event_t &amdgpu_cs_ioctl = events[ amdgpu_sched_run_job.id_start ];
+
+        amdgpu_cs_ioctl.duration = amdgpu_sched_run_job.ts - amdgpu_cs_ioctl.ts;
+
+        start_ts = amdgpu_cs_ioctl.ts;
+    }
+
+    // If our start time stamp is greater than the last fence time stamp then
+    //  reset our graph row back to the top.
+    if ( start_ts > state->last_fence_signaled_ts )
+        state->graph_row_id = 0;
+    fence_signaled.graph_row_id = state->graph_row_id++;
+
+    state->last_fence_signaled_ts = fence_signaled.ts;
+}
+
+void TraceEvents::calculate_event_durations()
+{
+    PROF_SCOPE( PROF_EventDurations );
+
+    struct timeline_t
+    {
+        uint32_t hashval;
+        std::vector< uint32_t > *locs;
+        TimelineIndex *index;
+    };
+    std::vector< timeline_t > timelines;
+    std::vector< trace_event_t > &events = m_events;
+    float label_sat = s_clrs().getalpha( col_Graph_TimelineLabelSat );
+    float label_alpha = s_clrs().getalpha( col_Graph_TimelineLabelAlpha );
+
+    // Add the index entries up front so workers don't touch the maps
+    for ( auto &timeline_locs : m_timeline_locations.m_locs.m_map )
+    {
+        timelines.push_back( { timeline_locs.first, &timeline_locs.second,
+                               &m_timeline_index.m_map[ timeline_locs.first ] } );
+    }
+
+    // Durations were filled in by update_fence_signaled_durations() as events
+    //  were loaded. Timelines (gfx, each compute ring, sdma0, ...) have their
+    //  own events, so each worker takes the next one, trims its row, builds
+    //  its job index and sets its colors.
+    std::atomic< size_t > next_timeline( 0 );
+
+    auto timeline_func = [&]()
+    {
+        for ( ;; )
+        {
+            size_t i = next_timeline++;
+
+            if ( i >= timelines.size() )
+                break;
+
+            std::vector< uint32_t > &locs = *timelines[ i ].locs;
+
+            // Erase all timeline events with single entries or no fence_signaled
+            locs.erase( std::remove_if( locs.begin(), locs.end(),
+                                        [&events]( const uint32_t index )
+                                            { return !events[ index ].is_timeline(); } ),
+                        locs.end() );
+
+            if ( !locs.empty() )
+            {
+                timelines[ i ].index->init( events, locs );
+                update_fence_signaled_colors( locs, label_sat, label_alpha );
+            }
+        }
+    };
+
+    std::vector< std::thread > threads;
+    size_t thread_count = get_thread_count( timelines.size() );
+
+    for ( size_t i = 1; i < thread_count; i++ )
+        threads.push_back( std::thread( timeline_func ) );
+    timeline_func();
+
+    for ( std::thread &thread : threads )
+        thread.join();
+
+    for ( const timeline_t &timeline : timelines )
+    {
+        // Completely erase timeline rows with zero entries.
+        if ( timeline.locs->empty() )
+        {
+            m_timeline_index.m_map.erase( timeline.hashval );
+            m_timeline_locations.m_locs.m_map.erase( timeline.hashval );
+        }
+    }
+}
+
+void TraceEvents::init_postload( const std::vector< INIEntry > &plot_entries )
+{
+    PROF_SCOPE( PROF_PostLoad );
+
+    // These each build their own tables and only read event fields the
+    //  others don't write, so they can run side by side.
+    std::thread ts_buckets_thread( &TraceEvents::init_ts_buckets, this );
+    std::thread filter_index_thread( &TraceEvents::init_filter_index, this );
+    std::thread cpu_runs_thread( &TraceEvents::init_cpu_runs, this );
+
+    calculate_event_durations();
+    init_vblanks();
+
+    ts_buckets_thread.join();
+    filter_index_thread.join();
+    cpu_runs_thread.join();
+
+    // Tdop expression lookups use m_filter_index and share the
+    //  m_tdopexpr_locations cache, so these go one at a time.
+    calculate_event_print_info();
+
+    for ( const std::string &name : graph_rows_timeline_names() )
+        get_locs( name.c_str() );
+
+    graph_plots_init( *this, plot_entries, nullptr );
+
+    shrink_to_fit();
+
+    m_postload_done = true;
+}
+
+void TraceEvents::init_ts_buckets()
+{
+    // Aim for around 8 events per bucket
+    size_t bucket_max = std::max< size_t >( m_events.size() / 8, 1 );
+
+    m_ts_buckets.clear();
+    m_ts_bucket_shift = 0;
+
+    if ( m_events.empty() )
+        return;
+
+    int64_t ts0 = m_events.front().ts;
+    uint64_t range = m_events.back().ts - ts0 + 1;
+
+    while ( ( range >> m_ts_bucket_shift ) >= bucket_max )
+        m_ts_bucket_shift++;
+
+    size_t id = 0;
+    size_t count = ( ( range - 1 ) >> m_ts_bucket_shift ) + 1;
+
+    m_ts_buckets.resize( count );
+    for ( size_t i = 0; i < count; i++ )
+    {
+        int64_t ts = ts0 + ( ( int64_t )i << m_ts_bucket_shift );
+
+        while ( ( id < m_events.size() ) && ( m_events[ id ].ts < ts ) )
+            id++;
+
+        m_ts_buckets[ i ] = id;
+    }
+}
+
+void TraceEvents::init_vblanks()
+{
+    // Read the locations directly since this runs alongside init_filter_index()
+    const std::vector< uint32_t > *plocs = m_tdopexpr_locations.get_locations_str( "$name=drm_vblank_event" );
+
+    m_crtc_vblanks.clear();
+
+    if ( !plocs )
+        return;
+
+    for ( uint32_t idx : *plocs )
+    {
+        const trace_event_t &event = m_events[ idx ];
+
+        if ( ( event.crtc >= 0 ) && ( event.crtc < 32 ) )
+        {
+            if ( ( size_t )event.crtc >= m_crtc_vblanks.size() )
+                m_crtc_vblanks.resize( event.crtc + 1 );
+
+            m_crtc_vblanks[ event.crtc ].ts.push_back( event.ts );
+        }
+    }
+
+    for ( crtc_vblanks_t &vblanks : m_crtc_vblanks )
     {
-        trace_event_t &event = m_events[ entry.first ];
-        event_print_info_t &print_info = entry.second;
+        if ( vblanks.ts.size() < 2 )
+            continue;
 
-        print_info.rect_size = ImGui::CalcTextSize( print_info.buf );
+        vblanks.deltas.resize( vblanks.ts.size() - 1 );
+        for ( size_t i = 0; i < vblanks.deltas.size(); i++ )
+            vblanks.deltas[ i ] = vblanks.ts[ i + 1 ] - vblanks.ts[ i ];
 
-        m_rect_size_max_x = std::max< float >( print_info.rect_size.x, m_rect_size_max_x );
+        std::vector< int64_t > sorted = vblanks.deltas;
+        size_t count = sorted.size();
 
-        if ( !print_info.buf_end )
-        {
-            event.color = IM_COL32( 0xff, 0, 0, label_alpha * 255 );
-        }
-        else
-        {
-            uint32_t hashval = fnv_hashstr32( print_info.buf, print_info.buf_end - print_info.buf );
+        std::sort( sorted.begin(), sorted.end() );
 
-            event.color = imgui_col_from_hashval( hashval, label_sat, label_alpha );
-        }
+        vblanks.delta_min = sorted.front();
+        vblanks.delta_max = sorted.back();
+        vblanks.delta_avg = ( vblanks.ts.back() - vblanks.ts.front() ) / ( int64_t )count;
+        vblanks.delta_median = sorted[ count / 2 ];
+        vblanks.delta_p99 = sorted[ std::min< size_t >( count * 99 / 100, count - 1 ) ];
+
+        int64_t long_delta = vblanks.delta_median + vblanks.delta_median / 2;
+        vblanks.long_count = sorted.end() - std::upper_bound( sorted.begin(), sorted.end(), long_delta );
     }
 }
 
-void TraceEvents::invalidate_ftraceprint_colors()
+void TraceEvents::init_cpu_runs()
 {
-    m_rect_size_max_x = -1.0f;
+    // Read the locations directly since this runs alongside init_filter_index()
+    const std::vector< uint32_t > *plocs = m_tdopexpr_locations.get_locations_str( "$name=sched_switch" );
+
+    if ( plocs )
+        m_cpu_runs.init( m_events, *plocs, m_cpucount.size() );
+    else
+        m_cpu_runs.m_lanes.clear();
 }
 
-void TraceEvents::update_fence_signaled_timeline_colors( float label_sat, float label_alpha )
+const CpuRunIndex::lane_t *TraceEvents::get_cpu_lane( const char *name )
 {
-    for ( auto &timeline_locs : m_timeline_locations.m_locs.m_map )
-    {
-        std::vector< uint32_t > &locs = timeline_locs.second;
+    char *end;
+    unsigned long cpu;
 
-        for ( uint32_t index : locs )
-        {
-            trace_event_t &fence_signaled = m_events[ index ];
+    if ( strncmp( name, "cpu", 3 ) || !isdigit( ( unsigned char )name[ 3 ] ) )
+        return NULL;
 
-            if ( fence_signaled.is_fence_signaled() &&
-                 is_valid_id( fence_signaled.id_start ) )
-            {
-                uint32_t hashval = fnv_hashstr32( fence_signaled.user_comm );
-                fence_signaled.color = imgui_col_from_hashval( hashval, label_sat, label_alpha );
-            }
-        }
-    }
+    cpu = strtoul( name + 3, &end, 10 );
+    if ( *end || ( cpu >= m_cpu_runs.m_lanes.size() ) )
+        return NULL;
+
+    const CpuRunIndex::lane_t &lane = m_cpu_runs.m_lanes[ cpu ];
+    return lane.locs.empty() ? NULL : &lane;
 }
 
-// Go through gfx, sdma0, sdma1, etc. timelines and calculate event durations
-void TraceEvents::calculate_event_durations()
+void TraceEvents::get_memory_usage( std::vector< memory_usage_t > &usage )
 {
-    std::vector< uint32_t > erase_list;
-    std::vector< trace_event_t > &events = m_events;
-    float label_sat = s_clrs().getalpha( col_Graph_TimelineLabelSat );
-    float label_alpha = s_clrs().getalpha( col_Graph_TimelineLabelAlpha );
+    size_t timeline_bytes = m_timeline_locations.bytes_allocated() + umap_bytes( m_timeline_index ) +
+            umap_bytes( m_timeline_durations );
+    for ( const auto &item : m_timeline_index.m_map )
+        timeline_bytes += vec_bytes( item.second.m_jobs );
 
-    for ( auto &timeline_locs : m_timeline_locations.m_locs.m_map )
+    size_t gfxcontext_bytes = vec_bytes( m_gfxcontexts.m_jobs ) + vec_bytes( m_gfxcontexts.m_overflow ) +
+            umap_bytes( m_gfxcontexts.m_map );
+    for ( const std::vector< uint32_t > &overflow : m_gfxcontexts.m_overflow )
+        gfxcontext_bytes += vec_bytes( overflow );
+
+    // std::set node: value plus parent, left, right and color
+    size_t tdopexpr_bytes = m_tdopexpr_locations.bytes_allocated() +
+            m_failed_commands.size() * ( sizeof( uint32_t ) + 4 * sizeof( void * ) );
+
+    size_t vblank_bytes = vec_bytes( m_crtc_vblanks );
+    for ( const crtc_vblanks_t &vblanks : m_crtc_vblanks )
+        vblank_bytes += vec_bytes( vblanks.ts ) + vec_bytes( vblanks.deltas );
+
+    size_t cpu_run_bytes = vec_bytes( m_cpu_runs.m_lanes );
+    for ( const CpuRunIndex::lane_t &lane : m_cpu_runs.m_lanes )
+        cpu_run_bytes += vec_bytes( lane.runs ) + vec_bytes( lane.busy ) + vec_bytes( lane.locs );
+
+    size_t print_bytes = umap_bytes( m_print_str_info ) + umap_bytes( m_print_buf_info ) +
+            vec_bytes( m_print_row_hashvals );
+
+    size_t plot_bytes = umap_bytes( m_graph_plots );
+    for ( const auto &item : m_graph_plots.m_map )
     {
-        uint32_t graph_row_id = 0;
-        int64_t last_fence_signaled_ts = 0;
-        std::vector< uint32_t > &locs = timeline_locs.second;
-        // const char *name = m_strpool.findstr( timeline_locs.first );
+        const GraphPlot &plot = item.second;
 
-        // Erase all timeline events with single entries or no fence_signaled
-        locs.erase( std::remove_if( locs.begin(), locs.end(),
-                                    [&events]( const uint32_t index )
-                                        { return !events[ index ].is_timeline(); } ),
-                    locs.end() );
+        plot_bytes += vec_bytes( plot.m_plotdata ) + vec_bytes( plot.m_levels ) + vec_bytes( plot.m_points );
+        for ( const GraphPlot::level_t &level : plot.m_levels )
+            plot_bytes += vec_bytes( level.buckets );
+    }
 
-        if ( locs.empty() )
-            erase_list.push_back( timeline_locs.first );
+    size_t lod_bytes = umap_bytes( m_graph_lods );
+    for ( const auto &item : m_graph_lods.m_map )
+    {
+        lod_bytes += vec_bytes( item.second.m_levels );
+        for ( const GraphLod::level_t &level : item.second.m_levels )
+            lod_bytes += vec_bytes( level.buckets );
+    }
 
-        for ( uint32_t index : locs )
-        {
-            trace_event_t &fence_signaled = events[ index ];
+    usage = {
+        { "Events", vec_bytes( m_events ) },
+        { "Event fields", m_fields_arena.bytes_allocated() },
+        { "Raw event payloads", m_raw_events.bytes_allocated() },
+        { "String pool", m_strpool.bytes_allocated() },
+        { "Filter locations", tdopexpr_bytes },
+        { "Comm locations", m_comm_locations.bytes_allocated() + umap_bytes( m_comm_renames ) },
+        { "Timeline locations", timeline_bytes },
+        { "Gpu jobs", gfxcontext_bytes },
+        { "Filter index", m_filter_index.bytes_allocated() },
+        { "Timestamp lookup", vec_bytes( m_ts_buckets ) },
+        { "Vblanks", vblank_bytes },
+        { "Cpu runs", cpu_run_bytes },
+        { "Print info", print_bytes },
+        { "Graph plots", plot_bytes },
+        { "Graph LODs", lod_bytes },
+    };
 
-            if ( fence_signaled.is_fence_signaled() &&
-                 is_valid_id( fence_signaled.id_start ) )
-            {
-                trace_event_t &amdgpu_sched_run_job = events[ fence_signaled.id_start ];
-                int64_t start_ts = amdgpu_sched_run_job.ts;
-
-                // amdgpu_cs_ioctl   amdgpu_sched_run_job   fence_signaled
-                //       |-----------------|---------------------|
-                //       |user-->          |hw-->                |
-                //                                               |
-                //          amdgpu_cs_ioctl  amdgpu_sched_run_job|   fence_signaled
-                //                |-----------------|------------|--------|
-                //                |user-->          |hwqueue-->  |hw->    |
-                //                                                        |
-
-                // Our starting location will be the last fence signaled timestamp or
-                //  our amdgpu_sched_run_job timestamp, whichever is larger.
-                int64_t hw_start_ts = std::max< int64_t >( last_fence_signaled_ts, amdgpu_sched_run_job.ts );
-
-                // Set duration times
-                fence_signaled.duration = fence_signaled.ts - hw_start_ts;
-                amdgpu_sched_run_job.duration = hw_start_ts - amdgpu_sched_run_job.ts;
-
-                if ( is_valid_id( amdgpu_sched_run_job.id_start ) )
-                {
-                    trace_event_t &amdgpu_cs_ioctl = events[ amdgpu_sched_run_job.id_start ];
+    std::sort( usage.begin(), usage.end(),
+               []( const memory_usage_t &lx, const memory_usage_t &rx ) { return rx.bytes < lx.bytes; } );
+}
 
-                    amdgpu_cs_ioctl.duration = amdgpu_sched_run_job.ts - amdgpu_cs_ioctl.ts;
+void TraceEvents::shrink_to_fit()
+{
+    // Nothing keeps pointers into m_events, just ids
+    m_events.shrink_to_fit();
 
-                    start_ts = amdgpu_cs_ioctl.ts;
-                }
+    m_tdopexpr_locations.shrink_to_fit();
+    m_comm_locations.shrink_to_fit();
+    m_timeline_locations.shrink_to_fit();
+    m_filter_index.shrink_to_fit();
 
-                // If our start time stamp is greater than the last fence time stamp then
-                //  reset our graph row back to the top.
-                if ( start_ts > last_fence_signaled_ts )
-                    graph_row_id = 0;
-                fence_signaled.graph_row_id = graph_row_id++;
+    m_gfxcontexts.m_jobs.shrink_to_fit();
+    m_gfxcontexts.m_overflow.shrink_to_fit();
+    for ( std::vector< uint32_t > &overflow : m_gfxcontexts.m_overflow )
+        overflow.shrink_to_fit();
 
-                last_fence_signaled_ts = fence_signaled.ts;
+    for ( crtc_vblanks_t &vblanks : m_crtc_vblanks )
+        vblanks.ts.shrink_to_fit();
 
-                uint32_t hashval = fnv_hashstr32( fence_signaled.user_comm );
-                fence_signaled.color = imgui_col_from_hashval( hashval, label_sat, label_alpha );
-            }
-        }
+    for ( CpuRunIndex::lane_t &lane : m_cpu_runs.m_lanes )
+    {
+        lane.runs.shrink_to_fit();
+        lane.locs.shrink_to_fit();
     }
+}
 
-    for ( uint32_t hashval : erase_list )
+int TraceEvents::ts_to_eventid( int64_t ts )
+{
+    auto first = m_events.begin();
+    auto last = m_events.end();
+
+    // Narrow the search down to ts's bucket. Before the buckets are built
+    //  (still loading) this falls back to searching all the events.
+    if ( !m_ts_buckets.empty() )
     {
-        // Completely erase timeline rows with zero entries.
-        m_timeline_locations.m_locs.m_map.erase( hashval );
+        if ( ts <= m_events.front().ts )
+            return 0;
+
+        uint64_t bucket = ( uint64_t )( ts - m_events.front().ts ) >> m_ts_bucket_shift;
+
+        if ( bucket >= m_ts_buckets.size() )
+            return m_events.size() - 1;
+
+        first = m_events.begin() + m_ts_buckets[ bucket ];
+        if ( bucket + 1 < m_ts_buckets.size() )
+            last = m_events.begin() + m_ts_buckets[ bucket + 1 ];
     }
+
+    auto eventidx = std::lower_bound( first, last, ts,
+        []( const trace_event_t &event, int64_t val ) {
+            return event.ts < val;
+        } );
+
+    int id = eventidx - m_events.begin();
+
+    if ( ( size_t )id >= m_events.size() )
+        id = m_events.size() - 1;
+
+    return id;
 }
 
 const std::vector< uint32_t > *TraceEvents::get_locs( const char *name, loc_type_t *type )
@@ -1677,6 +3302,13 @@ const std::vector< uint32_t > *TraceEvents::get_locs( const char *name, loc_type
             *type = LOC_TYPE_Print;
         plocs = get_tdopexpr_locs( "$name=print" );
     }
+    else if ( const CpuRunIndex::lane_t *lane = get_cpu_lane( name ) )
+    {
+        // Per cpu scheduling lanes: cpu0, cpu1, etc.
+        if ( type )
+            *type = LOC_TYPE_Cpu;
+        plocs = &lane->locs;
+    }
     else if ( !strncmp( name, "plot:", 5 ) )
     {
         GraphPlot *plot = get_plot_ptr( name );
@@ -1773,17 +3405,46 @@ TraceWin::~TraceWin()
     }
 }
 
+bool TraceWin::needs_redraw()
+{
+    // Show loading progress, running filters, and view changes from hotkeys
+    return ( SDL_AtomicGet( &m_trace_events.m_eventsloaded ) != m_eventsloaded_drawn ) ||
+            m_eventlist.filter_scan.is_running() ||
+            m_graph.view_changed;
+}
+
 bool TraceWin::render()
 {
     int eventsloaded = SDL_AtomicGet( &m_trace_events.m_eventsloaded );
 
+    m_eventsloaded_drawn = eventsloaded;
+
     if ( eventsloaded > 0 )
     {
         ImGui::Begin( m_title.c_str(), &m_open );
 
-        ImGui::Text( "Loading events %u...", eventsloaded );
-        if ( ImGui::Button( "Cancel" ) )
-            m_loader.cancel_load_file();
+        if ( SDL_AtomicGet( &m_trace_events.m_postloading ) )
+        {
+            ImGui::Text( "Processing events..." );
+        }
+        else
+        {
+            ImGui::Text( "Loading events %u...", eventsloaded );
+            if ( ImGui::Button( "Cancel" ) )
+                m_loader.cancel_load_file();
+        }
+
+        // Show the events loaded so far
+        if ( s_opts().getb( OPT_ShowEventList ) &&
+             !SDL_AtomicGet( &m_trace_events.m_postloading ) &&
+             SDL_AtomicGet( &m_trace_events.m_events_published ) )
+        {
+            std::lock_guard< std::mutex > lock( m_trace_events.m_events_mutex );
+
+            m_eventlist.do_gotoevent |= imgui_input_int( &m_eventlist.goto_eventid, 75.0f, "Goto Event:", "##GotoEvent" );
+
+            events_list_render();
+        }
 
         ImGui::End();
         return true;
@@ -1815,10 +3476,22 @@ bool TraceWin::render()
     {
         std::vector< INIEntry > entries = s_ini().GetSectionEntries( "$rename_comm$" );
 
-        // Init event durations
-        m_trace_events.calculate_event_durations();
-        // Init print column information
-        m_trace_events.calculate_event_print_info();
+        // The loader thread normally did these in init_postload()
+        if ( !m_trace_events.m_postload_done )
+        {
+            // Init event durations
+            m_trace_events.calculate_event_durations();
+            // Init print column information
+            m_trace_events.calculate_event_print_info();
+            // Init timestamp to event id lookups
+            m_trace_events.init_ts_buckets();
+            // Init filter equality lookups
+            m_trace_events.init_filter_index();
+            // Init per crtc vblank timestamps
+            m_trace_events.init_vblanks();
+            // Init per cpu sched_switch run lanes
+            m_trace_events.init_cpu_runs();
+        }
 
         // Initialize our graph rows first time through.
         m_graph.rows.init( m_trace_events );
@@ -1891,6 +3564,10 @@ bool TraceWin::render()
             graph_zoom( ts0, m_graph.start_ts, m_do_graph_zoom_in );
         }
 
+        ImGui::SameLine();
+        if ( ImGui::SmallButton( "Save Selection..." ) )
+            m_do_save_selection = true;
+
         {
             ImGui::SameLine();
             ImGui::PushItemWidth( imgui_scale( 120.0f ) );
@@ -1949,40 +3626,19 @@ bool TraceWin::render()
              imgui_input_text2( "Event Filter:", m_eventlist.filter_buf, 500.0f,
                                ImGuiInputTextFlags_EnterReturnsTrue | ImGuiInputText2FlagsLeft_LabelIsButton ) )
         {
-            m_eventlist.filtered_events.clear();
             m_eventlist.filtered_events_str.clear();
             m_eventlist.do_filter = false;
 
-            if ( m_eventlist.filter_buf[ 0 ] )
+            // Current filter results stay up until the new scan finishes
+            if ( !m_eventlist.filter_buf[ 0 ] )
             {
-                tdop_get_key_func get_key_func = std::bind( filter_get_key_func, &m_trace_events.m_strpool, _1, _2 );
-                class TdopExpr *tdop_expr = tdopexpr_compile( m_eventlist.filter_buf, get_key_func, m_eventlist.filtered_events_str );
-
-                util_time_t t0 = util_get_time();
-
-                if ( tdop_expr )
-                {
-                    for ( trace_event_t &event : m_trace_events.m_events )
-                    {
-                        tdop_get_keyval_func get_keyval_func = std::bind( filter_get_keyval_func, &event, _1, _2 );
-
-                        const char *ret = tdopexpr_exec( tdop_expr, get_keyval_func );
-
-                        event.is_filtered_out = !ret[ 0 ];
-                        if ( !event.is_filtered_out )
-                            m_eventlist.filtered_events.push_back( event.id );
-                    }
-
-                    if ( m_eventlist.filtered_events.empty() )
-                        m_eventlist.filtered_events_str = "WARNING: No events found.";
-
-                    tdopexpr_delete( tdop_expr );
-                    tdop_expr = NULL;
-                }
-
-                float time = util_time_to_ms( t0, util_get_time() );
-                if ( time > 1000.0f )
-                    logf( "tdopexpr_compile(\"%s\"): %.2fms\n", m_eventlist.filter_buf, time );
+                m_eventlist.filter_scan.cancel();
+                m_eventlist.filtered_events.clear();
+            }
+            else if ( !m_eventlist.filter_scan.start( m_trace_events, m_eventlist.filter_buf,
+                                                      m_eventlist.filtered_events_str ) )
+            {
+                m_eventlist.filtered_events.clear();
             }
         }
 
@@ -2005,15 +3661,62 @@ bool TraceWin::render()
             ImGui::SetTooltip( "%s", tooltip.c_str() );
         }
 
+        if ( m_eventlist.filter_scan.is_done() )
+        {
+            bool scanned = m_eventlist.filter_scan.is_scanned();
+            float time = m_eventlist.filter_scan.finish();
+
+            if ( time > 1000.0f )
+                logf( "tdopexpr_scan(\"%s\"): %.2fms\n", m_eventlist.filter_buf, time );
+
+            m_eventlist.filtered_events.swap( m_eventlist.filter_scan.m_locs );
+            m_eventlist.filter_scan.m_locs.clear();
+
+            // Save results for graph rows and later filters
+            if ( scanned && !m_eventlist.filtered_events.empty() )
+            {
+                std::vector< uint32_t > locs = m_eventlist.filtered_events;
+                uint32_t hashval = m_trace_events.tdopexpr_hashval( m_eventlist.filter_scan.m_expr.c_str() );
+
+                m_trace_events.m_tdopexpr_locations.set_locations_u32( hashval, locs );
+                m_trace_events.m_failed_commands.erase( hashval );
+            }
+            m_eventlist.filter_generation++;
+
+            // Walk sorted filtered ids and mark everything else as filtered out
+            size_t idx = 0;
+            for ( trace_event_t &event : m_trace_events.m_events )
+            {
+                bool found = ( idx < m_eventlist.filtered_events.size() ) &&
+                        ( m_eventlist.filtered_events[ idx ] == event.id );
+
+                event.is_filtered_out = !found;
+                idx += found;
+            }
+
+            if ( m_eventlist.filtered_events.empty() )
+                m_eventlist.filtered_events_str = "WARNING: No events found.";
+        }
+
         ImGui::SameLine();
         if ( ImGui::SmallButton( "Clear Filter" ) )
         {
+            m_eventlist.filter_scan.cancel();
             m_eventlist.filtered_events.clear();
             m_eventlist.filtered_events_str.clear();
             m_eventlist.filter_buf[ 0 ] = 0;
         }
 
-        if ( !m_eventlist.filtered_events_str.empty() )
+        if ( m_eventlist.filter_scan.is_running() )
+        {
+            ImGui::SameLine();
+            ImGui::Text( "Filtering %.0f%%...", 100.0f * m_eventlist.filter_scan.get_progress() );
+
+            ImGui::SameLine();
+            if ( ImGui::SmallButton( "Cancel" ) )
+                m_eventlist.filter_scan.cancel();
+        }
+        else if ( !m_eventlist.filtered_events_str.empty() )
         {
             ImGui::SameLine();
             ImGui::TextColored( ImVec4( 1, 0, 0, 1 ), "%s", m_eventlist.filtered_events_str.c_str() );
@@ -2037,6 +3740,30 @@ bool TraceWin::render()
     if ( m_create_plot_dlg.render_dlg( m_trace_events ) )
         m_create_plot_dlg.add_plot( m_graph.rows );
 
+    if ( m_do_save_selection )
+    {
+        // Markers A and B if they're both set, otherwise what the graph shows
+        if ( graph_marker_valid( 0 ) && graph_marker_valid( 1 ) )
+        {
+            int64_t ts0 = std::min( m_graph.ts_markers[ 0 ], m_graph.ts_markers[ 1 ] );
+            int64_t ts1 = std::max( m_graph.ts_markers[ 0 ], m_graph.ts_markers[ 1 ] );
+            std::string range_str = string_format( "Marker A to B (%s ms)", ts_to_timestr( ts1 - ts0, 0, 4 ).c_str() );
+
+            m_save_selection_dlg.init( m_trace_events, ts0, ts1, range_str );
+        }
+        else
+        {
+            int64_t ts0 = m_graph.start_ts + m_eventlist.tsoffset;
+            std::string range_str = string_format( "Graph %s ms to %s ms",
+                                                   ts_to_timestr( ts0, 0, 4 ).c_str(),
+                                                   ts_to_timestr( ts0 + m_graph.length_ts, 0, 4 ).c_str() );
+
+            m_save_selection_dlg.init( m_trace_events, ts0, ts0 + m_graph.length_ts, range_str );
+        }
+        m_do_save_selection = false;
+    }
+    m_save_selection_dlg.render_dlg( m_trace_events, m_eventlist.filtered_events );
+
     ImGui::End();
 
     m_inited = true;
@@ -2089,6 +3816,84 @@ void TraceWin::trace_render_info()
             }
         }
 
+        if ( !m_trace_events.m_crtc_vblanks.empty() )
+        {
+            if ( ImGui::CollapsingHeader( "Vblank Info" ) )
+            {
+                auto ms = []( int64_t ts ) { return ( double )ts / NSECS_PER_MSEC; };
+
+                imgui_begin_columns( "vblank_info", { "CRTC", "Vblanks", "Min", "Avg", "Median", "99%", "Max", "Long" } );
+
+                for ( size_t crtc = 0; crtc < m_trace_events.m_crtc_vblanks.size(); crtc++ )
+                {
+                    const TraceEvents::crtc_vblanks_t &vblanks = m_trace_events.m_crtc_vblanks[ crtc ];
+
+                    if ( vblanks.deltas.empty() )
+                        continue;
+
+                    ImGui::Text( "%zu", crtc );
+                    ImGui::NextColumn();
+                    ImGui::Text( "%zu", vblanks.ts.size() );
+                    ImGui::NextColumn();
+                    ImGui::Text( "%.3fms", ms( vblanks.delta_min ) );
+                    ImGui::NextColumn();
+                    ImGui::Text( "%.3fms (%.2fHz)", ms( vblanks.delta_avg ), 1000.0 / ms( vblanks.delta_avg ) );
+                    ImGui::NextColumn();
+                    ImGui::Text( "%.3fms", ms( vblanks.delta_median ) );
+                    ImGui::NextColumn();
+                    ImGui::Text( "%.3fms", ms( vblanks.delta_p99 ) );
+                    ImGui::NextColumn();
+                    ImGui::Text( "%.3fms", ms( vblanks.delta_max ) );
+                    ImGui::NextColumn();
+                    ImGui::Text( "%zu", vblanks.long_count );
+                    if ( ImGui::IsItemHovered() )
+                        ImGui::SetTooltip( "Intervals over 1.5x the median" );
+                    ImGui::NextColumn();
+                }
+
+                ImGui::EndColumns();
+            }
+        }
+
+        if ( ImGui::CollapsingHeader( "Memory Usage" ) )
+        {
+            std::vector< TraceEvents::memory_usage_t > usage;
+            size_t total = 0;
+            size_t rss = util_get_rss();
+            auto mb = []( size_t bytes ) { return bytes / ( 1024.0 * 1024.0 ); };
+
+            m_trace_events.get_memory_usage( usage );
+
+            if ( imgui_begin_columns( "memory_usage", { "Name", "Size" } ) )
+                ImGui::SetColumnWidth( 0, imgui_scale( 200.0f ) );
+
+            for ( const TraceEvents::memory_usage_t &item : usage )
+            {
+                ImGui::Text( "%s", item.name );
+                ImGui::NextColumn();
+                ImGui::Text( "%.2f MB", mb( item.bytes ) );
+                ImGui::NextColumn();
+
+                total += item.bytes;
+            }
+
+            ImGui::Separator();
+            ImGui::Text( "Total" );
+            ImGui::NextColumn();
+            ImGui::Text( "%.2f MB", mb( total ) );
+            ImGui::NextColumn();
+
+            if ( rss )
+            {
+                ImGui::Text( "Process RSS" );
+                ImGui::NextColumn();
+                ImGui::Text( "%.2f MB (all open traces)", mb( rss ) );
+                ImGui::NextColumn();
+            }
+
+            ImGui::EndColumns();
+        }
+
         if ( !trace_info.cpustats.empty() )
         {
             if ( ImGui::CollapsingHeader( "CPU Info" ) )
@@ -2200,17 +4005,19 @@ bool TraceWin::events_list_render_popupmenu( uint32_t eventid )
     return true;
 }
 
-std::string get_event_fields_str( const trace_event_t &event, const char *eqstr, char sep )
+std::string get_event_fields_str( TraceEvents &trace_events, const trace_event_t &event, const char *eqstr, char sep )
 {
     std::string fieldstr;
-    const std::vector< event_field_t > &fields = event.fields;
+    const char *comm = trace_events.comm_str( event.comm_id );
+    const char *user_comm = trace_events.comm_str( event.user_comm_id );
 
-    if ( event.user_comm != event.comm )
-        fieldstr += string_format( "%s%s%s%c", "user_comm", eqstr, event.user_comm, sep );
+    if ( user_comm != comm )
+        fieldstr += string_format( "%s%s%s%c", "user_comm", eqstr, user_comm, sep );
 
-    for ( const event_field_t &field : fields )
+    for ( uint32_t i = 0; i < event.numfields; i++ )
     {
-        std::string str = string_format( "%s%s%s%c", field.key, eqstr, field.value, sep );
+        const event_field_t &field = event.fields[ i ];
+        std::string str = string_format( "%s%s%s%c", field.key, eqstr, event.get_field_value( i ), sep );
 
         if ( event.is_ftrace_print() && !strcmp( field.key, "buf" ) )
             fieldstr += s_textclrs().ftraceprint_str( str.c_str() );
@@ -2223,6 +4030,41 @@ std::string get_event_fields_str( const trace_event_t &event, const char *eqstr,
     return fieldstr;
 }
 
+EventListRows::row_t &EventListRows::get( uint32_t eventid, int64_t tsoffset, uint32_t generation, bool &hit )
+{
+    auto it = m_rows.find( eventid );
+
+    if ( it != m_rows.end() )
+    {
+        // Move to the front, no allocation
+        m_lru.splice( m_lru.begin(), m_lru, it->second );
+    }
+    else
+    {
+        // Recycle the least recently used row once we're full
+        if ( m_lru.size() >= s_rows_max )
+        {
+            m_rows.erase( m_lru.back().eventid );
+            m_lru.splice( m_lru.begin(), m_lru, std::prev( m_lru.end() ) );
+        }
+        else
+        {
+            m_lru.emplace_front();
+        }
+
+        m_lru.front().eventid = eventid;
+        m_lru.front().generation = generation - 1;
+        m_rows[ eventid ] = m_lru.begin();
+    }
+
+    row_t &row = m_lru.front();
+
+    hit = ( row.tsoffset == tsoffset ) && ( row.generation == generation );
+    row.tsoffset = tsoffset;
+    row.generation = generation;
+    return row;
+}
+
 static float get_keyboard_scroll_lines( float visible_rows )
 {
     float scroll_lines = 0.0f;
@@ -2259,7 +4101,8 @@ bool TraceWin::events_list_handle_mouse( const trace_event_t &event, uint32_t i
         // Store the hovered event id.
         m_eventlist.hovered_eventid = event.id;
 
-        if ( ImGui::IsMouseClicked( 1 ) )
+        // No context menu while loading: its actions need all the events
+        if ( ImGui::IsMouseClicked( 1 ) && !m_trace_events.is_loading() )
         {
             // If they right clicked, show the context menu.
             m_eventlist.popup_eventid = i;
@@ -2271,7 +4114,7 @@ bool TraceWin::events_list_handle_mouse( const trace_event_t &event, uint32_t i
         {
             // Otherwise show a tooltip.
             std::string ts_str = ts_to_timestr( event.ts, m_eventlist.tsoffset );
-            std::string fieldstr = get_event_fields_str( event, ": ", '\n' );
+            std::string fieldstr = get_event_fields_str( m_trace_events, event, ": ", '\n' );
             std::string graph_markers;
 
             if ( graph_marker_valid( 0 ) )
@@ -2283,7 +4126,7 @@ bool TraceWin::events_list_handle_mouse( const trace_event_t &event, uint32_t i
 
             ImGui::SetTooltip( "%sId: %u\nTime: %s\nComm: %s\n%s",
                                graph_markers.c_str(), event.id,
-                               ts_str.c_str(), event.comm, fieldstr.c_str() );
+                               ts_str.c_str(), m_trace_events.comm_str( event.comm_id ), fieldstr.c_str() );
         }
     }
 
@@ -2444,14 +4287,43 @@ void TraceWin::events_list_render()
                 ImGui::PushStyleColor( ImGuiCol_Text, color );
 
                 // If this event is in the highlighted list, give it a bit of a colored background
-                bool highlight = !selected && std::binary_search(
+                bool highlight = !selected && !m_eventlist.highlight_ids.empty() && std::binary_search(
                             m_eventlist.highlight_ids.begin(), m_eventlist.highlight_ids.end(), event.id );
                 if ( highlight )
                     ImGui::PushStyleColor( ImGuiCol_Header, s_clrs().getv4( col_EventList_Hov ) );
 
+                // Durations are still being filled in until we're inited,
+                //  so use a fresh row each frame until then.
+                bool hit = false;
+                EventListRows::row_t &row = m_inited ?
+                            m_eventlist.rows.get( event.id, m_eventlist.tsoffset,
+                                                  m_trace_events.m_rename_generation, hit ) :
+                            m_eventlist.rows.get( INVALID_ID, m_eventlist.tsoffset, 0, hit );
+
+                if ( !hit || !m_inited )
+                {
+                    row.id_str = std::to_string( event.id );
+
+                    row.ts_str = ts_to_timestr( event.ts, m_eventlist.tsoffset ) + "ms";
+                    if ( event.id > 0 )
+                    {
+                        // Add time delta from previous event
+                        const trace_event_t &event0 = get_event( event.id - 1 );
+                        row.ts_str += " (+" + ts_to_timestr( event.ts - event0.ts, 0, 4 ) + ")";
+                    }
+
+                    row.duration_str.clear();
+                    if ( event.duration )
+                        row.duration_str = ts_to_timestr( event.duration, 0, 4 ) + "ms";
+
+                    row.info_str.clear();
+                    if ( !event.is_ftrace_print() )
+                        row.info_str = get_event_fields_str( m_trace_events, event, "=", ' ' );
+                }
+
                 // column 0: event id
                 {
-                    if ( ImGui::Selectable( std::to_string( event.id ).c_str(),
+                    if ( ImGui::Selectable( row.id_str.c_str(),
                                             highlight || selected, ImGuiSelectableFlags_SpanAllColumns ) )
                     {
                         m_eventlist.selected_eventid = event.id;
@@ -2469,22 +4341,13 @@ void TraceWin::events_list_render()
 
                 // column 1: time stamp
                 {
-                    std::string ts_str = ts_to_timestr( event.ts, m_eventlist.tsoffset ) + "ms";
-
-                    if ( event.id > 0 )
-                    {
-                        // Add time delta from previous event
-                        const trace_event_t &event0 = get_event( event.id - 1 );
-                        ts_str += " (+" + ts_to_timestr( event.ts - event0.ts, 0, 4 ) + ")";
-                    }
-
-                    ImGui::Text( "%s", ts_str.c_str() );
+                    ImGui::Text( "%s", row.ts_str.c_str() );
                     ImGui::NextColumn();
                 }
 
                 // column 2: comm
                 {
-                    ImGui::Text( "%s (%u)", event.comm, event.cpu );
+                    ImGui::Text( "%s (%u)", m_trace_events.comm_str( event.comm_id ), event.cpu );
                     ImGui::NextColumn();
                 }
 
@@ -2497,7 +4360,7 @@ void TraceWin::events_list_render()
                 // column 4: duration
                 {
                     if ( event.duration )
-                        ImGui::Text( "%sms", ts_to_timestr( event.duration, 0, 4 ).c_str() );
+                        ImGui::Text( "%s", row.duration_str.c_str() );
                     ImGui::NextColumn();
                 }
 
@@ -2509,9 +4372,7 @@ void TraceWin::events_list_render()
                     }
                     else
                     {
-                        std::string fieldstr = get_event_fields_str( event, "=", ' ' );
-
-                        ImGui::Text( "%s", fieldstr.c_str() );
+                        ImGui::Text( "%s", row.info_str.c_str() );
                     }
                     ImGui::NextColumn();
                 }
@@ -2574,6 +4435,12 @@ void TraceLoader::render_menu_options()
             m_show_gpuvis_console = true;
         }
 
+        if ( ImGui::MenuItem( "Gpuvis Profile" ) )
+        {
+            ImGui::SetWindowFocus( "Gpuvis Profile" );
+            m_show_profile = true;
+        }
+
         if ( ImGui::MenuItem( "Font Options" ) )
         {
             ImGui::SetWindowFocus( "Font Options" );
@@ -2904,6 +4771,67 @@ void TraceLoader::render_console()
     ImGui::End();
 }
 
+void TraceLoader::render_profile()
+{
+    if ( !ImGui::Begin( "Gpuvis Profile", &m_show_profile ) )
+    {
+        ImGui::End();
+        return;
+    }
+
+    if ( s_opts().render_imgui_opt( OPT_Profile ) )
+        g_prof_enabled = s_opts().getb( OPT_Profile );
+
+    ImGui::SameLine();
+    if ( ImGui::Button( "Reset" ) )
+        prof_reset();
+
+    ImGui::SameLine();
+    if ( ImGui::Button( "Save Chrome Trace" ) )
+    {
+        const char *filename = "gpuvis_profile.json";
+
+        if ( prof_save_chrome_trace( filename ) )
+            logf( "Saved profile to %s", filename );
+        else
+            logf( "[Error] Saving profile to %s failed", filename );
+    }
+
+    ImGui::Separator();
+
+    if ( ImGui::BeginColumns( "profile", 5, 0 ) )
+        ImGui::SetColumnWidth( 0, imgui_scale( 200.0f ) );
+
+    static const char *s_headers[] = { "Zone", "Count", "Total ms", "Avg us", "Max us" };
+    for ( const char *header : s_headers )
+    {
+        ImGui::TextColored( s_clrs().getv4( col_BrightText ), "%s", header );
+        ImGui::NextColumn();
+    }
+    ImGui::Separator();
+
+    for ( uint32_t i = 0; i < PROF_Max; i++ )
+    {
+        prof_stats_t stats;
+
+        prof_get_stats( ( prof_zone_t )i, stats );
+
+        ImGui::Text( "%s", stats.name );
+        ImGui::NextColumn();
+        ImGui::Text( "%llu", ( unsigned long long )stats.count );
+        ImGui::NextColumn();
+        ImGui::Text( "%.2f", stats.total_ns / 1000000.0 );
+        ImGui::NextColumn();
+        ImGui::Text( "%.2f", stats.count ? ( stats.total_ns / 1000.0 / stats.count ) : 0.0 );
+        ImGui::NextColumn();
+        ImGui::Text( "%.2f", stats.max_ns / 1000.0 );
+        ImGui::NextColumn();
+    }
+
+    ImGui::EndColumns();
+    ImGui::End();
+}
+
 void TraceLoader::render_menu()
 {
     if ( !ImGui::BeginMenuBar() )
@@ -2915,13 +4843,27 @@ void TraceLoader::render_menu()
         if ( ImGui::MenuItem( "Open Trace File..." ) )
         {
             const char *file = noc_file_dialog_open( NOC_FILE_DIALOG_OPEN,
-                "trace-cmd files (*.dat)\0*.dat\0", NULL, "trace.dat" );
+                "trace-cmd files (*.dat)\0*.dat;*.dat.xz;*.dat.zst\0", NULL, "trace.dat" );
 
             if ( file && file[ 0 ] )
                 m_inputfiles.push_back( file );
         }
 #endif
 
+        if ( !m_live_capture.is_running() )
+        {
+            if ( ImGui::MenuItem( "Start Live Capture" ) )
+                start_live_capture( get_default_tracefs() );
+        }
+        else
+        {
+            if ( ImGui::MenuItem( "Load Live Snapshot", NULL, false, !is_loading() ) )
+                load_live_snapshot();
+
+            if ( ImGui::MenuItem( "Stop Live Capture" ) )
+                stop_live_capture();
+        }
+
         if ( ImGui::MenuItem( "Quit" ) )
         {
             SDL_Event event;
@@ -2947,11 +4889,15 @@ void TraceLoader::parse_cmdline( int argc, char **argv )
     static struct option long_opts[] =
     {
         { "scale", ya_required_argument, 0, 0 },
+        { "live", ya_optional_argument, 0, 0 },
+        { "remote", ya_required_argument, 0, 0 },
+        { "merge", ya_no_argument, 0, 0 },
         { 0, 0, 0, 0 }
     };
 
     int c;
     int opt_ind = 0;
+    bool merge = false;
     while ( ( c = ya_getopt_long( argc, argv, "i:",
                                long_opts, &opt_ind ) ) != -1 )
     {
@@ -2960,9 +4906,14 @@ void TraceLoader::parse_cmdline( int argc, char **argv )
         case 0:
             if ( !strcasecmp( "scale", long_opts[ opt_ind ].name ) )
                 s_opts().setf( OPT_Scale, atof( ya_optarg ) );
+            else if ( !strcasecmp( "live", long_opts[ opt_ind ].name ) )
+                start_live_capture( ya_optarg ? ya_optarg : get_default_tracefs() );
+            else if ( !strcasecmp( "remote", long_opts[ opt_ind ].name ) )
+                m_remote_windows_list.push_back( new RemoteTraceWin( ya_optarg ) );
+            else if ( !strcasecmp( "merge", long_opts[ opt_ind ].name ) )
+                merge = true;
             break;
         case 'i':
-            m_inputfiles.clear();
             m_inputfiles.push_back( ya_optarg );
             break;
 
@@ -2972,10 +4923,13 @@ void TraceLoader::parse_cmdline( int argc, char **argv )
     }
 
     for ( ; ya_optind < argc; ya_optind++ )
-    {
-        m_inputfiles.clear();
         m_inputfiles.push_back( argv[ ya_optind ] );
-    }
+
+    // With --merge every file on the command line is loaded together as one
+    //  trace. Otherwise the last one wins like it always has. Split series
+    //  (trace.dat.N) still load as a whole either way.
+    if ( !merge && ( m_inputfiles.size() > 1 ) )
+        m_inputfiles.erase( m_inputfiles.begin(), m_inputfiles.end() - 1 );
 }
 
 #if SDL_VERSIONNUM( SDL_MAJOR_VERSION, SDL_MINOR_VERSION, SDL_PATCHLEVEL ) < SDL_VERSIONNUM( 2, 0, 5 )
@@ -2990,6 +4944,9 @@ int SDL_GetWindowBordersSize( SDL_Window *window, int *top, int *left, int *bott
 }
 #endif
 
+// gpuvis_bench is built with the same sources and has its own main()
+#ifndef GPUVIS_BENCH
+
 static void sdl_setwindow_icon( SDL_Window *window )
 {
 #include "gpuvis_icon.c"
@@ -3010,6 +4967,12 @@ static void sdl_setwindow_icon( SDL_Window *window )
 
 int main( int argc, char **argv )
 {
+    // Batch mode doesn't need a window (or a display) so skip SDL video
+    if ( headless_requested( argc, argv ) )
+        return headless_main( argc, argv );
+    if ( remote_serve_requested( argc, argv ) )
+        return remote_serve_main( argc, argv );
+
     // Initialize SDL
     if ( SDL_Init( SDL_INIT_VIDEO | SDL_INIT_TIMER ) )
     {
@@ -3031,6 +4994,8 @@ int main( int argc, char **argv )
     s_clrs().init();
     // Init opts singleton
     s_opts().init();
+    // Start timing hot paths before the first trace loads
+    g_prof_enabled = s_opts().getb( OPT_Profile );
     // Init loader
     loader.init( argc, argv );
     // Setup imgui default text color
@@ -3056,6 +5021,7 @@ int main( int argc, char **argv )
 
     // Setup ImGui binding
     ImGui_ImplSdlGL3_Init( window );
+    GLRectBatch::init();
 
     // 1 for updates synchronized with the vertical retrace
     SDL_GL_SetSwapInterval( 1 );
@@ -3065,6 +5031,8 @@ int main( int argc, char **argv )
 
     // Main loop
     bool done = false;
+    // Frames to draw after input before we can block waiting for more
+    int redraw_frames = 3;
     ImGuiMouseCursor mouse_cursor = ImGuiMouseCursor_Arrow;
     while ( !done )
     {
@@ -3078,16 +5046,27 @@ int main( int argc, char **argv )
                                cursor_sizens : cursor_default );
         }
 
+        // Nothing changing? Instead of spinning at vsync, block until there's
+        //  input. The timeout redraws once in a while in case we missed something.
+        if ( !redraw_frames && s_opts().getb( OPT_IdleWait ) && !loader.needs_redraw() )
+            SDL_WaitEventTimeout( NULL, 500 );
+
         while ( SDL_PollEvent( &event ) )
         {
             ImGui_ImplSdlGL3_ProcessEvent( &event );
 
             if ( event.type == SDL_QUIT )
                 done = true;
+
+            // ImGui hover, popups, etc. take a couple frames to catch up
+            redraw_frames = 3;
         }
+        if ( redraw_frames )
+            redraw_frames--;
         bool use_freetype = s_opts().getb( OPT_UseFreetype );
         ImGui_ImplSdlGL3_NewFrame( window, &use_freetype );
         s_opts().setb( OPT_UseFreetype, use_freetype );
+        GLRectBatch::new_frame();
 
         // Check for logf() calls from background threads.
         logf_update();
@@ -3112,23 +5091,26 @@ int main( int argc, char **argv )
         if ( loader.m_quit )
             break;
 
+        loader.update_live_capture();
+
         if ( !loader.m_inputfiles.empty() && !loader.is_loading() )
         {
-            const char *filename = loader.m_inputfiles[ 0 ].c_str();
-
-            loader.load_file( filename );
+            if ( loader.m_inputfiles.size() == 1 )
+                loader.load_file( loader.m_inputfiles[ 0 ].c_str() );
+            else
+                loader.load_files( loader.m_inputfiles );
 
-            loader.m_inputfiles.erase( loader.m_inputfiles.begin() );
+            loader.m_inputfiles.clear();
         }
 
         if ( ( loader.m_font_main.m_changed || loader.m_font_small.m_changed ) &&
-             !ImGui::IsMouseDown( 0 ) )
+             !ImGui::IsMouseDown( 0 ) && !loader.fonts_loading() )
         {
             imgui_set_scale( s_opts().getf( OPT_Scale ) );
 
-            ImGui_ImplSdlGL3_InvalidateDeviceObjects();
-            loader.load_fonts();
+            loader.load_fonts( true );
         }
+        loader.update_fonts();
     }
 
     {
@@ -3156,6 +5138,7 @@ int main( int argc, char **argv )
     // Cleanup
     logf_shutdown();
 
+    GLRectBatch::shutdown();
     ImGui_ImplSdlGL3_Shutdown();
 
     SDL_FreeCursor( cursor_sizens );
@@ -3165,3 +5148,5 @@ int main( int argc, char **argv )
     SDL_Quit();
     return 0;
 }
+
+#endif // !GPUVIS_BENCH
@@ -27,6 +27,7 @@ class Opts &s_opts();
 
 class TraceEvents;
 class TraceLoader;
+class RemoteTraceWin;
 
 class TraceLocations
 {
@@ -41,6 +42,12 @@ public:
         plocs->push_back( loc );
     }
 
+    // Swap in a whole array of locations for hashval.
+    void set_locations_u32( uint32_t hashval, std::vector< uint32_t > &locs )
+    {
+        m_locs.m_map[ hashval ].swap( locs );
+    }
+
     std::vector< uint32_t > *get_locations_u32( uint32_t hashval )
     {
         return m_locs.get_val( hashval );
@@ -56,11 +63,104 @@ public:
         return get_locations_u32( fnv_hashstr32( name ) );
     }
 
+    // Approximate heap bytes used
+    size_t bytes_allocated() const;
+    // Drop spare capacity of the location arrays once loading is done
+    void shrink_to_fit();
+
 public:
     // Map of name hashval to array of event locations.
     util_umap< uint32_t, std::vector< uint32_t > > m_locs;
 };
 
+// Sorted arrays of event locations stored as varint encoded deltas, which
+//  usually takes 1-2 bytes per location instead of 4.
+class TracePostings
+{
+public:
+    TracePostings() {}
+    ~TracePostings() {}
+
+    // Locations for each hashval need to be added in increasing order.
+    void add_location_u32( uint32_t hashval, uint32_t loc );
+    // Decode locations for hashval into locs. Returns false if there aren't any.
+    bool get_locations_u32( uint32_t hashval, std::vector< uint32_t > &locs );
+    // Merge locations of hashval_old into hashval_new.
+    void rename( uint32_t hashval_old, uint32_t hashval_new );
+
+    size_t bytes_allocated() const;
+    void shrink_to_fit();
+
+public:
+    struct postings_t
+    {
+        uint32_t count = 0;
+        uint32_t last = 0;
+        std::vector< uint8_t > buf;
+    };
+    util_umap< uint32_t, postings_t > m_postings;
+};
+
+// Timeline events with the same timeline, context and seqno make up one gpu
+//  job: amdgpu_cs_ioctl -> amdgpu_sched_run_job -> *fence_signaled. Jobs are
+//  keyed on ( context << 32 ) | seqno and timelines sharing a key are chained.
+class TraceGfxContexts
+{
+public:
+    TraceGfxContexts() {}
+    ~TraceGfxContexts() {}
+
+    static const uint32_t s_ids_max = 4;
+
+    struct job_t
+    {
+        const char *timeline;
+        uint32_t context;
+        uint32_t seqno;
+
+        // Next job with the same key or INVALID_ID
+        uint32_t next;
+        // Jobs with more than s_ids_max events keep the rest in m_overflow
+        uint32_t overflow;
+
+        uint32_t count;
+        uint32_t ids[ s_ids_max ];
+    };
+
+    // Add event (in id order) to its job and return it
+    const job_t &add( const trace_event_t &event );
+    // Return job event is part of or NULL
+    const job_t *find( const trace_event_t &event ) const;
+
+    // Return event id i of job
+    uint32_t get_id( const job_t &job, uint32_t i ) const
+    {
+        return ( i < s_ids_max ) ? job.ids[ i ] : m_overflow[ job.overflow ][ i - s_ids_max ];
+    }
+    uint32_t get_last_id( const job_t &job ) const
+    {
+        return get_id( job, job.count - 1 );
+    }
+
+    void clear()
+    {
+        m_jobs.clear();
+        m_overflow.clear();
+        m_map.m_map.clear();
+    }
+
+    static uint64_t get_key( const trace_event_t &event )
+    {
+        return ( ( uint64_t )event.context << 32 ) | event.seqno;
+    }
+
+public:
+    std::vector< job_t > m_jobs;
+    std::vector< std::vector< uint32_t > > m_overflow;
+    // Key to first m_jobs index in chain
+    util_umap< uint64_t, uint32_t > m_map;
+};
+
 // Given a sorted array (like from TraceLocations), binary search for eventid
 //   and return the vector index, or vec.size() if not found.
 inline size_t vec_find_eventid( const std::vector< uint32_t > &vec, uint32_t eventid )
@@ -70,13 +170,6 @@ inline size_t vec_find_eventid( const std::vector< uint32_t > &vec, uint32_t eve
     return i - vec.begin();
 }
 
-inline std::string get_event_gfxcontext_str( const trace_event_t &event )
-{
-    if ( event.timeline && event.context && event.seqno )
-        return string_format( "%s_%u_%u", event.timeline, event.context, event.seqno );
-    return "";
-}
-
 /*
    [Compositor] NewFrame idx=2776
    [Compositor Client] WaitGetPoses End ThreadId=5125
@@ -94,11 +187,20 @@ public:
     GraphPlot() {}
     ~GraphPlot() {}
 
+    // Parse plot values from events matching filter_str on worker threads.
+    //  Values are copied from any plot already built with the same filter_str
+    //  and scanf_str.
     bool init( TraceEvents &trace_events, const std::string &name,
                const std::string &filter_str, const std::string scanf_str );
 
     uint32_t find_ts_index( int64_t ts0 );
 
+    // Build m_levels from m_plotdata
+    void init_levels();
+    // Return coarsest level with buckets at most ts_per_px ns wide, or -1
+    //  if there isn't one and values should be drawn one by one.
+    int find_level( int64_t ts_per_px ) const;
+
 public:
     struct plotdata_t
     {
@@ -108,6 +210,28 @@ public:
     };
     std::vector< plotdata_t > m_plotdata;
 
+    // Plots with fewer values than this aren't worth decimating
+    static const size_t s_min_values = 4096;
+
+    // Min/max decimation of m_plotdata. Drawing the min and max value of each
+    //  bucket keeps every peak while emitting about two points per pixel.
+    struct bucket_t
+    {
+        uint32_t idx;           // m_plotdata index of first value
+        uint32_t count;
+        uint32_t idx_min;       // m_plotdata index of min value
+        uint32_t idx_max;       // m_plotdata index of max value
+    };
+    struct level_t
+    {
+        uint32_t shift;
+        std::vector< bucket_t > buckets;
+    };
+    std::vector< level_t > m_levels;
+
+    // Screen points reused by graph_render_plot()
+    std::vector< ImVec2 > m_points;
+
     float m_minval = FLT_MAX;
     float m_maxval = FLT_MIN;
 
@@ -119,6 +243,147 @@ public:
 
     // "[Compositor] TimeSyncLastVsync: %f("
     std::string m_scanf_str;
+
+    // m_events.size() when m_plotdata was built
+    size_t m_event_count = 0;
+
+    // TraceEvents::m_rename_generation when m_plotdata was built. Comm renames
+    //  can change what the filter matches.
+    uint32_t m_rename_generation = 0;
+};
+
+// Multi-resolution summary of a graph row's event locations. Level buckets
+//  cover ( 1 << shift ) ns each, so once a bucket is narrower than a pixel the
+//  graph can draw buckets instead of walking every event.
+class GraphLod
+{
+public:
+    GraphLod() {}
+    ~GraphLod() {}
+
+    void init( const std::vector< trace_event_t > &events, const std::vector< uint32_t > &locs );
+
+    // Whether we were built from this version of locs
+    bool is_current( const std::vector< uint32_t > &locs ) const;
+
+    // Return coarsest level with buckets at most ts_per_px ns wide, or -1
+    //  if there isn't one and events should be drawn one by one.
+    int find_level( int64_t ts_per_px ) const;
+
+public:
+    // Rows with fewer events than this aren't worth summarizing
+    static const size_t s_min_events = 4096;
+
+    struct bucket_t
+    {
+        int64_t ts_min;         // Timestamp of first event
+        int64_t ts_max;         // Timestamp of last event
+        uint32_t idx;           // locs index of first event
+        uint32_t count;
+        uint32_t crtcs;         // Mask of event crtcs (vblank rows)
+    };
+    struct level_t
+    {
+        uint32_t shift;
+        std::vector< bucket_t > buckets;
+    };
+    std::vector< level_t > m_levels;
+
+    size_t m_locs_size = 0;
+    uint32_t m_locs_front = INVALID_ID;
+    uint32_t m_locs_back = INVALID_ID;
+};
+
+// Jobs on a gpu timeline (amdgpu_cs_ioctl through fence_signaled) sorted by
+//  start time. An implicit interval tree over the array (each midpoint holds
+//  the max end of its subrange) finds jobs overlapping a time range in
+//  O( log n + k ).
+class TimelineIndex
+{
+public:
+    TimelineIndex() {}
+    ~TimelineIndex() {}
+
+    void init( const std::vector< trace_event_t > &events, const std::vector< uint32_t > &locs );
+
+    // Return fence_signaled ids of jobs overlapping [ts0, ts1), in id order.
+    void find_jobs( int64_t ts0, int64_t ts1, std::vector< uint32_t > &ids ) const;
+
+public:
+    struct job_t
+    {
+        int64_t ts_start;       // cs_ioctl (or sched_run_job) timestamp
+        int64_t ts_end;         // fence_signaled timestamp
+        int64_t ts_end_max;     // Max ts_end in this node's subrange
+        uint32_t fence_signaled;
+    };
+    std::vector< job_t > m_jobs;
+
+private:
+    int64_t init_ts_end_max( size_t lo, size_t hi );
+    void find_jobs( size_t lo, size_t hi, int64_t ts0, int64_t ts1, std::vector< uint32_t > &ids ) const;
+};
+
+// Intervals each cpu spent running a (non-idle) task, built once from the
+//  sched_switch events. Runs on a cpu don't overlap and are sorted by time,
+//  and a prefix sum of their lengths gives the busy time of any time range
+//  with two binary searches.
+class CpuRunIndex
+{
+public:
+    CpuRunIndex() {}
+    ~CpuRunIndex() {}
+
+    // locs are the sched_switch event ids
+    void init( const std::vector< trace_event_t > &events, const std::vector< uint32_t > &locs,
+               size_t cpu_count );
+
+public:
+    struct run_t
+    {
+        int64_t ts_start;
+        int64_t ts_end;
+        int pid;
+        // sched_switch to / from this task. INVALID_ID if it was already
+        //  running when the trace started or still running when it ended.
+        uint32_t id_start;
+        uint32_t id_end;
+    };
+    struct lane_t
+    {
+        std::vector< run_t > runs;
+        // busy[ i ] is the sum of run lengths before runs[ i ] (runs.size() + 1 entries)
+        std::vector< int64_t > busy;
+        // sched_switch event ids on this cpu
+        std::vector< uint32_t > locs;
+    };
+
+    // Index of first run in lane ending after ts (or runs.size())
+    static size_t find_run( const lane_t &lane, int64_t ts );
+    // Nanoseconds of [ts0, ts1) lane spent running tasks
+    static int64_t busy_time( const lane_t &lane, int64_t ts0, int64_t ts1 );
+
+    std::vector< lane_t > m_lanes;
+
+private:
+    static int64_t busy_before( const lane_t &lane, int64_t ts );
+};
+
+// Instanced rects for a graph row, kept across frames. Rects are laid out
+//  relative to ts0 for a window a few screens wide, so panning inside the
+//  window only moves the batch. Zooming or any change in key rebuilds it.
+struct graph_batch_t
+{
+    GLRectBatch batch;
+
+    int64_t ts0 = 0;
+    int64_t ts1 = -1;
+    int64_t tsdx = 0;
+    float w = 0.0f;
+    float h = 0.0f;
+
+    // Hash of locs version, lod level, colors, etc. used to build batch
+    uint32_t key = 0;
 };
 
 class ParsePlotStr
@@ -137,6 +402,9 @@ public:
 
     const char *m_scanf_str = nullptr;
     size_t m_scanf_len = 0;
+
+    // Lower and upper case first char of m_scanf_str for strpbrk()
+    char m_scanf_first[ 3 ] = { 0 };
 };
 
 class CreatePlotDlg
@@ -162,6 +430,27 @@ public:
     char m_plot_scanf_buf[ 256 ];
 };
 
+// Write the events in a time range (and optionally just the filtered ones) to
+//  a new trace.dat so a region of interest can be shared without the whole file.
+class SaveSelectionDlg
+{
+public:
+    SaveSelectionDlg() {}
+    ~SaveSelectionDlg() {}
+
+    // ts_start / ts_end are event timestamps, range_str describes where they came from
+    void init( TraceEvents &trace_events, int64_t ts_start, int64_t ts_end, const std::string &range_str );
+    void render_dlg( TraceEvents &trace_events, const std::vector< uint32_t > &filtered_events );
+
+public:
+    int64_t m_ts_start = 0;
+    int64_t m_ts_end = 0;
+    std::string m_range_str;
+    std::string m_err_str;
+    bool m_only_filtered = false;
+    char m_filename_buf[ PATH_MAX ] = { 0 };
+};
+
 class TraceEvents
 {
 public:
@@ -171,23 +460,111 @@ public:
 public:
     // Return vec of locations for a tdop expression. Ie: "$name=drm_handle_vblank"
     const std::vector< uint32_t > *get_tdopexpr_locs( const char *name, std::string *err = nullptr );
+    // Return smallest cached result of a top level && term (or leading run of
+    //   terms) of a normalized expression. Matches are a subset of these.
+    const std::vector< uint32_t > *get_tdopexpr_subset( const std::string &expr );
+    // Get sorted events which could match expression from m_filter_index and cached
+    //   results of its terms. Returns false if all events need to be evaluated. If
+    //   exact is set, ids are the matches and don't need to be evaluated.
+    bool get_tdopexpr_candidates( class TdopExpr *tdop_expr, const std::string &expr,
+                                  std::vector< uint32_t > &ids, bool &exact );
+    // Index lookup for "$var = value" (tdop_get_index_func).
+    bool get_filter_index_locs( int varid, const char *value, std::vector< uint32_t > &locs );
+    // Threads to split work_count pieces of work over: at most m_max_threads,
+    //  or the number of cores when that's 0.
+    size_t get_thread_count( size_t work_count ) const;
+    // Evaluate a compiled tdop expression over m_events (or just events in ids) on
+    //   worker threads and return matching event ids in order. Adds scanned event
+    //   counts to progress. Returns false if cancel was set before the scan completed.
+    bool tdopexpr_scan( class TdopExpr *tdop_expr, std::vector< uint32_t > &locs,
+                        SDL_atomic_t *progress = nullptr, SDL_atomic_t *cancel = nullptr,
+                        const std::vector< uint32_t > *ids = nullptr );
+    // m_tdopexpr_locations / m_failed_commands key for a normalized expression.
+    //  Renames change what $comm and $user_comm match, so results cached
+    //  before one are left behind for whoever still points at them.
+    uint32_t tdopexpr_hashval( const char *expr ) const
+    {
+        uint32_t hashval = fnv_hashstr32( expr );
+
+        if ( m_rename_generation )
+        {
+            uint32_t key[] = { hashval, m_rename_generation };
+
+            hashval = fnv_hashbuf32( key, sizeof( key ) );
+        }
+        return hashval;
+    }
     // Return vec of locations for a cmdline. Ie: "SkinningApp-1536"
     const std::vector< uint32_t > *get_comm_locs( const char *name );
     // "gfx", "sdma0", etc.
     const std::vector< uint32_t > *get_timeline_locs( const char *name );
-    // Pass a string like "gfx_249_91446"
-    const std::vector< uint32_t > *get_gfxcontext_locs( const char *name );
+    // Return the gpu job a timeline event is part of or NULL
+    const TraceGfxContexts::job_t *get_gfxcontext_job( const trace_event_t &event )
+    {
+        return m_gfxcontexts.find( event );
+    }
+    // Add timeline events to m_gfxcontexts (cache_load doesn't store its jobs)
+    void init_gfxcontexts();
 
     // Rename a comm event
     bool rename_comm( const char *comm_old, const char *comm_new );
 
+    // Return comm string for trace_event_t comm_id / user_comm_id
+    const char *comm_str( uint32_t comm_id )
+    {
+        if ( !m_comm_renames.m_map.empty() )
+        {
+            const char **pstr = m_comm_renames.get_val( comm_id );
+
+            if ( pstr )
+                return *pstr;
+        }
+
+        return m_strpool.idtostr( comm_id );
+    }
+
+    // Incrementally update timeline durations for a newly loaded fence_signaled event
+    void update_fence_signaled_durations( trace_event_t &fence_signaled );
+
     void calculate_event_durations();
     void calculate_event_print_info();
 
+    // Build m_ts_buckets once all events are loaded
+    void init_ts_buckets();
+    // Build m_filter_index once all events are loaded
+    void init_filter_index();
+    // Build m_crtc_vblanks once all events are loaded
+    void init_vblanks();
+    // Build m_cpu_runs once all events are loaded
+    void init_cpu_runs();
+
+    struct memory_usage_t
+    {
+        const char *name;
+        size_t bytes;
+    };
+    // Approximate heap bytes used by each part of the trace, largest first
+    void get_memory_usage( std::vector< memory_usage_t > &usage );
+    // Drop spare capacity left over from growing tables while loading
+    void shrink_to_fit();
+    // Run the passes above and look up the default graph row locations and
+    //  plot_entries ($graph_plots$) plots so the first TraceWin frame doesn't
+    //  have to. Called on the loader thread before m_eventsloaded goes to 0.
+    void init_postload( const std::vector< INIEntry > &plot_entries );
+    // Return id of first event at or after ts (or the last event)
+    int ts_to_eventid( int64_t ts );
+
+    // Save / restore decoded events of tracefile to a binary cache file.
+    bool cache_save( const char *cachefile, const char *tracefile );
+    bool cache_load( const char *cachefile, const char *tracefile );
+
     void invalidate_ftraceprint_colors();
     void update_ftraceprint_colors( float label_sat, float label_alpha );
 
     void update_fence_signaled_timeline_colors( float label_sat, float label_alpha );
+    // Set colors of the fence_signaled events in one timeline's locs
+    void update_fence_signaled_colors( const std::vector< uint32_t > &locs,
+                                       float label_sat, float label_alpha );
 
     enum loc_type_t
     {
@@ -197,6 +574,7 @@ public:
         LOC_TYPE_Plot,
         LOC_TYPE_Timeline,
         LOC_TYPE_Timeline_hw,
+        LOC_TYPE_Cpu,
         LOC_TYPE_Max
     };
     const std::vector< uint32_t > *get_locs( const char *name, loc_type_t *type = nullptr );
@@ -210,11 +588,26 @@ public:
         return m_graph_plots.m_map[ fnv_hashstr32( plot_name ) ];
     }
 
+    // Get level of detail summary for locs, building it if needed. Returns
+    //  NULL if locs is too small to bother.
+    GraphLod *get_graph_lod( const std::vector< uint32_t > &locs );
+
+    // Job index for timeline hashval (gfx, sdma0, etc.)
+    const TimelineIndex *get_timeline_index( uint32_t hashval )
+    {
+        return m_timeline_index.get_val( hashval );
+    }
+
+    // Run lane for a "cpu0", "cpu1", etc. row name or NULL
+    const CpuRunIndex::lane_t *get_cpu_lane( const char *name );
+
 public:
     int64_t m_ts_min = 0;
     std::vector< uint32_t > m_cpucount;
 
     std::string m_filename;
+    // All files of a split trace
+    std::vector< std::string > m_filenames;
     size_t m_filesize = 0;
     std::string m_title;
 
@@ -222,33 +615,215 @@ public:
     trace_info_t m_trace_info;
     std::vector< trace_event_t > m_events;
 
-    // Map of vblanks hashval to array of event locations.
+    // Storage for all the m_events[].fields arrays.
+    util_arena< event_field_t > m_fields_arena;
+    // Record payloads for m_events[].raw when loaded with lazy fields.
+    TraceRawEvents m_raw_events;
+
+    // Map of normalized tdop expression hashval to array of event locations.
+    //  Shared by graph rows and event list filters.
     TraceLocations m_tdopexpr_locations;
     std::set< uint32_t > m_failed_commands;
 
     // Map of comm hashval to array of event locations.
     TraceLocations m_comm_locations;
 
-    // Map of timeline/context/seqno to array of event locations.
-    TraceLocations m_gfxcontext_locations;
+    // Comm strpool id to its renamed comm. Events keep their comm ids so a
+    //  rename only touches this map.
+    util_umap< uint32_t, const char * > m_comm_renames;
+
+    // Filter variable and lowercased $name, $comm, $user_comm, $pid value hashval
+    //  to event locations. Used to answer filter equality compares without exec.
+    TracePostings m_filter_index;
+    bool m_filter_index_inited = false;
+
+    // Timeline/context/seqno gpu jobs.
+    TraceGfxContexts m_gfxcontexts;
 
     // Map of timeline (gfx, sdma0, etc) event locations.
     TraceLocations m_timeline_locations;
+    // Timeline hashval to index of its jobs. Built by calculate_event_durations().
+    util_umap< uint32_t, TimelineIndex > m_timeline_index;
+
+    // m_ts_buckets[ i ] is the first event id with ts >= m_events[ 0 ].ts + ( i << m_ts_bucket_shift ).
+    std::vector< uint32_t > m_ts_buckets;
+    uint32_t m_ts_bucket_shift = 0;
+
+    struct crtc_vblanks_t
+    {
+        // drm_vblank_event timestamps
+        std::vector< int64_t > ts;
+        // deltas[ i ] = ts[ i + 1 ] - ts[ i ]
+        std::vector< int64_t > deltas;
+
+        // Frame interval stats
+        int64_t delta_min = 0;
+        int64_t delta_max = 0;
+        int64_t delta_avg = 0;
+        int64_t delta_median = 0;
+        int64_t delta_p99 = 0;
+        // Intervals over 1.5x the median (missed vblanks)
+        size_t long_count = 0;
+    };
+    // Vblanks indexed by crtc so renders and tooltips can binary search
+    //  timestamps instead of walking m_events.
+    std::vector< crtc_vblanks_t > m_crtc_vblanks;
+
+    // Per cpu task run intervals from sched_switch, indexed by cpu
+    CpuRunIndex m_cpu_runs;
 
     struct event_print_info_t
     {
         const char *buf;
         const char *buf_end;
+        // Small font text size of buf. x < 0 until measured for the current font.
         ImVec2 rect_size;
     };
-    util_umap< uint32_t, event_print_info_t > m_print_buf_info;
+    // Return print info for eventid, measuring its text with the current font if needed
+    const event_print_info_t *get_print_info( uint32_t eventid );
+
+    // Interned print buf string to its prefix and text size
+    util_umap< const char *, event_print_info_t > m_print_str_info;
+    // Print event id to its m_print_str_info entry
+    util_umap< uint32_t, event_print_info_t * > m_print_buf_info;
+    // Prefix hashval for each print graph row id (row 0 is unrecognized prints)
+    std::vector< uint32_t > m_print_row_hashvals;
+    // Largest measured print text width. -1 when print colors need updating.
     float m_rect_size_max_x = -1.0f;
 
     // plot name to GraphPlot
     util_umap< uint32_t, GraphPlot > m_graph_plots;
 
+    // Graph row locations to their level of detail summaries
+    util_umap< const std::vector< uint32_t > *, GraphLod > m_graph_lods;
+
+    // Incremented when rename_comm() changes event comms
+    uint32_t m_rename_generation = 0;
+
+    // Thread budget for scans, plots and duration passes over this trace.
+    //  Headless jobs split the cores between the traces they load at once.
+    size_t m_max_threads = 0;
+
+    // Per timeline state for update_fence_signaled_durations()
+    struct timeline_durations_t
+    {
+        uint32_t graph_row_id = 0;
+        int64_t last_fence_signaled_ts = 0;
+    };
+    util_umap< uint32_t, timeline_durations_t > m_timeline_durations;
+
     // 0: events loaded, 1+: loading events, -1: error
     SDL_atomic_t m_eventsloaded = { 0 };
+
+    // While loading, the loader thread appends batches of events to m_events
+    //  and updates earlier events with this held. Readers need to hold it
+    //  until m_eventsloaded goes to 0, and can only look at m_events at all
+    //  once m_events_published is non-zero.
+    std::mutex m_events_mutex;
+    SDL_atomic_t m_events_published = { 0 };
+
+    // Loader thread is in init_postload() and holds m_events_mutex
+    SDL_atomic_t m_postloading = { 0 };
+    // init_postload() has run
+    bool m_postload_done = false;
+
+    // Events are still being added by the loader thread
+    bool is_loading()
+    {
+        return SDL_AtomicGet( &m_eventsloaded ) > 0;
+    }
+};
+
+// Compile time tdop variable lookup for trace event filters (tdop_get_key_func)
+int filter_get_key_func( StrPool *strpool, const char *name, size_t len );
+
+// Background tdop expression scan of trace events
+class TdopExprScan
+{
+public:
+    TdopExprScan() {}
+    ~TdopExprScan() { cancel(); }
+
+public:
+    // Compile expression and start scan thread. Returns false and sets errstr on failure.
+    //  Cached results are used without a scan, and refinements of a cached expression
+    //  only scan the cached events.
+    bool start( TraceEvents &trace_events, const char *expr, std::string &errstr );
+    // Stop scan and wait for scan thread to exit.
+    void cancel();
+
+    bool is_running() { return m_thread || m_resolved; }
+    // Scan thread is running and has finished all events
+    bool is_done() { return m_resolved || ( m_thread && SDL_AtomicGet( &m_done ) ); }
+    // Whether m_locs came from a scan (and aren't in the cache yet)
+    bool is_scanned() { return !m_resolved; }
+    // Wait for scan thread and return scan time in ms. Results are in m_locs.
+    float finish();
+
+    // Fraction of events scanned: 0..1
+    float get_progress();
+
+protected:
+    static int SDLCALL thread_func( void *data );
+
+public:
+    TraceEvents *m_trace_events = nullptr;
+    class TdopExpr *m_tdop_expr = nullptr;
+    SDL_Thread *m_thread = nullptr;
+
+    SDL_atomic_t m_progress = { 0 };
+    SDL_atomic_t m_cancel = { 0 };
+    SDL_atomic_t m_done = { 0 };
+
+    util_time_t m_time_start;
+    std::vector< uint32_t > m_locs;
+
+    // Normalized expression
+    std::string m_expr;
+    // Candidate events being scanned, and number of events to scan
+    std::vector< uint32_t > m_candidates;
+    bool m_use_candidates = false;
+    size_t m_scan_count = 0;
+    // m_locs came from cache or filter indexes without a scan
+    bool m_resolved = false;
+};
+
+// Formatted event list columns of recently drawn rows so scrolling doesn't
+//  rebuild the strings every frame.
+class EventListRows
+{
+public:
+    EventListRows() {}
+    ~EventListRows() {}
+
+    struct row_t
+    {
+        uint32_t eventid;
+        int64_t tsoffset;
+        uint32_t generation;
+
+        std::string id_str;
+        std::string ts_str;
+        std::string duration_str;
+        std::string info_str;
+    };
+
+    // Return row for eventid. Sets hit if the row strings are still valid,
+    //  otherwise the caller needs to fill them in.
+    row_t &get( uint32_t eventid, int64_t tsoffset, uint32_t generation, bool &hit );
+
+    void clear()
+    {
+        m_lru.clear();
+        m_rows.clear();
+    }
+
+public:
+    static const size_t s_rows_max = 512;
+
+    // Most recently used rows first
+    std::list< row_t > m_lru;
+    std::unordered_map< uint32_t, std::list< row_t >::iterator > m_rows;
 };
 
 class GraphRows
@@ -294,6 +869,46 @@ public:
     std::vector< std::string > m_graph_rows_add;
     // Map of user row moves: row src --> row dst
     util_umap< std::string, std::string > m_graph_rows_move;
+
+    // Incremented whenever m_graph_rows_list changes
+    uint32_t m_generation = 0;
+};
+
+typedef std::function< uint32_t ( class graph_info_t &gi ) > RenderGraphRowCallback;
+
+struct row_info_t
+{
+    uint32_t id;
+    std::string row_name;
+
+    uint32_t num_events = 0;
+    float minval = FLT_MAX;
+    float maxval = FLT_MIN;
+
+    float row_y;
+    float row_h;
+
+    TraceEvents::loc_type_t row_type;
+    const std::vector< uint32_t > *plocs;
+
+    RenderGraphRowCallback render_cb;
+};
+
+// Event groups of a graph row for one view, reused until the view changes
+struct graph_row_geom_t
+{
+    struct group_t
+    {
+        float x0, x1;           // Relative to graph left edge
+        uint32_t num_events;
+    };
+    std::vector< group_t > groups;
+
+    // Events drawn
+    uint32_t num_events = 0;
+
+    // Hash of view, locs, filter, etc. used to build groups
+    uint32_t key = 0;
 };
 
 class TraceWin
@@ -305,6 +920,9 @@ public:
 public:
     bool render();
 
+    // Whether window has something to draw without user input
+    bool needs_redraw();
+
     trace_event_t &get_event( uint32_t id )
     {
         return m_trace_events.m_events[ id ];
@@ -332,6 +950,8 @@ protected:
     uint32_t graph_render_print_timeline( class graph_info_t &gi );
     // Render plot row
     uint32_t graph_render_plot( class graph_info_t &gi );
+    // Render cpu scheduling lane
+    uint32_t graph_render_cpu_lane( class graph_info_t &gi );
     // Render regular trace events
     uint32_t graph_render_row_events( class graph_info_t &gi );
 
@@ -393,6 +1013,9 @@ public:
     // Whether our window is open or not
     bool m_open = true;
 
+    // m_trace_events.m_eventsloaded when we last rendered
+    int m_eventsloaded_drawn = 0;
+
     // false first time through render() call
     bool m_inited = false;
 
@@ -405,7 +1028,9 @@ public:
     uint32_t m_create_plot_eventid = INVALID_ID;
     CreatePlotDlg m_create_plot_dlg;
 
-    util_umap< int64_t, int > m_ts_to_eventid_cache;
+    // Show the save selection dialog next frame
+    bool m_do_save_selection = false;
+    SaveSelectionDlg m_save_selection_dlg;
 
     struct
     {
@@ -416,6 +1041,10 @@ public:
         char filter_buf[ 512 ] = { 0 };
         std::string filtered_events_str;
         std::vector< uint32_t > filtered_events;
+        // Incremented when event is_filtered_out flags change
+        uint32_t filter_generation = 0;
+        // Event filter being evaluated in the background
+        TdopExprScan filter_scan;
 
         // Goto Time buffer
         char timegoto_buf[ 32 ] = { 0 };
@@ -439,6 +1068,9 @@ public:
 
         // Whether event list columns have been resized.
         bool columns_resized = false;
+
+        // Formatted strings of recently drawn rows
+        EventListRows rows;
     } m_eventlist;
 
     enum mouse_captured_t
@@ -495,6 +1127,24 @@ public:
 
         std::vector< std::pair< int64_t, int64_t > > saved_locs;
 
+        // Scratch array of timeline jobs being rendered
+        std::vector< uint32_t > timeline_ids;
+
+        // Instanced event batches keyed by row name hash
+        util_umap< uint32_t, graph_batch_t > batches;
+
+        // Graph row layout, reused while rows and options are unchanged
+        std::vector< row_info_t > row_info;
+        uint32_t row_info_key = 0;
+        float row_info_height = 0.0f;
+
+        // Event row groups keyed by row name hash
+        util_umap< uint32_t, graph_row_geom_t > row_geoms;
+
+        // Hash of graph view state last frame and whether it just changed
+        uint32_t view_hash = 0;
+        bool view_changed = false;
+
         mouse_captured_t mouse_captured = MOUSE_NOT_CAPTURED;
         ImVec2 mouse_capture_pos;
 
@@ -533,6 +1183,17 @@ enum : uint32_t
     OPT_EventListRowCount,
     OPT_Scale,
     OPT_UseFreetype,
+    OPT_ParallelLoad,
+    OPT_UseTraceCache,
+    OPT_LazyFields,
+    OPT_PagedFields,
+    OPT_PageCacheSize,
+    OPT_GraphInstancing,
+    OPT_IdleWait,
+    OPT_Profile,
+    OPT_LiveBufferSize,
+    OPT_LiveWindow,
+    OPT_LiveFollow,
     OPT_PresetMax
 };
 
@@ -570,6 +1231,9 @@ public:
     option_id_t add_opt_graph_rowsize( const char *row_name, int defval = 4 );
     option_id_t get_opt_graph_rowsize_id( const std::string &row_name );
 
+    // Incremented whenever an option value changes
+    uint32_t get_generation() { return m_generation; }
+
 private:
     typedef uint32_t OPT_Flags;
     enum : uint32_t
@@ -589,6 +1253,8 @@ private:
 
     // Map row names to option IDs to store graph row sizes. Ie, "gfx", "print", "sdma0", etc.
     util_umap< std::string, option_id_t > m_graph_rowname_optid_map;
+
+    uint32_t m_generation = 0;
 };
 
 class TraceLoader
@@ -609,17 +1275,40 @@ public:
     void init( int argc, char **argv );
     void shutdown();
 
+    // Load filename, along with the rest of its parts if it's a split trace
     bool load_file( const char *filename );
+    // Load files into one trace with their events merged by timestamp
+    bool load_files( const std::vector< std::string > &filenames, bool live_snapshot = false );
     void cancel_load_file();
     bool is_loading();
 
+    // Start / stop capturing tracefs into m_live_capture
+    bool start_live_capture( const char *tracefs );
+    void stop_live_capture();
+    // Write m_live_capture to a trace file and load it
+    bool load_live_snapshot();
+    // Load a new snapshot when following the live capture
+    void update_live_capture();
+
+    // Whether we need to keep drawing frames with no user input
+    bool needs_redraw();
+
+    // Load files into trace_events on the calling thread. Used by --headless
+    //  mode which has no window to show progress in.
+    bool load_files_sync( TraceEvents *trace_events, const std::vector< std::string > &filenames,
+                          bool parallel );
+
     void new_event_window( TraceEvents *trace_events );
     void close_event_file( TraceEvents *trace_events, bool close_file  );
 
     void render();
     void render_menu();
 
-    void load_fonts();
+    // Add our fonts to a new atlas and build it. With async the atlas is
+    //  built on m_fonts_thread and update_fonts() switches to it when ready.
+    void load_fonts( bool async = false );
+    void update_fonts();
+    bool fonts_loading() { return !!m_fonts_next; }
 
     void get_window_pos( int &x, int &y, int &w, int &h );
     void save_window_pos( int x, int y, int w, int h );
@@ -628,6 +1317,7 @@ protected:
     void render_menu_options();
     void render_console();
     void render_log();
+    void render_profile();
     void render_font_options();
     void render_color_picker();
 
@@ -637,18 +1327,39 @@ protected:
     void set_state( state_t state );
 
     static int SDLCALL thread_func( void *data );
+    static int SDLCALL fonts_thread_func( void *data );
     static int new_event_cb( TraceLoader *loader, const trace_info_t &info,
                          const trace_event_t &event );
-    int init_new_event( trace_event_t &event, const trace_info_t &info );
+    void init_new_event( trace_event_t &event );
+    // Move m_pending_events into m_trace_events->m_events
+    void publish_events();
+    // Run init_postload() on the loaded events and hand them to the UI
+    void finish_load();
 
 public:
     std::string m_filename;
+    std::vector< std::string > m_filenames;
     SDL_atomic_t m_state = { 0 };
     SDL_Thread *m_thread = nullptr;
     TraceEvents *m_trace_events = nullptr;
 
+    // Events read by the loader thread but not published to m_trace_events yet
+    std::vector< trace_event_t > m_pending_events;
+
     std::vector< TraceEvents * > m_trace_events_list;
     std::vector< TraceWin * > m_trace_windows_list;
+    // Windows showing traces from a gpuvis --serve server (--remote)
+    std::vector< RemoteTraceWin * > m_remote_windows_list;
+
+    TraceLiveCapture m_live_capture;
+    // Snapshots alternate between two files since the open trace may still
+    //  be reading lazy fields from the last one
+    uint32_t m_live_snapshot_count = 0;
+    util_time_t m_live_snapshot_time;
+    // The trace being loaded is a live capture snapshot (don't cache it)
+    bool m_live_snapshot = false;
+    // $graph_plots$ entries for init_postload(), read when the load started
+    std::vector< INIEntry > m_graph_plot_entries;
 
     uint32_t m_crtc_max = 0;
     std::vector< std::string > m_inputfiles;
@@ -656,6 +1367,15 @@ public:
     FontInfo m_font_main;
     FontInfo m_font_small;
 
+    // Atlas io.Fonts points at, the next one being built, and ImGui's own
+    //  atlas which we point io.Fonts back at before shutting down ImGui
+    ImFontAtlas *m_fonts = nullptr;
+    ImFontAtlas *m_fonts_next = nullptr;
+    ImFontAtlas *m_fonts_default = nullptr;
+    SDL_Thread *m_fonts_thread = nullptr;
+    SDL_atomic_t m_fonts_ready = { 0 };
+    bool m_fonts_use_freetype = true;
+
     ImGuiTextFilter m_filter;
     size_t m_log_size = ( size_t )-1;
     std::vector< std::string > m_log;
@@ -669,6 +1389,7 @@ public:
 
     bool m_quit = false;
     bool m_show_gpuvis_console = true;
+    bool m_show_profile = false;
     bool m_show_imgui_test_window = false;
     bool m_show_imgui_style_editor = false;
     bool m_show_imgui_metrics_editor = false;
@@ -677,3 +1398,7 @@ public:
     bool m_show_scale_popup = false;
     bool m_show_help = false;
 };
+
+// Summarize traces on the command line without creating a window (--headless)
+bool headless_requested( int argc, char **argv );
+int headless_main( int argc, char **argv );
@@ -0,0 +1,1132 @@
+/*
+ * Copyright 2017 Valve Software
+ *
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <float.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <set>
+#include <unordered_map>
+#include <list>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <random>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
+#include <SDL.h>
+
+#define YA_GETOPT_NO_COMPAT_MACRO
+#include "ya_getopt.h"
+
+#include "imgui/imgui.h"
+
+#include "tdopexpr.h"
+#include "trace-cmd/trace-read.h"
+#include "trace-cmd/trace-write.h"
+
+#include "gpuvis_macros.h"
+#include "stlini.h"
+#include "gpuvis_utils.h"
+#include "gpuvis.h"
+
+/*
+ * gpuvis_bench
+ *
+ * Writes a synthetic trace.dat (or uses --trace) and times the hot paths
+ * over it: loading, the post load passes, filter evaluation, tdop location
+ * lookups, plot parsing, ts_to_eventid and a render pass of each graph row
+ * type into ImGui draw lists (no window or GL). Results are written as json
+ * with the median and min of --iterations runs:
+ *
+ *   { "name": "load_parallel", "unit": "ms", "median": 812.5, "min": 790.1 }
+ *
+ * Defaults never read or write gpuvis.ini so runs are repeatable.
+ */
+
+struct bench_opts_t
+{
+    uint32_t cpus = 8;
+    float seconds = 2.0f;
+    // sched_switch events per second (all cpus)
+    uint32_t rate = 500000;
+    // amdgpu jobs per second on each timeline
+    uint32_t job_rate = 2000;
+    uint32_t timelines = 3;
+    // ftrace print events per second
+    uint32_t print_rate = 20000;
+    // Buffer instances in addition to the main buffer
+    uint32_t instances = 0;
+    uint32_t seed = 1;
+
+    uint32_t iterations = 3;
+    uint32_t frames = 20;
+
+    std::string trace;
+    std::string write;
+    std::string output;
+};
+
+/*
+ * Synthetic trace.dat writer
+ */
+static const size_t s_synth_page_size = 4096;
+
+enum
+{
+    SYNTH_ID_print = 5,
+    SYNTH_ID_sched_switch = 300,
+    SYNTH_ID_amdgpu_cs_ioctl = 400,
+    SYNTH_ID_amdgpu_sched_run_job = 401,
+    SYNTH_ID_fence_signaled = 500,
+    SYNTH_ID_drm_vblank_event = 600,
+};
+
+static const struct
+{
+    int pid;
+    const char *comm;
+} s_synth_comms[] =
+{
+    { 101, "Xorg" },
+    { 202, "game" },
+    { 303, "compositor" },
+    { 404, "kworker/0:1" },
+    { 505, "audio" },
+};
+
+static const uint64_t s_synth_func_addr = 0xffffffff81000000ULL;
+
+struct synth_event_t
+{
+    int64_t ts;
+    uint64_t seq;
+    uint32_t cpu;
+    std::string data;
+};
+
+// Ring buffer pages of one cpu
+struct synth_cpu_t
+{
+    std::string data;
+    std::string page;
+    int64_t page_ts = 0;
+    int64_t last_ts = 0;
+};
+
+static void put_str16( std::string &out, const char *str )
+{
+    char buf[ 16 ] = { 0 };
+
+    strncpy( buf, str, sizeof( buf ) - 1 );
+    out.append( buf, sizeof( buf ) );
+}
+
+static std::string synth_format( const char *name, int id, const std::vector< const char * > &fields,
+                                 const char *print_fmt )
+{
+    std::string str = string_format( "name: %s\nID: %d\nformat:\n", name, id );
+
+    str += "\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n";
+    str += "\tfield:unsigned char common_flags;\toffset:2;\tsize:1;\tsigned:0;\n";
+    str += "\tfield:unsigned char common_preempt_count;\toffset:3;\tsize:1;\tsigned:0;\n";
+    str += "\tfield:int common_pid;\toffset:4;\tsize:4;\tsigned:1;\n\n";
+
+    for ( const char *field : fields )
+        str += string_format( "\tfield:%s;\n", field );
+
+    str += string_format( "\nprint fmt: %s\n", print_fmt );
+    return str;
+}
+
+static void synth_put_formats( std::string &out )
+{
+    static const char s_header_page[] =
+            "\tfield: u64 timestamp;\toffset:0;\tsize:8;\tsigned:0;\n"
+            "\tfield: local_t commit;\toffset:8;\tsize:8;\tsigned:1;\n"
+            "\tfield: int overwrite;\toffset:8;\tsize:1;\tsigned:1;\n"
+            "\tfield: char data;\toffset:16;\tsize:4080;\tsigned:1;\n";
+    static const char s_header_event[] =
+            "# compressed entry header\n"
+            "\ttype_len    :    5 bits\n"
+            "\ttime_delta  :   27 bits\n"
+            "\tarray       :   32 bits\n";
+    static const char *s_job_fields[] =
+    {
+        "unsigned long sched_job_id;\toffset:8;\tsize:8;\tsigned:0",
+        "char timeline[16];\toffset:16;\tsize:16;\tsigned:1",
+        "unsigned int context;\toffset:32;\tsize:4;\tsigned:0",
+        "unsigned int seqno;\toffset:36;\tsize:4;\tsigned:0",
+    };
+    static const char s_job_fmt[] =
+            "\"sched_job=%lu, timeline=%s, context=%u, seqno=%u\", "
+            "REC->sched_job_id, REC->timeline, REC->context, REC->seqno";
+
+    // The synthetic formats use 8 byte longs
+    trace_put_file_header( out, s_synth_page_size, 8, s_header_page, s_header_event );
+
+    std::string print = synth_format( "print", SYNTH_ID_print,
+        { "unsigned long ip;\toffset:8;\tsize:8;\tsigned:0",
+          "char buf[];\toffset:16;\tsize:0;\tsigned:0" },
+        "\"%ps: %s\", (void *)REC->ip, REC->buf" );
+
+    trace_put4( out, 1 );
+    trace_put8( out, print.size() );
+    out += print;
+
+    std::vector< std::pair< const char *, std::vector< std::string > > > systems;
+
+    systems.push_back( { "sched", {
+        synth_format( "sched_switch", SYNTH_ID_sched_switch,
+            { "char prev_comm[16];\toffset:8;\tsize:16;\tsigned:1",
+              "pid_t prev_pid;\toffset:24;\tsize:4;\tsigned:1",
+              "int prev_prio;\toffset:28;\tsize:4;\tsigned:1",
+              "long prev_state;\toffset:32;\tsize:8;\tsigned:1",
+              "char next_comm[16];\toffset:40;\tsize:16;\tsigned:1",
+              "pid_t next_pid;\toffset:56;\tsize:4;\tsigned:1",
+              "int next_prio;\toffset:60;\tsize:4;\tsigned:1" },
+            "\"prev_comm=%s prev_pid=%d prev_prio=%d prev_state=%ld ==> next_comm=%s next_pid=%d next_prio=%d\", "
+            "REC->prev_comm, REC->prev_pid, REC->prev_prio, REC->prev_state, REC->next_comm, REC->next_pid, REC->next_prio" ) } } );
+    systems.push_back( { "amdgpu", {
+        synth_format( "amdgpu_cs_ioctl", SYNTH_ID_amdgpu_cs_ioctl,
+            std::vector< const char * >( s_job_fields, s_job_fields + 4 ), s_job_fmt ),
+        synth_format( "amdgpu_sched_run_job", SYNTH_ID_amdgpu_sched_run_job,
+            std::vector< const char * >( s_job_fields, s_job_fields + 4 ), s_job_fmt ) } } );
+    systems.push_back( { "fence", {
+        synth_format( "fence_signaled", SYNTH_ID_fence_signaled,
+            { "char driver[16];\toffset:8;\tsize:16;\tsigned:1",
+              "char timeline[16];\toffset:24;\tsize:16;\tsigned:1",
+              "unsigned int context;\toffset:40;\tsize:4;\tsigned:0",
+              "unsigned int seqno;\toffset:44;\tsize:4;\tsigned:0" },
+            "\"driver=%s timeline=%s context=%u seqno=%u\", "
+            "REC->driver, REC->timeline, REC->context, REC->seqno" ) } } );
+    systems.push_back( { "drm", {
+        synth_format( "drm_vblank_event", SYNTH_ID_drm_vblank_event,
+            { "int crtc;\toffset:8;\tsize:4;\tsigned:1",
+              "unsigned int seq;\toffset:12;\tsize:4;\tsigned:0" },
+            "\"crtc=%d, seq=%u\", REC->crtc, REC->seq" ) } } );
+
+    trace_put4( out, systems.size() );
+    for ( const auto &system : systems )
+    {
+        trace_put_str( out, system.first );
+        trace_put4( out, system.second.size() );
+
+        for ( const std::string &format : system.second )
+        {
+            trace_put8( out, format.size() );
+            out += format;
+        }
+    }
+
+    std::string kallsyms;
+    for ( uint32_t i = 0; i < 64; i++ )
+        kallsyms += string_format( "%016llx T synth_func_%u\n",
+                                   ( unsigned long long )( s_synth_func_addr + i * 0x100 ), i );
+    trace_put4( out, kallsyms.size() );
+    out += kallsyms;
+
+    trace_put4( out, 0 );             // printk formats
+
+    std::string cmdlines;
+    for ( const auto &comm : s_synth_comms )
+        cmdlines += string_format( "%d %s\n", comm.pid, comm.comm );
+    trace_put8( out, cmdlines.size() );
+    out += cmdlines;
+}
+
+static void synth_flush_page( synth_cpu_t &cpu )
+{
+    if ( cpu.page.empty() )
+        return;
+
+    trace_put8( cpu.data, cpu.page_ts );
+    trace_put8( cpu.data, cpu.page.size() );
+    cpu.data += cpu.page;
+    cpu.data.resize( ( cpu.data.size() + s_synth_page_size - 1 ) & ~( s_synth_page_size - 1 ), 0 );
+
+    cpu.page.clear();
+}
+
+static void synth_add_record( synth_cpu_t &cpu, int64_t ts, const std::string &data )
+{
+    uint64_t delta = cpu.page.empty() ? 0 : ( ts - cpu.last_ts );
+    size_t size = 4 + data.size() + ( ( delta >= ( 1 << 27 ) ) ? 8 : 0 );
+
+    if ( 16 + cpu.page.size() + size > s_synth_page_size )
+        synth_flush_page( cpu );
+
+    if ( cpu.page.empty() )
+    {
+        cpu.page_ts = ts;
+        delta = 0;
+    }
+
+    // Time extend record for deltas that don't fit in 27 bits
+    if ( delta >= ( 1 << 27 ) )
+    {
+        trace_put4( cpu.page, 30 | ( ( delta & ( ( 1 << 27 ) - 1 ) ) << 5 ) );
+        trace_put4( cpu.page, delta >> 27 );
+        delta = 0;
+    }
+
+    // Records are all small enough to keep their length in type_len
+    trace_put4( cpu.page, ( data.size() / 4 ) | ( delta << 5 ) );
+    cpu.page += data;
+
+    cpu.last_ts = ts;
+}
+
+class SynthTrace
+{
+public:
+    SynthTrace( const bench_opts_t &opts, uint32_t instance ) :
+        m_opts( opts ), m_instance( instance ), m_rng( opts.seed + instance )
+    {
+        m_cpus.resize( opts.cpus );
+        m_next_job_ts.resize( opts.timelines, 0 );
+        m_last_fence_ts.resize( opts.timelines, 0 );
+        m_seqno.resize( opts.timelines, 1 );
+    }
+
+    // Generate events for the whole trace into m_cpus
+    void generate();
+
+public:
+    std::vector< synth_cpu_t > m_cpus;
+    size_t m_event_count = 0;
+
+protected:
+    uint32_t rand_u32( uint32_t max )
+    {
+        return max ? ( m_rng() % max ) : 0;
+    }
+    int64_t rand_range( int64_t lo, int64_t hi )
+    {
+        return lo + ( int64_t )( m_rng() % ( uint64_t )( hi - lo + 1 ) );
+    }
+
+    std::string common( uint16_t type, int pid )
+    {
+        std::string data;
+
+        trace_put2( data, type );
+        data.push_back( 1 );    // common_flags: irqs off
+        data.push_back( 0 );    // common_preempt_count
+        trace_put4( data, pid );
+        return data;
+    }
+
+    void add( int64_t ts, uint32_t cpu, std::string &data )
+    {
+        data.resize( ( data.size() + 3 ) & ~3, 0 );
+        m_pending.push_back( { ts, m_seq++, cpu, data } );
+    }
+
+    uint32_t event_count( double rate, double &carry, int64_t slice_ns );
+    void add_sched_switch( int64_t ts );
+    void add_print( int64_t ts );
+    void add_job( uint32_t timeline, int64_t ts );
+
+protected:
+    const bench_opts_t &m_opts;
+    uint32_t m_instance;
+    std::mt19937 m_rng;
+
+    uint64_t m_seq = 0;
+    std::vector< synth_event_t > m_pending;
+
+    std::vector< int64_t > m_next_job_ts;
+    std::vector< int64_t > m_last_fence_ts;
+    std::vector< uint32_t > m_seqno;
+    uint64_t m_sched_job_id = 0;
+};
+
+uint32_t SynthTrace::event_count( double rate, double &carry, int64_t slice_ns )
+{
+    carry += rate * slice_ns / NSECS_PER_SEC;
+
+    uint32_t count = ( uint32_t )carry;
+    carry -= count;
+    return count;
+}
+
+void SynthTrace::add_sched_switch( int64_t ts )
+{
+    const auto &prev = s_synth_comms[ rand_u32( ARRAY_SIZE( s_synth_comms ) ) ];
+    const auto &next = s_synth_comms[ rand_u32( ARRAY_SIZE( s_synth_comms ) ) ];
+    std::string data = common( SYNTH_ID_sched_switch, prev.pid );
+
+    put_str16( data, prev.comm );
+    trace_put4( data, prev.pid );
+    trace_put4( data, 120 );
+    trace_put8( data, rand_u32( 3 ) );
+    put_str16( data, next.comm );
+    trace_put4( data, next.pid );
+    trace_put4( data, 120 );
+
+    add( ts, rand_u32( m_opts.cpus ), data );
+}
+
+void SynthTrace::add_print( int64_t ts )
+{
+    uint32_t r = rand_u32( 10 );
+    const auto &comm = s_synth_comms[ 1 + rand_u32( 2 ) ];
+    std::string data = common( SYNTH_ID_print, comm.pid );
+    std::string buf;
+
+    if ( r < 5 )
+        buf = string_format( "[Compositor] TimeSinceLastVSync: %f(%u)", rand_u32( 16000 ) / 1000.0f, rand_u32( 100000 ) );
+    else if ( r < 8 )
+        buf = string_format( "[Compositor] Predicting( %f ms )", rand_u32( 40000 ) / 1000.0f );
+    else
+        buf = string_format( "frame %u begin", rand_u32( 1000 ) );
+
+    trace_put8( data, s_synth_func_addr + rand_u32( 64 ) * 0x100 );
+    trace_put_str( data, buf.c_str() );
+
+    add( ts, rand_u32( m_opts.cpus ), data );
+}
+
+void SynthTrace::add_job( uint32_t timeline, int64_t ts )
+{
+    std::string name = ( timeline == 0 ) ? "gfx" :
+                       ( timeline < 3 ) ? string_format( "sdma%u", timeline - 1 ) :
+                       string_format( "comp_1.%u.0", timeline - 3 );
+    uint32_t context = timeline + 1;
+    uint32_t seqno = m_seqno[ timeline ]++;
+    uint64_t sched_job_id = ++m_sched_job_id;
+    int64_t job_ns = NSECS_PER_SEC / std::max< uint32_t >( m_opts.job_rate, 1 );
+
+    // amdgpu_cs_ioctl -> amdgpu_sched_run_job -> fence_signaled, with the
+    //  hardware running one job at a time on each timeline
+    int64_t run_job_ts = ts + rand_range( 5000, 100000 );
+    int64_t fence_ts = std::max< int64_t >( run_job_ts, m_last_fence_ts[ timeline ] ) +
+            rand_range( job_ns / 4, job_ns + job_ns / 2 );
+
+    m_last_fence_ts[ timeline ] = fence_ts;
+
+    for ( uint32_t type : { SYNTH_ID_amdgpu_cs_ioctl, SYNTH_ID_amdgpu_sched_run_job } )
+    {
+        std::string data = common( type, s_synth_comms[ 1 ].pid );
+
+        trace_put8( data, sched_job_id );
+        put_str16( data, name.c_str() );
+        trace_put4( data, context );
+        trace_put4( data, seqno );
+
+        add( ( type == SYNTH_ID_amdgpu_cs_ioctl ) ? ts : run_job_ts, rand_u32( m_opts.cpus ), data );
+    }
+
+    std::string data = common( SYNTH_ID_fence_signaled, 0 );
+
+    put_str16( data, "amdgpu" );
+    put_str16( data, name.c_str() );
+    trace_put4( data, context );
+    trace_put4( data, seqno );
+
+    add( fence_ts, rand_u32( m_opts.cpus ), data );
+}
+
+void SynthTrace::generate()
+{
+    // Events are made a slice at a time and written once everything before
+    //  them is known. Job chains can reach a bit past their slice.
+    static const int64_t s_slice_ns = NSECS_PER_MSEC;
+    static const int64_t s_vblank_ns = NSECS_PER_SEC / 60;
+    int64_t ts0 = NSECS_PER_SEC;
+    int64_t ts_end = ts0 + ( int64_t )( m_opts.seconds * NSECS_PER_SEC );
+    bool main_buffer = ( m_instance == 0 );
+    // Instances only get a quarter of the sched_switch and print events
+    double rate_scale = main_buffer ? 1.0 : 0.25;
+    double sched_carry = 0.0;
+    double print_carry = 0.0;
+    int64_t next_vblank_ts[ 2 ] = { ts0, ts0 + s_vblank_ns / 3 };
+    uint32_t vblank_seq = 0;
+
+    for ( int64_t slice_ts = ts0; slice_ts < ts_end || !m_pending.empty(); slice_ts += s_slice_ns )
+    {
+        int64_t slice_end = slice_ts + s_slice_ns;
+
+        if ( slice_ts < ts_end )
+        {
+            for ( uint32_t i = event_count( m_opts.rate * rate_scale, sched_carry, s_slice_ns ); i > 0; i-- )
+                add_sched_switch( slice_ts + rand_u32( s_slice_ns ) );
+
+            for ( uint32_t i = event_count( m_opts.print_rate * rate_scale, print_carry, s_slice_ns ); i > 0; i-- )
+                add_print( slice_ts + rand_u32( s_slice_ns ) );
+
+            for ( uint32_t crtc = 0; main_buffer && ( crtc < 2 ); crtc++ )
+            {
+                for ( ; next_vblank_ts[ crtc ] < slice_end; next_vblank_ts[ crtc ] += s_vblank_ns )
+                {
+                    std::string data = common( SYNTH_ID_drm_vblank_event, 0 );
+
+                    trace_put4( data, crtc );
+                    trace_put4( data, vblank_seq++ );
+                    add( next_vblank_ts[ crtc ], rand_u32( m_opts.cpus ), data );
+                }
+            }
+
+            for ( uint32_t timeline = 0; main_buffer && m_opts.job_rate && ( timeline < m_opts.timelines ); timeline++ )
+            {
+                int64_t job_ns = NSECS_PER_SEC / m_opts.job_rate;
+
+                if ( !m_next_job_ts[ timeline ] )
+                    m_next_job_ts[ timeline ] = slice_ts + rand_u32( job_ns );
+
+                for ( ; m_next_job_ts[ timeline ] < slice_end;
+                      m_next_job_ts[ timeline ] += rand_range( job_ns / 2, job_ns + job_ns / 2 ) )
+                {
+                    add_job( timeline, m_next_job_ts[ timeline ] );
+                }
+            }
+        }
+        else
+        {
+            slice_end = INT64_MAX;
+        }
+
+        std::sort( m_pending.begin(), m_pending.end(),
+                   []( const synth_event_t &lx, const synth_event_t &rx )
+        {
+            return ( lx.ts < rx.ts ) || ( ( lx.ts == rx.ts ) && ( lx.seq < rx.seq ) );
+        } );
+
+        size_t count = 0;
+        for ( ; ( count < m_pending.size() ) && ( m_pending[ count ].ts < slice_end ); count++ )
+        {
+            const synth_event_t &event = m_pending[ count ];
+
+            synth_add_record( m_cpus[ event.cpu ], event.ts, event.data );
+        }
+
+        m_event_count += count;
+        m_pending.erase( m_pending.begin(), m_pending.begin() + count );
+    }
+
+    for ( synth_cpu_t &cpu : m_cpus )
+        synth_flush_page( cpu );
+}
+
+static void synth_put_flyrecord( std::string &out, const SynthTrace &trace )
+{
+    out.append( "flyrecord", 10 );
+
+    // Cpu data starts on the first page boundary after the offsets
+    size_t offset = out.size() + trace.m_cpus.size() * 16;
+    offset = ( offset + s_synth_page_size - 1 ) & ~( s_synth_page_size - 1 );
+
+    for ( const synth_cpu_t &cpu : trace.m_cpus )
+    {
+        trace_put8( out, cpu.data.empty() ? 0 : offset );
+        trace_put8( out, cpu.data.size() );
+        offset += cpu.data.size();
+    }
+
+    out.resize( ( out.size() + s_synth_page_size - 1 ) & ~( s_synth_page_size - 1 ), 0 );
+
+    for ( const synth_cpu_t &cpu : trace.m_cpus )
+        out += cpu.data;
+}
+
+// Write synthetic trace to filename. Returns number of events written or 0.
+static size_t synth_write_trace( const bench_opts_t &opts, const char *filename )
+{
+    // trace.dat option ids. Same as the TRACECMD_OPTION_* values in trace-read.cpp.
+    static const uint16_t s_option_done = 0;
+    static const uint16_t s_option_buffer = 3;
+    static const uint16_t s_option_uname = 5;
+
+    std::vector< std::unique_ptr< SynthTrace > > traces;
+    std::vector< std::thread > threads;
+    std::string out;
+    size_t event_count = 0;
+
+    // Buffer instances are independent, so generate them at the same time
+    for ( uint32_t i = 0; i <= opts.instances; i++ )
+        traces.push_back( std::unique_ptr< SynthTrace >( new SynthTrace( opts, i ) ) );
+    for ( auto &trace : traces )
+        threads.push_back( std::thread( &SynthTrace::generate, trace.get() ) );
+    for ( std::thread &thread : threads )
+        thread.join();
+
+    synth_put_formats( out );
+    trace_put4( out, opts.cpus );
+
+    out.append( "options  ", 10 );
+
+    const char *uname = "Linux gpuvis_bench 4.13.0 #1 SMP x86_64";
+    trace_put2( out, s_option_uname );
+    trace_put4( out, strlen( uname ) + 1 );
+    trace_put_str( out, uname );
+
+    // Instance offsets get filled in once we know where they go
+    std::vector< size_t > instance_offsets;
+    for ( uint32_t i = 1; i <= opts.instances; i++ )
+    {
+        std::string name = string_format( "instance%u", i );
+
+        trace_put2( out, s_option_buffer );
+        trace_put4( out, 8 + name.size() + 1 );
+        instance_offsets.push_back( out.size() );
+        trace_put8( out, 0 );
+        trace_put_str( out, name.c_str() );
+    }
+
+    trace_put2( out, s_option_done );
+
+    for ( size_t i = 0; i < traces.size(); i++ )
+    {
+        if ( i )
+        {
+            uint64_t offset = out.size();
+
+            memcpy( &out[ instance_offsets[ i - 1 ] ], &offset, sizeof( offset ) );
+        }
+
+        synth_put_flyrecord( out, *traces[ i ] );
+        event_count += traces[ i ]->m_event_count;
+    }
+
+    FILE *fp = fopen( filename, "wb" );
+    if ( !fp )
+    {
+        logf( "[Error] %s: fopen(\"%s\") failed: %s", __func__, filename, strerror( errno ) );
+        return 0;
+    }
+
+    bool ret = ( fwrite( out.data(), out.size(), 1, fp ) == 1 );
+    ret = !fclose( fp ) && ret;
+
+    if ( !ret )
+    {
+        logf( "[Error] %s: writing \"%s\" failed: %s", __func__, filename, strerror( errno ) );
+        return 0;
+    }
+
+    return event_count;
+}
+
+/*
+ * Benchmarks
+ */
+struct bench_result_t
+{
+    std::string name;
+    std::string unit;
+    double median;
+    double min;
+};
+
+static std::vector< bench_result_t > g_results;
+
+static void bench_add( const std::string &name, const char *unit, std::vector< double > vals )
+{
+    if ( vals.empty() )
+        return;
+
+    std::sort( vals.begin(), vals.end() );
+    g_results.push_back( { name, unit, vals[ vals.size() / 2 ], vals[ 0 ] } );
+
+    fprintf( stderr, "  %-40s %14.3f %s\n", name.c_str(), vals[ vals.size() / 2 ], unit );
+}
+
+static void bench_add( const std::string &name, const char *unit, double val )
+{
+    bench_add( name, unit, std::vector< double >( 1, val ) );
+}
+
+// Run func iterations times and return how long each run took in ms
+static std::vector< double > bench_time( uint32_t iterations, const std::function< void () > &func )
+{
+    std::vector< double > times;
+
+    for ( uint32_t i = 0; i < iterations; i++ )
+    {
+        util_time_t t0 = util_get_time();
+
+        func();
+        times.push_back( util_time_to_ms( t0, util_get_time() ) );
+    }
+
+    return times;
+}
+
+static double bench_peak_rss_mb()
+{
+#ifndef WIN32
+    struct rusage usage;
+
+    // ru_maxrss is in kilobytes on Linux
+    if ( !getrusage( RUSAGE_SELF, &usage ) )
+        return usage.ru_maxrss / 1024.0;
+#endif
+    return 0.0;
+}
+
+static TraceEvents *bench_load( TraceLoader &loader, const bench_opts_t &opts,
+                                const std::string &filename, size_t filesize )
+{
+    TraceEvents *trace_events = NULL;
+
+    for ( int parallel = 0; parallel < 2; parallel++ )
+    {
+        std::string name = parallel ? "load_parallel" : "load_serial";
+        std::vector< double > events_per_sec;
+        std::vector< double > mb_per_sec;
+
+        std::vector< double > times;
+
+        for ( uint32_t i = 0; i < opts.iterations; i++ )
+        {
+            delete trace_events;
+            trace_events = new TraceEvents;
+            trace_events->m_filename = filename;
+            trace_events->m_filesize = filesize;
+            trace_events->m_title = filename;
+
+            util_time_t t0 = util_get_time();
+
+            loader.load_files_sync( trace_events, { filename }, !!parallel );
+            times.push_back( util_time_to_ms( t0, util_get_time() ) );
+        }
+
+        for ( double ms : times )
+        {
+            events_per_sec.push_back( trace_events->m_events.size() * 1000.0 / ms );
+            mb_per_sec.push_back( filesize * 1000.0 / ( 1024.0 * 1024.0 * ms ) );
+        }
+
+        bench_add( name, "ms", times );
+        bench_add( name + "_events_per_sec", "events/s", events_per_sec );
+        bench_add( name + "_mb_per_sec", "MB/s", mb_per_sec );
+    }
+
+    bench_add( "load_peak_rss", "MB", bench_peak_rss_mb() );
+
+    if ( trace_events->m_events.empty() )
+    {
+        delete trace_events;
+        return NULL;
+    }
+    return trace_events;
+}
+
+static void bench_post_load( TraceEvents &trace_events )
+{
+    // These only do their work once, so they're timed once
+    bench_add( "calculate_event_durations", "ms",
+               bench_time( 1, [&]() { trace_events.calculate_event_durations(); } ) );
+    bench_add( "calculate_event_print_info", "ms",
+               bench_time( 1, [&]() { trace_events.calculate_event_print_info(); } ) );
+    bench_add( "init_ts_buckets", "ms",
+               bench_time( 1, [&]() { trace_events.init_ts_buckets(); } ) );
+    bench_add( "init_filter_index", "ms",
+               bench_time( 1, [&]() { trace_events.init_filter_index(); } ) );
+    bench_add( "init_vblanks", "ms",
+               bench_time( 1, [&]() { trace_events.init_vblanks(); } ) );
+}
+
+static const char *s_bench_exprs[] =
+{
+    "$name = sched_switch",
+    "$name = print && $buf =~ \"TimeSinceLastVSync\"",
+    "$prev_pid > 300 && $next_pid < 200",
+    "$comm =~ game || $timeline = gfx",
+};
+
+static void bench_filters( TraceEvents &trace_events, const bench_opts_t &opts )
+{
+    tdop_get_key_func get_key_func = std::bind( filter_get_key_func, &trace_events.m_strpool, _1, _2 );
+
+    // Evaluate each expression over every event, without indexes or cached results
+    for ( size_t i = 0; i < ARRAY_SIZE( s_bench_exprs ); i++ )
+    {
+        std::string errstr;
+        std::vector< uint32_t > locs;
+        class TdopExpr *tdop_expr = tdopexpr_compile( s_bench_exprs[ i ], get_key_func, errstr );
+
+        if ( !tdop_expr )
+        {
+            logf( "[Error] compiling '%s': %s", s_bench_exprs[ i ], errstr.c_str() );
+            continue;
+        }
+
+        bench_add( string_format( "filter_scan[%zu]", i ), "ms", bench_time( opts.iterations, [&]()
+        {
+            locs.clear();
+            trace_events.tdopexpr_scan( tdop_expr, locs );
+        } ) );
+
+        tdopexpr_delete( tdop_expr );
+    }
+
+    // get_tdopexpr_locs() with the caches as they were after loading, then cached
+    TraceLocations locations = trace_events.m_tdopexpr_locations;
+
+    for ( size_t i = 0; i < ARRAY_SIZE( s_bench_exprs ); i++ )
+    {
+        static const uint32_t s_cached_count = 1000;
+
+        bench_add( string_format( "get_tdopexpr_locs[%zu]", i ), "ms", bench_time( opts.iterations, [&]()
+        {
+            trace_events.m_tdopexpr_locations = locations;
+            trace_events.m_failed_commands.clear();
+            trace_events.get_tdopexpr_locs( s_bench_exprs[ i ] );
+        } ) );
+
+        std::vector< double > times = bench_time( opts.iterations, [&]()
+        {
+            for ( uint32_t j = 0; j < s_cached_count; j++ )
+                trace_events.get_tdopexpr_locs( s_bench_exprs[ i ] );
+        } );
+        for ( double &ms : times )
+            ms = ms * 1000.0 / s_cached_count;
+        bench_add( string_format( "get_tdopexpr_locs_cached[%zu]", i ), "us", times );
+    }
+
+    trace_events.m_tdopexpr_locations = locations;
+    trace_events.m_failed_commands.clear();
+
+    for ( size_t i = 0; i < ARRAY_SIZE( s_bench_exprs ); i++ )
+        logf( "  [%zu]: %s", i, s_bench_exprs[ i ] );
+}
+
+static const char s_bench_plot_name[] = "plot:bench_vsync";
+static const char s_bench_plot_filter[] = "$name = print && $buf =~ \"[Compositor] TimeSinceLastVSync: \"";
+static const char s_bench_plot_scanf[] = "[Compositor] TimeSinceLastVSync: %f(";
+
+static void bench_plot( TraceEvents &trace_events, const bench_opts_t &opts )
+{
+    size_t values = 0;
+
+    bench_add( "graphplot_init", "ms", bench_time( opts.iterations, [&]()
+    {
+        // Plots copy values from a plot already built with the same filter
+        trace_events.m_graph_plots.m_map.clear();
+
+        GraphPlot &plot = trace_events.get_plot( s_bench_plot_name );
+
+        plot.init( trace_events, s_bench_plot_name, s_bench_plot_filter, s_bench_plot_scanf );
+        values = plot.m_plotdata.size();
+    } ) );
+    bench_add( "graphplot_values", "count", values );
+
+    trace_events.m_graph_plots.m_map.clear();
+}
+
+static void bench_ts_to_eventid( TraceEvents &trace_events, const bench_opts_t &opts )
+{
+    static const uint32_t s_lookups = 1000000;
+    int64_t last_ts = trace_events.m_events.back().ts;
+    std::vector< int64_t > tsvals( s_lookups );
+    std::mt19937_64 rng( opts.seed );
+    uint64_t sum = 0;
+
+    for ( int64_t &ts : tsvals )
+        ts = rng() % ( uint64_t )( last_ts + 1 );
+
+    std::vector< double > times = bench_time( opts.iterations, [&]()
+    {
+        for ( int64_t ts : tsvals )
+            sum += trace_events.ts_to_eventid( ts );
+    } );
+    for ( double &ms : times )
+        ms = ms * NSECS_PER_MSEC / s_lookups;
+
+    bench_add( "ts_to_eventid", "ns", times );
+
+    // Keep the lookups from being optimized out
+    if ( !sum )
+        logf( "%s: no events found", __func__ );
+}
+
+static void bench_render( TraceLoader &loader, TraceEvents &trace_events, const bench_opts_t &opts )
+{
+    ImGuiIO &io = ImGui::GetIO();
+    unsigned char *pixels;
+    int width, height;
+
+    // Draw lists are built like any other frame but nothing gets rendered
+    io.IniFilename = NULL;
+    io.DisplaySize = ImVec2( 1920.0f, 1080.0f );
+    io.DeltaTime = 1.0f / 60.0f;
+
+    loader.load_fonts();
+    io.Fonts->GetTexDataAsRGBA32( &pixels, &width, &height );
+
+    std::string title = trace_events.m_title;
+    TraceWin win( loader, trace_events, title );
+    auto render_frame = [&]()
+    {
+        ImGui::NewFrame();
+        win.render();
+        ImGui::Render();
+    };
+
+    // First frame initializes graph rows, so it includes the post load passes
+    bench_add( "render_first_frame", "ms", bench_time( 1, render_frame ) );
+
+    win.m_graph.rows.add_row( trace_events, "$name = drm_vblank_event" );
+
+    // Show the whole trace so every row has all its events in view
+    win.m_graph.start_ts = 0;
+    win.m_graph.length_ts = trace_events.m_events.back().ts;
+
+    static const char *s_row_types[ TraceEvents::LOC_TYPE_Max ] =
+    {
+        "comm", "tdopexpr", "print", "plot", "timeline", "timeline_hw", "cpu"
+    };
+    std::vector< std::string > rows( TraceEvents::LOC_TYPE_Max );
+
+    for ( const GraphRows::graph_rows_info_t &info : win.m_graph.rows.m_graph_rows_list )
+    {
+        if ( !info.hidden && rows[ info.type ].empty() )
+            rows[ info.type ] = info.row_name;
+    }
+
+    for ( size_t i = 0; i < rows.size(); i++ )
+    {
+        if ( rows[ i ].empty() )
+            continue;
+
+        // Zooming a row renders just that row (and its hw row)
+        win.m_graph.zoom_row_name = rows[ i ];
+        render_frame();
+
+        bench_add( string_format( "render_row_%s", s_row_types[ i ] ), "ms",
+                   bench_time( opts.frames, render_frame ) );
+    }
+
+    win.m_graph.zoom_row_name.clear();
+    render_frame();
+    bench_add( "render_all_rows", "ms", bench_time( opts.frames, render_frame ) );
+}
+
+static bool bench_write_json( const bench_opts_t &opts, const std::string &filename,
+                              size_t filesize, size_t event_count )
+{
+    FILE *fp = opts.output.empty() ? stdout : fopen( opts.output.c_str(), "w" );
+
+    if ( !fp )
+    {
+        fprintf( stderr, "[Error] %s: fopen(%s) failed: %s\n", __func__, opts.output.c_str(), strerror( errno ) );
+        return false;
+    }
+
+    fprintf( fp, "{\n" );
+    fprintf( fp, "  \"trace\": %s,\n", string_json_quoted( filename ).c_str() );
+    fprintf( fp, "  \"trace_mb\": %.3f,\n", filesize / ( 1024.0 * 1024.0 ) );
+    fprintf( fp, "  \"events\": %zu,\n", event_count );
+    fprintf( fp, "  \"config\": { \"cpus\": %u, \"seconds\": %.3f, \"rate\": %u, \"job_rate\": %u, "
+             "\"timelines\": %u, \"print_rate\": %u, \"instances\": %u, \"seed\": %u, "
+             "\"iterations\": %u, \"frames\": %u, \"hardware_threads\": %u },\n",
+             opts.cpus, opts.seconds, opts.rate, opts.job_rate, opts.timelines, opts.print_rate,
+             opts.instances, opts.seed, opts.iterations, opts.frames, std::thread::hardware_concurrency() );
+    fprintf( fp, "  \"results\": [\n" );
+
+    for ( size_t i = 0; i < g_results.size(); i++ )
+    {
+        const bench_result_t &result = g_results[ i ];
+
+        fprintf( fp, "    { \"name\": %s, \"unit\": \"%s\", \"median\": %.6f, \"min\": %.6f }%s\n",
+                 string_json_quoted( result.name ).c_str(), result.unit.c_str(), result.median, result.min,
+                 ( i + 1 < g_results.size() ) ? "," : "" );
+    }
+
+    fprintf( fp, "  ]\n}\n" );
+
+    if ( fp != stdout )
+        fclose( fp );
+    return true;
+}
+
+static void bench_flush_log()
+{
+    logf_update();
+
+    for ( const char *str : logf_get() )
+        fprintf( stderr, "%s\n", str );
+    logf_clear();
+}
+
+static void bench_usage( const char *argv0 )
+{
+    fprintf( stderr,
+             "Usage: %s [options]\n"
+             "  --trace file       Benchmark an existing trace instead of a synthetic one\n"
+             "  --write file       Write the synthetic trace to file and keep it\n"
+             "  --output file      Write json results to file instead of stdout\n"
+             "  --cpus N           Synthetic trace cpus (8)\n"
+             "  --seconds S        Synthetic trace length (2.0)\n"
+             "  --rate N           sched_switch events per second (500000)\n"
+             "  --job-rate N       amdgpu jobs per second on each timeline (2000)\n"
+             "  --timelines N      amdgpu timelines: gfx, sdma0, sdma1, comp_1.0.0... (3)\n"
+             "  --print-rate N     ftrace print events per second (20000)\n"
+             "  --instances N      Extra buffer instances (0)\n"
+             "  --seed N           Random seed (1)\n"
+             "  --iterations N     Runs of each benchmark (3)\n"
+             "  --frames N         Frames rendered for each graph row type (20)\n",
+             argv0 );
+}
+
+int main( int argc, char **argv )
+{
+    static struct option long_opts[] =
+    {
+        { "trace", ya_required_argument, 0, 0 },
+        { "write", ya_required_argument, 0, 0 },
+        { "output", ya_required_argument, 0, 0 },
+        { "cpus", ya_required_argument, 0, 0 },
+        { "seconds", ya_required_argument, 0, 0 },
+        { "rate", ya_required_argument, 0, 0 },
+        { "job-rate", ya_required_argument, 0, 0 },
+        { "timelines", ya_required_argument, 0, 0 },
+        { "print-rate", ya_required_argument, 0, 0 },
+        { "instances", ya_required_argument, 0, 0 },
+        { "seed", ya_required_argument, 0, 0 },
+        { "iterations", ya_required_argument, 0, 0 },
+        { "frames", ya_required_argument, 0, 0 },
+        { "help", ya_no_argument, 0, 'h' },
+        { 0, 0, 0, 0 }
+    };
+    bench_opts_t opts;
+
+    int c;
+    int opt_ind = 0;
+    while ( ( c = ya_getopt_long( argc, argv, "h", long_opts, &opt_ind ) ) != -1 )
+    {
+        if ( c != 0 )
+        {
+            bench_usage( argv[ 0 ] );
+            return ( c == 'h' ) ? 0 : -1;
+        }
+
+        const char *name = long_opts[ opt_ind ].name;
+        uint32_t val = strtoul( ya_optarg, NULL, 0 );
+
+        if ( !strcmp( name, "trace" ) )
+            opts.trace = ya_optarg;
+        else if ( !strcmp( name, "write" ) )
+            opts.write = ya_optarg;
+        else if ( !strcmp( name, "output" ) )
+            opts.output = ya_optarg;
+        else if ( !strcmp( name, "cpus" ) )
+            opts.cpus = Clamp< uint32_t >( val, 1, 256 );
+        else if ( !strcmp( name, "seconds" ) )
+            opts.seconds = std::max< float >( atof( ya_optarg ), 0.001f );
+        else if ( !strcmp( name, "rate" ) )
+            opts.rate = val;
+        else if ( !strcmp( name, "job-rate" ) )
+            opts.job_rate = val;
+        else if ( !strcmp( name, "timelines" ) )
+            opts.timelines = Clamp< uint32_t >( val, 0, 16 );
+        else if ( !strcmp( name, "print-rate" ) )
+            opts.print_rate = val;
+        else if ( !strcmp( name, "instances" ) )
+            opts.instances = Clamp< uint32_t >( val, 0, 16 );
+        else if ( !strcmp( name, "seed" ) )
+            opts.seed = val;
+        else if ( !strcmp( name, "iterations" ) )
+            opts.iterations = std::max< uint32_t >( val, 1 );
+        else if ( !strcmp( name, "frames" ) )
+            opts.frames = std::max< uint32_t >( val, 1 );
+    }
+
+    logf_init();
+    s_clrs().init();
+    s_opts().init();
+
+    std::string filename = opts.trace;
+    bool remove_trace = false;
+
+    if ( filename.empty() )
+    {
+        const char *tmpdir = getenv( "TMPDIR" );
+
+        filename = !opts.write.empty() ? opts.write :
+                string_format( "%s/gpuvis_bench_%d.dat", tmpdir ? tmpdir : "/tmp", ( int )getpid() );
+        remove_trace = opts.write.empty();
+
+        fprintf( stderr, "Writing synthetic trace %s...\n", filename.c_str() );
+
+        size_t count = 0;
+        bench_add( "synth_write_trace", "ms", bench_time( 1, [&]()
+        {
+            count = synth_write_trace( opts, filename.c_str() );
+        } ) );
+
+        if ( !count )
+        {
+            bench_flush_log();
+            return -1;
+        }
+    }
+
+    size_t filesize = get_file_size( filename.c_str() );
+    TraceLoader loader;
+    TraceEvents *trace_events = bench_load( loader, opts, filename, filesize );
+
+    bench_flush_log();
+
+    if ( !trace_events )
+    {
+        fprintf( stderr, "[Error] %s: no events loaded from %s\n", __func__, filename.c_str() );
+        return -1;
+    }
+
+    bench_post_load( *trace_events );
+    bench_filters( *trace_events, opts );
+    bench_plot( *trace_events, opts );
+    bench_ts_to_eventid( *trace_events, opts );
+
+    // Graph rows pick up plots from the ini file
+    s_ini().PutStr( s_bench_plot_name,
+                    string_format( "%s\t%s", s_bench_plot_filter, s_bench_plot_scanf ).c_str(),
+                    "$graph_plots$" );
+
+    bench_render( loader, *trace_events, opts );
+    bench_add( "peak_rss", "MB", bench_peak_rss_mb() );
+
+    bench_flush_log();
+
+    bool ret = bench_write_json( opts, filename, filesize, trace_events->m_events.size() );
+
+    delete trace_events;
+    if ( remove_trace )
+        remove( filename.c_str() );
+
+    logf_shutdown();
+    return ret ? 0 : -1;
+}
@@ -0,0 +1,590 @@
+/*
+ * Copyright 2017 Valve Software
+ *
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <set>
+#include <unordered_map>
+#include <list>
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <mutex>
+
+#include <SDL.h>
+
+#include "imgui/imgui.h"
+
+#include "gpuvis_macros.h"
+#include "stlini.h"
+#include "trace-cmd/trace-read.h"
+#include "gpuvis_utils.h"
+#include "gpuvis.h"
+
+/*
+ * Trace event cache file.
+ *
+ * Saved next to the trace file as "trace.dat.gpuviscache" after the trace is
+ * read, and used instead of parsing the trace when its key (trace file size,
+ * mtime and hash of the first 64k) still matches. Layout:
+ *
+ *   cache_header_t
+ *   info:      trace_info_t, m_ts_min, m_cpucount
+ *   events:    cache_event_t[ event_count ]
+ *   fields:    cache_field_t[ field_count ]
+ *   strings:   string_count nul terminated strings
+ *   locations: tdopexpr, comm, timeline TraceLocations
+ *
+ * Sections start on 8 byte boundaries at the header offsets, so the events
+ * and fields arrays are read in place from the mapped file. String pointers
+ * are stored as indices into the strings section.
+ */
+static const char s_cache_magic[ 8 ] = "GPUVISC";
+static const uint32_t s_cache_version = 4;
+static const size_t s_cache_hash_size = 64 * 1024;
+
+struct cache_header_t
+{
+    char magic[ 8 ];
+    uint32_t version;
+    uint32_t header_size;
+
+    // Trace file key
+    uint64_t trace_size;
+    int64_t trace_mtime;
+    uint32_t trace_hash;
+
+    uint32_t event_count;
+    uint64_t field_count;
+    uint64_t string_count;
+
+    uint64_t info_offset;
+    uint64_t events_offset;
+    uint64_t fields_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t locations_offset;
+};
+
+struct cache_event_t
+{
+    int64_t ts;
+    int32_t pid;
+    int32_t crtc;
+
+    uint32_t id;
+    uint32_t cpu;
+    uint32_t flags;
+    uint32_t context;
+    uint32_t seqno;
+    uint32_t id_start;
+    uint32_t graph_row_id;
+    uint32_t duration;
+    uint32_t color;
+
+    uint32_t comm;
+    uint32_t system;
+    uint32_t name;
+    uint32_t timeline;
+    uint32_t user_comm;
+
+    uint32_t numfields;
+    uint32_t pad;
+};
+
+struct cache_field_t
+{
+    uint32_t key;
+    uint32_t value;
+};
+
+// Get the key we use to check a cache file is still valid for a trace file
+static bool cache_get_trace_key( const char *tracefile, cache_header_t &header )
+{
+    struct stat st;
+    std::vector< char > buf( s_cache_hash_size );
+
+    if ( stat( tracefile, &st ) )
+        return false;
+
+    FILE *fp = fopen( tracefile, "rb" );
+    if ( !fp )
+        return false;
+
+    size_t len = fread( &buf[ 0 ], 1, buf.size(), fp );
+    fclose( fp );
+
+    header.trace_size = st.st_size;
+    header.trace_mtime = ( int64_t )st.st_mtim.tv_sec * NSECS_PER_SEC + st.st_mtim.tv_nsec;
+    header.trace_hash = fnv_hashbuf32( &buf[ 0 ], len );
+    return true;
+}
+
+struct cache_writer_t
+{
+    FILE *fp = nullptr;
+    uint64_t offset = 0;
+    bool error = false;
+
+    void write( const void *data, size_t size )
+    {
+        if ( size && ( fwrite( data, size, 1, fp ) != 1 ) )
+            error = true;
+        offset += size;
+    }
+
+    template < typename T >
+    void write_val( const T &val )
+    {
+        write( &val, sizeof( T ) );
+    }
+
+    void write_str( const std::string &str )
+    {
+        write_val< uint32_t >( str.size() );
+        write( str.c_str(), str.size() );
+    }
+
+    void write_locations( TraceLocations &locations )
+    {
+        write_val< uint64_t >( locations.m_locs.m_map.size() );
+
+        for ( const auto &item : locations.m_locs.m_map )
+        {
+            write_val< uint32_t >( item.first );
+            write_val< uint32_t >( item.second.size() );
+            write( item.second.data(), item.second.size() * sizeof( uint32_t ) );
+        }
+    }
+
+    // Pad to the next 8 byte boundary and return the offset
+    uint64_t align()
+    {
+        static const char s_zeros[ 8 ] = { 0 };
+
+        write( s_zeros, ( 8 - ( offset & 7 ) ) & 7 );
+        return offset;
+    }
+};
+
+struct cache_reader_t
+{
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+    size_t offset = 0;
+    bool error = false;
+
+    void seek( uint64_t pos )
+    {
+        if ( pos > size )
+            error = true;
+        else
+            offset = pos;
+    }
+
+    const void *read( uint64_t len )
+    {
+        if ( error || ( len > size - offset ) )
+        {
+            error = true;
+            return NULL;
+        }
+
+        const void *ptr = data + offset;
+        offset += len;
+        return ptr;
+    }
+
+    template < typename T >
+    T read_val()
+    {
+        T val = T();
+        const void *ptr = read( sizeof( T ) );
+
+        if ( ptr )
+            memcpy( &val, ptr, sizeof( T ) );
+        return val;
+    }
+
+    std::string read_str()
+    {
+        uint32_t len = read_val< uint32_t >();
+        const char *str = ( const char * )read( len );
+
+        return str ? std::string( str, len ) : std::string();
+    }
+
+    // Read location map, checking all ids are below id_max
+    void read_locations( TraceLocations &locations, uint32_t id_max )
+    {
+        uint64_t count = read_val< uint64_t >();
+
+        for ( uint64_t i = 0; ( i < count ) && !error; i++ )
+        {
+            uint32_t hashval = read_val< uint32_t >();
+            uint32_t len = read_val< uint32_t >();
+            const uint32_t *ids = ( const uint32_t * )read( ( uint64_t )len * sizeof( uint32_t ) );
+
+            if ( ids )
+            {
+                std::vector< uint32_t > locs( ids, ids + len );
+
+                for ( uint32_t id : locs )
+                    error |= ( id >= id_max );
+
+                locations.set_locations_u32( hashval, locs );
+            }
+        }
+    }
+};
+
+bool TraceEvents::cache_save( const char *cachefile, const char *tracefile )
+{
+    cache_header_t header;
+    cache_writer_t writer;
+    std::unordered_map< const char *, uint32_t > str_ids;
+    std::string tmpfile = std::string( cachefile ) + ".tmp";
+
+    memset( &header, 0, sizeof( header ) );
+    if ( !cache_get_trace_key( tracefile, header ) )
+        return false;
+
+    writer.fp = fopen( tmpfile.c_str(), "wb" );
+    if ( !writer.fp )
+    {
+        logf( "[Error] %s: fopen(%s) failed: %s", __func__, tmpfile.c_str(), strerror( errno ) );
+        return false;
+    }
+
+    // Map string pointers to strpool ids. Strings not in the pool
+    //  (string literals from the reader) are added to it.
+    auto get_str_id = [&]( const char *str )
+    {
+        if ( !str )
+            return INVALID_ID;
+
+        auto it = str_ids.find( str );
+        if ( it != str_ids.end() )
+            return it->second;
+
+        uint32_t id;
+        m_strpool.getstr( str, ( size_t )-1, &id );
+        str_ids[ str ] = id;
+        return id;
+    };
+
+    // Header gets rewritten with section offsets when we're done
+    writer.write_val( header );
+
+    header.info_offset = writer.align();
+    writer.write_val< uint32_t >( m_trace_info.cpus );
+    writer.write_val< uint32_t >( m_trace_info.timestamp_in_us );
+    writer.write_str( m_trace_info.file );
+    writer.write_str( m_trace_info.uname );
+    writer.write_val< uint32_t >( m_trace_info.cpustats.size() );
+    for ( const std::string &str : m_trace_info.cpustats )
+        writer.write_str( str );
+    writer.write_val< int64_t >( m_ts_min );
+    writer.write_val< uint32_t >( m_cpucount.size() );
+    writer.write( m_cpucount.data(), m_cpucount.size() * sizeof( uint32_t ) );
+
+    header.events_offset = writer.align();
+    for ( const trace_event_t &event : m_events )
+    {
+        cache_event_t cevent;
+
+        memset( &cevent, 0, sizeof( cevent ) );
+        cevent.ts = event.ts;
+        cevent.pid = event.pid;
+        cevent.crtc = event.crtc;
+        cevent.id = event.id;
+        cevent.cpu = event.cpu;
+        cevent.flags = event.flags;
+        cevent.context = event.context;
+        cevent.seqno = event.seqno;
+        cevent.id_start = event.id_start;
+        cevent.graph_row_id = event.graph_row_id;
+        cevent.duration = event.duration;
+        cevent.color = event.color;
+        cevent.comm = event.comm_id;
+        cevent.system = get_str_id( event.system );
+        cevent.name = get_str_id( event.name );
+        cevent.timeline = get_str_id( event.timeline );
+        cevent.user_comm = event.user_comm_id;
+        cevent.numfields = event.numfields;
+
+        writer.write_val( cevent );
+        header.field_count += event.numfields;
+    }
+    header.event_count = m_events.size();
+
+    header.fields_offset = writer.align();
+    for ( const trace_event_t &event : m_events )
+    {
+        for ( uint32_t i = 0; i < event.numfields; i++ )
+        {
+            cache_field_t field;
+
+            field.key = get_str_id( event.fields[ i ].key );
+            field.value = get_str_id( event.get_field_value( i ) );
+            writer.write_val( field );
+        }
+    }
+
+    // Strings go last so ids we added above are included
+    header.strings_offset = writer.align();
+    header.string_count = m_strpool.count();
+    for ( uint32_t id = 0; id < header.string_count; id++ )
+    {
+        const char *str = m_strpool.idtostr( id );
+
+        writer.write( str, strlen( str ) + 1 );
+    }
+    header.strings_size = writer.offset - header.strings_offset;
+
+    header.locations_offset = writer.align();
+    writer.write_locations( m_tdopexpr_locations );
+    writer.write_locations( m_comm_locations );
+    writer.write_locations( m_timeline_locations );
+
+    memcpy( header.magic, s_cache_magic, sizeof( header.magic ) );
+    header.version = s_cache_version;
+    header.header_size = sizeof( header );
+
+    if ( !writer.error && fseek( writer.fp, 0, SEEK_SET ) )
+        writer.error = true;
+    writer.write_val( header );
+
+    if ( fclose( writer.fp ) )
+        writer.error = true;
+
+    // Only replace the cache file once it's been completely written
+    if ( writer.error || rename( tmpfile.c_str(), cachefile ) )
+    {
+        logf( "[Error] %s: writing %s failed: %s", __func__, cachefile, strerror( errno ) );
+
+        unlink( tmpfile.c_str() );
+        return false;
+    }
+
+    return true;
+}
+
+bool TraceEvents::cache_load( const char *cachefile, const char *tracefile )
+{
+    struct stat st;
+    cache_header_t key;
+    cache_reader_t reader;
+    std::vector< const char * > strs;
+    std::vector< uint32_t > str_ids;
+
+    int fd = open( cachefile, O_RDONLY );
+    if ( fd < 0 )
+        return false;
+
+    if ( fstat( fd, &st ) || ( ( size_t )st.st_size < sizeof( cache_header_t ) ) )
+    {
+        close( fd );
+        return false;
+    }
+
+    void *map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+
+    if ( map == MAP_FAILED )
+        return false;
+
+    madvise( map, st.st_size, MADV_SEQUENTIAL );
+
+    reader.data = ( const uint8_t * )map;
+    reader.size = st.st_size;
+
+    cache_header_t header = reader.read_val< cache_header_t >();
+
+    // Check cache file is ours and still matches the trace file
+    if ( memcmp( header.magic, s_cache_magic, sizeof( header.magic ) ) ||
+         ( header.version != s_cache_version ) ||
+         ( header.header_size != sizeof( header ) ) ||
+         !cache_get_trace_key( tracefile, key ) ||
+         ( header.trace_size != key.trace_size ) ||
+         ( header.trace_mtime != key.trace_mtime ) ||
+         ( header.trace_hash != key.trace_hash ) )
+    {
+        munmap( map, st.st_size );
+        return false;
+    }
+
+    // Strings
+    reader.seek( header.strings_offset );
+    const char *str = ( const char * )reader.read( header.strings_size );
+    const char *str_end = str + header.strings_size;
+
+    strs.reserve( header.string_count );
+    str_ids.reserve( header.string_count );
+    for ( uint64_t i = 0; str && ( i < header.string_count ); i++ )
+    {
+        const char *end = ( const char * )memchr( str, 0, str_end - str );
+
+        if ( !end )
+        {
+            reader.error = true;
+            break;
+        }
+
+        uint32_t id;
+
+        strs.push_back( m_strpool.getstr( str, end - str, &id ) );
+        str_ids.push_back( id );
+        str = end + 1;
+    }
+
+    auto get_str = [&]( uint32_t id )
+    {
+        if ( id == INVALID_ID )
+            return ( const char * )NULL;
+        if ( id >= strs.size() )
+        {
+            reader.error = true;
+            return "";
+        }
+        return strs[ id ];
+    };
+
+    // Comms are stored as strpool ids
+    auto get_comm_id = [&]( uint32_t id )
+    {
+        if ( id >= str_ids.size() )
+        {
+            reader.error = true;
+            return 0u;
+        }
+        return str_ids[ id ];
+    };
+
+    // Info
+    reader.seek( header.info_offset );
+    m_trace_info.cpus = reader.read_val< uint32_t >();
+    m_trace_info.timestamp_in_us = !!reader.read_val< uint32_t >();
+    m_trace_info.file = reader.read_str();
+    m_trace_info.uname = reader.read_str();
+    m_trace_info.cpustats.resize( reader.read_val< uint32_t >() );
+    for ( std::string &cpustat : m_trace_info.cpustats )
+        cpustat = reader.read_str();
+    m_ts_min = reader.read_val< int64_t >();
+    m_cpucount.resize( reader.read_val< uint32_t >() );
+    for ( uint32_t &count : m_cpucount )
+        count = reader.read_val< uint32_t >();
+
+    // Events and fields
+    reader.seek( header.events_offset );
+    const cache_event_t *cevents = ( const cache_event_t * )reader.read(
+                ( uint64_t )header.event_count * sizeof( cache_event_t ) );
+    reader.seek( header.fields_offset );
+    const cache_field_t *cfields = ( const cache_field_t * )reader.read(
+                header.field_count * sizeof( cache_field_t ) );
+
+    if ( !reader.error )
+    {
+        uint64_t field_index = 0;
+
+        m_events.resize( header.event_count );
+
+        for ( uint32_t i = 0; i < header.event_count; i++ )
+        {
+            const cache_event_t &cevent = cevents[ i ];
+            trace_event_t &event = m_events[ i ];
+
+            // Event ids are used as m_events indices all over
+            if ( ( cevent.id != i ) ||
+                 ( is_valid_id( cevent.id_start ) && ( cevent.id_start >= header.event_count ) ) ||
+                 ( cevent.numfields > header.field_count - field_index ) )
+            {
+                reader.error = true;
+                break;
+            }
+
+            event.is_filtered_out = false;
+            event.ts = cevent.ts;
+            event.pid = cevent.pid;
+            event.crtc = cevent.crtc;
+            event.id = cevent.id;
+            event.cpu = cevent.cpu;
+            event.flags = cevent.flags;
+            event.context = cevent.context;
+            event.seqno = cevent.seqno;
+            event.id_start = cevent.id_start;
+            event.graph_row_id = cevent.graph_row_id;
+            event.duration = cevent.duration;
+            event.color = cevent.color;
+            event.comm_id = get_comm_id( cevent.comm );
+            event.system = get_str( cevent.system );
+            event.name = get_str( cevent.name );
+            event.timeline = get_str( cevent.timeline );
+            event.user_comm_id = get_comm_id( cevent.user_comm );
+            event.raw = NULL;
+
+            event.numfields = cevent.numfields;
+            event.fields = m_fields_arena.alloc( event.numfields );
+            for ( uint32_t j = 0; j < event.numfields; j++ )
+            {
+                const cache_field_t &cfield = cfields[ field_index++ ];
+
+                event.fields[ j ].key = get_str( cfield.key );
+                event.fields[ j ].value.store( get_str( cfield.value ), std::memory_order_relaxed );
+            }
+        }
+    }
+
+    // Locations
+    reader.seek( header.locations_offset );
+    reader.read_locations( m_tdopexpr_locations, header.event_count );
+    reader.read_locations( m_comm_locations, header.event_count );
+    reader.read_locations( m_timeline_locations, header.event_count );
+
+    munmap( map, st.st_size );
+
+    if ( reader.error )
+    {
+        logf( "[Error] %s: %s is corrupt", __func__, cachefile );
+
+        m_events.clear();
+        m_cpucount.clear();
+        m_trace_info = trace_info_t();
+        m_tdopexpr_locations.m_locs.m_map.clear();
+        m_comm_locations.m_locs.m_map.clear();
+        m_timeline_locations.m_locs.m_map.clear();
+        return false;
+    }
+
+    // Gpu jobs are cheap to rebuild from the timeline events
+    init_gfxcontexts();
+    return true;
+}
@@ -62,6 +62,7 @@ _XTAG( col_Graph_BarHwQueue, 0x80613030, "Graph timeline hw queue bar" )
 _XTAG( col_Graph_BarHwRunning, 0xd9ffaa00, "Graph timeline hw running bar" )
 _XTAG( col_Graph_BarSelRect, 0xd9fff300, "Graph timeline selected bar rectangle" )
 _XTAG( col_Graph_BarText, IM_COL32( 0xff, 0xff, 0xff, 255 ), "Graph timeline bar text" )
+_XTAG( col_Graph_CpuBusy, 0xd960c060, "Graph cpu lane busy bar" )
 
 // ImGui colors
 _XTAG( col_ImGui_Text, 0xffe6e6e6, "ImGui text" )
@@ -0,0 +1,302 @@
+/*
+ * Copyright 2017 Valve Software
+ *
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdint.h>
+
+#include <vector>
+#include <functional>
+#include <chrono>
+
+#include <SDL.h>
+
+#include "imgui/imgui.h"
+#include "GL/gl3w.h"
+
+#include "gpuvis_macros.h"
+#include "stlini.h"
+#include "gpuvis_utils.h"
+
+/*
+ * Instanced graph rectangles.
+ *
+ * Each GLRectBatch owns a vertex buffer with one rect_t per instance. The
+ * vertex shader expands every instance into a 4 vertex triangle strip and
+ * adds the batch offset, so a batch is uploaded once and can then be drawn
+ * at any position with a single glDrawArraysInstanced call. Draws are
+ * queued with ImDrawList::AddCallback so they land in the right spot of the
+ * ImGui draw order and clip rect.
+ */
+struct glrects_draw_t
+{
+    GLuint vao;
+    GLsizei count;
+    float x;
+    float y;
+    float alpha;
+};
+
+static bool g_glrects_inited = false;
+static GLuint g_glrects_program = 0;
+static GLint g_glrects_loc_projmtx = -1;
+static GLint g_glrects_loc_offset = -1;
+static GLint g_glrects_loc_alpha = -1;
+static GLint g_glrects_loc_rect = -1;
+static GLint g_glrects_loc_color = -1;
+
+// Draws queued this frame. ImDrawCmd::UserCallbackData is an index into this.
+static std::vector< glrects_draw_t > g_glrects_draws;
+
+// GL objects of destroyed batches. The current frame's draw lists can still
+//  reference them, so they're deleted at the start of the next frame.
+static std::vector< GLuint > g_glrects_dead_vaos;
+static std::vector< GLuint > g_glrects_dead_vbos;
+
+static GLuint glrects_compile_shader( GLenum type, const GLchar *src )
+{
+    GLint status = 0;
+    GLuint shader = glCreateShader( type );
+
+    glShaderSource( shader, 1, &src, NULL );
+    glCompileShader( shader );
+    glGetShaderiv( shader, GL_COMPILE_STATUS, &status );
+
+    if ( !status )
+    {
+        char log[ 512 ];
+
+        glGetShaderInfoLog( shader, sizeof( log ), NULL, log );
+        logf( "[Error] %s: %s", __func__, log );
+
+        glDeleteShader( shader );
+        return 0;
+    }
+
+    return shader;
+}
+
+bool GLRectBatch::init()
+{
+    const GLchar *vertex_shader =
+        "#version 330\n"
+        "uniform mat4 ProjMtx;\n"
+        "uniform vec2 Offset;\n"
+        "uniform float Alpha;\n"
+        "in vec4 Rect;\n"
+        "in vec4 Color;\n"
+        "out vec4 Frag_Color;\n"
+        "void main()\n"
+        "{\n"
+        "    vec2 corner = vec2( gl_VertexID & 1, gl_VertexID >> 1 );\n"
+        "    vec2 pos = Offset + Rect.xy + corner * Rect.zw;\n"
+        "    Frag_Color = vec4( Color.rgb, Color.a * Alpha );\n"
+        "    gl_Position = ProjMtx * vec4( pos, 0, 1 );\n"
+        "}\n";
+
+    const GLchar *fragment_shader =
+        "#version 330\n"
+        "in vec4 Frag_Color;\n"
+        "out vec4 Out_Color;\n"
+        "void main()\n"
+        "{\n"
+        "    Out_Color = Frag_Color;\n"
+        "}\n";
+
+    // glVertexAttribDivisor is GL 3.3, and we ask for a 3.2 context.
+    if ( !glVertexAttribDivisor || !glDrawArraysInstanced )
+    {
+        logf( "[Error] %s: GL instancing not supported", __func__ );
+        return false;
+    }
+
+    GLuint vert = glrects_compile_shader( GL_VERTEX_SHADER, vertex_shader );
+    GLuint frag = glrects_compile_shader( GL_FRAGMENT_SHADER, fragment_shader );
+
+    if ( vert && frag )
+    {
+        GLint status = 0;
+
+        g_glrects_program = glCreateProgram();
+        glAttachShader( g_glrects_program, vert );
+        glAttachShader( g_glrects_program, frag );
+        glLinkProgram( g_glrects_program );
+        glGetProgramiv( g_glrects_program, GL_LINK_STATUS, &status );
+
+        if ( !status )
+        {
+            logf( "[Error] %s: glLinkProgram failed", __func__ );
+
+            glDeleteProgram( g_glrects_program );
+            g_glrects_program = 0;
+        }
+    }
+
+    if ( vert )
+        glDeleteShader( vert );
+    if ( frag )
+        glDeleteShader( frag );
+
+    if ( !g_glrects_program )
+        return false;
+
+    g_glrects_loc_projmtx = glGetUniformLocation( g_glrects_program, "ProjMtx" );
+    g_glrects_loc_offset = glGetUniformLocation( g_glrects_program, "Offset" );
+    g_glrects_loc_alpha = glGetUniformLocation( g_glrects_program, "Alpha" );
+    g_glrects_loc_rect = glGetAttribLocation( g_glrects_program, "Rect" );
+    g_glrects_loc_color = glGetAttribLocation( g_glrects_program, "Color" );
+
+    g_glrects_inited = true;
+    return true;
+}
+
+void GLRectBatch::shutdown()
+{
+    new_frame();
+
+    if ( g_glrects_program )
+        glDeleteProgram( g_glrects_program );
+
+    g_glrects_program = 0;
+    g_glrects_inited = false;
+}
+
+bool GLRectBatch::is_supported()
+{
+    return g_glrects_inited;
+}
+
+void GLRectBatch::new_frame()
+{
+    g_glrects_draws.clear();
+
+    if ( !g_glrects_dead_vaos.empty() )
+    {
+        glDeleteVertexArrays( g_glrects_dead_vaos.size(), g_glrects_dead_vaos.data() );
+        g_glrects_dead_vaos.clear();
+    }
+    if ( !g_glrects_dead_vbos.empty() )
+    {
+        glDeleteBuffers( g_glrects_dead_vbos.size(), g_glrects_dead_vbos.data() );
+        g_glrects_dead_vbos.clear();
+    }
+}
+
+GLRectBatch::~GLRectBatch()
+{
+    if ( m_vao )
+        g_glrects_dead_vaos.push_back( m_vao );
+    if ( m_vbo )
+        g_glrects_dead_vbos.push_back( m_vbo );
+}
+
+void GLRectBatch::clear()
+{
+    m_rects.clear();
+    m_dirty = true;
+}
+
+void GLRectBatch::add( float x, float y, float w, float h, ImU32 color )
+{
+    m_rects.push_back( { x, y, w, h, color } );
+    m_dirty = true;
+}
+
+static void glrects_draw_cb( const ImDrawList *parent_list, const ImDrawCmd *cmd )
+{
+    const glrects_draw_t &draw = g_glrects_draws[ ( size_t )( intptr_t )cmd->UserCallbackData ];
+    ImGuiIO &io = ImGui::GetIO();
+    int fb_height = ( int )( io.DisplaySize.y * io.DisplayFramebufferScale.y );
+    const float ortho_projection[ 4 ][ 4 ] =
+    {
+        { 2.0f / io.DisplaySize.x, 0.0f,                     0.0f, 0.0f },
+        { 0.0f,                    2.0f / -io.DisplaySize.y, 0.0f, 0.0f },
+        { 0.0f,                    0.0f,                    -1.0f, 0.0f },
+        { -1.0f,                   1.0f,                     0.0f, 1.0f },
+    };
+
+    // The ImGui renderer doesn't rebind its program or vertex array between
+    //  commands, so put them back when we're done.
+    GLint last_program;
+    GLint last_vertex_array;
+
+    glGetIntegerv( GL_CURRENT_PROGRAM, &last_program );
+    glGetIntegerv( GL_VERTEX_ARRAY_BINDING, &last_vertex_array );
+
+    glScissor( ( int )cmd->ClipRect.x, ( int )( fb_height - cmd->ClipRect.w ),
+               ( int )( cmd->ClipRect.z - cmd->ClipRect.x ), ( int )( cmd->ClipRect.w - cmd->ClipRect.y ) );
+
+    glUseProgram( g_glrects_program );
+    glUniformMatrix4fv( g_glrects_loc_projmtx, 1, GL_FALSE, &ortho_projection[ 0 ][ 0 ] );
+    glUniform2f( g_glrects_loc_offset, draw.x, draw.y );
+    glUniform1f( g_glrects_loc_alpha, draw.alpha );
+
+    glBindVertexArray( draw.vao );
+    glDrawArraysInstanced( GL_TRIANGLE_STRIP, 0, 4, draw.count );
+
+    glUseProgram( last_program );
+    glBindVertexArray( last_vertex_array );
+}
+
+bool GLRectBatch::draw( ImDrawList *draw_list, float x, float y, float alpha )
+{
+    if ( !g_glrects_inited )
+        return false;
+
+    if ( !m_vao )
+    {
+        glGenVertexArrays( 1, &m_vao );
+        glGenBuffers( 1, &m_vbo );
+
+        glBindVertexArray( m_vao );
+        glBindBuffer( GL_ARRAY_BUFFER, m_vbo );
+
+        glEnableVertexAttribArray( g_glrects_loc_rect );
+        glVertexAttribPointer( g_glrects_loc_rect, 4, GL_FLOAT, GL_FALSE,
+                               sizeof( rect_t ), ( GLvoid * )offsetof( rect_t, x ) );
+        glVertexAttribDivisor( g_glrects_loc_rect, 1 );
+
+        glEnableVertexAttribArray( g_glrects_loc_color );
+        glVertexAttribPointer( g_glrects_loc_color, 4, GL_UNSIGNED_BYTE, GL_TRUE,
+                               sizeof( rect_t ), ( GLvoid * )offsetof( rect_t, color ) );
+        glVertexAttribDivisor( g_glrects_loc_color, 1 );
+
+        glBindVertexArray( 0 );
+    }
+
+    if ( m_dirty )
+    {
+        glBindBuffer( GL_ARRAY_BUFFER, m_vbo );
+        glBufferData( GL_ARRAY_BUFFER, m_rects.size() * sizeof( rect_t ), m_rects.data(), GL_STATIC_DRAW );
+        glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+        m_count = m_rects.size();
+        m_dirty = false;
+    }
+
+    if ( m_count )
+    {
+        g_glrects_draws.push_back( { m_vao, ( GLsizei )m_count, x, y, alpha } );
+        draw_list->AddCallback( glrects_draw_cb, ( void * )( intptr_t )( g_glrects_draws.size() - 1 ) );
+    }
+
+    return true;
+}
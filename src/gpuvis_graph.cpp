@@ -23,6 +23,7 @@
  */
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 
 #include <algorithm>
 #include <future>
@@ -30,16 +31,21 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unordered_map>
+#include <list>
 #include <vector>
 #include <array>
 #include <limits.h>
 #include <functional>
+#include <atomic>
+#include <mutex>
+#include <thread>
 
 #include <SDL.h>
 
 #include "imgui/imgui.h"
 
 #include "gpuvis_macros.h"
+#include "gpuvis_prof.h"
 #include "stlini.h"
 #include "trace-cmd/trace-read.h"
 #include "gpuvis_utils.h"
@@ -119,10 +125,15 @@ public:
     event_renderer_t( float y_in, float w_in, float h_in );
 
     void add_event( float x );
+    // Add count events which are all within a pixel of each other
+    void add_events( float xfirst, float xlast, uint32_t count );
     void done();
 
     void set_y( float y_in, float h_in );
 
+    // Draw group of num_events events from xfirst to xlast
+    void draw_group( float xfirst, float xlast, uint32_t count );
+
 protected:
     void start( float x );
     void draw();
@@ -132,26 +143,11 @@ public:
     uint32_t num_events;
 
     float y, w, h;
-};
-
-typedef std::function< uint32_t ( class graph_info_t &gi ) > RenderGraphRowCallback;
-
-struct row_info_t
-{
-    uint32_t id;
-    std::string row_name;
-
-    uint32_t num_events = 0;
-    float minval = FLT_MAX;
-    float maxval = FLT_MIN;
-
-    float row_y;
-    float row_h;
-
-    TraceEvents::loc_type_t row_type;
-    const std::vector< uint32_t > *plocs;
 
-    RenderGraphRowCallback render_cb;
+    // If set, rects are added here instead of the window draw list
+    GLRectBatch *batch = nullptr;
+    // If set, groups are saved here instead of drawn
+    std::vector< graph_row_geom_t::group_t > *groups = nullptr;
 };
 
 class graph_info_t
@@ -202,6 +198,10 @@ public:
     // Id of hovered / selected fence signaled event
     uint32_t hovered_fence_signaled = INVALID_ID;
 
+    // Cpu lane run under the mouse
+    const CpuRunIndex::run_t *hovered_cpu_run = nullptr;
+    const char *hovered_cpu_row = nullptr;
+
     bool timeline_render_user;
     bool graph_only_filtered;
 
@@ -246,10 +246,10 @@ static void imgui_draw_text( float x, float y, const char *text, ImU32 color, bo
 
 const char *get_event_field_val( const trace_event_t &event, const char *name )
 {
-    for ( const event_field_t &field : event.fields )
+    for ( uint32_t i = 0; i < event.numfields; i++ )
     {
-        if ( !strcmp( field.key, name ) )
-            return field.value;
+        if ( !strcmp( event.fields[ i ].key, name ) )
+            return event.get_field_value( i );
     }
 
     return "";
@@ -301,6 +301,18 @@ void event_renderer_t::add_event( float x )
     }
 }
 
+void event_renderer_t::add_events( float xfirst, float xlast, uint32_t count )
+{
+    // Same as count add_event() calls since each event would join the group.
+    add_event( xfirst );
+
+    if ( count > 1 )
+    {
+        x1 = xlast;
+        num_events += count - 1;
+    }
+}
+
 void event_renderer_t::done()
 {
     if ( x0 != -1 )
@@ -319,12 +331,23 @@ void event_renderer_t::start( float x )
 
 void event_renderer_t::draw()
 {
-    int index = std::min< int >( col_Graph_1Event + num_events, col_Graph_6Event );
+    if ( groups )
+        groups->push_back( { x0, x1, num_events } );
+    else
+        draw_group( x0, x1, num_events );
+}
+
+void event_renderer_t::draw_group( float xfirst, float xlast, uint32_t count )
+{
+    int index = std::min< int >( col_Graph_1Event + count, col_Graph_6Event );
     ImU32 color = s_clrs().get( index );
-    float min_width = std::min< float >( num_events + 1.0f, 4.0f );
-    float width = std::max< float >( x1 - x0, min_width );
+    float min_width = std::min< float >( count + 1.0f, 4.0f );
+    float width = std::max< float >( xlast - xfirst, min_width );
 
-    imgui_drawrect( x0, width, y, h, color );
+    if ( batch )
+        batch->add( xfirst, y, width, h, color );
+    else
+        imgui_drawrect( xfirst, width, y, h, color );
 }
 
 static option_id_t get_comm_option_id( TraceLoader &loader, const std::string &row_name )
@@ -340,6 +363,264 @@ static option_id_t get_comm_option_id( TraceLoader &loader, const std::string &r
     return OPT_Invalid;
 }
 
+/*
+ * GraphLod
+ */
+void GraphLod::init( const std::vector< trace_event_t > &events, const std::vector< uint32_t > &locs )
+{
+    static const uint32_t s_shift_min = 10;
+    static const uint32_t s_shift_max = 40;
+    uint32_t shift = s_shift_min;
+    std::vector< bucket_t > buckets;
+
+    m_levels.clear();
+    m_locs_size = locs.size();
+    m_locs_front = locs.empty() ? INVALID_ID : locs.front();
+    m_locs_back = locs.empty() ? INVALID_ID : locs.back();
+
+    // Finest level comes straight from the events
+    for ( size_t idx = 0; idx < locs.size(); idx++ )
+    {
+        const trace_event_t &event = events[ locs[ idx ] ];
+        uint32_t crtcs = ( ( event.crtc >= 0 ) && ( event.crtc < 32 ) ) ? ( 1u << event.crtc ) : 0;
+
+        if ( buckets.empty() || ( ( buckets.back().ts_min >> shift ) != ( event.ts >> shift ) ) )
+            buckets.push_back( { event.ts, event.ts, ( uint32_t )idx, 0, 0 } );
+
+        bucket_t &bucket = buckets.back();
+
+        bucket.ts_max = event.ts;
+        bucket.count++;
+        bucket.crtcs |= crtcs;
+    }
+
+    for ( ;; )
+    {
+        // Only keep levels which save a decent amount of work over the events
+        if ( buckets.size() <= locs.size() / 2 )
+            m_levels.push_back( { shift, buckets } );
+
+        if ( ( buckets.size() <= 1 ) || ( shift >= s_shift_max ) )
+            break;
+
+        // Next level merges the buckets which now land in the same slot
+        std::vector< bucket_t > next;
+
+        shift++;
+        for ( const bucket_t &bucket : buckets )
+        {
+            if ( next.empty() || ( ( next.back().ts_min >> shift ) != ( bucket.ts_min >> shift ) ) )
+            {
+                next.push_back( bucket );
+            }
+            else
+            {
+                next.back().ts_max = bucket.ts_max;
+                next.back().count += bucket.count;
+                next.back().crtcs |= bucket.crtcs;
+            }
+        }
+
+        buckets.swap( next );
+    }
+}
+
+bool GraphLod::is_current( const std::vector< uint32_t > &locs ) const
+{
+    // Location arrays only get swapped out wholesale (filters, renames),
+    //  so checking the size and ends is enough.
+    return ( m_locs_size == locs.size() ) &&
+            ( m_locs_front == ( locs.empty() ? INVALID_ID : locs.front() ) ) &&
+            ( m_locs_back == ( locs.empty() ? INVALID_ID : locs.back() ) );
+}
+
+int GraphLod::find_level( int64_t ts_per_px ) const
+{
+    for ( int i = ( int )m_levels.size() - 1; i >= 0; i-- )
+    {
+        if ( ( ( int64_t )1 << m_levels[ i ].shift ) <= ts_per_px )
+            return i;
+    }
+
+    return -1;
+}
+
+GraphLod *TraceEvents::get_graph_lod( const std::vector< uint32_t > &locs )
+{
+    if ( locs.size() < GraphLod::s_min_events )
+        return NULL;
+
+    GraphLod &lod = m_graph_lods.m_map[ &locs ];
+
+    if ( !lod.is_current( locs ) )
+        lod.init( m_events, locs );
+
+    return lod.m_levels.empty() ? NULL : &lod;
+}
+
+/*
+ * TimelineIndex
+ */
+void TimelineIndex::init( const std::vector< trace_event_t > &events, const std::vector< uint32_t > &locs )
+{
+    m_jobs.clear();
+
+    for ( uint32_t idx : locs )
+    {
+        const trace_event_t &fence_signaled = events[ idx ];
+
+        if ( fence_signaled.is_fence_signaled() && is_valid_id( fence_signaled.id_start ) )
+        {
+            const trace_event_t &sched_run_job = events[ fence_signaled.id_start ];
+            const trace_event_t &cs_ioctl = is_valid_id( sched_run_job.id_start ) ?
+                        events[ sched_run_job.id_start ] : sched_run_job;
+
+            m_jobs.push_back( { cs_ioctl.ts, fence_signaled.ts, fence_signaled.ts, fence_signaled.id } );
+        }
+    }
+
+    std::stable_sort( m_jobs.begin(), m_jobs.end(),
+        []( const job_t &lhs, const job_t &rhs ) { return lhs.ts_start < rhs.ts_start; } );
+
+    init_ts_end_max( 0, m_jobs.size() );
+}
+
+int64_t TimelineIndex::init_ts_end_max( size_t lo, size_t hi )
+{
+    if ( lo >= hi )
+        return INT64_MIN;
+
+    size_t mid = lo + ( hi - lo ) / 2;
+    job_t &job = m_jobs[ mid ];
+
+    job.ts_end_max = std::max< int64_t >( job.ts_end,
+                        std::max< int64_t >( init_ts_end_max( lo, mid ), init_ts_end_max( mid + 1, hi ) ) );
+    return job.ts_end_max;
+}
+
+void TimelineIndex::find_jobs( int64_t ts0, int64_t ts1, std::vector< uint32_t > &ids ) const
+{
+    ids.clear();
+    find_jobs( 0, m_jobs.size(), ts0, ts1, ids );
+
+    // Callers draw in event order like the event lists
+    std::sort( ids.begin(), ids.end() );
+}
+
+void TimelineIndex::find_jobs( size_t lo, size_t hi, int64_t ts0, int64_t ts1, std::vector< uint32_t > &ids ) const
+{
+    if ( lo >= hi )
+        return;
+
+    size_t mid = lo + ( hi - lo ) / 2;
+    const job_t &job = m_jobs[ mid ];
+
+    // Everything in here finished before our range
+    if ( job.ts_end_max < ts0 )
+        return;
+
+    find_jobs( lo, mid, ts0, ts1, ids );
+
+    // This job and everything after it start after our range
+    if ( job.ts_start >= ts1 )
+        return;
+
+    if ( job.ts_end >= ts0 )
+        ids.push_back( job.fence_signaled );
+
+    find_jobs( mid + 1, hi, ts0, ts1, ids );
+}
+
+/*
+ * CpuRunIndex
+ */
+void CpuRunIndex::init( const std::vector< trace_event_t > &events, const std::vector< uint32_t > &locs,
+                        size_t cpu_count )
+{
+    // Task each cpu was switched to, when, and by which sched_switch
+    struct running_t
+    {
+        bool valid;
+        int pid;
+        int64_t ts;
+        uint32_t id;
+    };
+    std::vector< running_t > running( cpu_count, { false, 0, 0, INVALID_ID } );
+
+    m_lanes.clear();
+    m_lanes.resize( cpu_count );
+
+    if ( events.empty() )
+        return;
+
+    for ( uint32_t idx : locs )
+    {
+        const trace_event_t &event = events[ idx ];
+
+        if ( event.cpu >= cpu_count )
+            continue;
+
+        lane_t &lane = m_lanes[ event.cpu ];
+        running_t &cur = running[ event.cpu ];
+
+        // The event pid is the task being switched out. If this is the first
+        //  switch on the cpu, it's been running since the start of the trace.
+        if ( event.pid > 0 )
+        {
+            int64_t ts_start = cur.valid ? cur.ts : events.front().ts;
+
+            lane.runs.push_back( { ts_start, event.ts, event.pid, cur.id, event.id } );
+        }
+
+        lane.locs.push_back( event.id );
+
+        cur.valid = true;
+        cur.pid = atoi( get_event_field_val( event, "next_pid" ) );
+        cur.ts = event.ts;
+        cur.id = event.id;
+    }
+
+    for ( size_t cpu = 0; cpu < cpu_count; cpu++ )
+    {
+        lane_t &lane = m_lanes[ cpu ];
+        const running_t &cur = running[ cpu ];
+
+        // Still running when the trace ends
+        if ( cur.valid && ( cur.pid > 0 ) )
+            lane.runs.push_back( { cur.ts, events.back().ts, cur.pid, cur.id, INVALID_ID } );
+
+        lane.busy.resize( lane.runs.size() + 1 );
+        lane.busy[ 0 ] = 0;
+        for ( size_t i = 0; i < lane.runs.size(); i++ )
+            lane.busy[ i + 1 ] = lane.busy[ i ] + ( lane.runs[ i ].ts_end - lane.runs[ i ].ts_start );
+    }
+}
+
+size_t CpuRunIndex::find_run( const lane_t &lane, int64_t ts )
+{
+    auto it = std::upper_bound( lane.runs.begin(), lane.runs.end(), ts,
+        []( int64_t val, const run_t &run ) { return val < run.ts_end; } );
+
+    return it - lane.runs.begin();
+}
+
+int64_t CpuRunIndex::busy_before( const lane_t &lane, int64_t ts )
+{
+    size_t idx = find_run( lane, ts );
+    int64_t busy = lane.busy[ idx ];
+
+    // Add the part of a run straddling ts
+    if ( ( idx < lane.runs.size() ) && ( lane.runs[ idx ].ts_start < ts ) )
+        busy += ts - lane.runs[ idx ].ts_start;
+
+    return busy;
+}
+
+int64_t CpuRunIndex::busy_time( const lane_t &lane, int64_t ts0, int64_t ts1 )
+{
+    return ( ts1 > ts0 ) ? busy_before( lane, ts1 ) - busy_before( lane, ts0 ) : 0;
+}
+
 /*
  * graph_info_t
  */
@@ -354,10 +635,39 @@ void graph_info_t::init_row_info( TraceWin *win, const std::vector< GraphRows::g
     text_h = ImGui::GetTextLineHeightWithSpacing();
     row_h = text_h * 2 + graph_row_padding;
 
-    total_graph_height = graph_row_padding;
-
     imgui_pop_smallfont();
 
+    // Layout only depends on the rows, options, and font size
+    struct
+    {
+        uint32_t rows_generation;
+        uint32_t opts_generation;
+        size_t num_events;
+        float text_h;
+        float padding;
+    } key = { win->m_graph.rows.m_generation, s_opts().get_generation(),
+              win->m_trace_events.m_events.size(), text_h, graph_row_padding };
+    uint32_t hashval = fnv_hashbuf32( &key, sizeof( key ) );
+
+    // Borrow the cached layout. graph_render() hands it back when done.
+    row_info.swap( win->m_graph.row_info );
+
+    if ( hashval == win->m_graph.row_info_key )
+    {
+        for ( row_info_t &ri : row_info )
+        {
+            ri.num_events = 0;
+            ri.minval = FLT_MAX;
+            ri.maxval = FLT_MIN;
+        }
+
+        total_graph_height = win->m_graph.row_info_height;
+        return;
+    }
+
+    row_info.clear();
+    total_graph_height = graph_row_padding;
+
     for ( const GraphRows::graph_rows_info_t &grow : graph_rows )
     {
         row_info_t rinfo;
@@ -400,6 +710,11 @@ void graph_info_t::init_row_info( TraceWin *win, const std::vector< GraphRows::g
             rinfo.row_h = 2 * text_h;
             rinfo.render_cb = std::bind( &TraceWin::graph_render_hw_row_timeline, win, _1 );
         }
+        else if ( rinfo.row_type == TraceEvents::LOC_TYPE_Cpu )
+        {
+            rinfo.row_h = 2 * text_h;
+            rinfo.render_cb = std::bind( &TraceWin::graph_render_cpu_lane, win, _1 );
+        }
         else
         {
             // LOC_Type_Comm or LOC_TYPE_Tdopexpr hopefully
@@ -422,6 +737,9 @@ void graph_info_t::init_row_info( TraceWin *win, const std::vector< GraphRows::g
 
     total_graph_height += imgui_scale( 2.0f );
     total_graph_height = std::max< float >( total_graph_height, 4 * row_h );
+
+    win->m_graph.row_info_key = hashval;
+    win->m_graph.row_info_height = total_graph_height;
 }
 
 void graph_info_t::init( TraceWin *win, float x_in, float w_in )
@@ -459,11 +777,11 @@ void graph_info_t::init( TraceWin *win, float x_in, float w_in )
     if ( is_valid_id( event_hov ) && events[ event_hov ].is_timeline() )
     {
         // Find the fence signaled event for this timeline
-        std::string context = get_event_gfxcontext_str( events[ event_hov ] );
-        const std::vector< uint32_t > *plocs = win->m_trace_events.get_gfxcontext_locs( context.c_str() );
+        const TraceGfxContexts::job_t *job = win->m_trace_events.get_gfxcontext_job( events[ event_hov ] );
 
         // Mark it as hovered so it'll have a selection rectangle
-        hovered_fence_signaled = plocs->back();
+        if ( job )
+            hovered_fence_signaled = win->m_trace_events.m_gfxcontexts.get_last_id( *job );
     }
 }
 
@@ -567,6 +885,48 @@ bool graph_info_t::add_mouse_hovered_event( float xin, const trace_event_t &even
     return inserted;
 }
 
+// Query items [ idx0, idx1 ) sorted by get_ts( idx ) for the ones within hover
+//  distance of the mouse. Walks out from the mouse position in both directions
+//  until hovered_max items which try_add( idx ) accepts are found, so the cost
+//  doesn't depend on how many items are drawn.
+template < typename T_ts, typename T_add >
+static void hover_query( graph_info_t &gi, size_t idx0, size_t idx1, T_ts get_ts, T_add try_add )
+{
+    float hover_dx = imgui_scale( 8.0f );
+    int64_t ts = gi.screenx_to_ts( gi.mouse_pos.x );
+    int64_t ts_lo = gi.screenx_to_ts( gi.mouse_pos.x - hover_dx );
+    int64_t ts_hi = gi.screenx_to_ts( gi.mouse_pos.x + hover_dx );
+    size_t lo = idx0;
+    size_t hi = idx1;
+
+    // Find first item at or after ts
+    while ( lo < hi )
+    {
+        size_t mid = lo + ( hi - lo ) / 2;
+
+        if ( get_ts( mid ) < ts )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    size_t count = 0;
+    for ( size_t idx = lo; ( idx > idx0 ) && ( count < gi.hovered_max ); idx-- )
+    {
+        if ( get_ts( idx - 1 ) < ts_lo )
+            break;
+        count += try_add( idx - 1 );
+    }
+
+    count = 0;
+    for ( size_t idx = lo; ( idx < idx1 ) && ( count < gi.hovered_max ); idx++ )
+    {
+        if ( get_ts( idx ) > ts_hi )
+            break;
+        count += try_add( idx );
+    }
+}
+
 static size_t str_get_digit_loc( const char *str )
 {
     const char *buf = str;
@@ -773,6 +1133,9 @@ void CreatePlotDlg::add_plot( GraphRows &rows )
                 { TraceEvents::LOC_TYPE_Plot, m_plot->m_plotdata.size(), m_plot_name, false } );
     }
 
+    // Plot may have new locations even if its row was already there
+    rows.m_generation++;
+
     std::string val = string_format( "%s\t%s", m_plot->m_filter_str.c_str(), m_plot->m_scanf_str.c_str() );
     s_ini().PutStr( m_plot_name.c_str(), val.c_str(), "$graph_plots$" );
 }
@@ -781,8 +1144,35 @@ bool GraphPlot::init( TraceEvents &trace_events, const std::string &name,
                       const std::string &filter_str, const std::string scanf_str )
 {
     m_name = name;
+
+    for ( const auto &item : trace_events.m_graph_plots.m_map )
+    {
+        const GraphPlot &plot = item.second;
+
+        if ( ( plot.m_event_count == trace_events.m_events.size() ) &&
+             ( plot.m_rename_generation == trace_events.m_rename_generation ) &&
+             ( plot.m_filter_str == filter_str ) &&
+             ( plot.m_scanf_str == scanf_str ) )
+        {
+            if ( &plot != this )
+            {
+                m_plotdata = plot.m_plotdata;
+                m_levels = plot.m_levels;
+                m_minval = plot.m_minval;
+                m_maxval = plot.m_maxval;
+                m_filter_str = filter_str;
+                m_scanf_str = scanf_str;
+                m_event_count = plot.m_event_count;
+                m_rename_generation = plot.m_rename_generation;
+            }
+            return !m_plotdata.empty();
+        }
+    }
+
     m_filter_str = filter_str;
     m_scanf_str = scanf_str;
+    m_event_count = trace_events.m_events.size();
+    m_rename_generation = trace_events.m_rename_generation;
 
     m_minval = FLT_MAX;
     m_maxval = FLT_MIN;
@@ -790,49 +1180,171 @@ bool GraphPlot::init( TraceEvents &trace_events, const std::string &name,
 
     std::string errstr;
     const std::vector< uint32_t > *plocs = trace_events.get_tdopexpr_locs( m_filter_str.c_str(), &errstr );
+    bool is_duration = ( scanf_str == "$duration" );
+    ParsePlotStr parse_plot_str0;
 
-    if ( plocs )
+    if ( !plocs || ( !is_duration && !parse_plot_str0.init( m_scanf_str.c_str() ) ) )
+        return false;
+
+    static const size_t s_chunk_size = 16 * 1024;
+    const std::vector< uint32_t > &locs = *plocs;
+    size_t chunk_count = ( locs.size() + s_chunk_size - 1 ) / s_chunk_size;
+    size_t thread_count = trace_events.get_thread_count( chunk_count );
+    std::vector< std::vector< plotdata_t > > chunk_data( chunk_count );
+    std::vector< std::thread > threads;
+    std::atomic< size_t > next_chunk( 0 );
+
+    // Field keys are strpool strings so "buf" can be found by pointer
+    const char *buf_key = trace_events.m_strpool.getstr( "buf" );
+
+    // Each thread grabs the next chunk of locations until they're all gone
+    auto parse_func = [&]()
     {
-        if ( scanf_str == "$duration" )
+        ParsePlotStr parse_plot_str = parse_plot_str0;
+        uint32_t buf_slot = 0;
+
+        for ( ;; )
         {
-            for ( uint32_t idx : *plocs )
+            size_t chunk = next_chunk++;
+
+            if ( chunk >= chunk_count )
+                break;
+
+            size_t start = chunk * s_chunk_size;
+            size_t end = std::min< size_t >( start + s_chunk_size, locs.size() );
+            std::vector< plotdata_t > &data = chunk_data[ chunk ];
+
+            for ( size_t i = start; i < end; i++ )
             {
-                const trace_event_t &event = trace_events.m_events[ idx ];
+                const trace_event_t &event = trace_events.m_events[ locs[ i ] ];
+
+                if ( is_duration )
+                {
+                    float valf = event.duration * ( 1.0 / NSECS_PER_MSEC );
 
-                float valf = event.duration * ( 1.0 / NSECS_PER_MSEC );
+                    data.push_back( { event.ts, event.id, valf } );
+                    continue;
+                }
 
-                m_minval = std::min< float >( m_minval, valf );
-                m_maxval = std::max< float >( m_maxval, valf );
+                // Matching events are mostly the same format, so try the
+                //  slot buf was in last time first.
+                if ( ( buf_slot >= event.numfields ) || ( event.fields[ buf_slot ].key != buf_key ) )
+                {
+                    for ( buf_slot = 0; buf_slot < event.numfields; buf_slot++ )
+                    {
+                        if ( event.fields[ buf_slot ].key == buf_key )
+                            break;
+                    }
+                }
 
-                m_plotdata.push_back( { event.ts, event.id, valf } );
+                if ( ( buf_slot < event.numfields ) &&
+                     parse_plot_str.parse( event.get_field_value( buf_slot ) ) )
+                {
+                    data.push_back( { event.ts, event.id, parse_plot_str.m_valf } );
+                }
             }
         }
-        else
+    };
+
+    for ( size_t i = 1; i < thread_count; i++ )
+        threads.push_back( std::thread( parse_func ) );
+    parse_func();
+
+    for ( std::thread &thread : threads )
+        thread.join();
+
+    size_t count = 0;
+    for ( const std::vector< plotdata_t > &data : chunk_data )
+        count += data.size();
+
+    m_plotdata.reserve( count );
+    for ( const std::vector< plotdata_t > &data : chunk_data )
+    {
+        for ( const plotdata_t &plotdata : data )
         {
-            ParsePlotStr parse_plot_str;
+            m_minval = std::min< float >( m_minval, plotdata.valf );
+            m_maxval = std::max< float >( m_maxval, plotdata.valf );
+        }
 
-            if ( parse_plot_str.init( m_scanf_str.c_str() ) )
-            {
-                for ( uint32_t idx : *plocs )
-                {
-                    const trace_event_t &event = trace_events.m_events[ idx ];
-                    const char *buf = get_event_field_val( event, "buf" );
+        m_plotdata.insert( m_plotdata.end(), data.begin(), data.end() );
+    }
 
-                    if ( parse_plot_str.parse( buf ) )
-                    {
-                        float valf = parse_plot_str.m_valf;
+    init_levels();
+    return !m_plotdata.empty();
+}
 
-                        m_minval = std::min< float >( m_minval, valf );
-                        m_maxval = std::max< float >( m_maxval, valf );
+void GraphPlot::init_levels()
+{
+    static const uint32_t s_shift_min = 10;
+    static const uint32_t s_shift_max = 40;
+    uint32_t shift = s_shift_min;
+    std::vector< bucket_t > buckets;
 
-                        m_plotdata.push_back( { event.ts, event.id, valf } );
-                    }
-                }
+    m_levels.clear();
+    if ( m_plotdata.size() < s_min_values )
+        return;
+
+    // Finest level comes straight from the values
+    for ( uint32_t idx = 0; idx < m_plotdata.size(); idx++ )
+    {
+        const plotdata_t &data = m_plotdata[ idx ];
+
+        if ( buckets.empty() || ( ( m_plotdata[ buckets.back().idx ].ts >> shift ) != ( data.ts >> shift ) ) )
+            buckets.push_back( { idx, 0, idx, idx } );
+
+        bucket_t &bucket = buckets.back();
+
+        bucket.count++;
+        if ( data.valf < m_plotdata[ bucket.idx_min ].valf )
+            bucket.idx_min = idx;
+        if ( data.valf > m_plotdata[ bucket.idx_max ].valf )
+            bucket.idx_max = idx;
+    }
+
+    for ( ;; )
+    {
+        // Only keep levels which save a decent amount of work over the values
+        if ( buckets.size() <= m_plotdata.size() / 2 )
+            m_levels.push_back( { shift, buckets } );
+
+        if ( ( buckets.size() <= 1 ) || ( shift >= s_shift_max ) )
+            break;
+
+        // Next level merges the buckets which now land in the same slot
+        std::vector< bucket_t > next;
+
+        shift++;
+        for ( const bucket_t &bucket : buckets )
+        {
+            if ( next.empty() || ( ( m_plotdata[ next.back().idx ].ts >> shift ) != ( m_plotdata[ bucket.idx ].ts >> shift ) ) )
+            {
+                next.push_back( bucket );
+            }
+            else
+            {
+                bucket_t &merged = next.back();
+
+                merged.count += bucket.count;
+                if ( m_plotdata[ bucket.idx_min ].valf < m_plotdata[ merged.idx_min ].valf )
+                    merged.idx_min = bucket.idx_min;
+                if ( m_plotdata[ bucket.idx_max ].valf > m_plotdata[ merged.idx_max ].valf )
+                    merged.idx_max = bucket.idx_max;
             }
         }
+
+        buckets.swap( next );
     }
+}
 
-    return !m_plotdata.empty();
+int GraphPlot::find_level( int64_t ts_per_px ) const
+{
+    for ( int i = ( int )m_levels.size() - 1; i >= 0; i-- )
+    {
+        if ( ( ( int64_t )1 << m_levels[ i ].shift ) <= ts_per_px )
+            return i;
+    }
+
+    return -1;
 }
 
 uint32_t GraphPlot::find_ts_index( int64_t ts0 )
@@ -859,24 +1371,107 @@ bool ParsePlotStr::init( const char *scanf_str )
     {
         m_scanf_str = scanf_str;
         m_scanf_len = pct_f - scanf_str;
+
+        m_scanf_first[ 0 ] = tolower( ( unsigned char )scanf_str[ 0 ] );
+        m_scanf_first[ 1 ] = toupper( ( unsigned char )scanf_str[ 0 ] );
         return true;
     }
 
     return false;
 }
 
+// Locale independent strtof() for plain [-+]ddd.ddd[e[-+]dd] values. Anything
+//  else (hex, inf, nan, long mantissas) goes to strtof().
+static float plot_strtof( const char *str, char **endptr )
+{
+    static const double s_pow10[] =
+    {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *s = str;
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exp10 = 0;
+    bool neg = false;
+
+    while ( isspace( ( unsigned char )*s ) )
+        s++;
+
+    if ( ( *s == '-' ) || ( *s == '+' ) )
+        neg = ( *s++ == '-' );
+
+    for ( ; ( *s >= '0' ) && ( *s <= '9' ); s++, digits++ )
+        mantissa = mantissa * 10 + ( *s - '0' );
+
+    if ( *s == '.' )
+    {
+        for ( s++; ( *s >= '0' ) && ( *s <= '9' ); s++, digits++, exp10-- )
+            mantissa = mantissa * 10 + ( *s - '0' );
+    }
+
+    if ( !digits || ( digits > 15 ) || ( *s == 'x' ) || ( *s == 'X' ) )
+        return strtof( str, endptr );
+
+    if ( ( *s == 'e' ) || ( *s == 'E' ) )
+    {
+        const char *e = s + 1;
+        bool eneg = false;
+        int val = 0;
+
+        if ( ( *e == '-' ) || ( *e == '+' ) )
+            eneg = ( *e++ == '-' );
+
+        if ( ( *e >= '0' ) && ( *e <= '9' ) )
+        {
+            for ( ; ( *e >= '0' ) && ( *e <= '9' ) && ( val < 1000 ); e++ )
+                val = val * 10 + ( *e - '0' );
+
+            exp10 += eneg ? -val : val;
+            s = e;
+        }
+    }
+
+    // Mantissas under 10^15 and powers of ten up to 10^22 are exact doubles,
+    //  so one multiply or divide gives the correctly rounded double.
+    if ( ( exp10 < -22 ) || ( exp10 > 22 ) || ( ( *s >= '0' ) && ( *s <= '9' ) ) )
+        return strtof( str, endptr );
+
+    double val = ( exp10 < 0 ) ? ( mantissa / s_pow10[ -exp10 ] ) : ( mantissa * s_pow10[ exp10 ] );
+
+    *endptr = ( char * )s;
+    return ( float )( neg ? -val : val );
+}
+
 bool ParsePlotStr::parse( const char *buf )
 {
     if ( buf )
     {
-        const char *pat_start = strncasestr( buf, m_scanf_str, m_scanf_len );
+        const char *pat_start = NULL;
+
+        if ( !m_scanf_len )
+        {
+            pat_start = buf;
+        }
+        else
+        {
+            // strpbrk() to the first char then compare the rest
+            for ( const char *str = buf; ( str = strpbrk( str, m_scanf_first ) ); str++ )
+            {
+                if ( !strncasecmp( str + 1, m_scanf_str + 1, m_scanf_len - 1 ) )
+                {
+                    pat_start = str;
+                    break;
+                }
+            }
+        }
 
         if ( pat_start )
         {
             char *val_end;
             const char *val_start = pat_start + m_scanf_len;
 
-            m_valf = strtof( val_start, &val_end );
+            m_valf = plot_strtof( val_start, &val_end );
 
             if ( val_start != val_end )
             {
@@ -892,27 +1487,34 @@ bool ParsePlotStr::parse( const char *buf )
 
 uint32_t TraceWin::graph_render_plot( graph_info_t &gi )
 {
+    PROF_SCOPE( PROF_RenderPlot );
+
     float minval = FLT_MAX;
     float maxval = FLT_MIN;
-    std::vector< ImVec2 > points;
     const char *row_name = gi.prinfo_cur->row_name.c_str();
     GraphPlot &plot = m_trace_events.get_plot( row_name );
-    uint32_t index0 = plot.find_ts_index( gi.ts0 );
-    uint32_t index1 = plot.find_ts_index( gi.ts1 );
 
-    if ( index1 == ( uint32_t)-1 )
-        index1 = plot.m_plotdata.size();
+    // Rebuild plots made before a comm rename
+    if ( plot.m_rename_generation != m_trace_events.m_rename_generation )
+    {
+        std::string filter_str = plot.m_filter_str;
+        std::string scanf_str = plot.m_scanf_str;
+
+        plot.init( m_trace_events, plot.m_name, filter_str, scanf_str );
+    }
+
+    std::vector< ImVec2 > &points = plot.m_points;
+    uint32_t index0 = plot.find_ts_index( gi.ts0 );
+    int level = plot.find_level( gi.dx_to_ts( 1.0f ) );
 
-    points.reserve( index1 - index0 + 10 );
+    points.clear();
 
     uint32_t idx0 = gi.prinfo_cur->plocs->front();
     ImU32 color_line = m_trace_events.m_events[ idx0 ].color;
     ImU32 color_point = imgui_col_complement( color_line );
 
-    for ( size_t idx = index0; idx < plot.m_plotdata.size(); idx++ )
+    auto lambda_add_point = [&]( const GraphPlot::plotdata_t &data, float x )
     {
-        GraphPlot::plotdata_t &data = plot.m_plotdata[ idx ];
-        float x = gi.ts_to_screenx( data.ts );
         float y = data.valf;
 
         if ( x <= 0.0f )
@@ -925,13 +1527,64 @@ uint32_t TraceWin::graph_render_plot( graph_info_t &gi )
 
         minval = std::min< float >( minval, y );
         maxval = std::max< float >( maxval, y );
+    };
+
+    if ( level < 0 )
+    {
+        for ( size_t idx = index0; idx < plot.m_plotdata.size(); idx++ )
+        {
+            GraphPlot::plotdata_t &data = plot.m_plotdata[ idx ];
+            float x = gi.ts_to_screenx( data.ts );
 
-        // Check if we're mouse hovering this event
-        if ( gi.mouse_over )
-            gi.add_mouse_hovered_event( x, get_event( data.eventid ) );
+            lambda_add_point( data, x );
 
-        if ( x >= gi.x + gi.w )
-            break;
+            if ( x >= gi.x + gi.w )
+                break;
+        }
+    }
+    else
+    {
+        const std::vector< GraphPlot::bucket_t > &buckets = plot.m_levels[ level ].buckets;
+        auto it = std::upper_bound( buckets.begin(), buckets.end(), index0,
+            []( uint32_t idx, const GraphPlot::bucket_t &bucket ) { return idx < bucket.idx; } );
+
+        // index0 is -1 when every value is before ts0
+        if ( index0 == ( uint32_t )-1 )
+            it = buckets.end();
+        else if ( it != buckets.begin() )
+            it--;
+
+        // Buckets are at most a pixel wide, so their min and max values in
+        //  time order are all that would show.
+        for ( ; it != buckets.end(); it++ )
+        {
+            uint32_t idx_first = std::min< uint32_t >( it->idx_min, it->idx_max );
+            uint32_t idx_last = std::max< uint32_t >( it->idx_min, it->idx_max );
+            const GraphPlot::plotdata_t &data_first = plot.m_plotdata[ idx_first ];
+            const GraphPlot::plotdata_t &data_last = plot.m_plotdata[ idx_last ];
+            float x_last = gi.ts_to_screenx( data_last.ts );
+
+            lambda_add_point( data_first, gi.ts_to_screenx( data_first.ts ) );
+            if ( idx_last != idx_first )
+                lambda_add_point( data_last, x_last );
+
+            if ( x_last >= gi.x + gi.w )
+                break;
+        }
+    }
+
+    // Check for hovered values around the mouse
+    if ( gi.mouse_over )
+    {
+        hover_query( gi, 0, plot.m_plotdata.size(),
+            [&]( size_t idx ) { return plot.m_plotdata[ idx ].ts; },
+            [&]( size_t idx )
+            {
+                const GraphPlot::plotdata_t &data = plot.m_plotdata[ idx ];
+
+                gi.add_mouse_hovered_event( gi.ts_to_screenx( data.ts ), get_event( data.eventid ) );
+                return true;
+            } );
     }
 
     if ( points.size() )
@@ -969,6 +1622,8 @@ uint32_t TraceWin::graph_render_plot( graph_info_t &gi )
 
 uint32_t TraceWin::graph_render_print_timeline( graph_info_t &gi )
 {
+    PROF_SCOPE( PROF_RenderPrintTimeline );
+
     imgui_push_smallfont();
 
     struct row_draw_info_t
@@ -1023,16 +1678,12 @@ uint32_t TraceWin::graph_render_print_timeline( graph_info_t &gi )
         // Otherwise draw a little tick for it
         imgui_drawrect( x, imgui_scale( 2.0f ), y, gi.text_h, event.color );
 
-        // Check if we're mouse hovering this event
-        if ( gi.mouse_over && gi.mouse_pos.y >= y && gi.mouse_pos.y <= y + gi.text_h )
-            gi.add_mouse_hovered_event( x, event );
-
         num_events++;
 
         if ( timeline_labels )
         {
             row_draw_info[ row_id ].x = x;
-            row_draw_info[ row_id ].print_info = m_trace_events.m_print_buf_info.get_val( event.id );
+            row_draw_info[ row_id ].print_info = m_trace_events.get_print_info( event.id );
             row_draw_info[ row_id ].event = &event;
         }
     }
@@ -1048,8 +1699,30 @@ uint32_t TraceWin::graph_render_print_timeline( graph_info_t &gi )
             float y = gi.y + row_id * gi.text_h;
             const trace_event_t *event = draw_info.event;
 
-            imgui_draw_text( x0, y + imgui_scale( 2.0f ), print_info->buf, event->color );
-        }
+            imgui_draw_text( x0, y + imgui_scale( 2.0f ), print_info->buf, event->color );
+        }
+    }
+
+    // Check for hovered events in the sub row the mouse is over
+    if ( gi.mouse_over )
+    {
+        hover_query( gi, 0, locs.size(),
+            [&]( size_t idx ) { return get_event( locs[ idx ] ).ts; },
+            [&]( size_t idx )
+            {
+                const trace_event_t &event = get_event( locs[ idx ] );
+                uint32_t row_id = event.graph_row_id ? ( event.graph_row_id % row_count + 1 ) : 0;
+                float y = gi.y + row_id * gi.text_h;
+
+                if ( ( gi.graph_only_filtered && event.is_filtered_out ) ||
+                     ( gi.mouse_pos.y < y ) || ( gi.mouse_pos.y > y + gi.text_h ) )
+                {
+                    return false;
+                }
+
+                gi.add_mouse_hovered_event( gi.ts_to_screenx( event.ts ), event );
+                return true;
+            } );
     }
 
     imgui_pop_smallfont();
@@ -1059,6 +1732,8 @@ uint32_t TraceWin::graph_render_print_timeline( graph_info_t &gi )
 
 uint32_t TraceWin::graph_render_hw_row_timeline( graph_info_t &gi )
 {
+    PROF_SCOPE( PROF_RenderRowHwTimeline );
+
     imgui_push_smallfont();
 
     float row_h = gi.h;
@@ -1069,17 +1744,20 @@ uint32_t TraceWin::graph_render_hw_row_timeline( graph_info_t &gi )
     ImU32 last_color = 0;
     float y = gi.y;
     bool draw_label = !ImGui::GetIO().KeyAlt;
-    const std::vector< uint32_t > &locs = *gi.prinfo_cur->plocs;
+    const std::string &row_name = gi.prinfo_cur->row_name;
+    const TimelineIndex *index = m_trace_events.get_timeline_index(
+                fnv_hashstr32( row_name.c_str(), row_name.size() - 3 ) );
 
-    for ( size_t idx = vec_find_eventid( locs, gi.eventstart );
-          idx < locs.size();
-          idx++ )
+    if ( index )
+        index->find_jobs( gi.ts0, gi.ts1, m_graph.timeline_ids );
+    else
+        m_graph.timeline_ids.clear();
+
+    for ( uint32_t id : m_graph.timeline_ids )
     {
-        const trace_event_t &fence_signaled = get_event( locs.at( idx ) );
+        const trace_event_t &fence_signaled = get_event( id );
 
-        if ( fence_signaled.is_fence_signaled() &&
-             is_valid_id( fence_signaled.id_start ) &&
-             ( fence_signaled.ts - fence_signaled.duration < gi.ts1 ) )
+        if ( fence_signaled.ts - fence_signaled.duration < gi.ts1 )
         {
             float x0 = gi.ts_to_screenx( fence_signaled.ts - fence_signaled.duration );
             float x1 = gi.ts_to_screenx( fence_signaled.ts );
@@ -1089,7 +1767,7 @@ uint32_t TraceWin::graph_render_hw_row_timeline( graph_info_t &gi )
             // Draw a label if we have room.
             if ( draw_label )
             {
-                const char *label = fence_signaled.user_comm;
+                const char *label = m_trace_events.comm_str( fence_signaled.user_comm_id );
                 ImVec2 size = ImGui::CalcTextSize( label );
 
                 if ( size.x + imgui_scale( 4 ) >= x1 - x0 )
@@ -1137,6 +1815,8 @@ uint32_t TraceWin::graph_render_hw_row_timeline( graph_info_t &gi )
 
 uint32_t TraceWin::graph_render_row_timeline( graph_info_t &gi )
 {
+    PROF_SCOPE( PROF_RenderRowTimeline );
+
     imgui_push_smallfont();
 
     ImRect hov_rect;
@@ -1145,107 +1825,101 @@ uint32_t TraceWin::graph_render_row_timeline( graph_info_t &gi )
     ImU32 col_userspace = s_clrs().get( col_Graph_BarUserspace );
     ImU32 col_hwqueue = s_clrs().get( col_Graph_BarHwQueue );
     ImU32 color_1event = s_clrs().get( col_Graph_1Event );
-    const std::vector< uint32_t > &locs = *gi.prinfo_cur->plocs;
 
     uint32_t timeline_row_count = gi.h / gi.text_h;
 
     bool render_timeline_events = s_opts().getb( OPT_TimelineEvents );
     bool render_timeline_labels = s_opts().getb( OPT_TimelineLabels ) && !ImGui::GetIO().KeyAlt;
+    const TimelineIndex *index = m_trace_events.get_timeline_index( fnv_hashstr32( gi.prinfo_cur->row_name.c_str() ) );
 
-    for ( size_t idx = vec_find_eventid( locs, gi.eventstart );
-          idx < locs.size();
-          idx++ )
+    // Jobs with any part in [ts0, ts1)
+    if ( index )
+        index->find_jobs( gi.ts0, gi.ts1, m_graph.timeline_ids );
+    else
+        m_graph.timeline_ids.clear();
+
+    for ( uint32_t id : m_graph.timeline_ids )
     {
-        const trace_event_t &fence_signaled = get_event( locs[ idx ] );
+        const trace_event_t &fence_signaled = get_event( id );
+        const trace_event_t &sched_run_job = get_event( fence_signaled.id_start );
+        const trace_event_t &cs_ioctl = is_valid_id( sched_run_job.id_start ) ?
+                    get_event( sched_run_job.id_start ) : sched_run_job;
+        bool hovered = false;
+        float y = gi.y + ( fence_signaled.graph_row_id % timeline_row_count ) * gi.text_h;
+
+        // amdgpu_cs_ioctl  amdgpu_sched_run_job   |   fence_signaled
+        //       |-----------------|---------------|--------|
+        //       |user-->          |hwqueue-->     |hw->    |
+        float x_user_start = gi.ts_to_screenx( cs_ioctl.ts );
+        float x_hwqueue_start = gi.ts_to_screenx( sched_run_job.ts );
+        float x_hwqueue_end = gi.ts_to_screenx( fence_signaled.ts - fence_signaled.duration );
+        float x_hw_end = gi.ts_to_screenx( fence_signaled.ts );
+        float xleft = gi.timeline_render_user ? x_user_start : x_hwqueue_start;
 
-        if ( fence_signaled.is_fence_signaled() &&
-             is_valid_id( fence_signaled.id_start ) )
+        // Check if this fence_signaled is selected / hovered
+        if ( ( gi.hovered_fence_signaled == fence_signaled.id ) ||
+            gi.mouse_pos_in_rect( xleft, x_hw_end - xleft, y, gi.text_h ) )
         {
-            const trace_event_t &sched_run_job = get_event( fence_signaled.id_start );
-            const trace_event_t &cs_ioctl = is_valid_id( sched_run_job.id_start ) ?
-                        get_event( sched_run_job.id_start ) : sched_run_job;
+            // Mouse is hovering over this fence_signaled.
+            hovered = true;
+            hov_rect = { x_user_start, y, x_hw_end, y + gi.text_h };
 
-            //$ TODO mikesart: can we bail out of this loop at some point if
-            //  our start times for all the graphs are > gi.ts1?
-            if ( cs_ioctl.ts < gi.ts1 )
-            {
-                bool hovered = false;
-                float y = gi.y + ( fence_signaled.graph_row_id % timeline_row_count ) * gi.text_h;
-
-                // amdgpu_cs_ioctl  amdgpu_sched_run_job   |   fence_signaled
-                //       |-----------------|---------------|--------|
-                //       |user-->          |hwqueue-->     |hw->    |
-                float x_user_start = gi.ts_to_screenx( cs_ioctl.ts );
-                float x_hwqueue_start = gi.ts_to_screenx( sched_run_job.ts );
-                float x_hwqueue_end = gi.ts_to_screenx( fence_signaled.ts - fence_signaled.duration );
-                float x_hw_end = gi.ts_to_screenx( fence_signaled.ts );
-                float xleft = gi.timeline_render_user ? x_user_start : x_hwqueue_start;
-
-                // Check if this fence_signaled is selected / hovered
-                if ( ( gi.hovered_fence_signaled == fence_signaled.id ) ||
-                    gi.mouse_pos_in_rect( xleft, x_hw_end - xleft, y, gi.text_h ) )
-                {
-                    // Mouse is hovering over this fence_signaled.
-                    hovered = true;
-                    hov_rect = { x_user_start, y, x_hw_end, y + gi.text_h };
+            if ( !is_valid_id( gi.hovered_fence_signaled ) )
+                gi.hovered_fence_signaled = fence_signaled.id;
+        }
 
-                    if ( !is_valid_id( gi.hovered_fence_signaled ) )
-                        gi.hovered_fence_signaled = fence_signaled.id;
-                }
+        // Draw user bar
+        if ( hovered || gi.timeline_render_user )
+            imgui_drawrect( x_user_start, x_hwqueue_start - x_user_start, y, gi.text_h, col_userspace );
 
-                // Draw user bar
-                if ( hovered || gi.timeline_render_user )
-                    imgui_drawrect( x_user_start, x_hwqueue_start - x_user_start, y, gi.text_h, col_userspace );
+        // Draw hw queue bar
+        if ( x_hwqueue_end != x_hwqueue_start )
+            imgui_drawrect( x_hwqueue_start, x_hwqueue_end - x_hwqueue_start, y, gi.text_h, col_hwqueue );
 
-                // Draw hw queue bar
-                if ( x_hwqueue_end != x_hwqueue_start )
-                    imgui_drawrect( x_hwqueue_start, x_hwqueue_end - x_hwqueue_start, y, gi.text_h, col_hwqueue );
+        // Draw hw running bar
+        imgui_drawrect( x_hwqueue_end, x_hw_end - x_hwqueue_end, y, gi.text_h, col_hwrunning );
 
-                // Draw hw running bar
-                imgui_drawrect( x_hwqueue_end, x_hw_end - x_hwqueue_end, y, gi.text_h, col_hwrunning );
+        if ( render_timeline_labels )
+        {
+            const char *user_comm = m_trace_events.comm_str( cs_ioctl.user_comm_id );
+            const ImVec2 size = ImGui::CalcTextSize( user_comm );
+            float x_text = std::max< float >( x_hwqueue_start, gi.x ) + imgui_scale( 2.0f );
 
-                if ( render_timeline_labels )
-                {
-                    const ImVec2 size = ImGui::CalcTextSize( cs_ioctl.user_comm );
-                    float x_text = std::max< float >( x_hwqueue_start, gi.x ) + imgui_scale( 2.0f );
+            if ( x_hw_end - x_text >= size.x )
+            {
+                ImGui::GetWindowDrawList()->AddText( ImVec2( x_text, y + imgui_scale( 1.0f ) ),
+                                                     s_clrs().get( col_Graph_BarText ), user_comm );
+            }
+        }
 
-                    if ( x_hw_end - x_text >= size.x )
-                    {
-                        ImGui::GetWindowDrawList()->AddText( ImVec2( x_text, y + imgui_scale( 1.0f ) ),
-                                                             s_clrs().get( col_Graph_BarText ), cs_ioctl.user_comm );
-                    }
-                }
+        if ( render_timeline_events )
+        {
+            if ( cs_ioctl.id != sched_run_job.id )
+            {
+                // Draw event line for start of user
+                imgui_drawrect( x_user_start, 1.0, y, gi.text_h, color_1event );
 
-                if ( render_timeline_events )
+                // Check if we're mouse hovering starting event
+                if ( gi.mouse_over && gi.mouse_pos.y >= y && gi.mouse_pos.y <= y + gi.text_h )
                 {
-                    if ( cs_ioctl.id != sched_run_job.id )
+                    // If we are hovering, and no selection bar is set, do it.
+                    if ( gi.add_mouse_hovered_event( x_user_start, cs_ioctl ) && ( hov_rect.Min.x == FLT_MAX ) )
                     {
-                        // Draw event line for start of user
-                        imgui_drawrect( x_user_start, 1.0, y, gi.text_h, color_1event );
-
-                        // Check if we're mouse hovering starting event
-                        if ( gi.mouse_over && gi.mouse_pos.y >= y && gi.mouse_pos.y <= y + gi.text_h )
-                        {
-                            // If we are hovering, and no selection bar is set, do it.
-                            if ( gi.add_mouse_hovered_event( x_user_start, cs_ioctl ) && ( hov_rect.Min.x == FLT_MAX ) )
-                            {
-                                hov_rect = { x_user_start, y, x_hw_end, y + gi.text_h };
+                        hov_rect = { x_user_start, y, x_hw_end, y + gi.text_h };
 
-                                // Draw user bar for hovered events if they weren't already drawn
-                                if ( !hovered && !gi.timeline_render_user )
-                                    imgui_drawrect( x_user_start, x_hwqueue_start - x_user_start, y, gi.text_h, col_userspace );
-                            }
-                        }
+                        // Draw user bar for hovered events if they weren't already drawn
+                        if ( !hovered && !gi.timeline_render_user )
+                            imgui_drawrect( x_user_start, x_hwqueue_start - x_user_start, y, gi.text_h, col_userspace );
                     }
-
-                    // Draw event line for hwqueue start and hw end
-                    imgui_drawrect( x_hwqueue_start, 1.0, y, gi.text_h, color_1event );
-                    imgui_drawrect( x_hw_end, 1.0, y, gi.text_h, color_1event );
                 }
-
-                num_events++;
             }
+
+            // Draw event line for hwqueue start and hw end
+            imgui_drawrect( x_hwqueue_start, 1.0, y, gi.text_h, color_1event );
+            imgui_drawrect( x_hw_end, 1.0, y, gi.text_h, color_1event );
         }
+
+        num_events++;
     }
 
     if ( hov_rect.Min.x < gi.x + gi.w )
@@ -1256,46 +1930,228 @@ uint32_t TraceWin::graph_render_row_timeline( graph_info_t &gi )
     return num_events;
 }
 
+// Call cb( ts_first, ts_last, count, crtcs ) for each lod bucket of events in locs[ idx0, idx1 )
+template < typename T >
+static void lod_for_each_bucket( TraceWin *win, const GraphLod::level_t &level,
+                                 const std::vector< uint32_t > &locs, size_t idx0, size_t idx1, T cb )
+{
+    const std::vector< GraphLod::bucket_t > &buckets = level.buckets;
+    auto it = std::upper_bound( buckets.begin(), buckets.end(), idx0,
+        []( size_t idx, const GraphLod::bucket_t &bucket ) { return idx < bucket.idx; } );
+
+    if ( it != buckets.begin() )
+        it--;
+
+    for ( ; ( it != buckets.end() ) && ( it->idx < idx1 ); it++ )
+    {
+        size_t start = std::max< size_t >( it->idx, idx0 );
+        size_t end = std::min< size_t >( it->idx + it->count, idx1 );
+
+        if ( start >= end )
+            continue;
+
+        // Buckets on the edges are clipped to the visible events
+        int64_t ts_first = ( start == it->idx ) ? it->ts_min : win->get_event( locs[ start ] ).ts;
+        int64_t ts_last = ( end == it->idx + it->count ) ? it->ts_max : win->get_event( locs[ end - 1 ] ).ts;
+
+        cb( ts_first, ts_last, ( uint32_t )( end - start ), it->crtcs );
+    }
+}
+
+static bool graph_event_hidden( TraceWin *win, graph_info_t &gi, uint32_t eventid )
+{
+    return gi.graph_only_filtered && win->get_event( eventid ).is_filtered_out;
+}
+
+// Check events around the mouse in locs[ idx0, idx1 ) for hovering
+static void locs_add_hovered_events( TraceWin *win, graph_info_t &gi,
+                                     const std::vector< uint32_t > &locs, size_t idx0, size_t idx1 )
+{
+    hover_query( gi, idx0, idx1,
+        [&]( size_t idx ) { return win->get_event( locs[ idx ] ).ts; },
+        [&]( size_t idx )
+        {
+            const trace_event_t &event = win->get_event( locs[ idx ] );
+
+            if ( graph_event_hidden( win, gi, event.id ) )
+                return false;
+
+            gi.add_mouse_hovered_event( gi.ts_to_screenx( event.ts ), event );
+            return true;
+        } );
+}
+
+static bool locs_has_eventid( const std::vector< uint32_t > &locs, size_t idx0, size_t idx1, uint32_t eventid )
+{
+    return is_valid_id( eventid ) &&
+            std::binary_search( locs.begin() + idx0, locs.begin() + idx1, eventid );
+}
+
+// Hash of what a row batch was built from besides the zoom and window
+static uint32_t graph_batch_key( const std::vector< uint32_t > &locs, int level,
+                                 colors_t col0, colors_t col1, uint32_t extra )
+{
+    uint32_t key[] =
+    {
+        ( uint32_t )( uintptr_t )&locs,
+        ( uint32_t )locs.size(),
+        locs.empty() ? INVALID_ID : locs.back(),
+        ( uint32_t )level,
+        extra,
+        0, 0, 0, 0, 0, 0
+    };
+
+    for ( colors_t col = col0; col <= col1; col++ )
+        key[ 5 + col - col0 ] = s_clrs().get( col );
+
+    return fnv_hashbuf32( key, sizeof( key ) );
+}
+
+// Return row batch for hashval if instancing is enabled, resetting it with a
+//  new window around the visible range if it can't be reused for this frame.
+static graph_batch_t *graph_get_batch( util_umap< uint32_t, graph_batch_t > &batches,
+                                       graph_info_t &gi, uint32_t hashval, uint32_t key, bool &rebuild )
+{
+    if ( !s_opts().getb( OPT_GraphInstancing ) || !GLRectBatch::is_supported() )
+        return NULL;
+
+    graph_batch_t &gb = batches.m_map[ hashval ];
+
+    rebuild = ( gb.key != key ) || ( gb.tsdx != gi.tsdx ) ||
+            ( gb.w != gi.w ) || ( gb.h != gi.h ) ||
+            ( gi.ts0 < gb.ts0 ) || ( gi.ts1 > gb.ts1 );
+    if ( rebuild )
+    {
+        // Cover a screen on either side so panning doesn't have to rebuild
+        gb.ts0 = gi.ts0 - gi.tsdx;
+        gb.ts1 = gi.ts1 + gi.tsdx;
+        gb.tsdx = gi.tsdx;
+        gb.w = gi.w;
+        gb.h = gi.h;
+        gb.key = key;
+
+        gb.batch.clear();
+    }
+
+    return &gb;
+}
+
 uint32_t TraceWin::graph_render_row_events( graph_info_t &gi )
 {
+    PROF_SCOPE( PROF_RenderRowEvents );
+
+    bool drawn = false;
     uint32_t num_events = 0;
-    bool draw_hovered_event = false;
-    bool draw_selected_event = false;
     const std::vector< uint32_t > &locs = *gi.prinfo_cur->plocs;
-    event_renderer_t event_renderer( gi.y + 4, gi.w, gi.h - 8 );
+    uint32_t hashval = fnv_hashstr32( gi.prinfo_cur->row_name.c_str() );
+    size_t idx0 = vec_find_eventid( locs, gi.eventstart );
+    size_t idx1 = vec_find_eventid( locs, gi.eventend + 1 );
 
-    for ( size_t idx = vec_find_eventid( locs, gi.eventstart );
-          idx < locs.size();
-          idx++ )
+    // Zoomed out far enough to draw summary buckets instead of events?
+    GraphLod *lod = gi.graph_only_filtered ? NULL : m_trace_events.get_graph_lod( locs );
+    int level = lod ? lod->find_level( gi.dx_to_ts( 1.0f ) ) : -1;
+
+    if ( level >= 0 )
     {
-        uint32_t eventid = locs[ idx ];
-        const trace_event_t &event = get_event( eventid );
+        bool rebuild = false;
+        uint32_t key = graph_batch_key( locs, level, col_Graph_1Event, col_Graph_6Event, 0 );
+        graph_batch_t *gb = graph_get_batch( m_graph.batches, gi, hashval, key, rebuild );
 
-        if ( eventid > gi.eventend )
-            break;
-        else if ( gi.graph_only_filtered && event.is_filtered_out )
-            continue;
+        if ( gb )
+        {
+            if ( rebuild )
+            {
+                // Batch rects are relative to gb->ts0 at the row's top left
+                size_t bidx0 = vec_find_eventid( locs, ts_to_eventid( gb->ts0 ) );
+                size_t bidx1 = vec_find_eventid( locs, ts_to_eventid( gb->ts1 ) + 1 );
+                event_renderer_t batch_renderer( 4, gi.w, gi.h - 8 );
+
+                batch_renderer.batch = &gb->batch;
+                lod_for_each_bucket( this, lod->m_levels[ level ], locs, bidx0, bidx1,
+                    [&]( int64_t ts_first, int64_t ts_last, uint32_t count, uint32_t crtcs )
+                    {
+                        batch_renderer.add_events( gi.w * ( ts_first - gb->ts0 ) * gi.tsdxrcp,
+                                                   gi.w * ( ts_last - gb->ts0 ) * gi.tsdxrcp, count );
+                    } );
+                batch_renderer.done();
+            }
 
-        float x = gi.ts_to_screenx( event.ts );
+            drawn = gb->batch.draw( ImGui::GetWindowDrawList(), gi.ts_to_screenx( gb->ts0 ), gi.y );
+            num_events = idx1 - idx0;
+        }
+    }
+
+    if ( !drawn )
+    {
+        // Groups only change with the view's time range and width, so
+        //  vertical scrolling and hovering reuse them.
+        graph_row_geom_t &geom = m_graph.row_geoms.m_map[ hashval ];
+        uint64_t keyvals[] =
+        {
+            ( uint64_t )gi.ts0, ( uint64_t )gi.ts1, ( uint64_t )( gi.w * 256.0f ),
+            ( uint64_t )( uintptr_t )&locs, locs.size(), locs.empty() ? INVALID_ID : locs.back(),
+            ( uint64_t )level, gi.graph_only_filtered ? m_eventlist.filter_generation + 1ULL : 0,
+        };
+        uint32_t key = fnv_hashbuf32( keyvals, sizeof( keyvals ) );
 
-        if ( eventid == m_eventlist.hovered_eventid )
-            draw_hovered_event = true;
-        else if ( eventid == m_eventlist.selected_eventid )
-            draw_selected_event = true;
+        if ( geom.key != key )
+        {
+            event_renderer_t geom_renderer( 0, gi.w, 0 );
 
-        // Check if we're mouse hovering this event
-        if ( gi.mouse_over )
-            gi.add_mouse_hovered_event( x, event );
+            geom.key = key;
+            geom.num_events = 0;
+            geom.groups.clear();
+            geom_renderer.groups = &geom.groups;
 
-        event_renderer.add_event( x );
-        num_events++;
+            if ( level >= 0 )
+            {
+                lod_for_each_bucket( this, lod->m_levels[ level ], locs, idx0, idx1,
+                    [&]( int64_t ts_first, int64_t ts_last, uint32_t count, uint32_t crtcs )
+                    {
+                        geom_renderer.add_events( gi.ts_to_x( ts_first ), gi.ts_to_x( ts_last ), count );
+                    } );
+
+                geom.num_events = idx1 - idx0;
+            }
+            else
+            {
+                for ( size_t idx = idx0; idx < idx1; idx++ )
+                {
+                    const trace_event_t &event = get_event( locs[ idx ] );
+
+                    if ( gi.graph_only_filtered && event.is_filtered_out )
+                        continue;
+
+                    geom_renderer.add_event( gi.ts_to_x( event.ts ) );
+                    geom.num_events++;
+                }
+            }
+
+            geom_renderer.done();
+        }
+
+        event_renderer_t event_renderer( gi.y + 4, gi.w, gi.h - 8 );
+
+        for ( const graph_row_geom_t::group_t &group : geom.groups )
+            event_renderer.draw_group( gi.x + group.x0, gi.x + group.x1, group.num_events );
+
+        num_events = geom.num_events;
     }
 
-    event_renderer.done();
+    uint32_t hovered_eventid = m_eventlist.hovered_eventid;
+    uint32_t selected_eventid = m_eventlist.selected_eventid;
+    bool draw_hovered_event = locs_has_eventid( locs, idx0, idx1, hovered_eventid ) &&
+            !graph_event_hidden( this, gi, hovered_eventid );
+    bool draw_selected_event = ( selected_eventid != hovered_eventid ) &&
+            locs_has_eventid( locs, idx0, idx1, selected_eventid ) &&
+            !graph_event_hidden( this, gi, selected_eventid );
+
+    if ( gi.mouse_over )
+        locs_add_hovered_events( this, gi, locs, idx0, idx1 );
 
     if ( draw_hovered_event )
     {
-        trace_event_t &event = get_event( m_eventlist.hovered_eventid );
+        trace_event_t &event = get_event( hovered_eventid );
         float x = gi.ts_to_screenx( event.ts );
 
         ImGui::GetWindowDrawList()->AddCircleFilled(
@@ -1306,7 +2162,7 @@ uint32_t TraceWin::graph_render_row_events( graph_info_t &gi )
 
     if ( draw_selected_event )
     {
-        trace_event_t &event = get_event( m_eventlist.selected_eventid );
+        trace_event_t &event = get_event( selected_eventid );
         float x = gi.ts_to_screenx( event.ts );
 
         ImGui::GetWindowDrawList()->AddCircleFilled(
@@ -1318,6 +2174,167 @@ uint32_t TraceWin::graph_render_row_events( graph_info_t &gi )
     return num_events;
 }
 
+// Comm of the task in a cpu lane run
+static const char *cpu_run_comm( TraceWin *win, const CpuRunIndex::run_t &run )
+{
+    if ( is_valid_id( run.id_start ) )
+        return get_event_field_val( win->get_event( run.id_start ), "next_comm" );
+
+    return get_event_field_val( win->get_event( run.id_end ), "prev_comm" );
+}
+
+// Call cb( x, width, height ) for spans of w pixel columns from ts_start with the
+//  same busy height. Column height is the fraction of its time the cpu was busy.
+template < typename T >
+static void cpu_lane_for_each_column( const CpuRunIndex::lane_t &lane, int64_t ts_start,
+                                      double ts_per_px, float w, float h, T cb )
+{
+    float x0 = 0.0f;
+    float h0 = 0.0f;
+
+    for ( float x = 0.0f; x < w; x += 1.0f )
+    {
+        int64_t ts0 = ts_start + ( int64_t )( x * ts_per_px );
+        int64_t ts1 = ts_start + ( int64_t )( ( x + 1.0f ) * ts_per_px );
+        int64_t busy = CpuRunIndex::busy_time( lane, ts0, ts1 );
+        // Round up so short runs still show up as a pixel
+        float height = ( ts1 > ts0 ) ? ceilf( h * busy / ( float )( ts1 - ts0 ) ) : 0.0f;
+
+        if ( height != h0 )
+        {
+            if ( h0 > 0.0f )
+                cb( x0, x - x0, h0 );
+
+            x0 = x;
+            h0 = height;
+        }
+    }
+
+    if ( h0 > 0.0f )
+        cb( x0, w - x0, h0 );
+}
+
+uint32_t TraceWin::graph_render_cpu_lane( graph_info_t &gi )
+{
+    PROF_SCOPE( PROF_RenderCpuLane );
+
+    const CpuRunIndex::lane_t *lane = m_trace_events.get_cpu_lane( gi.prinfo_cur->row_name.c_str() );
+
+    if ( !lane )
+        return 0;
+
+    const std::vector< uint32_t > &locs = lane->locs;
+    const std::vector< CpuRunIndex::run_t > &runs = lane->runs;
+    size_t idx0 = vec_find_eventid( locs, gi.eventstart );
+    size_t idx1 = vec_find_eventid( locs, gi.eventend + 1 );
+
+    // Runs with any part in [ts0, ts1)
+    size_t run0 = CpuRunIndex::find_run( *lane, gi.ts0 );
+    size_t run1 = std::lower_bound( runs.begin() + run0, runs.end(), gi.ts1,
+        []( const CpuRunIndex::run_t &run, int64_t ts ) { return run.ts_start < ts; } ) - runs.begin();
+
+    float y = gi.y + imgui_scale( 1.0f );
+    float h = gi.h - imgui_scale( 2.0f );
+    ImU32 col_busy = s_clrs().get( col_Graph_CpuBusy );
+
+    if ( run1 - run0 <= gi.w / 4 )
+    {
+        // Few enough runs to draw them one by one, colored by pid
+        float label_sat = s_clrs().getalpha( col_Graph_TimelineLabelSat );
+        float label_alpha = s_clrs().getalpha( col_Graph_TimelineLabelAlpha );
+        bool render_labels = s_opts().getb( OPT_TimelineLabels ) && !ImGui::GetIO().KeyAlt;
+
+        imgui_push_smallfont();
+
+        for ( size_t i = run0; i < run1; i++ )
+        {
+            const CpuRunIndex::run_t &run = runs[ i ];
+            float x0 = gi.ts_to_screenx( run.ts_start );
+            float x1 = gi.ts_to_screenx( run.ts_end );
+            ImU32 color = imgui_col_from_hashval( fnv_hashbuf32( &run.pid, sizeof( run.pid ) ),
+                                                  label_sat, label_alpha );
+
+            imgui_drawrect( x0, std::max< float >( x1 - x0, 1.0f ), y, h, color );
+
+            if ( render_labels && ( x1 - x0 > imgui_scale( 16.0f ) ) )
+            {
+                const char *comm = cpu_run_comm( this, run );
+                const ImVec2 size = ImGui::CalcTextSize( comm );
+                float x_text = std::max< float >( x0, gi.x ) + imgui_scale( 2.0f );
+
+                if ( x1 - x_text >= size.x )
+                {
+                    ImGui::GetWindowDrawList()->AddText( ImVec2( x_text, y + imgui_scale( 1.0f ) ),
+                                                         s_clrs().get( col_Graph_BarText ), comm );
+                }
+            }
+        }
+
+        imgui_pop_smallfont();
+    }
+    else
+    {
+        // Zoomed out: draw how busy each pixel column was from the run lengths
+        //  prefix sums, so this costs the same at any zoom level.
+        bool rebuild = false;
+        double ts_per_px = gi.tsdx / ( double )gi.w;
+        uint32_t hashval = fnv_hashstr32( gi.prinfo_cur->row_name.c_str() );
+        uint32_t key = graph_batch_key( locs, 0, col_Graph_CpuBusy, col_Graph_CpuBusy, 0 );
+        graph_batch_t *gb = graph_get_batch( m_graph.batches, gi, hashval, key, rebuild );
+        bool drawn = false;
+
+        if ( gb )
+        {
+            if ( rebuild )
+            {
+                // Batch rects are relative to gb->ts0 at the row's top left
+                float bw = ( float )( ( gb->ts1 - gb->ts0 ) / ts_per_px );
+
+                cpu_lane_for_each_column( *lane, gb->ts0, ts_per_px, ceilf( bw ), h,
+                    [&]( float x, float width, float height )
+                    {
+                        gb->batch.add( x, y - gi.y + h - height, width, height, col_busy );
+                    } );
+            }
+
+            drawn = gb->batch.draw( ImGui::GetWindowDrawList(), gi.ts_to_screenx( gb->ts0 ), gi.y );
+        }
+
+        if ( !drawn )
+        {
+            cpu_lane_for_each_column( *lane, gi.ts0, ts_per_px, ceilf( gi.w ), h,
+                [&]( float x, float width, float height )
+                {
+                    imgui_drawrect( gi.x + x, width, y + h - height, height, col_busy );
+                } );
+        }
+    }
+
+    if ( gi.mouse_over )
+    {
+        int64_t mouse_ts = gi.screenx_to_ts( gi.mouse_pos.x );
+        size_t idx = CpuRunIndex::find_run( *lane, mouse_ts );
+
+        if ( ( idx < runs.size() ) && ( runs[ idx ].ts_start <= mouse_ts ) )
+        {
+            const CpuRunIndex::run_t &run = runs[ idx ];
+            float x0 = gi.ts_to_screenx( run.ts_start );
+            float x1 = gi.ts_to_screenx( run.ts_end );
+
+            gi.hovered_cpu_run = &run;
+            gi.hovered_cpu_row = gi.prinfo_cur->row_name.c_str();
+
+            ImGui::GetWindowDrawList()->AddRect( ImVec2( x0, y ), ImVec2( std::max< float >( x1, x0 + 1.0f ), y + h ),
+                                                 s_clrs().get( col_Graph_BarSelRect ) );
+        }
+
+        // sched_switch events around the mouse
+        locs_add_hovered_events( this, gi, locs, idx0, idx1 );
+    }
+
+    return idx1 - idx0;
+}
+
 void TraceWin::graph_render_row( graph_info_t &gi )
 {
     if ( gi.mouse_over )
@@ -1371,37 +2388,35 @@ void TraceWin::graph_render_time_ticks( class graph_info_t &gi )
     }
 }
 
-static float get_vblank_xdiffs( TraceWin *win, graph_info_t &gi, const std::vector< uint32_t > *vblank_locs )
+// Widest gap in pixels between the first few vblanks on screen of the
+//  densest shown crtc
+static float get_vblank_xdiffs( TraceWin *win, graph_info_t &gi )
 {
-    float xdiff = 0.0f;
-    float xlast = 0.0f;
-    uint32_t count = 0;
+    int64_t delta = INT64_MAX;
+    const std::vector< TraceEvents::crtc_vblanks_t > &crtc_vblanks = win->m_trace_events.m_crtc_vblanks;
 
-    for ( size_t idx = vec_find_eventid( *vblank_locs, gi.eventstart );
-          idx < vblank_locs->size();
-          idx++ )
+    for ( size_t crtc = 0; crtc < crtc_vblanks.size(); crtc++ )
     {
-        uint32_t id = vblank_locs->at( idx );
-        trace_event_t &event = win->get_event( id );
+        const TraceEvents::crtc_vblanks_t &vblanks = crtc_vblanks[ crtc ];
 
-        if ( s_opts().getcrtc( event.crtc ) )
-        {
-            float x = gi.ts_to_screenx( event.ts );
+        if ( vblanks.deltas.empty() || !s_opts().getcrtc( crtc ) )
+            continue;
 
-            if ( xlast )
-                xdiff = std::max< float >( xdiff, x - xlast );
-            xlast = x;
+        size_t idx0 = std::lower_bound( vblanks.ts.begin(), vblanks.ts.end(), gi.ts0 ) - vblanks.ts.begin();
+        size_t idx1 = std::min< size_t >( idx0 + 10, vblanks.deltas.size() );
 
-            if ( count++ >= 10 )
-                break;
-        }
+        if ( idx0 < idx1 )
+            delta = std::min< int64_t >( delta, *std::max_element( vblanks.deltas.begin() + idx0,
+                                                                 vblanks.deltas.begin() + idx1 ) );
     }
 
-    return xdiff;
+    return ( delta == INT64_MAX ) ? 0.0f : ( float )( gi.w * delta * gi.tsdxrcp );
 }
 
 void TraceWin::graph_render_vblanks( graph_info_t &gi )
 {
+    PROF_SCOPE( PROF_RenderVblanks );
+
     // Draw vblank events on every graph.
     const std::vector< uint32_t > *vblank_locs = m_trace_events.get_tdopexpr_locs( "$name=drm_vblank_event" );
 
@@ -1415,29 +2430,99 @@ void TraceWin::graph_render_vblanks( graph_info_t &gi )
          * when pretty close, but in the background if there's more than ~50 on screen
          * probably?
          */
-        float xdiff = get_vblank_xdiffs( this, gi, vblank_locs ) / imgui_scale( 1.0f );
+        float xdiff = get_vblank_xdiffs( this, gi ) / imgui_scale( 1.0f );
         uint32_t alpha = std::min< uint32_t >( 255, 50 + 2 * xdiff );
+        GraphLod *lod = m_trace_events.get_graph_lod( *vblank_locs );
+        int level = lod ? lod->find_level( gi.dx_to_ts( 1.0f ) ) : -1;
 
-        for ( size_t idx = vec_find_eventid( *vblank_locs, gi.eventstart );
-              idx < vblank_locs->size();
-              idx++ )
+        if ( level >= 0 )
         {
-            uint32_t id = vblank_locs->at( idx );
+            bool rebuild = false;
+            uint32_t crtc_mask = 0;
 
-            if ( id > gi.eventend )
-                break;
+            for ( uint32_t crtc = 0; crtc <= OPT_RenderCrtc9 - OPT_RenderCrtc0; crtc++ )
+                crtc_mask |= s_opts().getcrtc( crtc ) << crtc;
 
-            trace_event_t &event = get_event( id );
+            uint32_t key = graph_batch_key( *vblank_locs, level, col_VBlank0, col_VBlank1, crtc_mask );
+            graph_batch_t *gb = graph_get_batch( m_graph.batches, gi,
+                                                 fnv_hashstr32( "$vblanks$" ), key, rebuild );
 
-            if ( s_opts().getcrtc( event.crtc ) )
+            if ( gb )
             {
-                // drm_vblank_event0: blue, drm_vblank_event1: red
-                colors_t col = ( event.crtc > 0 ) ? col_VBlank1 : col_VBlank0;
-                float x = gi.ts_to_screenx( event.ts );
+                if ( rebuild )
+                {
+                    size_t bidx0 = vec_find_eventid( *vblank_locs, ts_to_eventid( gb->ts0 ) );
+                    size_t bidx1 = vec_find_eventid( *vblank_locs, ts_to_eventid( gb->ts1 ) + 1 );
+
+                    // Bars are added opaque and faded with the batch alpha
+                    lod_for_each_bucket( this, lod->m_levels[ level ], *vblank_locs, bidx0, bidx1,
+                        [&]( int64_t ts_first, int64_t ts_last, uint32_t count, uint32_t crtcs )
+                        {
+                            float x0 = gi.w * ( ts_first - gb->ts0 ) * gi.tsdxrcp;
+                            float x1 = gi.w * ( ts_last - gb->ts0 ) * gi.tsdxrcp;
+
+                            for ( int crtc = 0; crtcs; crtc++, crtcs >>= 1 )
+                            {
+                                if ( ( crtcs & 1 ) && ( crtc_mask & ( 1 << crtc ) ) )
+                                {
+                                    colors_t col = ( crtc > 0 ) ? col_VBlank1 : col_VBlank0;
+
+                                    gb->batch.add( x0, 0.0f, x1 - x0 + imgui_scale( 1.0f ), gi.h,
+                                                   s_clrs().get( col, 255 ) );
+                                }
+                            }
+                        } );
+                }
+
+                if ( gb->batch.draw( ImGui::GetWindowDrawList(), gi.ts_to_screenx( gb->ts0 ), gi.y,
+                                     alpha / 255.0f ) )
+                    return;
+            }
+
+            size_t idx0 = vec_find_eventid( *vblank_locs, gi.eventstart );
+            size_t idx1 = vec_find_eventid( *vblank_locs, gi.eventend + 1 );
+
+            // One bar per crtc for each bucket of vblanks within a pixel
+            lod_for_each_bucket( this, lod->m_levels[ level ], *vblank_locs, idx0, idx1,
+                [&]( int64_t ts_first, int64_t ts_last, uint32_t count, uint32_t crtcs )
+                {
+                    float x0 = gi.ts_to_screenx( ts_first );
+                    float x1 = gi.ts_to_screenx( ts_last );
+
+                    for ( int crtc = 0; crtcs; crtc++, crtcs >>= 1 )
+                    {
+                        if ( ( crtcs & 1 ) && s_opts().getcrtc( crtc ) )
+                        {
+                            colors_t col = ( crtc > 0 ) ? col_VBlank1 : col_VBlank0;
+
+                            imgui_drawrect( x0, x1 - x0 + imgui_scale( 1.0f ),
+                                            gi.y, gi.h,
+                                            s_clrs().get( col, alpha ) );
+                        }
+                    }
+                } );
+            return;
+        }
+
+        const std::vector< TraceEvents::crtc_vblanks_t > &crtc_vblanks = m_trace_events.m_crtc_vblanks;
 
-                imgui_drawrect( x, imgui_scale( 1.0f ),
-                                gi.y, gi.h,
-                                s_clrs().get( col, alpha ) );
+        for ( size_t crtc = 0; crtc < crtc_vblanks.size(); crtc++ )
+        {
+            const std::vector< int64_t > &ts = crtc_vblanks[ crtc ].ts;
+
+            if ( !s_opts().getcrtc( crtc ) )
+                continue;
+
+            // drm_vblank_event0: blue, drm_vblank_event1: red
+            colors_t col = ( crtc > 0 ) ? col_VBlank1 : col_VBlank0;
+            ImU32 color = s_clrs().get( col, alpha );
+
+            for ( auto it = std::lower_bound( ts.begin(), ts.end(), gi.ts0 );
+                  ( it != ts.end() ) && ( *it <= gi.ts1 );
+                  it++ )
+            {
+                imgui_drawrect( gi.ts_to_screenx( *it ), imgui_scale( 1.0f ),
+                                gi.y, gi.h, color );
             }
         }
     }
@@ -1945,6 +3030,23 @@ void TraceWin::graph_render()
 
         s_opts().setf( opt, m_graph.resize_graph_click_pos + ImGui::GetMouseDragDelta( 0 ).y );
     }
+
+    // Keep row layout for next frame
+    m_graph.row_info.swap( gi.row_info );
+
+    // If the view moved without any input (keyboard scrolling, gotos, etc.)
+    //  we need to keep drawing frames until it settles.
+    int64_t view[] =
+    {
+        m_graph.start_ts, m_graph.length_ts, m_eventlist.tsoffset,
+        m_graph.ts_markers[ 0 ], m_graph.ts_markers[ 1 ],
+        ( int64_t )m_graph.start_y,
+        m_eventlist.hovered_eventid, m_eventlist.selected_eventid,
+    };
+    uint32_t view_hash = fnv_hashbuf32( view, sizeof( view ) );
+
+    m_graph.view_changed = ( view_hash != m_graph.view_hash );
+    m_graph.view_hash = view_hash;
 }
 
 bool TraceWin::graph_render_popupmenu( graph_info_t &gi )
@@ -2279,32 +3381,28 @@ void TraceWin::graph_set_mouse_tooltip( class graph_info_t &gi, int64_t mouse_ts
 
     m_eventlist.highlight_ids.clear();
 
-    const std::vector< uint32_t > *vblank_locs = m_trace_events.get_tdopexpr_locs( "$name=drm_vblank_event" );
-    if ( vblank_locs )
+    if ( !m_trace_events.m_crtc_vblanks.empty() )
     {
         int64_t prev_vblank_ts = INT64_MAX;
         int64_t next_vblank_ts = INT64_MAX;
-        int eventid = ts_to_eventid( mouse_ts );
-        size_t idx = vec_find_eventid( *vblank_locs, eventid );
-        size_t idxmax = std::min< size_t >( idx + 20, vblank_locs->size() );
+        const std::vector< TraceEvents::crtc_vblanks_t > &crtc_vblanks = m_trace_events.m_crtc_vblanks;
 
-        for ( idx = ( idx > 10 ) ? ( idx - 10 ) : 0; idx < idxmax; idx++ )
+        // Closest vblank on a shown crtc each way from the mouse
+        for ( size_t crtc = 0; crtc < crtc_vblanks.size(); crtc++ )
         {
-            trace_event_t &event = get_event( vblank_locs->at( idx ) );
+            const std::vector< int64_t > &ts = crtc_vblanks[ crtc ].ts;
 
-            if ( s_opts().getcrtc( event.crtc ) )
-            {
-                if ( event.ts < mouse_ts )
-                {
-                    if ( mouse_ts - event.ts < prev_vblank_ts )
-                        prev_vblank_ts = mouse_ts - event.ts;
-                }
-                if ( event.ts > mouse_ts )
-                {
-                    if ( event.ts - mouse_ts < next_vblank_ts )
-                        next_vblank_ts = event.ts - mouse_ts;
-                }
-            }
+            if ( !s_opts().getcrtc( crtc ) )
+                continue;
+
+            auto it = std::lower_bound( ts.begin(), ts.end(), mouse_ts );
+
+            if ( it != ts.begin() )
+                prev_vblank_ts = std::min< int64_t >( prev_vblank_ts, mouse_ts - *( it - 1 ) );
+
+            it = std::upper_bound( it, ts.end(), mouse_ts );
+            if ( it != ts.end() )
+                next_vblank_ts = std::min< int64_t >( next_vblank_ts, *it - mouse_ts );
         }
 
         if ( prev_vblank_ts != INT64_MAX )
@@ -2373,13 +3471,15 @@ void TraceWin::graph_set_mouse_tooltip( class graph_info_t &gi, int64_t mouse_ts
     if ( is_valid_id( gi.hovered_fence_signaled ) )
     {
         const trace_event_t &event_hov = get_event( gi.hovered_fence_signaled );
-        std::string context = get_event_gfxcontext_str( event_hov );
-        const std::vector< uint32_t > *plocs = m_trace_events.get_gfxcontext_locs( context.c_str() );
+        const TraceGfxContexts &gfxcontexts = m_trace_events.m_gfxcontexts;
+        const TraceGfxContexts::job_t *job = m_trace_events.get_gfxcontext_job( event_hov );
+        uint32_t count = job ? job->count : 0;
 
-        time_buf += string_format( "\n\n%s", event_hov.user_comm );
+        time_buf += string_format( "\n\n%s", m_trace_events.comm_str( event_hov.user_comm_id ) );
 
-        for ( uint32_t id : *plocs )
+        for ( uint32_t i = 0; i < count; i++ )
         {
+            uint32_t id = gfxcontexts.get_id( *job, i );
             const trace_event_t &event = get_event( id );
             const char *name = event.get_timeline_name( event.name );
             std::string timestr = ts_to_timestr( event.duration, 0, 4 );
@@ -2391,11 +3491,28 @@ void TraceWin::graph_set_mouse_tooltip( class graph_info_t &gi, int64_t mouse_ts
                                        s_textclrs().ftraceprint_str( timestr + "ms" ).c_str() );
         }
 
-        if ( sync_event_list_to_graph && !m_eventlist.do_gotoevent )
+        if ( job && sync_event_list_to_graph && !m_eventlist.do_gotoevent )
         {
             // Sync event list to first event id in this context
             m_eventlist.do_gotoevent = true;
-            m_eventlist.goto_eventid = plocs->at( 0 );
+            m_eventlist.goto_eventid = job->ids[ 0 ];
+        }
+    }
+
+    if ( gi.hovered_cpu_run )
+    {
+        const CpuRunIndex::run_t &run = *gi.hovered_cpu_run;
+        const CpuRunIndex::lane_t *lane = m_trace_events.get_cpu_lane( gi.hovered_cpu_row );
+        std::string timestr = ts_to_timestr( run.ts_end - run.ts_start, 0, 4 );
+
+        time_buf += string_format( "\n\n%s: %s-%d", gi.hovered_cpu_row, cpu_run_comm( this, run ), run.pid );
+        time_buf += string_format( "\n  Running: %s", s_textclrs().ftraceprint_str( timestr + "ms" ).c_str() );
+
+        if ( lane )
+        {
+            double busy = CpuRunIndex::busy_time( *lane, gi.ts0, gi.ts1 );
+
+            time_buf += string_format( "\n  Busy in view: %.1f%%", 100.0 * busy / gi.tsdx );
         }
     }
 
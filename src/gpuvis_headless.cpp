@@ -0,0 +1,465 @@
+/*
+ * Copyright 2017 Valve Software
+ *
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <float.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <set>
+#include <unordered_map>
+#include <list>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include <SDL.h>
+
+#define YA_GETOPT_NO_COMPAT_MACRO
+#include "ya_getopt.h"
+
+#include "imgui/imgui.h"
+
+#include "tdopexpr.h"
+#include "trace-cmd/trace-read.h"
+
+#include "gpuvis_macros.h"
+#include "stlini.h"
+#include "gpuvis_utils.h"
+#include "gpuvis.h"
+
+/*
+ * Headless batch mode.
+ *
+ *   gpuvis --headless [--output file] [--format json|csv] [--jobs N] trace.dat...
+ *
+ * Each trace file on the command line is read and summarized on a pool of
+ * worker threads without creating a window:
+ *
+ *   timeline:  per gfx, sdma0, etc. job latency (amdgpu_cs_ioctl to fence
+ *              signaled), hw queue time and execution time in ms
+ *   vblank:    interval between drm_vblank_events of each crtc in ms
+ *   plot:      values of each $graph_plots$ ini entry
+ *
+ * Summaries go to stdout (or --output) and log messages to stderr.
+ */
+
+struct headless_stats_t
+{
+    std::string kind;
+    std::string name;
+
+    size_t count = 0;
+    double min = 0.0;
+    double mean = 0.0;
+    double p50 = 0.0;
+    double p90 = 0.0;
+    double p99 = 0.0;
+    double max = 0.0;
+};
+
+struct headless_trace_t
+{
+    std::string filename;
+    bool loaded = false;
+
+    size_t event_count = 0;
+    double duration_ms = 0.0;
+
+    std::vector< headless_stats_t > stats;
+};
+
+static void headless_add_stats( headless_trace_t &trace, const char *kind, const std::string &name,
+                                std::vector< double > &vals )
+{
+    headless_stats_t stats;
+
+    stats.kind = kind;
+    stats.name = name;
+    stats.count = vals.size();
+
+    if ( !vals.empty() )
+    {
+        double sum = 0.0;
+
+        std::sort( vals.begin(), vals.end() );
+        for ( double val : vals )
+            sum += val;
+
+        // Nearest rank percentiles
+        auto percentile = [&vals]( double p )
+        {
+            size_t rank = ( size_t )( p * vals.size() + 0.5 );
+
+            return vals[ Clamp< size_t >( rank, 1, vals.size() ) - 1 ];
+        };
+
+        stats.min = vals.front();
+        stats.max = vals.back();
+        stats.mean = sum / vals.size();
+        stats.p50 = percentile( 0.50 );
+        stats.p90 = percentile( 0.90 );
+        stats.p99 = percentile( 0.99 );
+    }
+
+    trace.stats.push_back( stats );
+}
+
+static void headless_timeline_stats( TraceEvents &trace_events, headless_trace_t &trace )
+{
+    std::vector< std::pair< std::string, const std::vector< uint32_t > * > > timelines;
+
+    for ( const auto &item : trace_events.m_timeline_locations.m_locs.m_map )
+        timelines.push_back( { trace_events.m_events[ item.second[ 0 ] ].timeline, &item.second } );
+
+    // Hash map order isn't stable between runs
+    std::sort( timelines.begin(), timelines.end() );
+
+    for ( const auto &timeline : timelines )
+    {
+        std::vector< double > latency;
+        std::vector< double > queue;
+        std::vector< double > hw;
+
+        for ( uint32_t id : *timeline.second )
+        {
+            const trace_event_t &fence_signaled = trace_events.m_events[ id ];
+
+            if ( !fence_signaled.is_fence_signaled() || !is_valid_id( fence_signaled.id_start ) )
+                continue;
+
+            const trace_event_t &sched_run_job = trace_events.m_events[ fence_signaled.id_start ];
+            int64_t start_ts = sched_run_job.ts;
+
+            if ( is_valid_id( sched_run_job.id_start ) )
+                start_ts = trace_events.m_events[ sched_run_job.id_start ].ts;
+
+            latency.push_back( ( fence_signaled.ts - start_ts ) / ( double )NSECS_PER_MSEC );
+            queue.push_back( sched_run_job.duration / ( double )NSECS_PER_MSEC );
+            hw.push_back( fence_signaled.duration / ( double )NSECS_PER_MSEC );
+        }
+
+        headless_add_stats( trace, "latency_ms", timeline.first, latency );
+        headless_add_stats( trace, "hw_queue_ms", timeline.first, queue );
+        headless_add_stats( trace, "execution_ms", timeline.first, hw );
+    }
+}
+
+static void headless_vblank_stats( TraceEvents &trace_events, headless_trace_t &trace )
+{
+    const std::vector< uint32_t > *plocs =
+            trace_events.m_tdopexpr_locations.get_locations_str( "$name=drm_vblank_event" );
+
+    if ( !plocs )
+        return;
+
+    // crtc to its vblank intervals
+    std::vector< std::vector< double > > intervals;
+    std::vector< int64_t > last_ts;
+
+    for ( uint32_t id : *plocs )
+    {
+        const trace_event_t &event = trace_events.m_events[ id ];
+
+        if ( event.crtc < 0 )
+            continue;
+
+        if ( ( size_t )event.crtc >= intervals.size() )
+        {
+            intervals.resize( event.crtc + 1 );
+            last_ts.resize( event.crtc + 1, INT64_MIN );
+        }
+
+        if ( last_ts[ event.crtc ] != INT64_MIN )
+            intervals[ event.crtc ].push_back( ( event.ts - last_ts[ event.crtc ] ) / ( double )NSECS_PER_MSEC );
+        last_ts[ event.crtc ] = event.ts;
+    }
+
+    for ( size_t crtc = 0; crtc < intervals.size(); crtc++ )
+    {
+        if ( last_ts[ crtc ] != INT64_MIN )
+            headless_add_stats( trace, "vblank_ms", string_format( "crtc%zu", crtc ), intervals[ crtc ] );
+    }
+}
+
+static void headless_plot_stats( TraceEvents &trace_events, headless_trace_t &trace,
+                                 const std::vector< INIEntry > &plot_entries )
+{
+    for ( const INIEntry &entry : plot_entries )
+    {
+        const std::string &plot_name = entry.first;
+        const std::vector< std::string > plot_args = string_explode( entry.second, '\t' );
+
+        if ( plot_args.size() != 2 )
+            continue;
+
+        GraphPlot &plot = trace_events.get_plot( plot_name.c_str() );
+        std::vector< double > vals;
+
+        if ( plot.init( trace_events, plot_name, plot_args[ 0 ], plot_args[ 1 ] ) )
+        {
+            vals.reserve( plot.m_plotdata.size() );
+            for ( const GraphPlot::plotdata_t &data : plot.m_plotdata )
+                vals.push_back( data.valf );
+        }
+
+        headless_add_stats( trace, "plot", plot_name, vals );
+    }
+}
+
+static void headless_summarize( TraceLoader &loader, headless_trace_t &trace, bool parallel,
+                                size_t max_threads, const std::vector< INIEntry > &plot_entries )
+{
+    TraceEvents trace_events;
+
+    trace_events.m_max_threads = max_threads;
+
+    trace_events.m_filename = trace.filename;
+    trace_events.m_filesize = get_file_size( trace.filename.c_str() );
+    trace_events.m_title = trace.filename;
+
+    if ( !loader.load_files_sync( &trace_events, { trace.filename }, parallel ) )
+        return;
+
+    trace.loaded = true;
+    trace.event_count = trace_events.m_events.size();
+    if ( trace_events.m_events.empty() )
+        return;
+
+    trace.duration_ms = trace_events.m_events.back().ts / ( double )NSECS_PER_MSEC;
+
+    trace_events.calculate_event_durations();
+    trace_events.init_filter_index();
+
+    headless_timeline_stats( trace_events, trace );
+    headless_vblank_stats( trace_events, trace );
+    headless_plot_stats( trace_events, trace, plot_entries );
+
+    logf( "Summarized %s: %zu events", trace.filename.c_str(), trace.event_count );
+}
+
+static std::string csv_str( const std::string &str )
+{
+    if ( str.find_first_of( ",\"\n" ) == std::string::npos )
+        return str;
+
+    std::string ret = "\"";
+
+    for ( char c : str )
+    {
+        if ( c == '"' )
+            ret += '"';
+        ret += c;
+    }
+
+    return ret + "\"";
+}
+
+static void headless_write_json( FILE *fp, const std::vector< headless_trace_t > &traces )
+{
+    fprintf( fp, "[\n" );
+
+    for ( size_t i = 0; i < traces.size(); i++ )
+    {
+        const headless_trace_t &trace = traces[ i ];
+
+        fprintf( fp, "  {\n" );
+        fprintf( fp, "    \"file\": %s,\n", string_json_quoted( trace.filename ).c_str() );
+        fprintf( fp, "    \"loaded\": %s,\n", trace.loaded ? "true" : "false" );
+        fprintf( fp, "    \"events\": %zu,\n", trace.event_count );
+        fprintf( fp, "    \"duration_ms\": %.6f,\n", trace.duration_ms );
+        fprintf( fp, "    \"stats\": [" );
+
+        for ( size_t j = 0; j < trace.stats.size(); j++ )
+        {
+            const headless_stats_t &stats = trace.stats[ j ];
+
+            fprintf( fp, "%s\n      { \"kind\": \"%s\", \"name\": %s, \"count\": %zu, "
+                     "\"min\": %.6f, \"mean\": %.6f, \"p50\": %.6f, \"p90\": %.6f, \"p99\": %.6f, \"max\": %.6f }",
+                     j ? "," : "", stats.kind.c_str(), string_json_quoted( stats.name ).c_str(), stats.count,
+                     stats.min, stats.mean, stats.p50, stats.p90, stats.p99, stats.max );
+        }
+
+        fprintf( fp, "%s]\n", trace.stats.empty() ? "" : "\n    " );
+        fprintf( fp, "  }%s\n", ( i + 1 < traces.size() ) ? "," : "" );
+    }
+
+    fprintf( fp, "]\n" );
+}
+
+static void headless_write_csv( FILE *fp, const std::vector< headless_trace_t > &traces )
+{
+    fprintf( fp, "file,kind,name,count,min,mean,p50,p90,p99,max\n" );
+
+    for ( const headless_trace_t &trace : traces )
+    {
+        std::string file = csv_str( trace.filename );
+
+        fprintf( fp, "%s,events,,%zu,,,,,,\n", file.c_str(), trace.event_count );
+
+        for ( const headless_stats_t &stats : trace.stats )
+        {
+            fprintf( fp, "%s,%s,%s,%zu,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f\n",
+                     file.c_str(), stats.kind.c_str(), csv_str( stats.name ).c_str(), stats.count,
+                     stats.min, stats.mean, stats.p50, stats.p90, stats.p99, stats.max );
+        }
+    }
+}
+
+static void headless_flush_log( size_t &log_count )
+{
+    logf_update();
+
+    const std::vector< char * > &log = logf_get();
+
+    for ( ; log_count < log.size(); log_count++ )
+        fprintf( stderr, "%s\n", log[ log_count ] );
+}
+
+bool headless_requested( int argc, char **argv )
+{
+    for ( int i = 1; i < argc; i++ )
+    {
+        if ( !strcmp( argv[ i ], "--headless" ) )
+            return true;
+    }
+
+    return false;
+}
+
+int headless_main( int argc, char **argv )
+{
+    static struct option long_opts[] =
+    {
+        { "headless", ya_no_argument, 0, 0 },
+        { "output", ya_required_argument, 0, 'o' },
+        { "format", ya_required_argument, 0, 'f' },
+        { "jobs", ya_required_argument, 0, 'j' },
+        { 0, 0, 0, 0 }
+    };
+
+    const char *output = NULL;
+    std::string format = "json";
+    size_t jobs = std::max< size_t >( std::thread::hardware_concurrency(), 1 );
+    std::vector< headless_trace_t > traces;
+
+    int c;
+    int opt_ind = 0;
+    while ( ( c = ya_getopt_long( argc, argv, "o:f:j:", long_opts, &opt_ind ) ) != -1 )
+    {
+        switch ( c )
+        {
+        case 'o':
+            output = ya_optarg;
+            break;
+        case 'f':
+            format = ya_optarg;
+            break;
+        case 'j':
+            jobs = std::max< int >( atoi( ya_optarg ), 1 );
+            break;
+        default:
+            break;
+        }
+    }
+
+    for ( ; ya_optind < argc; ya_optind++ )
+    {
+        traces.push_back( headless_trace_t() );
+        traces.back().filename = argv[ ya_optind ];
+    }
+
+    if ( traces.empty() || ( ( format != "json" ) && ( format != "csv" ) ) )
+    {
+        fprintf( stderr, "Usage: %s --headless [--output file] [--format json|csv] [--jobs N] trace.dat...\n", argv[ 0 ] );
+        return -1;
+    }
+
+    logf_init();
+    s_ini().Open( "gpuvis", "gpuvis.ini" );
+    s_clrs().init();
+    s_opts().init();
+
+    // Traces are spread over the workers, so each one only decodes its
+    //  cpu buffers in parallel when there's a single worker. Scans and plots
+    //  over each trace get their share of the cores.
+    jobs = std::min< size_t >( jobs, traces.size() );
+    bool parallel = ( jobs == 1 ) && s_opts().getb( OPT_ParallelLoad );
+    size_t max_threads = std::max< size_t >( std::thread::hardware_concurrency() / jobs, 1 );
+    std::vector< INIEntry > plot_entries = s_ini().GetSectionEntries( "$graph_plots$" );
+    std::atomic< size_t > next_trace( 0 );
+    std::atomic< size_t > done_count( 0 );
+    std::vector< std::thread > threads;
+
+    for ( size_t i = 0; i < jobs; i++ )
+    {
+        threads.push_back( std::thread( [&]()
+        {
+            TraceLoader loader;
+
+            for ( size_t idx = next_trace++; idx < traces.size(); idx = next_trace++ )
+            {
+                headless_summarize( loader, traces[ idx ], parallel, max_threads, plot_entries );
+                done_count++;
+            }
+        } ) );
+    }
+
+    // Workers log from their own threads, so pass messages along as they come in
+    size_t log_count = 0;
+    while ( done_count < traces.size() )
+    {
+        headless_flush_log( log_count );
+        SDL_Delay( 50 );
+    }
+
+    for ( std::thread &thread : threads )
+        thread.join();
+    headless_flush_log( log_count );
+
+    FILE *fp = output ? fopen( output, "w" ) : stdout;
+    if ( !fp )
+    {
+        fprintf( stderr, "[Error] %s: fopen(%s) failed: %s\n", __func__, output, strerror( errno ) );
+        return -1;
+    }
+
+    if ( format == "csv" )
+        headless_write_csv( fp, traces );
+    else
+        headless_write_json( fp, traces );
+
+    if ( fp != stdout )
+        fclose( fp );
+
+    logf_clear();
+    logf_shutdown();
+
+    bool all_loaded = std::all_of( traces.begin(), traces.end(),
+                                   []( const headless_trace_t &trace ) { return trace.loaded; } );
+    return all_loaded ? 0 : 1;
+}
@@ -24,6 +24,8 @@
 #ifndef _GPUVIS_MACROS_H_
 #define _GPUVIS_MACROS_H_
 
+#include <stdarg.h>
+
 // Super handy macros from Jonathan Wakely / Patrick Horgan:
 //   http://dbp-consulting.com/tutorials/SuppressingGCCWarnings.html
 #if defined( __GNUC__ )
@@ -87,6 +89,7 @@ char *strtok_r( char *str, const char *delim, char **saveptr );
 #if defined( __cplusplus )
 
 extern "C" uint32_t fnv_hashstr32( const char *str, size_t len = ( size_t )-1 );
+extern "C" uint32_t fnv_hashbuf32( const void *buf, size_t len );
 
 size_t get_file_size( const char *filename );
 const char *get_path_filename( const char *filename );
@@ -119,6 +122,8 @@ std::string string_ltrimmed( std::string s );
 std::string string_rtrimmed( std::string s );
 // trim from both ends (copying)
 std::string string_trimmed( std::string s );
+// quote string for json, escaping quotes, backslashes and control chars
+std::string string_json_quoted( const std::string &s );
 
 template < typename T >
 T Clamp( const T& val, const T& lower, const T& upper )
@@ -171,7 +176,7 @@ char *strcpy_safe( char ( &dest )[ T ], const std::string &src )
 }
 
 template < size_t T >
-void strcat_safe( char ( &dest )[ T ], const char *src )
+char *strcat_safe( char ( &dest )[ T ], const char *src )
 {
     size_t i;
 
@@ -0,0 +1,209 @@
+/*
+ * Copyright 2017 Valve Software
+ *
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+#include "gpuvis_macros.h"
+#include "gpuvis_prof.h"
+
+/*
+ * Hot path profiling.
+ *
+ * Every zone keeps atomic counts and times so threads can add to them
+ * without locks. Coarse zones (a load, a header parse, a row render) also
+ * keep their spans in a ring buffer for the Chrome trace export. Per record
+ * zones only keep totals: there would be millions of spans.
+ */
+struct prof_zone_info_t
+{
+    const char *name;
+    bool log_spans;
+};
+
+static const prof_zone_info_t s_prof_zones[ PROF_Max ] =
+{
+    { "Load trace", true },
+    { "Header parse", true },
+    { "Page read", false },
+    { "Block decompress", true },
+    { "Record decode", false },
+    { "Field format", false },
+    { "StrPool intern", false },
+    { "init_new_event", false },
+    { "calculate_event_durations", true },
+    { "init_postload", true },
+    { "Render row events", true },
+    { "Render row timeline", true },
+    { "Render row hw timeline", true },
+    { "Render print timeline", true },
+    { "Render plot", true },
+    { "Render cpu lane", true },
+    { "Render vblanks", true },
+};
+
+struct prof_zone_stats_t
+{
+    std::atomic< uint64_t > count{ 0 };
+    std::atomic< uint64_t > total_ns{ 0 };
+    std::atomic< uint64_t > max_ns{ 0 };
+};
+
+struct prof_span_t
+{
+    uint64_t t0;
+    uint64_t t1;
+    uint32_t tid;
+    prof_zone_t zone;
+};
+
+std::atomic< bool > g_prof_enabled{ false };
+
+static const std::chrono::steady_clock::time_point s_prof_start = std::chrono::steady_clock::now();
+static prof_zone_stats_t s_prof_stats[ PROF_Max ];
+
+// Most recent spans. s_prof_span_next counts all spans ever added.
+static const size_t s_prof_span_max = 256 * 1024;
+static std::mutex s_prof_span_mutex;
+static std::vector< prof_span_t > s_prof_spans;
+static size_t s_prof_span_next = 0;
+
+static uint32_t prof_get_tid()
+{
+    static std::atomic< uint32_t > s_next_tid{ 1 };
+    static thread_local uint32_t t_tid = s_next_tid++;
+
+    return t_tid;
+}
+
+uint64_t prof_get_ns()
+{
+    auto dt = std::chrono::steady_clock::now() - s_prof_start;
+
+    return std::chrono::duration_cast< std::chrono::nanoseconds >( dt ).count() + 1;
+}
+
+void prof_add( prof_zone_t zone, uint64_t t0, uint64_t t1 )
+{
+    prof_zone_stats_t &stats = s_prof_stats[ zone ];
+    uint64_t dt = t1 - t0;
+    uint64_t max_ns = stats.max_ns.load( std::memory_order_relaxed );
+
+    stats.count.fetch_add( 1, std::memory_order_relaxed );
+    stats.total_ns.fetch_add( dt, std::memory_order_relaxed );
+
+    while ( ( dt > max_ns ) &&
+            !stats.max_ns.compare_exchange_weak( max_ns, dt, std::memory_order_relaxed ) )
+    {
+    }
+
+    if ( s_prof_zones[ zone ].log_spans )
+    {
+        std::lock_guard< std::mutex > lock( s_prof_span_mutex );
+
+        if ( s_prof_spans.size() < s_prof_span_max )
+            s_prof_spans.resize( s_prof_span_max );
+
+        prof_span_t &span = s_prof_spans[ s_prof_span_next++ % s_prof_span_max ];
+
+        span.t0 = t0;
+        span.t1 = t1;
+        span.tid = prof_get_tid();
+        span.zone = zone;
+    }
+}
+
+void prof_get_stats( prof_zone_t zone, prof_stats_t &stats )
+{
+    stats.name = s_prof_zones[ zone ].name;
+    stats.count = s_prof_stats[ zone ].count.load( std::memory_order_relaxed );
+    stats.total_ns = s_prof_stats[ zone ].total_ns.load( std::memory_order_relaxed );
+    stats.max_ns = s_prof_stats[ zone ].max_ns.load( std::memory_order_relaxed );
+}
+
+void prof_reset()
+{
+    for ( prof_zone_stats_t &stats : s_prof_stats )
+    {
+        stats.count = 0;
+        stats.total_ns = 0;
+        stats.max_ns = 0;
+    }
+
+    std::lock_guard< std::mutex > lock( s_prof_span_mutex );
+
+    s_prof_spans.clear();
+    s_prof_spans.shrink_to_fit();
+    s_prof_span_next = 0;
+}
+
+bool prof_save_chrome_trace( const char *filename )
+{
+    std::vector< prof_span_t > spans;
+
+    {
+        std::lock_guard< std::mutex > lock( s_prof_span_mutex );
+        size_t count = std::min< size_t >( s_prof_span_next, s_prof_span_max );
+
+        // Oldest span first
+        for ( size_t i = s_prof_span_next - count; i < s_prof_span_next; i++ )
+            spans.push_back( s_prof_spans[ i % s_prof_span_max ] );
+    }
+
+    FILE *fp = fopen( filename, "wb" );
+    if ( !fp )
+        return false;
+
+    fprintf( fp, "{\n\"traceEvents\": [\n" );
+    fprintf( fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"gpuvis\"}}" );
+
+    for ( const prof_span_t &span : spans )
+    {
+        // Chrome trace times are in microseconds
+        fprintf( fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                 s_prof_zones[ span.zone ].name, span.tid,
+                 span.t0 / 1000.0, ( span.t1 - span.t0 ) / 1000.0 );
+    }
+
+    fprintf( fp, "\n],\n\"otherData\": {" );
+    for ( uint32_t i = 0; i < PROF_Max; i++ )
+    {
+        prof_stats_t stats;
+
+        prof_get_stats( ( prof_zone_t )i, stats );
+        fprintf( fp, "%s\n\"%s\": \"count=%llu total=%.3fms max=%.3fms\"", i ? "," : "",
+                 stats.name, ( unsigned long long )stats.count,
+                 stats.total_ns / 1000000.0, stats.max_ns / 1000000.0 );
+    }
+    fprintf( fp, "\n}\n}\n" );
+
+    return !fclose( fp );
+}
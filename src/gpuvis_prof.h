@@ -0,0 +1,102 @@
+/*
+ * Copyright 2017 Valve Software
+ *
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef _GPUVIS_PROF_H_
+#define _GPUVIS_PROF_H_
+
+#include <stdint.h>
+#include <atomic>
+
+// Hot path timers and counters. Zones are only timed while g_prof_enabled is
+//  set since the clock calls add up in per record paths. Coarse zones also log
+//  spans which prof_save_chrome_trace() writes out for chrome://tracing.
+//
+//   void foo()
+//   {
+//       PROF_SCOPE( PROF_PageRead );
+//       ...
+//   }
+enum prof_zone_t
+{
+    PROF_LoadTrace,
+    PROF_HeaderParse,
+    PROF_PageRead,
+    PROF_BlockDecompress,
+    PROF_RecordDecode,
+    PROF_FieldFormat,
+    PROF_StrPoolIntern,
+    PROF_InitNewEvent,
+    PROF_EventDurations,
+    PROF_PostLoad,
+    PROF_RenderRowEvents,
+    PROF_RenderRowTimeline,
+    PROF_RenderRowHwTimeline,
+    PROF_RenderPrintTimeline,
+    PROF_RenderPlot,
+    PROF_RenderCpuLane,
+    PROF_RenderVblanks,
+    PROF_Max
+};
+
+struct prof_stats_t
+{
+    const char *name;
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+extern std::atomic< bool > g_prof_enabled;
+
+// Nanoseconds since profiling started. Never 0.
+uint64_t prof_get_ns();
+// Add time from t0 to t1 to zone.
+void prof_add( prof_zone_t zone, uint64_t t0, uint64_t t1 );
+
+void prof_get_stats( prof_zone_t zone, prof_stats_t &stats );
+void prof_reset();
+
+// Write logged spans and zone totals as Chrome trace event json.
+bool prof_save_chrome_trace( const char *filename );
+
+class prof_scope_t
+{
+public:
+    prof_scope_t( prof_zone_t zone ) : m_zone( zone ),
+        m_t0( g_prof_enabled.load( std::memory_order_relaxed ) ? prof_get_ns() : 0 ) {}
+    ~prof_scope_t()
+    {
+        if ( m_t0 )
+            prof_add( m_zone, m_t0, prof_get_ns() );
+    }
+
+private:
+    prof_zone_t m_zone;
+    uint64_t m_t0;
+};
+
+#define PROF_SCOPE_NAME2( _x, _y ) _x##_y
+#define PROF_SCOPE_NAME( _x, _y ) PROF_SCOPE_NAME2( _x, _y )
+#define PROF_SCOPE( _zone ) prof_scope_t PROF_SCOPE_NAME( prof_scope_, __LINE__ )( _zone )
+
+#endif // _GPUVIS_PROF_H_
@@ -0,0 +1,1391 @@
+/*
+ * Copyright 2017 Valve Software
+ *
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <float.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <set>
+#include <list>
+#include <unordered_map>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#if !defined( WIN32 )
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#include <SDL.h>
+
+#define YA_GETOPT_NO_COMPAT_MACRO
+#include "ya_getopt.h"
+
+#include "imgui/imgui.h"
+
+#include "tdopexpr.h"
+#include "trace-cmd/trace-read.h"
+
+#include "gpuvis_macros.h"
+#include "stlini.h"
+#include "gpuvis_utils.h"
+#include "gpuvis.h"
+#include "gpuvis_remote.h"
+
+// Largest message either side will accept
+static const uint32_t s_remote_msg_max = 64 * 1024 * 1024;
+// Most event list rows or pixels a client can ask for at once
+static const uint32_t s_remote_rows_max = 4096;
+static const uint32_t s_remote_pixels_max = 16384;
+// Requests a client sends ahead of the replies it has read. Sending just a
+//  few keeps both sides from blocking in send() with full socket buffers.
+static const size_t s_remote_inflight_max = 8;
+
+/*
+ * RemoteBuf
+ */
+class RemoteBuf
+{
+public:
+    RemoteBuf() {}
+    ~RemoteBuf() {}
+
+    void put_u8( uint8_t val )
+    {
+        m_data.push_back( val );
+    }
+    void put_u32( uint32_t val )
+    {
+        for ( int i = 0; i < 4; i++ )
+            m_data.push_back( ( uint8_t )( val >> ( i * 8 ) ) );
+    }
+    void put_u64( uint64_t val )
+    {
+        put_u32( ( uint32_t )val );
+        put_u32( ( uint32_t )( val >> 32 ) );
+    }
+    void put_f32( float val )
+    {
+        uint32_t u32;
+
+        memcpy( &u32, &val, sizeof( u32 ) );
+        put_u32( u32 );
+    }
+    void put_str( const char *str, size_t len )
+    {
+        put_u32( len );
+        m_data.insert( m_data.end(), str, str + len );
+    }
+    void put_str( const std::string &str )
+    {
+        put_str( str.c_str(), str.size() );
+    }
+
+    uint8_t get_u8()
+    {
+        const uint8_t *data = get( 1 );
+
+        return data ? data[ 0 ] : 0;
+    }
+    uint32_t get_u32()
+    {
+        const uint8_t *data = get( 4 );
+
+        return data ? ( data[ 0 ] | ( data[ 1 ] << 8 ) | ( data[ 2 ] << 16 ) | ( ( uint32_t )data[ 3 ] << 24 ) ) : 0;
+    }
+    uint64_t get_u64()
+    {
+        uint64_t lo = get_u32();
+
+        return lo | ( ( uint64_t )get_u32() << 32 );
+    }
+    float get_f32()
+    {
+        float val;
+        uint32_t u32 = get_u32();
+
+        memcpy( &val, &u32, sizeof( val ) );
+        return val;
+    }
+    std::string get_str()
+    {
+        uint32_t len = get_u32();
+        const uint8_t *data = get( len );
+
+        return data ? std::string( ( const char * )data, len ) : "";
+    }
+
+    void clear()
+    {
+        m_data.clear();
+        m_pos = 0;
+        m_err = false;
+    }
+
+protected:
+    const uint8_t *get( size_t size )
+    {
+        if ( m_err || ( size > m_data.size() - m_pos ) )
+        {
+            m_err = true;
+            return NULL;
+        }
+
+        m_pos += size;
+        return m_data.data() + m_pos - size;
+    }
+
+public:
+    std::vector< uint8_t > m_data;
+    size_t m_pos = 0;
+    // Set when a get ran past the end of m_data
+    bool m_err = false;
+};
+
+#if !defined( WIN32 )
+
+static bool remote_write( int fd, const void *data, size_t size )
+{
+    const char *ptr = ( const char * )data;
+
+    while ( size )
+    {
+        ssize_t ret = send( fd, ptr, size, MSG_NOSIGNAL );
+
+        if ( ret < 0 && errno == EINTR )
+            continue;
+        if ( ret <= 0 )
+            return false;
+
+        ptr += ret;
+        size -= ret;
+    }
+
+    return true;
+}
+
+static bool remote_read( int fd, void *data, size_t size )
+{
+    char *ptr = ( char * )data;
+
+    while ( size )
+    {
+        ssize_t ret = recv( fd, ptr, size, 0 );
+
+        if ( ret < 0 && errno == EINTR )
+            continue;
+        if ( ret <= 0 )
+            return false;
+
+        ptr += ret;
+        size -= ret;
+    }
+
+    return true;
+}
+
+static bool remote_send_msg( int fd, uint32_t type, const RemoteBuf &buf )
+{
+    RemoteBuf hdr;
+
+    hdr.put_u32( s_remote_magic );
+    hdr.put_u32( type );
+    hdr.put_u32( buf.m_data.size() );
+
+    return remote_write( fd, hdr.m_data.data(), hdr.m_data.size() ) &&
+            remote_write( fd, buf.m_data.data(), buf.m_data.size() );
+}
+
+static bool remote_recv_msg( int fd, uint32_t &type, RemoteBuf &buf )
+{
+    RemoteBuf hdr;
+
+    hdr.m_data.resize( 12 );
+    if ( !remote_read( fd, hdr.m_data.data(), hdr.m_data.size() ) )
+        return false;
+
+    uint32_t magic = hdr.get_u32();
+    type = hdr.get_u32();
+    uint32_t size = hdr.get_u32();
+
+    if ( ( magic != s_remote_magic ) || ( size > s_remote_msg_max ) )
+    {
+        logf( "[Error] %s: bad message header (magic 0x%x, %u bytes)", __func__, magic, size );
+        return false;
+    }
+
+    buf.clear();
+    buf.m_data.resize( size );
+    return remote_read( fd, buf.m_data.data(), size );
+}
+
+static void remote_set_nodelay( int fd )
+{
+    // Requests and replies are small and answered one after another
+    int val = 1;
+
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof( val ) );
+}
+
+/*
+ * Trace server
+ */
+struct remote_server_t
+{
+    TraceEvents trace_events;
+    GraphRows rows;
+
+    // TraceEvents caches lookups as it goes, so requests are handled one
+    //  at a time across all clients.
+    std::mutex mutex;
+
+    // Connected client sockets. Shut down when the server quits so the
+    //  client threads exit before the server goes away.
+    std::mutex clients_mutex;
+    std::condition_variable clients_cond;
+    std::set< int > client_fds;
+};
+
+struct remote_client_t
+{
+    // Event ids matching the client's last filter (or NULL)
+    const std::vector< uint32_t > *filter_locs = nullptr;
+};
+
+static std::string remote_event_info( TraceEvents &trace_events, const trace_event_t &event )
+{
+    std::string info;
+    const char *comm = trace_events.comm_str( event.comm_id );
+    const char *user_comm = trace_events.comm_str( event.user_comm_id );
+
+    if ( user_comm != comm )
+        info += string_format( "user_comm=%s ", user_comm );
+
+    for ( uint32_t i = 0; i < event.numfields; i++ )
+        info += string_format( "%s=%s ", event.fields[ i ].key, event.get_field_value( i ) );
+
+    return info + string_format( "system=%s", event.system );
+}
+
+static bool remote_serve_info( remote_server_t &server, RemoteBuf &req, RemoteBuf &reply, std::string &err )
+{
+    TraceEvents &trace_events = server.trace_events;
+    std::vector< const GraphRows::graph_rows_info_t * > rows;
+
+    for ( const GraphRows::graph_rows_info_t &info : server.rows.m_graph_rows_list )
+    {
+        if ( !info.hidden )
+            rows.push_back( &info );
+    }
+
+    reply.put_u32( s_remote_version );
+    reply.put_str( trace_events.m_title );
+    reply.put_u64( trace_events.m_events.size() );
+    reply.put_u64( trace_events.m_events.empty() ? 0 : trace_events.m_events.front().ts );
+    reply.put_u64( trace_events.m_events.empty() ? 0 : trace_events.m_events.back().ts );
+
+    reply.put_u32( rows.size() );
+    for ( const GraphRows::graph_rows_info_t *info : rows )
+    {
+        reply.put_str( info->row_name );
+        reply.put_u32( info->type );
+        reply.put_u64( info->event_count );
+    }
+
+    return true;
+}
+
+static bool remote_serve_row( remote_server_t &server, RemoteBuf &req, RemoteBuf &reply, std::string &err )
+{
+    TraceEvents &trace_events = server.trace_events;
+    std::string name = req.get_str();
+    int64_t ts0 = req.get_u64();
+    int64_t ts1 = req.get_u64();
+    uint32_t pixels = req.get_u32();
+
+    // Timestamps come from the client: ts1 - ts0 has to fit in an int64_t
+    if ( req.m_err || ( ts1 <= ts0 ) || ( ( ts0 < 0 ) && ( ts1 > INT64_MAX + ts0 ) ) ||
+         !pixels || ( pixels > s_remote_pixels_max ) )
+    {
+        err = "Bad row request";
+        return false;
+    }
+
+    TraceEvents::loc_type_t type;
+    const std::vector< uint32_t > *plocs = trace_events.get_locs( name.c_str(), &type );
+    GraphPlot *plot = ( plocs && ( type == TraceEvents::LOC_TYPE_Plot ) ) ?
+                trace_events.get_plot_ptr( name.c_str() ) : NULL;
+
+    if ( !plocs || ( ( type == TraceEvents::LOC_TYPE_Plot ) && !plot ) )
+    {
+        err = string_format( "Unknown row %s", name.c_str() );
+        return false;
+    }
+
+    // Plot rows are drawn from their values, the rest from their events
+    std::function< int64_t ( size_t ) > get_ts;
+    size_t count;
+
+    if ( plot )
+    {
+        get_ts = [plot]( size_t i ) { return plot->m_plotdata[ i ].ts; };
+        count = plot->m_plotdata.size();
+    }
+    else
+    {
+        get_ts = [&]( size_t i ) { return trace_events.m_events[ ( *plocs )[ i ] ].ts; };
+        count = plocs->size();
+    }
+
+    // First index in [lo, count) with ts >= ts
+    auto lower_bound = [&]( size_t lo, int64_t ts )
+    {
+        size_t hi = count;
+
+        while ( lo < hi )
+        {
+            size_t mid = lo + ( hi - lo ) / 2;
+
+            if ( get_ts( mid ) < ts )
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    };
+
+    // Clamp the lookups to the trace so ts1 + 1 can't overflow
+    int64_t ts_first = trace_events.m_events.empty() ? 0 : trace_events.m_events.front().ts;
+    int64_t ts_last = trace_events.m_events.empty() ? 0 : trace_events.m_events.back().ts;
+    size_t idx0 = lower_bound( 0, std::max< int64_t >( ts0, ts_first ) );
+    size_t idx1 = ( ts1 < ts_first ) ? idx0 : lower_bound( idx0, std::min< int64_t >( ts1, ts_last ) + 1 );
+    bool detail = ( idx1 - idx0 <= pixels );
+
+    reply.put_u32( type );
+    reply.put_u8( detail );
+
+    if ( detail )
+    {
+        reply.put_u32( idx1 - idx0 );
+
+        for ( size_t i = idx0; i < idx1; i++ )
+        {
+            uint32_t id = plot ? plot->m_plotdata[ i ].eventid : ( *plocs )[ i ];
+            const trace_event_t &event = trace_events.m_events[ id ];
+
+            reply.put_u32( id );
+            reply.put_u64( get_ts( i ) );
+            reply.put_u32( is_valid_id( event.duration ) ? event.duration : 0 );
+            reply.put_u32( event.color );
+        }
+        return true;
+    }
+
+    size_t idx = idx0;
+
+    for ( uint32_t px = 0; px < pixels; px++ )
+    {
+        int64_t ts_end = ts0 + ( int64_t )( ( double )( ts1 - ts0 ) * ( px + 1 ) / pixels );
+        size_t end = ( px + 1 == pixels ) ? idx1 : lower_bound( idx, ts_end );
+        float valmin = 0.0f;
+        float valmax = 0.0f;
+
+        if ( plot && ( end > idx ) )
+        {
+            valmin = FLT_MAX;
+            valmax = -FLT_MAX;
+
+            for ( size_t i = idx; i < end; i++ )
+            {
+                valmin = std::min< float >( valmin, plot->m_plotdata[ i ].valf );
+                valmax = std::max< float >( valmax, plot->m_plotdata[ i ].valf );
+            }
+        }
+
+        reply.put_u32( end - idx );
+        reply.put_f32( valmin );
+        reply.put_f32( valmax );
+        idx = end;
+    }
+
+    return true;
+}
+
+static bool remote_serve_filter( remote_server_t &server, remote_client_t &client,
+                                 RemoteBuf &req, RemoteBuf &reply, std::string &err )
+{
+    std::string expr = req.get_str();
+    std::string errstr;
+
+    if ( req.m_err )
+    {
+        err = "Bad filter request";
+        return false;
+    }
+
+    client.filter_locs = server.trace_events.get_tdopexpr_locs( expr.c_str(), &errstr );
+
+    reply.put_str( errstr );
+    reply.put_u64( client.filter_locs ? client.filter_locs->size() : 0 );
+    return true;
+}
+
+static bool remote_serve_events( remote_server_t &server, remote_client_t &client,
+                                 RemoteBuf &req, RemoteBuf &reply, std::string &err )
+{
+    TraceEvents &trace_events = server.trace_events;
+    bool filtered = !!req.get_u8();
+    uint64_t start = req.get_u64();
+    uint32_t count = req.get_u32();
+
+    if ( req.m_err || ( count > s_remote_rows_max ) )
+    {
+        err = "Bad events request";
+        return false;
+    }
+
+    uint64_t total = filtered ? ( client.filter_locs ? client.filter_locs->size() : 0 ) :
+                                trace_events.m_events.size();
+    start = std::min< uint64_t >( start, total );
+
+    uint64_t end = std::min< uint64_t >( total, start + count );
+
+    reply.put_u64( total );
+    reply.put_u32( end - start );
+
+    for ( uint64_t i = start; i < end; i++ )
+    {
+        uint32_t id = filtered ? ( *client.filter_locs )[ i ] : ( uint32_t )i;
+        const trace_event_t &event = trace_events.m_events[ id ];
+
+        reply.put_u32( id );
+        reply.put_u64( event.ts );
+        reply.put_u32( is_valid_id( event.duration ) ? event.duration : 0 );
+        reply.put_str( trace_events.comm_str( event.comm_id ) );
+        reply.put_str( event.name );
+        reply.put_str( remote_event_info( trace_events, event ) );
+    }
+
+    return true;
+}
+
+static void remote_serve_client( remote_server_t *server, int fd, std::string peer )
+{
+    remote_client_t client;
+    RemoteBuf req;
+    RemoteBuf reply;
+    uint32_t type;
+
+    remote_set_nodelay( fd );
+    logf( "Client %s connected", peer.c_str() );
+
+    while ( remote_recv_msg( fd, type, req ) )
+    {
+        std::string err;
+        bool ret = false;
+
+        reply.clear();
+        {
+            std::lock_guard< std::mutex > lock( server->mutex );
+
+            switch ( type )
+            {
+            case REMOTE_Info:
+                ret = remote_serve_info( *server, req, reply, err );
+                break;
+            case REMOTE_Row:
+                ret = remote_serve_row( *server, req, reply, err );
+                break;
+            case REMOTE_Filter:
+                ret = remote_serve_filter( *server, client, req, reply, err );
+                break;
+            case REMOTE_Events:
+                ret = remote_serve_events( *server, client, req, reply, err );
+                break;
+            default:
+                err = string_format( "Unknown request %u", type );
+                break;
+            }
+        }
+
+        if ( !ret )
+        {
+            reply.clear();
+            reply.put_str( err );
+            type = REMOTE_Error;
+        }
+
+        if ( !remote_send_msg( fd, type, reply ) )
+            break;
+    }
+
+    logf( "Client %s disconnected", peer.c_str() );
+
+    std::lock_guard< std::mutex > lock( server->clients_mutex );
+
+    close( fd );
+    server->client_fds.erase( fd );
+    server->clients_cond.notify_all();
+}
+
+static int remote_listen( const char *bind_addr, uint16_t port )
+{
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    std::string port_str = std::to_string( port );
+
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    int ret = getaddrinfo( bind_addr, port_str.c_str(), &hints, &res );
+    if ( ret )
+    {
+        logf( "[Error] %s: getaddrinfo(%s) failed: %s", __func__, bind_addr, gai_strerror( ret ) );
+        return -1;
+    }
+
+    int fd = -1;
+    for ( struct addrinfo *ai = res; ai; ai = ai->ai_next )
+    {
+        int val = 1;
+
+        fd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+        if ( fd < 0 )
+            continue;
+
+        setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof( val ) );
+        if ( !bind( fd, ai->ai_addr, ai->ai_addrlen ) && !listen( fd, 8 ) )
+            break;
+
+        close( fd );
+        fd = -1;
+    }
+    freeaddrinfo( res );
+
+    if ( fd < 0 )
+        logf( "[Error] %s: can't listen on %s:%u: %s", __func__, bind_addr, port, strerror( errno ) );
+    return fd;
+}
+
+static int remote_connect( const std::string &address, std::string &err )
+{
+    std::string host = address;
+    std::string port = std::to_string( s_remote_port );
+    size_t colon = address.rfind( ':' );
+
+    // host, host:port, [v6addr] or [v6addr]:port
+    if ( address[ 0 ] == '[' )
+    {
+        size_t bracket = address.find( ']' );
+
+        host = address.substr( 1, bracket - 1 );
+        if ( ( bracket != std::string::npos ) && ( colon == bracket + 1 ) )
+            port = address.substr( colon + 1 );
+    }
+    else if ( ( colon != std::string::npos ) && ( address.find( ':' ) == colon ) )
+    {
+        host = address.substr( 0, colon );
+        port = address.substr( colon + 1 );
+    }
+
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int ret = getaddrinfo( host.c_str(), port.c_str(), &hints, &res );
+    if ( ret )
+    {
+        err = string_format( "Can't resolve %s: %s", host.c_str(), gai_strerror( ret ) );
+        return -1;
+    }
+
+    int fd = -1;
+    for ( struct addrinfo *ai = res; ai; ai = ai->ai_next )
+    {
+        fd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+        if ( fd < 0 )
+            continue;
+
+        if ( !connect( fd, ai->ai_addr, ai->ai_addrlen ) )
+            break;
+
+        close( fd );
+        fd = -1;
+    }
+    freeaddrinfo( res );
+
+    if ( fd < 0 )
+        err = string_format( "Can't connect to %s: %s", address.c_str(), strerror( errno ) );
+    else
+        remote_set_nodelay( fd );
+    return fd;
+}
+
+static void remote_flush_log( size_t &log_count )
+{
+    logf_update();
+
+    const std::vector< char * > &log = logf_get();
+
+    for ( ; log_count < log.size(); log_count++ )
+        fprintf( stderr, "%s\n", log[ log_count ] );
+}
+
+#endif // !WIN32
+
+bool remote_serve_requested( int argc, char **argv )
+{
+    for ( int i = 1; i < argc; i++ )
+    {
+        if ( !strcmp( argv[ i ], "--serve" ) )
+            return true;
+    }
+
+    return false;
+}
+
+#if !defined( WIN32 )
+static volatile sig_atomic_t s_remote_quit = 0;
+
+static void remote_quit_handler( int signum )
+{
+    s_remote_quit = 1;
+}
+#endif
+
+int remote_serve_main( int argc, char **argv )
+{
+#if defined( WIN32 )
+    fprintf( stderr, "[Error] %s: --serve isn't supported on Windows\n", __func__ );
+    return -1;
+#else
+    static struct option long_opts[] =
+    {
+        { "serve", ya_no_argument, 0, 0 },
+        { "port", ya_required_argument, 0, 'p' },
+        { "bind", ya_required_argument, 0, 'b' },
+        { 0, 0, 0, 0 }
+    };
+
+    uint16_t port = s_remote_port;
+    const char *bind_addr = "localhost";
+    std::vector< std::string > files;
+
+    int c;
+    int opt_ind = 0;
+    while ( ( c = ya_getopt_long( argc, argv, "p:b:", long_opts, &opt_ind ) ) != -1 )
+    {
+        switch ( c )
+        {
+        case 'p':
+            port = atoi( ya_optarg );
+            break;
+        case 'b':
+            bind_addr = ya_optarg;
+            break;
+        default:
+            break;
+        }
+    }
+
+    for ( ; ya_optind < argc; ya_optind++ )
+        files.push_back( argv[ ya_optind ] );
+
+    if ( files.empty() || !port )
+    {
+        fprintf( stderr, "Usage: %s --serve [--port N] [--bind addr] trace.dat...\n", argv[ 0 ] );
+        return -1;
+    }
+
+    logf_init();
+    s_ini().Open( "gpuvis", "gpuvis.ini" );
+    s_clrs().init();
+    s_opts().init();
+
+    size_t log_count = 0;
+    remote_server_t server;
+    TraceEvents &trace_events = server.trace_events;
+    TraceLoader loader;
+
+    trace_events.m_filename = files[ 0 ];
+    trace_events.m_filenames = files;
+    trace_events.m_title = files[ 0 ];
+    if ( files.size() > 1 )
+        trace_events.m_title += string_format( " +%zu", files.size() - 1 );
+    for ( const std::string &file : files )
+        trace_events.m_filesize += get_file_size( file.c_str() );
+
+    bool loaded = loader.load_files_sync( &trace_events, files, s_opts().getb( OPT_ParallelLoad ) );
+    if ( loaded && !trace_events.m_events.empty() )
+    {
+        util_time_t t0 = util_get_time();
+
+        trace_events.init_postload( s_ini().GetSectionEntries( "$graph_plots$" ) );
+        server.rows.init( trace_events );
+        util_malloc_trim();
+
+        logf( "Processed %zu events (%.2fms)", trace_events.m_events.size(),
+              util_time_to_ms( t0, util_get_time() ) );
+    }
+
+    int listen_fd = loaded ? remote_listen( bind_addr, port ) : -1;
+    if ( listen_fd < 0 )
+    {
+        remote_flush_log( log_count );
+        return 1;
+    }
+
+    logf( "Serving %s on %s port %u", trace_events.m_title.c_str(), bind_addr, port );
+
+    // Ctrl+C or kill stops the server
+    signal( SIGINT, remote_quit_handler );
+    signal( SIGTERM, remote_quit_handler );
+
+    while ( !s_remote_quit )
+    {
+        struct pollfd pfd = { listen_fd, POLLIN, 0 };
+
+        // Clients log from their own threads, so pass messages along as they come in
+        remote_flush_log( log_count );
+
+        if ( poll( &pfd, 1, 250 ) <= 0 )
+            continue;
+
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof( addr );
+        int fd = accept( listen_fd, ( struct sockaddr * )&addr, &addrlen );
+
+        if ( fd >= 0 )
+        {
+            char host[ NI_MAXHOST ] = "?";
+            char serv[ NI_MAXSERV ] = "?";
+
+            getnameinfo( ( struct sockaddr * )&addr, addrlen, host, sizeof( host ), serv, sizeof( serv ),
+                         NI_NUMERICHOST | NI_NUMERICSERV );
+
+            std::lock_guard< std::mutex > lock( server.clients_mutex );
+
+            server.client_fds.insert( fd );
+            std::thread( remote_serve_client, &server, fd, string_format( "%s:%s", host, serv ) ).detach();
+        }
+    }
+
+    close( listen_fd );
+    logf( "Shutting down" );
+
+    // Wake the client threads up and wait for them to let go of the server
+    {
+        std::unique_lock< std::mutex > lock( server.clients_mutex );
+
+        for ( int fd : server.client_fds )
+            shutdown( fd, SHUT_RDWR );
+        server.clients_cond.wait( lock, [&]() { return server.client_fds.empty(); } );
+    }
+
+    remote_flush_log( log_count );
+    return 0;
+#endif
+}
+
+/*
+ * RemoteTraceWin
+ */
+RemoteTraceWin::RemoteTraceWin( const char *address )
+{
+    m_address = address;
+    m_title = string_format( "Remote: %s", address );
+    m_status = "Connecting...";
+
+    m_thread = std::thread( thread_func, this );
+}
+
+RemoteTraceWin::~RemoteTraceWin()
+{
+    {
+        std::lock_guard< std::mutex > lock( m_mutex );
+
+        m_quit = true;
+    }
+    m_cond.notify_one();
+
+#if !defined( WIN32 )
+    // Wake the worker if it's waiting on the server
+    int fd = m_fd.load();
+    if ( fd >= 0 )
+        shutdown( fd, SHUT_RDWR );
+#endif
+
+    m_thread.join();
+}
+
+bool RemoteTraceWin::needs_redraw()
+{
+    std::lock_guard< std::mutex > lock( m_mutex );
+
+    return m_dirty || ( m_connected && ( m_reply_generation != m_view_generation ) );
+}
+
+void RemoteTraceWin::set_view( const view_t &view )
+{
+    {
+        std::lock_guard< std::mutex > lock( m_mutex );
+
+        m_view = view;
+        m_view_generation++;
+    }
+    m_cond.notify_one();
+}
+
+void RemoteTraceWin::thread_func( RemoteTraceWin *win )
+{
+#if defined( WIN32 )
+    std::lock_guard< std::mutex > lock( win->m_mutex );
+
+    win->m_status = "Remote traces aren't supported on Windows";
+    win->m_dirty = true;
+#else
+    std::string err;
+    int fd = remote_connect( win->m_address, err );
+    RemoteBuf buf;
+    uint32_t type;
+
+    win->m_fd = fd;
+
+    if ( ( fd >= 0 ) && remote_send_msg( fd, REMOTE_Info, buf ) && remote_recv_msg( fd, type, buf ) &&
+         ( type == REMOTE_Info ) && ( buf.get_u32() == s_remote_version ) )
+    {
+        std::lock_guard< std::mutex > lock( win->m_mutex );
+
+        win->m_trace_title = buf.get_str();
+        win->m_event_count = buf.get_u64();
+        win->m_ts_first = buf.get_u64();
+        win->m_ts_last = buf.get_u64();
+
+        uint32_t count = buf.get_u32();
+        for ( uint32_t i = 0; ( i < count ) && !buf.m_err; i++ )
+        {
+            row_t row;
+
+            row.name = buf.get_str();
+            row.type = buf.get_u32();
+            row.events = buf.get_u64();
+            win->m_rows.push_back( row );
+        }
+
+        win->m_connected = !buf.m_err;
+        win->m_status = win->m_connected ? "" : "Bad reply from server";
+        win->m_dirty = true;
+    }
+    else
+    {
+        std::lock_guard< std::mutex > lock( win->m_mutex );
+
+        win->m_status = ( fd < 0 ) ? err : "Server didn't answer or runs a different version";
+        win->m_dirty = true;
+    }
+
+    uint32_t filter_generation = 0;
+    uint32_t generation = 0;
+
+    while ( win->m_connected )
+    {
+        view_t view;
+        {
+            std::unique_lock< std::mutex > lock( win->m_mutex );
+
+            win->m_cond.wait( lock, [&]() { return win->m_quit || ( win->m_view_generation != generation ); } );
+            if ( win->m_quit )
+                break;
+
+            view = win->m_view;
+            generation = win->m_view_generation;
+        }
+
+        if ( !win->query( fd, view, filter_generation ) )
+        {
+            std::lock_guard< std::mutex > lock( win->m_mutex );
+
+            win->m_status = "Lost connection to server";
+            win->m_connected = false;
+            win->m_dirty = true;
+            break;
+        }
+
+        std::lock_guard< std::mutex > lock( win->m_mutex );
+
+        win->m_reply_generation = generation;
+    }
+
+    win->m_fd = -1;
+    if ( fd >= 0 )
+        close( fd );
+#endif
+}
+
+bool RemoteTraceWin::query( int fd, const view_t &view, uint32_t &filter_generation )
+{
+#if defined( WIN32 )
+    return false;
+#else
+    // Requests for the view in the order they're sent. Replies come back in
+    //  the same order, so the whole view costs about one round trip.
+    struct request_t
+    {
+        uint32_t type;
+        size_t row;
+        RemoteBuf buf;
+    };
+    std::vector< request_t > requests;
+
+    if ( view.filter_generation != filter_generation )
+    {
+        requests.push_back( { REMOTE_Filter, 0, RemoteBuf() } );
+        requests.back().buf.put_str( view.filter );
+    }
+
+    size_t row_end = view.pixels ? std::min< size_t >( view.row_start + view.row_count, m_rows.size() ) : 0;
+
+    for ( size_t row = view.row_start; row < row_end; row++ )
+    {
+        requests.push_back( { REMOTE_Row, row, RemoteBuf() } );
+
+        RemoteBuf &req = requests.back().buf;
+        req.put_str( m_rows[ row ].name );
+        req.put_u64( view.ts0 );
+        req.put_u64( view.ts1 );
+        req.put_u32( view.pixels );
+    }
+
+    if ( view.list_count )
+    {
+        requests.push_back( { REMOTE_Events, 0, RemoteBuf() } );
+
+        RemoteBuf &req = requests.back().buf;
+        req.put_u8( !view.filter.empty() );
+        req.put_u64( view.list_start );
+        req.put_u32( view.list_count );
+    }
+
+    RemoteBuf buf;
+    uint32_t type;
+    size_t sent = 0;
+    std::string filter_err = m_filter_err;
+    uint64_t filter_matches = m_filter_matches;
+    std::vector< row_data_t > row_data( row_end > view.row_start ? row_end - view.row_start : 0 );
+    uint64_t list_total = 0;
+    std::vector< list_row_t > list_rows;
+
+    for ( size_t received = 0; received < requests.size(); received++ )
+    {
+        // Stay a few requests ahead of the replies
+        while ( ( sent < requests.size() ) && ( sent - received < s_remote_inflight_max ) )
+        {
+            if ( !remote_send_msg( fd, requests[ sent ].type, requests[ sent ].buf ) )
+                return false;
+            sent++;
+        }
+
+        if ( !remote_recv_msg( fd, type, buf ) )
+            return false;
+
+        const request_t &req = requests[ received ];
+
+        if ( req.type == REMOTE_Filter )
+        {
+            filter_err = buf.get_str();
+            filter_matches = ( type == REMOTE_Filter ) ? buf.get_u64() : 0;
+            filter_generation = view.filter_generation;
+        }
+        else if ( ( req.type == REMOTE_Row ) && ( type == REMOTE_Row ) )
+        {
+            row_data_t &data = row_data[ req.row - view.row_start ];
+
+            data.type = buf.get_u32();
+            data.detail = !!buf.get_u8();
+
+            if ( data.detail )
+            {
+                uint32_t count = buf.get_u32();
+
+                for ( uint32_t i = 0; ( i < count ) && !buf.m_err; i++ )
+                {
+                    row_event_t event;
+
+                    event.id = buf.get_u32();
+                    event.ts = buf.get_u64();
+                    event.duration = buf.get_u32();
+                    event.color = buf.get_u32();
+                    data.events.push_back( event );
+                }
+            }
+            else
+            {
+                data.buckets.resize( view.pixels );
+
+                for ( row_bucket_t &bucket : data.buckets )
+                {
+                    bucket.count = buf.get_u32();
+                    bucket.min = buf.get_f32();
+                    bucket.max = buf.get_f32();
+                }
+            }
+        }
+        else if ( ( req.type == REMOTE_Events ) && ( type == REMOTE_Events ) )
+        {
+            list_total = buf.get_u64();
+
+            uint32_t count = buf.get_u32();
+            for ( uint32_t i = 0; ( i < count ) && !buf.m_err; i++ )
+            {
+                list_row_t row;
+
+                row.id = buf.get_u32();
+                row.ts = buf.get_u64();
+                row.duration = buf.get_u32();
+                row.comm = buf.get_str();
+                row.name = buf.get_str();
+                row.info = buf.get_str();
+                list_rows.push_back( row );
+            }
+        }
+    }
+
+    std::lock_guard< std::mutex > lock( m_mutex );
+
+    m_reply_view = view;
+    m_row_data.swap( row_data );
+    m_filter_err = filter_err;
+    m_filter_matches = filter_matches;
+    m_list_total = list_total;
+    m_list_rows.swap( list_rows );
+    m_dirty = true;
+    return true;
+#endif
+}
+
+static std::string remote_ts_str( int64_t ts )
+{
+    return string_format( "%.6fms", ts / ( double )NSECS_PER_MSEC );
+}
+
+void RemoteTraceWin::render()
+{
+    ImGui::SetNextWindowSize( ImVec2( imgui_scale( 1000.0f ), imgui_scale( 700.0f ) ), ImGuiSetCond_FirstUseEver );
+
+    if ( !ImGui::Begin( m_title.c_str(), &m_open ) )
+    {
+        ImGui::End();
+        return;
+    }
+
+    bool connected;
+    {
+        std::lock_guard< std::mutex > lock( m_mutex );
+
+        m_dirty = false;
+        connected = m_connected;
+
+        if ( !m_status.empty() )
+            ImGui::TextColored( ImVec4( 1, 1, 0, 1 ), "%s", m_status.c_str() );
+
+        if ( connected && !m_ui_inited )
+        {
+            m_ui_view.ts0 = m_ts_first;
+            m_ui_view.ts1 = std::max< int64_t >( m_ts_last, m_ts_first + 1 );
+            m_ui_inited = true;
+        }
+    }
+
+    if ( connected )
+    {
+        view_t view = m_ui_view;
+
+        ImGui::Text( "%s: %llu events", m_trace_title.c_str(), ( unsigned long long )m_event_count );
+
+        if ( ImGui::CollapsingHeader( "Events Graph", ImGuiTreeNodeFlags_DefaultOpen ) )
+            render_graph();
+
+        if ( ImGui::CollapsingHeader( "Events List", ImGuiTreeNodeFlags_DefaultOpen ) )
+            render_event_list();
+
+        const view_t &v = m_ui_view;
+        if ( ( v.ts0 != view.ts0 ) || ( v.ts1 != view.ts1 ) || ( v.pixels != view.pixels ) ||
+             ( v.row_start != view.row_start ) || ( v.row_count != view.row_count ) ||
+             ( v.list_start != view.list_start ) || ( v.list_count != view.list_count ) ||
+             ( v.filter_generation != view.filter_generation ) )
+        {
+            set_view( m_ui_view );
+        }
+    }
+
+    ImGui::End();
+}
+
+void RemoteTraceWin::render_graph()
+{
+    std::lock_guard< std::mutex > lock( m_mutex );
+
+    float row_h = imgui_scale( 24.0f );
+    float w = ImGui::GetContentRegionAvailWidth();
+    float h = row_h * m_rows.size();
+    ImVec2 pos = ImGui::GetCursorScreenPos();
+    ImDrawList *draw_list = ImGui::GetWindowDrawList();
+    view_t &view = m_ui_view;
+    int64_t tsdx = view.ts1 - view.ts0;
+
+    ImGui::Text( "%s - %s (%s)", remote_ts_str( view.ts0 ).c_str(), remote_ts_str( view.ts1 ).c_str(),
+                 remote_ts_str( tsdx ).c_str() );
+    ImGui::SameLine();
+    if ( ImGui::SmallButton( "Zoom Out" ) )
+    {
+        view.ts0 = m_ts_first;
+        view.ts1 = std::max< int64_t >( m_ts_last, m_ts_first + 1 );
+    }
+
+    pos = ImGui::GetCursorScreenPos();
+    ImGui::InvisibleButton( "##remote_graph", ImVec2( w, std::max< float >( h, row_h ) ) );
+
+    view.pixels = std::max< uint32_t >( 1, std::min< uint32_t >( w, s_remote_pixels_max ) );
+
+    // Only ask for the rows that are scrolled into view
+    size_t row_start = m_rows.size();
+    size_t row_end = 0;
+    for ( size_t i = 0; i < m_rows.size(); i++ )
+    {
+        float y = pos.y + i * row_h;
+
+        if ( ImGui::IsRectVisible( ImVec2( pos.x, y ), ImVec2( pos.x + w, y + row_h ) ) )
+        {
+            row_start = std::min< size_t >( row_start, i );
+            row_end = i + 1;
+        }
+    }
+    view.row_start = ( row_end > row_start ) ? row_start : 0;
+    view.row_count = ( row_end > row_start ) ? row_end - row_start : 0;
+
+    // Only draw what we have replies for this time range
+    bool current = ( m_reply_view.ts0 == view.ts0 ) && ( m_reply_view.ts1 == view.ts1 ) &&
+            ( m_reply_view.pixels == view.pixels );
+    auto ts_to_x = [&]( int64_t ts ) { return pos.x + w * ( ts - view.ts0 ) / ( double )tsdx; };
+
+    draw_list->AddRectFilled( pos, ImVec2( pos.x + w, pos.y + h ), s_clrs().get( col_Graph_Bk ) );
+
+    for ( size_t i = 0; i < m_rows.size(); i++ )
+    {
+        float y = pos.y + i * row_h;
+
+        draw_list->AddRectFilled( ImVec2( pos.x, y + 1 ), ImVec2( pos.x + w, y + row_h - 1 ),
+                                  s_clrs().get( col_Graph_RowBk ) );
+
+        if ( current && ( i >= m_reply_view.row_start ) && ( i - m_reply_view.row_start < m_row_data.size() ) )
+        {
+            const row_data_t &data = m_row_data[ i - m_reply_view.row_start ];
+
+            if ( data.detail )
+            {
+                for ( const row_event_t &event : data.events )
+                {
+                    float x0 = ts_to_x( event.ts );
+                    float x1 = std::max< float >( x0 + 1.0f, ts_to_x( event.ts + event.duration ) );
+                    ImU32 color = event.color ? event.color : s_clrs().get( col_Graph_1Event );
+
+                    draw_list->AddRectFilled( ImVec2( x0, y + 2 ), ImVec2( x1, y + row_h - 2 ), color );
+                }
+            }
+            else if ( data.type == TraceEvents::LOC_TYPE_Plot )
+            {
+                float minval = FLT_MAX;
+                float maxval = -FLT_MAX;
+
+                for ( const row_bucket_t &bucket : data.buckets )
+                {
+                    if ( bucket.count )
+                    {
+                        minval = std::min< float >( minval, bucket.min );
+                        maxval = std::max< float >( maxval, bucket.max );
+                    }
+                }
+
+                float range = std::max< float >( maxval - minval, FLT_EPSILON );
+                for ( size_t px = 0; px < data.buckets.size(); px++ )
+                {
+                    const row_bucket_t &bucket = data.buckets[ px ];
+
+                    if ( bucket.count )
+                    {
+                        float y0 = y + row_h - 2 - ( row_h - 4 ) * ( bucket.max - minval ) / range;
+                        float y1 = y + row_h - 2 - ( row_h - 4 ) * ( bucket.min - minval ) / range;
+
+                        draw_list->AddLine( ImVec2( pos.x + px, y0 ), ImVec2( pos.x + px, y1 + 1 ),
+                                            s_clrs().get( col_Graph_1Event ) );
+                    }
+                }
+            }
+            else
+            {
+                // Shade pixels by how many events landed in them
+                for ( size_t px = 0; px < data.buckets.size(); px++ )
+                {
+                    uint32_t count = data.buckets[ px ].count;
+
+                    if ( count )
+                    {
+                        colors_t col = ( colors_t )( col_Graph_1Event + std::min< uint32_t >( count, 6 ) - 1 );
+
+                        draw_list->AddLine( ImVec2( pos.x + px, y + 2 ), ImVec2( pos.x + px, y + row_h - 2 ),
+                                            s_clrs().get( col ) );
+                    }
+                }
+            }
+        }
+
+        std::string label = string_format( "%s (%llu events)", m_rows[ i ].name.c_str(), ( unsigned long long )m_rows[ i ].events );
+        draw_list->AddText( ImVec2( pos.x + imgui_scale( 4.0f ), y + 2 ),
+                            s_clrs().get( col_Graph_RowLabelText ), label.c_str() );
+    }
+
+    if ( ImGui::IsItemHovered() )
+    {
+        ImGuiIO &io = ImGui::GetIO();
+        double mouse_frac = std::min< double >( std::max< double >( ( io.MousePos.x - pos.x ) / w, 0.0 ), 1.0 );
+
+        // Wheel zooms around the mouse, dragging pans
+        if ( io.MouseWheel )
+        {
+            int64_t len = std::max< int64_t >( tsdx * ( io.MouseWheel > 0 ? 0.8 : 1.25 ), 1000 );
+            int64_t ts_mouse = view.ts0 + ( int64_t )( tsdx * mouse_frac );
+
+            view.ts0 = ts_mouse - ( int64_t )( len * mouse_frac );
+            view.ts1 = view.ts0 + len;
+        }
+        else if ( ImGui::IsMouseDragging( 0 ) && io.MouseDelta.x )
+        {
+            int64_t dts = ( int64_t )( -io.MouseDelta.x * tsdx / w );
+
+            view.ts0 += dts;
+            view.ts1 += dts;
+        }
+
+        ImGui::SetTooltip( "Time: %s", remote_ts_str( view.ts0 + ( int64_t )( tsdx * mouse_frac ) ).c_str() );
+    }
+}
+
+void RemoteTraceWin::render_event_list()
+{
+    view_t &view = m_ui_view;
+
+    if ( imgui_input_text2( "Filter:", m_filter_buf, 500.0f, ImGuiInputTextFlags_EnterReturnsTrue ) )
+    {
+        view.filter = m_filter_buf;
+        view.filter_generation++;
+        view.list_start = 0;
+    }
+
+    std::lock_guard< std::mutex > lock( m_mutex );
+
+    bool current = ( m_reply_view.filter_generation == view.filter_generation );
+
+    if ( !view.filter.empty() && current )
+    {
+        ImGui::SameLine();
+        if ( !m_filter_err.empty() )
+            ImGui::TextColored( ImVec4( 1, 0, 0, 1 ), "%s", m_filter_err.c_str() );
+        else
+            ImGui::Text( "%llu matches", ( unsigned long long )m_filter_matches );
+    }
+
+    uint64_t total = view.filter.empty() ? m_event_count : ( current ? m_list_total : 0 );
+    float row_h = ImGui::GetTextLineHeightWithSpacing();
+
+    ImGui::BeginChild( "remote_events", ImVec2( 0.0f, imgui_scale( 300.0f ) ) );
+    ImGui::Columns( 6, "remote_event_list" );
+    for ( const char *title : { "Id", "Time Stamp", "Task", "Event", "Duration", "Info" } )
+    {
+        ImGui::Text( "%s", title );
+        ImGui::NextColumn();
+    }
+    ImGui::Separator();
+
+    ImGuiListClipper clipper( ( int )std::min< uint64_t >( total, INT32_MAX ), row_h );
+    uint64_t reply_start = m_reply_view.list_start;
+
+    for ( int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++ )
+    {
+        uint64_t idx = i - reply_start;
+
+        if ( current && ( i >= ( int64_t )reply_start ) && ( idx < m_list_rows.size() ) )
+        {
+            const list_row_t &row = m_list_rows[ idx ];
+
+            ImGui::Text( "%u", row.id );
+            ImGui::NextColumn();
+            ImGui::Text( "%s", remote_ts_str( row.ts ).c_str() );
+            ImGui::NextColumn();
+            ImGui::Text( "%s", row.comm.c_str() );
+            ImGui::NextColumn();
+            ImGui::Text( "%s", row.name.c_str() );
+            ImGui::NextColumn();
+            if ( row.duration )
+                ImGui::Text( "%s", remote_ts_str( row.duration ).c_str() );
+            ImGui::NextColumn();
+            ImGui::Text( "%s", row.info.c_str() );
+            ImGui::NextColumn();
+        }
+        else
+        {
+            ImGui::Text( "..." );
+            for ( int col = 0; col < 6; col++ )
+                ImGui::NextColumn();
+        }
+    }
+
+    // Ask for a page around the visible rows when they aren't covered
+    uint64_t start = clipper.DisplayStart;
+    uint64_t end = clipper.DisplayEnd;
+    if ( ( start < view.list_start ) || ( end > view.list_start + view.list_count ) )
+    {
+        view.list_start = ( start > 64 ) ? ( start - 64 ) : 0;
+        view.list_count = std::min< uint64_t >( end - start + 128, s_remote_rows_max );
+    }
+
+    clipper.End();
+    ImGui::Columns( 1 );
+    ImGui::EndChild();
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright 2017 Valve Software
+ *
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef _GPUVIS_REMOTE_H_
+#define _GPUVIS_REMOTE_H_
+
+/*
+ * Remote traces
+ *
+ *   gpuvis --serve [--port N] [--bind addr] trace.dat...
+ *   gpuvis --remote host[:port]
+ *
+ * The server loads a trace (with its indexes, graph rows and plots) on a
+ * machine with the memory for it and answers range queries over TCP. The
+ * client window keeps just the answers for what's on screen: per pixel
+ * aggregates of each graph row and a page of event list rows.
+ *
+ * Messages are a header of u32 magic, u32 type (remote_msg_t) and u32 size
+ * followed by size bytes of payload. All integers are little endian and
+ * strings are a u32 length and their bytes.
+ *
+ *   Info:   -> u32 version, str title, u64 events, i64 ts_first, i64 ts_last,
+ *              u32 rows, { str name, u32 type, u64 events }[ rows ]
+ *   Row:    str name, i64 ts0, i64 ts1, u32 pixels
+ *           -> u32 type, u8 detail, then when detail is set (few events):
+ *                u32 count, { u32 id, i64 ts, u32 duration, u32 color }[ count ]
+ *              and otherwise one bucket per pixel:
+ *                { u32 count, f32 min, f32 max }[ pixels ] (min / max of plot rows)
+ *   Filter: str expr -> str error, u64 matches
+ *   Events: u8 filtered, u64 start, u32 count
+ *           -> u64 total, u32 count,
+ *              { u32 id, i64 ts, u32 duration, str comm, str name, str info }[ count ]
+ *   Error:  -> str message, in place of the reply to a bad request
+ *
+ * There is no authentication, so the server only listens on localhost
+ * unless --bind says otherwise. Use an ssh tunnel to reach it.
+ */
+
+static const uint32_t s_remote_magic = 0x52555047; // "GPUR"
+static const uint32_t s_remote_version = 1;
+static const uint16_t s_remote_port = 47000;
+
+enum remote_msg_t
+{
+    REMOTE_Info = 1,
+    REMOTE_Row,
+    REMOTE_Filter,
+    REMOTE_Events,
+    REMOTE_Error,
+};
+
+// Serve traces on the command line to remote clients (--serve)
+bool remote_serve_requested( int argc, char **argv );
+int remote_serve_main( int argc, char **argv );
+
+// Window showing a trace from a gpuvis --serve server. Queries run on a
+//  worker thread which always works on the latest view, so panning and
+//  zooming never wait on the network.
+class RemoteTraceWin
+{
+public:
+    RemoteTraceWin( const char *address );
+    ~RemoteTraceWin();
+
+    void render();
+    // A reply arrived that hasn't been drawn yet or a query is in flight
+    bool needs_redraw();
+
+public:
+    bool m_open = true;
+
+    struct row_t
+    {
+        std::string name;
+        uint32_t type;
+        uint64_t events;
+    };
+    struct row_event_t
+    {
+        uint32_t id;
+        int64_t ts;
+        uint32_t duration;
+        uint32_t color;
+    };
+    struct row_bucket_t
+    {
+        uint32_t count;
+        float min;
+        float max;
+    };
+    struct row_data_t
+    {
+        uint32_t type = 0;
+        bool detail = false;
+        std::vector< row_event_t > events;
+        std::vector< row_bucket_t > buckets;
+    };
+    struct list_row_t
+    {
+        uint32_t id;
+        int64_t ts;
+        uint32_t duration;
+        std::string comm;
+        std::string name;
+        std::string info;
+    };
+
+    // What the window is showing. The worker queries for it whenever
+    //  m_view_generation changes.
+    struct view_t
+    {
+        int64_t ts0 = 0;
+        int64_t ts1 = 0;
+        uint32_t pixels = 0;
+
+        // Graph rows scrolled into view
+        uint32_t row_start = 0;
+        uint32_t row_count = 0;
+
+        uint64_t list_start = 0;
+        uint32_t list_count = 0;
+
+        std::string filter;
+        uint32_t filter_generation = 0;
+    };
+
+protected:
+    void render_graph();
+    void render_event_list();
+    void set_view( const view_t &view );
+
+    static void thread_func( RemoteTraceWin *win );
+    bool query( int fd, const view_t &view, uint32_t &filter_generation );
+
+protected:
+    std::string m_address;
+    std::string m_title;
+    std::thread m_thread;
+    // Worker's socket, shut down to wake it when the window closes
+    std::atomic< int > m_fd{ -1 };
+
+    // Everything below here is shared with the worker and needs m_mutex
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    bool m_quit = false;
+    bool m_dirty = false;
+    std::string m_status;
+
+    view_t m_view;
+    uint32_t m_view_generation = 0;
+    // m_view_generation the last reply was for
+    uint32_t m_reply_generation = 0;
+
+    bool m_connected = false;
+    std::string m_trace_title;
+    uint64_t m_event_count = 0;
+    int64_t m_ts_first = 0;
+    int64_t m_ts_last = 0;
+    std::vector< row_t > m_rows;
+
+    // Replies for m_reply_view. m_row_data[ 0 ] is row m_reply_view.row_start.
+    view_t m_reply_view;
+    std::vector< row_data_t > m_row_data;
+    std::string m_filter_err;
+    uint64_t m_filter_matches = 0;
+    uint64_t m_list_total = 0;
+    std::vector< list_row_t > m_list_rows;
+
+    // UI thread only
+    view_t m_ui_view;
+    bool m_ui_inited = false;
+    char m_filter_buf[ 512 ] = { 0 };
+};
+
+#endif // _GPUVIS_REMOTE_H_
@@ -21,7 +21,14 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
+#include <errno.h>
 #include <sys/stat.h>
+#if defined( __GLIBC__ )
+#include <malloc.h>
+#endif
+#if defined( __linux__ )
+#include <unistd.h>
+#endif
 
 #include <string>
 #include <vector>
@@ -31,6 +38,7 @@
 #include <sstream>
 #include <unordered_map>
 #include <functional>
+#include <atomic>
 
 #include <SDL.h>
 
@@ -48,8 +56,6 @@
 
 static SDL_threadID g_main_tid = -1;
 static std::vector< char * > g_log;
-static std::vector< char * > g_thread_log;
-static SDL_mutex *g_mutex = nullptr;
 
 static float g_scale = 1.0f;
 
@@ -91,19 +97,125 @@ font_id_t get_font_id( const char *name, const char *filename )
     return FontID_Unknown;
 }
 
+void util_malloc_trim()
+{
+#if defined( __GLIBC__ )
+    malloc_trim( 0 );
+#endif
+}
+
+size_t util_get_rss()
+{
+    size_t rss = 0;
+
+#if defined( __linux__ )
+    FILE *fp = fopen( "/proc/self/statm", "r" );
+
+    if ( fp )
+    {
+        unsigned long size, resident;
+
+        if ( fscanf( fp, "%lu %lu", &size, &resident ) == 2 )
+            rss = ( size_t )resident * sysconf( _SC_PAGESIZE );
+        fclose( fp );
+    }
+#endif
+
+    return rss;
+}
+
 /*
  * log routines
  */
+// Other threads log into a fixed ring of slots that logf_update() drains on
+//  the main thread, so logging never takes a lock or allocates. Each slot's
+//  seq says whose turn it is: pos when free for the producer claiming ring
+//  position pos, pos + 1 once its text is written. Messages are dropped
+//  when the ring is full or a thread logs more than s_log_rate_max a second.
+struct log_slot_t
+{
+    std::atomic< uint32_t > seq;
+    char text[ 512 ];
+};
+
+static const uint32_t s_log_slot_count = 1024;
+static const uint32_t s_log_rate_max = 1000;
+
+static log_slot_t g_log_slots[ s_log_slot_count ];
+static std::atomic< uint32_t > g_log_head( 0 );     // next position to claim
+static uint32_t g_log_tail = 0;                     // next position to drain
+static std::atomic< uint32_t > g_log_dropped( 0 );
+static std::atomic< uint32_t > g_log_ratelimited( 0 );
+
+static void logf_slots_init()
+{
+    for ( uint32_t i = 0; i < s_log_slot_count; i++ )
+        g_log_slots[ i ].seq.store( i, std::memory_order_relaxed );
+}
+// Slots have to be ready for threads that log before logf_init()
+static struct log_slots_init_t { log_slots_init_t() { logf_slots_init(); } } s_log_slots_init;
+
+static bool logf_ratelimit()
+{
+    static thread_local uint32_t t_window_ms = 0;
+    static thread_local uint32_t t_count = 0;
+    uint32_t now = SDL_GetTicks();
+
+    if ( now - t_window_ms >= 1000 )
+    {
+        t_window_ms = now;
+        t_count = 0;
+    }
+
+    return ( ++t_count > s_log_rate_max );
+}
+
+static void logf_ring_add( const char *fmt, va_list args ) ATTRIBUTE_PRINTF( 1, 0 );
+static void logf_ring_add( const char *fmt, va_list args )
+{
+    if ( logf_ratelimit() )
+    {
+        g_log_ratelimited.fetch_add( 1, std::memory_order_relaxed );
+        return;
+    }
+
+    uint32_t pos = g_log_head.load( std::memory_order_relaxed );
+
+    for ( ;; )
+    {
+        log_slot_t &slot = g_log_slots[ pos % s_log_slot_count ];
+        int32_t diff = ( int32_t )( slot.seq.load( std::memory_order_acquire ) - pos );
+
+        if ( diff == 0 )
+        {
+            if ( g_log_head.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+            {
+                vsnprintf( slot.text, sizeof( slot.text ), fmt, args );
+                slot.seq.store( pos + 1, std::memory_order_release );
+                return;
+            }
+        }
+        else if ( diff < 0 )
+        {
+            // Slot still holds a message from the last lap: ring is full
+            g_log_dropped.fetch_add( 1, std::memory_order_relaxed );
+            return;
+        }
+        else
+        {
+            pos = g_log_head.load( std::memory_order_relaxed );
+        }
+    }
+}
+
 void logf_init()
 {
     g_main_tid = SDL_ThreadID();
-    g_mutex = SDL_CreateMutex();
 }
 
 void logf_shutdown()
 {
-    SDL_DestroyMutex( g_mutex );
-    g_mutex = NULL;
+    logf_update();
 }
 
 const std::vector< char * > &logf_get()
@@ -113,40 +225,58 @@ const std::vector< char * > &logf_get()
 
 void logf( const char *fmt, ... )
 {
-    int ret;
     va_list args;
-    char *buf = NULL;
 
     va_start( args, fmt );
-    ret = vasprintf( &buf, fmt, args );
-    va_end( args );
 
-    if ( ret >= 0 )
+    if ( SDL_ThreadID() == g_main_tid )
     {
-        if ( SDL_ThreadID() == g_main_tid )
-        {
+        char *buf = NULL;
+
+        if ( vasprintf( &buf, fmt, args ) >= 0 )
             g_log.push_back( buf );
-        }
-        else
-        {
-            SDL_LockMutex( g_mutex );
-            g_thread_log.push_back( buf );
-            SDL_UnlockMutex( g_mutex );
-        }
     }
+    else
+    {
+        logf_ring_add( fmt, args );
+    }
+
+    va_end( args );
 }
 
 void logf_update()
 {
-    if ( g_thread_log.size() )
+    static uint32_t s_dropped = 0;
+    static uint32_t s_ratelimited = 0;
+
+    for ( ;; )
     {
-        SDL_LockMutex( g_mutex );
+        log_slot_t &slot = g_log_slots[ g_log_tail % s_log_slot_count ];
 
-        for ( char *str : g_thread_log )
-            g_log.push_back( str );
-        g_thread_log.clear();
+        if ( slot.seq.load( std::memory_order_acquire ) != g_log_tail + 1 )
+            break;
+
+        g_log.push_back( strdup( slot.text ) );
 
-        SDL_UnlockMutex( g_mutex );
+        // Hand the slot to whoever claims it on the next lap
+        slot.seq.store( g_log_tail + s_log_slot_count, std::memory_order_release );
+        g_log_tail++;
+    }
+
+    uint32_t dropped = g_log_dropped.load( std::memory_order_relaxed );
+    uint32_t ratelimited = g_log_ratelimited.load( std::memory_order_relaxed );
+
+    if ( ( dropped != s_dropped ) || ( ratelimited != s_ratelimited ) )
+    {
+        char *buf = NULL;
+
+        if ( asprintf( &buf, "[Warning] Dropped %u log messages (%u ring full, %u rate limited)",
+                       ( dropped - s_dropped ) + ( ratelimited - s_ratelimited ),
+                       dropped - s_dropped, ratelimited - s_ratelimited ) >= 0 )
+            g_log.push_back( buf );
+
+        s_dropped = dropped;
+        s_ratelimited = ratelimited;
     }
 }
 
@@ -296,6 +426,23 @@ std::string string_remove_punct( const std::string &s )
     return ret;
 }
 
+std::string string_json_quoted( const std::string &s )
+{
+    std::string ret = "\"";
+
+    for ( char c : s )
+    {
+        if ( ( c == '"' ) || ( c == '\\' ) )
+            ret += string_format( "\\%c", c );
+        else if ( ( unsigned char )c < 0x20 )
+            ret += string_format( "\\u%04x", c );
+        else
+            ret += c;
+    }
+
+    return ret + "\"";
+}
+
 std::string gen_random_str( size_t len )
 {
     std::string str;
@@ -561,7 +708,7 @@ void FontInfo::update_ini()
     s_ini().PutFloat( "Brighten", m_font_cfg.Brighten, section );
 }
 
-void FontInfo::load_font( const char *section, const char *defname, float defsize )
+void FontInfo::load_font( ImFontAtlas *atlas, const char *section, const char *defname, float defsize )
 {
     m_section = section;
     m_font_cfg = ImFontConfig();
@@ -595,7 +742,6 @@ void FontInfo::load_font( const char *section, const char *defname, float defsiz
 
     m_input_filename_err = "";
 
-    ImGuiIO &io = ImGui::GetIO();
     static const ImWchar ranges[] =
     {
         // Basic Latin + Latin Supplement
@@ -607,7 +753,7 @@ void FontInfo::load_font( const char *section, const char *defname, float defsiz
     };
     if ( m_font_id == FontID_TTFFile )
     {
-        ImFont *font = io.Fonts->AddFontFromFileTTF( m_filename.c_str(), m_size, &m_font_cfg, &ranges[ 0 ] );
+        ImFont *font = atlas->AddFontFromFileTTF( m_filename.c_str(), m_size, &m_font_cfg, &ranges[ 0 ] );
 
         if ( font )
         {
@@ -629,7 +775,7 @@ void FontInfo::load_font( const char *section, const char *defname, float defsiz
 
         if ( g_font_info[ m_font_id ].ttf_data )
         {
-            io.Fonts->AddFontFromMemoryCompressedTTF(
+            atlas->AddFontFromMemoryCompressedTTF(
                         g_font_info[ m_font_id ].ttf_data,
                         g_font_info[ m_font_id ].ttf_size,
                         m_size, &m_font_cfg, &ranges[ 0 ] );
@@ -637,7 +783,7 @@ void FontInfo::load_font( const char *section, const char *defname, float defsiz
         else
         {
             m_font_cfg.SizePixels = m_size;
-            io.Fonts->AddFontDefault( &m_font_cfg );
+            atlas->AddFontDefault( &m_font_cfg );
         }
     }
 
@@ -648,6 +794,287 @@ void FontInfo::load_font( const char *section, const char *defname, float defsiz
     m_changed = false;
 }
 
+/*
+ * Font atlas cache
+ *
+ * Rasterizing the fonts is most of our startup time, so built atlases are
+ * saved in the config dir and loaded directly while their key still matches.
+ * The key holds everything that goes into the build: each font's ttf data
+ * hash, size, oversampling, glyph ranges, FreeType flags, etc. Sizes are
+ * already scaled, so each scale gets its own atlas. Keys hash into one of
+ * s_font_cache_slots files so flipping between a few scales or fonts stays
+ * cached without the cache growing forever. Layout:
+ *
+ *   char magic[ 8 ], u32 version, u32 keysize, key[ keysize ]
+ *   u32 use_freetype, i32 width, i32 height, ImVec2 uv_white_pixel
+ *   pixels: u8 alpha[ width * height ]
+ *   u32 font_count, fonts: FontSize, Ascent, Descent, MetricsTotalSurface,
+ *     ConfigDataCount, u32 glyph_count, ImFont::Glyph[ glyph_count ]
+ */
+static const char s_font_cache_magic[ 8 ] = "GPUVISF";
+static const uint32_t s_font_cache_version = 1;
+static const uint32_t s_font_cache_slots = 8;
+
+static std::vector< uint8_t > font_atlas_key( ImFontAtlas *atlas, bool use_freetype )
+{
+    std::vector< uint8_t > key;
+
+    auto add = [&key]( const void *data, size_t size )
+    {
+        key.insert( key.end(), ( const uint8_t * )data, ( const uint8_t * )data + size );
+    };
+    auto add_val = [&add]( uint32_t val ) { add( &val, sizeof( val ) ); };
+    auto add_float = [&add]( float val ) { add( &val, sizeof( val ) ); };
+
+    add_val( use_freetype );
+    add_val( atlas->TexDesiredWidth );
+    add_val( atlas->Fonts.Size );
+    add_val( sizeof( ImFont::Glyph ) );
+
+    for ( const ImFontConfig &cfg : atlas->ConfigData )
+    {
+        int font_index = 0;
+
+        while ( ( font_index < atlas->Fonts.Size ) && ( atlas->Fonts[ font_index ] != cfg.DstFont ) )
+            font_index++;
+
+        add_val( fnv_hashbuf32( cfg.FontData, cfg.FontDataSize ) );
+        add_val( cfg.FontDataSize );
+        add_val( cfg.FontNo );
+        add_val( font_index );
+        add_float( cfg.SizePixels );
+        add_val( cfg.OversampleH );
+        add_val( cfg.OversampleV );
+        add_val( cfg.PixelSnapH );
+        add_float( cfg.GlyphExtraSpacing.x );
+        add_float( cfg.GlyphExtraSpacing.y );
+        add_float( cfg.GlyphOffset.x );
+        add_float( cfg.GlyphOffset.y );
+        add_val( cfg.MergeMode );
+        add_val( cfg.FreetypeFlags );
+        add_float( cfg.Brighten );
+
+        for ( const ImWchar *range = cfg.GlyphRanges; range && range[ 0 ]; range++ )
+            add_val( range[ 0 ] );
+        add_val( 0 );
+    }
+
+    return key;
+}
+
+static std::string font_atlas_cache_filename( const std::vector< uint8_t > &key )
+{
+    uint32_t slot = fnv_hashbuf32( key.data(), key.size() ) % s_font_cache_slots;
+
+    return util_get_config_dir( "gpuvis" ) + string_format( "/fontatlas%u.cache", slot );
+}
+
+static bool font_atlas_cache_load( ImFontAtlas *atlas, const std::vector< uint8_t > &key, bool *use_freetype )
+{
+    std::string filename = font_atlas_cache_filename( key );
+    FILE *fp = fopen( filename.c_str(), "rb" );
+
+    if ( !fp )
+        return false;
+
+    bool ok = true;
+    auto read = [&]( void *data, size_t size )
+    {
+        if ( ok && size && ( fread( data, size, 1, fp ) != 1 ) )
+            ok = false;
+        return ok;
+    };
+
+    char magic[ 8 ];
+    uint32_t version = 0;
+    uint32_t keysize = 0;
+    std::vector< uint8_t > filekey;
+
+    read( magic, sizeof( magic ) );
+    read( &version, sizeof( version ) );
+    read( &keysize, sizeof( keysize ) );
+    if ( ok && !memcmp( magic, s_font_cache_magic, sizeof( magic ) ) &&
+         ( version == s_font_cache_version ) && ( keysize == key.size() ) )
+    {
+        filekey.resize( keysize );
+        read( filekey.data(), keysize );
+    }
+
+    // Different fonts hashed to this slot, or an older cache
+    if ( !ok || ( filekey != key ) )
+    {
+        fclose( fp );
+        return false;
+    }
+
+    uint32_t freetype = 0;
+    int width = 0;
+    int height = 0;
+    ImVec2 uv_white_pixel;
+    uint32_t font_count = 0;
+    unsigned char *pixels = NULL;
+
+    read( &freetype, sizeof( freetype ) );
+    read( &width, sizeof( width ) );
+    read( &height, sizeof( height ) );
+    read( &uv_white_pixel, sizeof( uv_white_pixel ) );
+    if ( ok && ( width > 0 ) && ( height > 0 ) && ( width <= 16384 ) && ( height <= 16384 ) )
+    {
+        pixels = ( unsigned char * )ImGui::MemAlloc( ( size_t )width * height );
+        read( pixels, ( size_t )width * height );
+    }
+    read( &font_count, sizeof( font_count ) );
+
+    ok = ok && pixels && ( font_count == ( uint32_t )atlas->Fonts.Size );
+
+    for ( int i = 0; ok && ( i < atlas->Fonts.Size ); i++ )
+    {
+        ImFont *font = atlas->Fonts[ i ];
+        uint32_t glyph_count = 0;
+
+        font->ConfigData = NULL;
+        for ( ImFontConfig &cfg : atlas->ConfigData )
+        {
+            if ( cfg.DstFont == font )
+            {
+                font->ConfigData = &cfg;
+                break;
+            }
+        }
+
+        read( &font->FontSize, sizeof( font->FontSize ) );
+        read( &font->Ascent, sizeof( font->Ascent ) );
+        read( &font->Descent, sizeof( font->Descent ) );
+        read( &font->MetricsTotalSurface, sizeof( font->MetricsTotalSurface ) );
+        read( &font->ConfigDataCount, sizeof( font->ConfigDataCount ) );
+        read( &glyph_count, sizeof( glyph_count ) );
+
+        if ( ok && ( glyph_count <= 0x10000 ) )
+        {
+            font->Glyphs.resize( glyph_count );
+            read( font->Glyphs.Data, glyph_count * sizeof( ImFont::Glyph ) );
+        }
+        else
+        {
+            ok = false;
+        }
+
+        font->ContainerAtlas = atlas;
+        font->FallbackGlyph = NULL;
+        font->BuildLookupTable();
+    }
+
+    fclose( fp );
+
+    if ( !ok )
+    {
+        if ( pixels )
+            ImGui::MemFree( pixels );
+
+        // Anything half loaded gets redone by the build
+        for ( ImFont *font : atlas->Fonts )
+            font->Clear();
+
+        logf( "[Warning] %s: %s is corrupt, rebuilding fonts", __func__, filename.c_str() );
+        return false;
+    }
+
+    atlas->ClearTexData();
+    atlas->TexPixelsAlpha8 = pixels;
+    atlas->TexWidth = width;
+    atlas->TexHeight = height;
+    atlas->TexUvWhitePixel = uv_white_pixel;
+
+    *use_freetype = !!freetype;
+    return true;
+}
+
+static void font_atlas_cache_save( ImFontAtlas *atlas, const std::vector< uint8_t > &key, bool use_freetype )
+{
+    std::string filename = font_atlas_cache_filename( key );
+    std::string tmpfile = filename + ".tmp";
+    FILE *fp = fopen( tmpfile.c_str(), "wb" );
+
+    if ( !fp )
+        return;
+
+    bool ok = true;
+    auto write = [&]( const void *data, size_t size )
+    {
+        if ( ok && size && ( fwrite( data, size, 1, fp ) != 1 ) )
+            ok = false;
+    };
+    uint32_t keysize = key.size();
+    uint32_t freetype = use_freetype;
+    uint32_t font_count = atlas->Fonts.Size;
+
+    write( s_font_cache_magic, sizeof( s_font_cache_magic ) );
+    write( &s_font_cache_version, sizeof( s_font_cache_version ) );
+    write( &keysize, sizeof( keysize ) );
+    write( key.data(), key.size() );
+
+    write( &freetype, sizeof( freetype ) );
+    write( &atlas->TexWidth, sizeof( atlas->TexWidth ) );
+    write( &atlas->TexHeight, sizeof( atlas->TexHeight ) );
+    write( &atlas->TexUvWhitePixel, sizeof( atlas->TexUvWhitePixel ) );
+    write( atlas->TexPixelsAlpha8, ( size_t )atlas->TexWidth * atlas->TexHeight );
+
+    write( &font_count, sizeof( font_count ) );
+    for ( const ImFont *font : atlas->Fonts )
+    {
+        uint32_t glyph_count = font->Glyphs.Size;
+
+        write( &font->FontSize, sizeof( font->FontSize ) );
+        write( &font->Ascent, sizeof( font->Ascent ) );
+        write( &font->Descent, sizeof( font->Descent ) );
+        write( &font->MetricsTotalSurface, sizeof( font->MetricsTotalSurface ) );
+        write( &font->ConfigDataCount, sizeof( font->ConfigDataCount ) );
+        write( &glyph_count, sizeof( glyph_count ) );
+        write( font->Glyphs.Data, glyph_count * sizeof( ImFont::Glyph ) );
+    }
+
+    if ( fclose( fp ) )
+        ok = false;
+
+    // Only replace the cache file once it's been completely written
+    if ( !ok || rename( tmpfile.c_str(), filename.c_str() ) )
+    {
+        logf( "[Error] %s: writing %s failed: %s", __func__, filename.c_str(), strerror( errno ) );
+        remove( tmpfile.c_str() );
+    }
+}
+
+void font_atlas_build( ImFontAtlas *atlas, bool *use_freetype )
+{
+    util_time_t t0 = util_get_time();
+    std::vector< uint8_t > key = font_atlas_key( atlas, *use_freetype );
+
+    if ( font_atlas_cache_load( atlas, key, use_freetype ) )
+    {
+        logf( "Loaded cached font atlas (%.2fms)", util_time_to_ms( t0, util_get_time() ) );
+        return;
+    }
+
+    bool built = false;
+
+#ifdef USE_FREETYPE
+    if ( *use_freetype )
+        built = ImGuiFreeType::BuildFontAtlas( atlas );
+#endif
+    if ( !built )
+    {
+        *use_freetype = false;
+        built = atlas->Build();
+    }
+
+    if ( built )
+    {
+        logf( "Built font atlas (%.2fms)", util_time_to_ms( t0, util_get_time() ) );
+
+        font_atlas_cache_save( atlas, key, *use_freetype );
+    }
+}
+
 static bool listbox_get_fontname( void *unused, int i, const char **name )
 {
     if ( ( i >= 0 ) && ( ( size_t )i < ARRAY_SIZE( g_font_info ) ) )
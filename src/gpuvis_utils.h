@@ -57,8 +57,15 @@ inline float util_time_to_ms( util_time_t start, util_time_t end )
     return ( float )std::chrono::duration< double, std::milli >( diff ).count();
 }
 
+// Hand freed heap memory back to the OS. glibc holds on to it otherwise.
+void util_malloc_trim();
+// Resident set size of this process in bytes, or 0 if it isn't known
+size_t util_get_rss();
+
 void logf_init();
 void logf_shutdown();
+// Safe from any thread. Messages from other threads show up in logf_get()
+//  once the main thread calls logf_update().
 void logf( const char *fmt, ... ) ATTRIBUTE_PRINTF( 1, 2 );
 void logf_update();
 void logf_clear();
@@ -90,6 +97,45 @@ bool imgui_mousepos_valid( const ImVec2 &pos );
 bool imgui_push_smallfont();
 void imgui_pop_smallfont();
 
+// Batch of solid rectangles drawn with GL instancing. Rects are stored
+//  relative to the offset passed to draw(), so panning a batch is just a
+//  uniform change and the instance buffer is only uploaded when modified.
+class GLRectBatch
+{
+public:
+    GLRectBatch() {}
+    ~GLRectBatch();
+
+    static bool init();
+    static void shutdown();
+    static void new_frame();
+    static bool is_supported();
+
+    void clear();
+    void add( float x, float y, float w, float h, ImU32 color );
+    size_t size() const { return m_rects.size(); }
+
+    // Queue batch draw on draw_list. Returns false if instancing isn't available.
+    bool draw( ImDrawList *draw_list, float x, float y, float alpha = 1.0f );
+
+public:
+    struct rect_t
+    {
+        float x, y, w, h;
+        ImU32 color;
+    };
+
+private:
+    GLRectBatch( const GLRectBatch & ) = delete;
+    GLRectBatch &operator=( const GLRectBatch & ) = delete;
+
+    std::vector< rect_t > m_rects;
+    bool m_dirty = true;
+    size_t m_count = 0;
+    uint32_t m_vao = 0;
+    uint32_t m_vbo = 0;
+};
+
 // Does ImGui InputText with two new flags to put label on left or have label be a button.
 #define ImGuiInputText2FlagsLeft_LabelOnRight  ( 1 << 29 )
 #define ImGuiInputText2FlagsLeft_LabelIsButton ( 1 << 30 )
@@ -148,7 +194,8 @@ public:
     FontInfo() {}
     ~FontInfo() {}
 
-    void load_font( const char *section, const char *defname, float defsize );
+    // Add this font to atlas using its ini section settings
+    void load_font( ImFontAtlas *atlas, const char *section, const char *defname, float defsize );
     void render_font_options( bool m_use_freetype );
 
 protected:
@@ -168,6 +215,12 @@ public:
     char m_input_filename[ PATH_MAX ] = { 0 };
 };
 
+// Build the fonts added to atlas, or load them from the font atlas cache when
+//  they haven't changed since it was saved. Can run on any thread for an atlas
+//  ImGui isn't using yet. use_freetype is cleared when FreeType couldn't build
+//  the atlas and stb_truetype was used instead.
+void font_atlas_build( ImFontAtlas *atlas, bool *use_freetype );
+
 // Print color marked up text.
 // We've added a quick hack in ImFont::RenderText() which checks for:
 //   ESC + RGBA bytes
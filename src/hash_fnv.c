@@ -161,3 +161,9 @@ fnv_hashstr32( const char *str, size_t len )
 {
     return fnv_32_str( str, FNV1_32_INIT, len );
 }
+
+uint32_t
+fnv_hashbuf32( const void *buf, size_t len )
+{
+    return fnv_32_buf( buf, len, FNV1_32_INIT );
+}
@@ -182,7 +182,9 @@ void ImGui_ImplSdlGL3_CreateFontsTexture(bool *use_freetype)
     unsigned char* pixels;
     int width, height;
 
-    if ( use_freetype && *use_freetype )
+    // Skip the build if the atlas already has its pixels (gpuvis builds it
+    //  ahead of time or loads it from the font atlas cache)
+    if ( use_freetype && *use_freetype && !io.Fonts->TexPixelsAlpha8 )
     {
         if ( !ImGuiFreeType::BuildFontAtlas( io.Fonts ) )
             *use_freetype = false;
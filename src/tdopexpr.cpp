@@ -28,6 +28,7 @@
 
 #include <future>
 #include <algorithm>
+#include <iterator>
 #include <vector>
 
 #include "tdopexpr.h"
@@ -50,15 +51,37 @@ enum tdop_tok_type_t
     TOK_INFIX_OP
 };
 
-typedef const char * ( TDOP_INFIX_FUNC )( const char *a, const char *b );
+// Bytecode ops. Expressions compile to a postfix program run on a small value stack.
+enum tdop_opcode_t
+{
+    OP_PUSH_CONST,          // push m_consts[ arg ]
+    OP_PUSH_VAR,            // push variable arg
+    OP_AND_JMP,             // if top is false: leave false & jump to arg, else pop
+    OP_OR_JMP,              // if top is true: leave true & jump to arg, else pop
+    OP_TO_BOOL,             // top = is_true( top )
+    OP_EQUAL,
+    OP_NOTEQUAL,
+    OP_CONTAINS,
+    OP_GT,
+    OP_GE,
+    OP_LT,
+    OP_LE,
+};
+
+struct tdop_op_t
+{
+    tdop_opcode_t code;
+    bool want_str;          // OP_PUSH_VAR: value is used as a string
+    int arg;
+};
 
 struct tdop_state_token
 {
     int lbp;
     tdop_tok_type_t type;
 
-    const char *variable;
-    TDOP_INFIX_FUNC *function;
+    int varid;
+    tdop_opcode_t opcode;
     char value_buf[ 64 ];
 
     void set_value_buf( const char *val, size_t val_len )
@@ -80,18 +103,55 @@ struct tdop_state
     tdop_get_key_func get_key_func;
 };
 
-static int num_compare( const char *a, const char *b, int defval )
+static void val_set_bool( tdop_val_t &val, bool b )
+{
+    val.str = b ? "1" : "";
+    val.has_num = false;
+}
+
+static bool val_is_true( const tdop_val_t &val )
+{
+    // Numeric variables without strings always format to something non-empty
+    return val.str ? !!val.str[ 0 ] : val.has_num;
+}
+
+static const char *val_get_str( const tdop_val_t &val )
 {
-    char *endptr;
+    return val.str ? val.str : "";
+}
 
-    if ( !a[ 0 ] || !b[ 0 ] )
+static bool val_is_float( const tdop_val_t &val )
+{
+    if ( val.has_num )
+        return val.is_float;
+
+    return ( val.str[ 0 ] == '-' ) || strchr( val.str, '.' );
+}
+
+static double val_get_double( const tdop_val_t &val )
+{
+    return val.has_num ? val.vald : strtod( val.str, NULL );
+}
+
+static uint64_t val_get_uint( const tdop_val_t &val )
+{
+    if ( val.has_num )
+        return val.valu;
+
+    int base = ( val.str[ 0 ] == '0' && val.str[ 1 ] == 'x' ) ? 16 : 10;
+
+    return strtoull( val.str, NULL, base );
+}
+
+static int num_compare( const tdop_val_t &a, const tdop_val_t &b, int defval )
+{
+    if ( ( a.str && !a.str[ 0 ] ) || ( b.str && !b.str[ 0 ] ) )
         return defval;
 
-    if ( a[ 0 ] == '-' || b[ 0 ] == '-' ||
-         strchr( a, '.' ) || strchr( b, '.' ) )
+    if ( val_is_float( a ) || val_is_float( b ) )
     {
-        double val_a = strtod( a, &endptr );
-        double val_b = strtod( b, &endptr );
+        double val_a = val_get_double( a );
+        double val_b = val_get_double( b );
 
         if ( val_a == val_b )
             return 0;
@@ -101,11 +161,8 @@ static int num_compare( const char *a, const char *b, int defval )
     }
     else
     {
-        int base_a = ( a[ 0 ] == '0' && a[ 1 ] == 'x' ) ? 16 : 10;
-        int base_b = ( b[ 0 ] == '0' && b[ 1 ] == 'x' ) ? 16 : 10;
-
-        uint64_t val_a = strtoull( a, &endptr, base_a );
-        uint64_t val_b = strtoull( b, &endptr, base_b );
+        uint64_t val_a = val_get_uint( a );
+        uint64_t val_b = val_get_uint( b );
 
         if ( val_a == val_b )
             return 0;
@@ -115,59 +172,27 @@ static int num_compare( const char *a, const char *b, int defval )
     }
 }
 
-static const char *func_gt( const char *a, const char *b )
-{
-    return ( num_compare( a, b, -1 ) > 0 ) ? "1" : "";
-}
-
-static const char *func_ge( const char *a, const char *b )
-{
-    return ( num_compare( a, b, -1 ) >= 0 ) ? "1" : "";
-}
-
-static const char *func_lt( const char *a, const char *b )
-{
-    return ( num_compare( a, b, 1 ) < 0 ) ? "1" : "";
-}
-
-static const char *func_le( const char *a, const char *b )
-{
-    return ( num_compare( a, b, 1 ) <= 0 ) ? "1" : "";
-}
-
-static const char *func_and( const char *a, const char *b )
+// Parse a constant once at compile time so exec doesn't have to
+static void val_init_const( tdop_val_t &val, const char *str )
 {
-    return a[ 0 ] && b[ 0 ] ? "1" : "";
-}
-
-static const char *func_or( const char *a, const char *b )
-{
-    return a[ 0 ] || b[ 0 ] ? "1" : "";
-}
-
-static const char *func_equal( const char *a, const char *b )
-{
-    return !strcasecmp( a, b ) ? "1" : "";
-}
+    val.str = str;
+    val.has_num = false;
 
-static const char *func_notequal( const char *a, const char *b )
-{
-    return strcasecmp( a, b ) ? "1" : "";
-}
-
-/* $line =~ [[:space:]]* */
-/* contains operator: "12345678 =~ 345" is true */
-static const char *func_contains( const char * a, const char * b )
-{
-    return ( b[ 0 ] && strcasestr( a, b ) ) ? "1" : "";
+    if ( str[ 0 ] )
+    {
+        val.is_float = val_is_float( val );
+        val.has_num = true;
+        val.vald = strtod( str, NULL );
+        val.valu = strtoull( str, NULL, ( str[ 0 ] == '0' && str[ 1 ] == 'x' ) ? 16 : 10 );
+    }
 }
 
 static void next_token( tdop_state *s )
 {
     s->tok.lbp = 0;
     s->tok.type = TOK_NULL;
-    s->tok.variable = NULL;
-    s->tok.function = NULL;
+    s->tok.varid = -1;
+    s->tok.opcode = OP_PUSH_CONST;
     s->tok.value_buf[ 0 ] = 0;
 
     while ( s->tok.type == TOK_NULL )
@@ -190,8 +215,8 @@ static void next_token( tdop_state *s )
             }
 
             s->tok.type = TOK_VARIABLE;
-            s->tok.variable = s->get_key_func( value, s->next - value );
-            if ( !s->tok.variable )
+            s->tok.varid = s->get_key_func( value, s->next - value );
+            if ( s->tok.varid < 0 )
                 s->tok.type = TOK_ERROR;
         }
         else if ( s->next[ 0 ] == '"' )
@@ -254,21 +279,21 @@ static void next_token( tdop_state *s )
             struct op_t
             {
                 const char *opstr;
-                TDOP_INFIX_FUNC *function;
+                tdop_opcode_t opcode;
                 int lbp;
             };
             static const op_t s_ops[] =
             {
-                { "&&", func_and, 10 },
-                { "||", func_or, 10 },
-                { "!=", func_notequal, 20 },
-                { "=~", func_contains, 20 },
-                { "==", func_equal, 20 },
-                { "=", func_equal, 20 },
-                { ">=", func_ge, 20 },
-                { ">", func_gt, 20 },
-                { "<=", func_le, 20 },
-                { "<", func_lt, 20 },
+                { "&&", OP_AND_JMP, 10 },
+                { "||", OP_OR_JMP, 10 },
+                { "!=", OP_NOTEQUAL, 20 },
+                { "=~", OP_CONTAINS, 20 },
+                { "==", OP_EQUAL, 20 },
+                { "=", OP_EQUAL, 20 },
+                { ">=", OP_GE, 20 },
+                { ">", OP_GT, 20 },
+                { "<=", OP_LE, 20 },
+                { "<", OP_LT, 20 },
             };
 
             const char *n = s->next++;
@@ -307,7 +332,7 @@ static void next_token( tdop_state *s )
 
                         s->tok.type = TOK_INFIX_OP;
                         s->tok.lbp = op.lbp;
-                        s->tok.function = op.function;
+                        s->tok.opcode = op.opcode;
                         break;
                     }
                 }
@@ -324,19 +349,26 @@ public:
     ~TdopExpr() {}
 
     int compile( const char *expression, tdop_get_key_func &get_key_func, std::string &errstr );
-    const char *exec( tdop_get_keyval_func &get_keyval_func );
+    bool exec( tdop_get_keyval_func &get_keyval_func, const void *data ) const;
+    bool index( tdop_get_index_func &get_index_func, std::vector< uint32_t > &ids, bool &exact ) const;
 
 protected:
     tdop_state_token *get_next_token();
-    const char *tdop_infix( tdop_state_token *self, const char *left );
-    const char *tdop_expression( int rbp );
+    void emit( tdop_opcode_t code, int arg );
+    void use_str( int pc );
+    int gen_expression( int rbp );
 
 public:
-    tdop_get_keyval_func m_get_keyval_func;
     tdop_state_token *m_token = nullptr;
 
     size_t m_token_index = 0;
     std::vector< tdop_state_token > m_vec_tokens;
+
+    // Compiled program, constants, and max value stack depth
+    std::vector< tdop_op_t > m_code;
+    std::vector< tdop_val_t > m_consts;
+    int m_stack_size = 0;
+    int m_stack_depth = 0;
 };
 
 class TdopExpr *tdopexpr_compile( const char *expression, tdop_get_key_func &get_key_func, std::string &errstr )
@@ -352,9 +384,9 @@ class TdopExpr *tdopexpr_compile( const char *expression, tdop_get_key_func &get
     return tdop_expr;
 }
 
-const char *tdopexpr_exec( class TdopExpr *tdop_expr, tdop_get_keyval_func &get_keyval_func )
+bool tdopexpr_exec( class TdopExpr *tdop_expr, tdop_get_keyval_func &get_keyval_func, const void *data )
 {
-    return tdop_expr ? tdop_expr->exec( get_keyval_func ) : "";
+    return tdop_expr ? tdop_expr->exec( get_keyval_func, data ) : false;
 }
 
 void tdopexpr_delete( TdopExpr *tdop_expr )
@@ -362,6 +394,13 @@ void tdopexpr_delete( TdopExpr *tdop_expr )
     delete tdop_expr;
 }
 
+bool tdopexpr_index( class TdopExpr *tdop_expr, tdop_get_index_func &get_index_func,
+                     std::vector< uint32_t > &ids, bool &exact )
+{
+    exact = false;
+    return tdop_expr ? tdop_expr->index( get_index_func, ids, exact ) : false;
+}
+
 tdop_state_token *TdopExpr::get_next_token()
 {
     if ( m_token_index >= m_vec_tokens.size() )
@@ -370,32 +409,63 @@ tdop_state_token *TdopExpr::get_next_token()
     return &m_vec_tokens[ m_token_index++ ];
 }
 
-const char *TdopExpr::tdop_infix( tdop_state_token *self, const char *left )
+void TdopExpr::emit( tdop_opcode_t code, int arg )
 {
-    const char *right = tdop_expression( self->lbp );
+    tdop_op_t op;
+
+    op.code = code;
+    op.want_str = false;
+    op.arg = arg;
+    m_code.push_back( op );
 
-    return self->function( left, right );
+    if ( ( code == OP_PUSH_CONST ) || ( code == OP_PUSH_VAR ) )
+    {
+        m_stack_depth++;
+        m_stack_size = std::max< int >( m_stack_size, m_stack_depth );
+    }
+    else if ( code != OP_TO_BOOL )
+    {
+        // Binary ops and the and/or jumps pop one value
+        m_stack_depth--;
+    }
 }
 
-const char *TdopExpr::tdop_expression( int rbp )
+// Value produced by op at pc is consumed as a string
+void TdopExpr::use_str( int pc )
 {
-    const char *left;
+    if ( ( pc >= 0 ) && ( m_code[ pc ].code == OP_PUSH_VAR ) )
+        m_code[ pc ].want_str = true;
+}
+
+// Same walk the old recursive evaluator did, but emits code instead
+//  of evaluating. Returns pc of the op which pushed the value if it
+//  was a single push, or -1.
+int TdopExpr::gen_expression( int rbp )
+{
+    int left;
 
     if ( m_token->type == TOK_LPAREN )
     {
         m_token = get_next_token();
-        left = tdop_expression( 0 );
+        left = gen_expression( 0 );
 
         // m_token should be TOK_RPAREN right now
     }
     else if ( m_token->type == TOK_VARIABLE )
     {
-        left = m_get_keyval_func( m_token->variable, m_token->value_buf );
+        left = m_code.size();
+        emit( OP_PUSH_VAR, m_token->varid );
     }
     else
     {
         // m_token should be TOK_STRING / TOK_NUMBER
-        left = m_token->value_buf;
+        tdop_val_t val;
+
+        val_init_const( val, m_token->value_buf );
+
+        left = m_code.size();
+        emit( OP_PUSH_CONST, m_consts.size() );
+        m_consts.push_back( val );
     }
 
     m_token = get_next_token();
@@ -404,23 +474,272 @@ const char *TdopExpr::tdop_expression( int rbp )
     while ( rbp < m_token->lbp )
     {
         tdop_state_token *tok = m_token;
+        tdop_opcode_t opcode = tok->opcode;
 
         m_token = get_next_token();
 
-        left = tdop_infix( tok, left );
+        if ( ( opcode == OP_AND_JMP ) || ( opcode == OP_OR_JMP ) )
+        {
+            // Short circuit: jump target patched once right side is emitted
+            int pc_jmp = m_code.size();
+
+            use_str( left );
+            emit( opcode, 0 );
+
+            use_str( gen_expression( tok->lbp ) );
+            emit( OP_TO_BOOL, 0 );
+
+            m_code[ pc_jmp ].arg = m_code.size();
+        }
+        else
+        {
+            int right = gen_expression( tok->lbp );
+
+            if ( ( opcode == OP_EQUAL ) || ( opcode == OP_NOTEQUAL ) || ( opcode == OP_CONTAINS ) )
+            {
+                use_str( left );
+                use_str( right );
+            }
+
+            emit( opcode, 0 );
+        }
+
+        left = -1;
     }
 
     return left;
 }
 
-const char *TdopExpr::exec( tdop_get_keyval_func &get_keyval_func )
+bool TdopExpr::exec( tdop_get_keyval_func &get_keyval_func, const void *data ) const
 {
-    m_get_keyval_func = get_keyval_func;
+    tdop_val_t stack_buf[ 16 ];
+    std::vector< tdop_val_t > stack_vec;
+    tdop_val_t *stack = stack_buf;
+    int sp = -1;
 
-    m_token_index = 0;
-    m_token = get_next_token();
+    if ( m_stack_size > ( int )ARRAY_SIZE( stack_buf ) )
+    {
+        stack_vec.resize( m_stack_size );
+        stack = &stack_vec[ 0 ];
+    }
+
+    for ( size_t pc = 0; pc < m_code.size(); pc++ )
+    {
+        const tdop_op_t &op = m_code[ pc ];
 
-    return tdop_expression( 0 );
+        switch ( op.code )
+        {
+        case OP_PUSH_CONST:
+        {
+            const tdop_val_t &val = m_consts[ op.arg ];
+            tdop_val_t &top = stack[ ++sp ];
+
+            top.str = val.str;
+            top.has_num = val.has_num;
+            top.is_float = val.is_float;
+            top.valu = val.valu;
+            top.vald = val.vald;
+            break;
+        }
+        case OP_PUSH_VAR:
+        {
+            tdop_val_t &top = stack[ ++sp ];
+
+            top.str = NULL;
+            top.has_num = false;
+            get_keyval_func( top, data, op.arg, op.want_str );
+
+            if ( !top.str && !top.has_num )
+                top.str = "";
+            break;
+        }
+        case OP_AND_JMP:
+            if ( !val_is_true( stack[ sp ] ) )
+            {
+                val_set_bool( stack[ sp ], false );
+                pc = op.arg - 1;
+            }
+            else
+            {
+                sp--;
+            }
+            break;
+        case OP_OR_JMP:
+            if ( val_is_true( stack[ sp ] ) )
+            {
+                val_set_bool( stack[ sp ], true );
+                pc = op.arg - 1;
+            }
+            else
+            {
+                sp--;
+            }
+            break;
+        case OP_TO_BOOL:
+            val_set_bool( stack[ sp ], val_is_true( stack[ sp ] ) );
+            break;
+        default:
+        {
+            const tdop_val_t &b = stack[ sp-- ];
+            tdop_val_t &a = stack[ sp ];
+            bool ret = false;
+
+            switch ( op.code )
+            {
+            case OP_EQUAL:
+                ret = !strcasecmp( val_get_str( a ), val_get_str( b ) );
+                break;
+            case OP_NOTEQUAL:
+                ret = !!strcasecmp( val_get_str( a ), val_get_str( b ) );
+                break;
+            case OP_CONTAINS:
+                /* contains operator: "12345678 =~ 345" is true */
+                ret = val_get_str( b )[ 0 ] && strcasestr( val_get_str( a ), val_get_str( b ) );
+                break;
+            case OP_GT:
+                ret = ( num_compare( a, b, -1 ) > 0 );
+                break;
+            case OP_GE:
+                ret = ( num_compare( a, b, -1 ) >= 0 );
+                break;
+            case OP_LT:
+                ret = ( num_compare( a, b, 1 ) < 0 );
+                break;
+            case OP_LE:
+                ret = ( num_compare( a, b, 1 ) <= 0 );
+                break;
+            default:
+                break;
+            }
+
+            val_set_bool( a, ret );
+            break;
+        }
+        }
+    }
+
+    return ( sp == 0 ) && val_is_true( stack[ 0 ] );
+}
+
+// Set of ids an op could be true for. Pushed values and unindexed ops can be true for anything.
+struct tdop_index_val_t
+{
+    int pc = -1;            // op of pushed value, or -1 for op results
+    bool all = true;
+    bool exact = false;
+    std::vector< uint32_t > ids;
+};
+
+static void index_combine( tdop_index_val_t &left, tdop_index_val_t &right, bool is_and )
+{
+    tdop_index_val_t ret;
+
+    if ( is_and && ( !left.all || !right.all ) )
+    {
+        if ( left.all || right.all )
+        {
+            // Only one side narrows things down, so it's a superset of the matches
+            ret.ids.swap( left.all ? right.ids : left.ids );
+        }
+        else
+        {
+            std::set_intersection( left.ids.begin(), left.ids.end(),
+                                   right.ids.begin(), right.ids.end(),
+                                   std::back_inserter( ret.ids ) );
+            ret.exact = left.exact && right.exact;
+        }
+        ret.all = false;
+    }
+    else if ( !is_and && !left.all && !right.all )
+    {
+        std::set_union( left.ids.begin(), left.ids.end(),
+                        right.ids.begin(), right.ids.end(),
+                        std::back_inserter( ret.ids ) );
+        ret.exact = left.exact && right.exact;
+        ret.all = false;
+    }
+
+    left = std::move( ret );
+}
+
+// Walk the program like exec does, but with id sets instead of values
+bool TdopExpr::index( tdop_get_index_func &get_index_func, std::vector< uint32_t > &ids, bool &exact ) const
+{
+    struct pending_t
+    {
+        size_t pc_end;
+        bool is_and;
+        tdop_index_val_t left;
+    };
+    std::vector< pending_t > pending;
+    std::vector< tdop_index_val_t > stack;
+
+    for ( size_t pc = 0; pc <= m_code.size(); pc++ )
+    {
+        // Combine and/or left sides with their right sides once those are done
+        while ( !pending.empty() && ( pending.back().pc_end == pc ) )
+        {
+            index_combine( pending.back().left, stack.back(), pending.back().is_and );
+
+            stack.back() = std::move( pending.back().left );
+            pending.pop_back();
+        }
+
+        if ( pc == m_code.size() )
+            break;
+
+        const tdop_op_t &op = m_code[ pc ];
+
+        switch ( op.code )
+        {
+        case OP_PUSH_CONST:
+        case OP_PUSH_VAR:
+            stack.push_back( tdop_index_val_t() );
+            stack.back().pc = pc;
+            break;
+        case OP_AND_JMP:
+        case OP_OR_JMP:
+            pending.push_back( { ( size_t )op.arg, ( op.code == OP_AND_JMP ), std::move( stack.back() ) } );
+            stack.pop_back();
+            break;
+        case OP_TO_BOOL:
+            stack.back().pc = -1;
+            break;
+        default:
+        {
+            int pc_b = stack.back().pc;
+
+            stack.pop_back();
+            int pc_a = stack.back().pc;
+            tdop_index_val_t &a = stack.back();
+
+            a = tdop_index_val_t();
+
+            if ( ( op.code == OP_EQUAL ) && ( pc_a >= 0 ) && ( pc_b >= 0 ) )
+            {
+                const tdop_op_t &op_a = m_code[ pc_a ];
+                const tdop_op_t &op_b = m_code[ pc_b ];
+                const tdop_op_t *op_var = ( op_a.code == OP_PUSH_VAR ) ? &op_a : &op_b;
+                const tdop_op_t *op_const = ( op_a.code == OP_PUSH_VAR ) ? &op_b : &op_a;
+
+                if ( ( op_var->code == OP_PUSH_VAR ) && ( op_const->code == OP_PUSH_CONST ) &&
+                     get_index_func( op_var->arg, m_consts[ op_const->arg ].str, a.ids ) )
+                {
+                    a.all = false;
+                    a.exact = true;
+                }
+            }
+            break;
+        }
+        }
+    }
+
+    if ( stack.empty() || stack.back().all )
+        return false;
+
+    ids.swap( stack.back().ids );
+    exact = stack.back().exact;
+    return true;
 }
 
 static bool is_arg( tdop_tok_type_t type )
@@ -525,6 +844,18 @@ int TdopExpr::compile( const char *expression, tdop_get_key_func &get_key_func,
     }
 
     errstr = validate_info_tokens( m_vec_tokens );
+    if ( !errstr.empty() )
+        return -1;
+
+    // Generate bytecode
+    m_code.clear();
+    m_consts.clear();
+    m_stack_size = 0;
+    m_stack_depth = 0;
+
+    m_token_index = 0;
+    m_token = get_next_token();
+    gen_expression( 0 );
 
-    return errstr.empty() ? 0 : -1;
+    return 0;
 }
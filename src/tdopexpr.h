@@ -24,11 +24,61 @@
 #ifndef __TDOPEXPR_H__
 #define __TDOPEXPR_H__
 
-typedef std::function< const char * ( const char *name, size_t len ) > tdop_get_key_func;
-typedef std::function< const char * ( const char *name, char ( &buf )[ 64 ] ) > tdop_get_keyval_func;
+// Value of an expression variable. Variables set str, a number, or both.
+//  Numeric values let compares skip parsing strings.
+struct tdop_val_t
+{
+    // String value. May be left NULL for numeric variables when want_str is false.
+    const char *str;
+
+    bool has_num;
+    bool is_float;          // compare as double (negative or fractional value)
+    uint64_t valu;
+    double vald;
+
+    // Scratch space for variables that need to format their string value.
+    char buf[ 64 ];
+
+    void set_uint( uint64_t val )
+    {
+        has_num = true;
+        is_float = false;
+        valu = val;
+        vald = ( double )val;
+    }
+    void set_int( int64_t val )
+    {
+        has_num = true;
+        is_float = ( val < 0 );
+        valu = ( uint64_t )val;
+        vald = ( double )val;
+    }
+    void set_float( double val )
+    {
+        has_num = true;
+        is_float = true;
+        valu = ( uint64_t )val;
+        vald = val;
+    }
+};
+
+// Compile time variable lookup. Returns variable id, or -1 if unknown.
+typedef std::function< int ( const char *name, size_t len ) > tdop_get_key_func;
+// Exec time variable lookup. want_str is set when the variable is used in a string op.
+typedef std::function< void ( tdop_val_t &val, const void *data, int varid, bool want_str ) > tdop_get_keyval_func;
+
+// Index lookup for "$var = value". Returns false if var isn't indexed, otherwise
+//  fills ids with the sorted ids of items where var equals value (may be empty).
+typedef std::function< bool ( int varid, const char *value, std::vector< uint32_t > &ids ) > tdop_get_index_func;
 
 class TdopExpr *tdopexpr_compile( const char *expression, tdop_get_key_func &get_key_func, std::string &errstr );
-const char *tdopexpr_exec( class TdopExpr *tdop_expr, tdop_get_keyval_func &get_keyval_func );
+bool tdopexpr_exec( class TdopExpr *tdop_expr, tdop_get_keyval_func &get_keyval_func, const void *data );
 void tdopexpr_delete( class TdopExpr *tdop_expr );
 
+// Resolve indexed equality compares with set intersection / union to get a sorted
+//  superset of matching ids. Returns false if the indexes don't narrow the match down.
+//  Sets exact if ids are exactly the matching items and don't need exec.
+bool tdopexpr_index( class TdopExpr *tdop_expr, tdop_get_index_func &get_index_func,
+                     std::vector< uint32_t > &ids, bool &exact );
+
 #endif
@@ -0,0 +1,763 @@
+/*
+ * Copyright 2017 Valve Software
+ *
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#define _LARGEFILE64_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <unordered_map>
+#include <algorithm>
+
+#ifdef WIN32
+#include <io.h>
+
+#define read _read
+#define lseek64 _lseeki64
+#else
+#include <unistd.h>
+#endif
+
+#ifdef USE_LZMA
+#include <lzma.h>
+#endif
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "../gpuvis_macros.h"
+#include "../gpuvis_prof.h"
+#include "trace-compress.h"
+
+void logf( const char *fmt, ... ) ATTRIBUTE_PRINTF( 1, 2 );
+
+enum zfile_type_t
+{
+    ZFILE_Xz,
+    ZFILE_Zstd,
+};
+
+typedef struct zblock
+{
+    uint64_t coffset;       // compressed offset in the file
+    uint64_t csize;
+    uint64_t uoffset;       // decompressed offset
+    uint64_t usize;
+    uint32_t check;         // xz check type
+} zblock_t;
+
+enum zblock_state_t
+{
+    ZBLOCK_Queued,          // waiting for a pool thread
+    ZBLOCK_Decoding,
+    ZBLOCK_Ready,
+    ZBLOCK_Failed,
+};
+
+typedef std::shared_ptr< std::vector< char > > zdata_t;
+
+typedef struct zcache_entry
+{
+    zblock_state_t state = ZBLOCK_Queued;
+    uint64_t tick = 0;
+    zdata_t data;
+} zcache_entry_t;
+
+struct trace_zfile
+{
+    // Decoded bytes we try to stay under. Always room for the readahead though.
+    static const size_t s_cache_bytes = 256 * 1024 * 1024;
+
+    int fd = -1;
+    std::string filename;
+    zfile_type_t type = ZFILE_Xz;
+    std::atomic< int > ref{ 1 };
+
+    // Set for zstd files without a seek table, decoded as one block
+    bool streamed = false;
+
+    uint64_t size = 0;
+    std::vector< zblock_t > blocks;
+
+    std::mutex mutex;
+    std::condition_variable cond;   // block decoded, queued, or quit
+    uint64_t pos = 0;               // zfile_read / zfile_seek position
+    uint64_t tick = 0;
+    size_t bytes = 0;
+    size_t bytes_max = 0;
+    size_t readahead = 0;
+    std::unordered_map< size_t, zcache_entry_t > cache;
+    std::deque< size_t > queue;
+    bool quit = false;
+    std::vector< std::thread > threads;
+
+#ifdef WIN32
+    // Serializes the lseek + read pairs of read_at()
+    std::mutex io_mutex;
+#endif
+};
+
+// std::max() takes it by reference, so it needs a definition
+const size_t trace_zfile::s_cache_bytes;
+
+static bool read_at( trace_zfile_t *zfile, void *data, size_t size, uint64_t offset )
+{
+    char *dst = ( char * )data;
+
+#ifdef WIN32
+    std::lock_guard< std::mutex > lock( zfile->io_mutex );
+
+    if ( lseek64( zfile->fd, offset, SEEK_SET ) < 0 )
+        return false;
+#endif
+
+    while ( size )
+    {
+#ifdef WIN32
+        ssize_t ret = read( zfile->fd, dst, size );
+#else
+        ssize_t ret = TEMP_FAILURE_RETRY( pread64( zfile->fd, dst, size, offset ) );
+#endif
+        if ( ret <= 0 )
+            return false;
+
+        dst += ret;
+        size -= ret;
+        offset += ret;
+    }
+
+    return true;
+}
+
+/*
+ * xz
+ */
+#ifdef USE_LZMA
+static bool xz_open( trace_zfile_t *zfile, uint64_t file_size )
+{
+    uint8_t buf[ LZMA_STREAM_HEADER_SIZE ];
+    std::vector< uint8_t > index_buf;
+    lzma_index *combined = NULL;
+    uint64_t pos = file_size;
+
+    // Walk the streams back to front, each ends with its index and a footer
+    while ( pos )
+    {
+        lzma_stream_flags header;
+        lzma_stream_flags footer;
+        lzma_index *index = NULL;
+        uint64_t memlimit = UINT64_MAX;
+        uint64_t padding = 0;
+        size_t in_pos = 0;
+
+        // Stream padding is a multiple of four zero bytes
+        while ( pos >= 4 && read_at( zfile, buf, 4, pos - 4 ) && !memcmp( buf, "\0\0\0\0", 4 ) )
+        {
+            pos -= 4;
+            padding += 4;
+        }
+
+        if ( ( pos < 2 * LZMA_STREAM_HEADER_SIZE ) ||
+             !read_at( zfile, buf, LZMA_STREAM_HEADER_SIZE, pos - LZMA_STREAM_HEADER_SIZE ) ||
+             ( lzma_stream_footer_decode( &footer, buf ) != LZMA_OK ) ||
+             ( pos - LZMA_STREAM_HEADER_SIZE < footer.backward_size ) )
+            goto fail;
+
+        index_buf.resize( footer.backward_size );
+        if ( !read_at( zfile, index_buf.data(), index_buf.size(), pos - LZMA_STREAM_HEADER_SIZE - index_buf.size() ) ||
+             ( lzma_index_buffer_decode( &index, &memlimit, NULL, index_buf.data(), &in_pos, index_buf.size() ) != LZMA_OK ) )
+            goto fail;
+
+        if ( ( pos < lzma_index_stream_size( index ) ) ||
+             !read_at( zfile, buf, LZMA_STREAM_HEADER_SIZE, pos - lzma_index_stream_size( index ) ) ||
+             ( lzma_stream_header_decode( &header, buf ) != LZMA_OK ) ||
+             ( lzma_stream_flags_compare( &header, &footer ) != LZMA_OK ) ||
+             ( lzma_index_stream_flags( index, &footer ) != LZMA_OK ) ||
+             ( lzma_index_stream_padding( index, padding ) != LZMA_OK ) )
+        {
+            lzma_index_end( index, NULL );
+            goto fail;
+        }
+
+        pos -= lzma_index_stream_size( index );
+
+        // Append the streams we've already seen after this one
+        if ( combined && ( lzma_index_cat( index, combined, NULL ) != LZMA_OK ) )
+        {
+            lzma_index_end( index, NULL );
+            goto fail;
+        }
+        combined = index;
+    }
+
+    if ( combined )
+    {
+        lzma_index_iter iter;
+
+        lzma_index_iter_init( &iter, combined );
+        while ( !lzma_index_iter_next( &iter, LZMA_INDEX_ITER_BLOCK ) )
+        {
+            zblock_t block;
+
+            block.coffset = iter.block.compressed_file_offset;
+            block.csize = iter.block.total_size;
+            block.uoffset = iter.block.uncompressed_file_offset;
+            block.usize = iter.block.uncompressed_size;
+            block.check = iter.stream.flags->check;
+            zfile->blocks.push_back( block );
+        }
+
+        zfile->size = lzma_index_uncompressed_size( combined );
+        lzma_index_end( combined, NULL );
+        return true;
+    }
+
+fail:
+    logf( "[Error] %s: \"%s\" xz index is corrupt.", __func__, zfile->filename.c_str() );
+    if ( combined )
+        lzma_index_end( combined, NULL );
+    return false;
+}
+
+static bool xz_decode( const zblock_t &block, const std::vector< uint8_t > &in, std::vector< char > &out )
+{
+    lzma_filter filters[ LZMA_FILTERS_MAX + 1 ];
+    lzma_block lblock;
+    size_t in_pos;
+    size_t out_pos = 0;
+    lzma_ret ret;
+
+    memset( &lblock, 0, sizeof( lblock ) );
+    lblock.version = 1;
+    lblock.check = ( lzma_check )block.check;
+    lblock.filters = filters;
+    lblock.header_size = lzma_block_header_size_decode( in[ 0 ] );
+
+    if ( ( lblock.header_size > in.size() ) ||
+         ( lzma_block_header_decode( &lblock, NULL, in.data() ) != LZMA_OK ) )
+        return false;
+
+    in_pos = lblock.header_size;
+    out.resize( block.usize );
+    ret = lzma_block_buffer_decode( &lblock, NULL, in.data(), &in_pos, in.size(),
+                                    ( uint8_t * )out.data(), &out_pos, out.size() );
+
+    for ( size_t i = 0; filters[ i ].id != LZMA_VLI_UNKNOWN; i++ )
+        free( filters[ i ].options );
+
+    return ( ret == LZMA_OK ) && ( out_pos == out.size() );
+}
+#endif // USE_LZMA
+
+/*
+ * zstd
+ */
+#ifdef USE_ZSTD
+// https://github.com/facebook/zstd/blob/dev/contrib/seekable_format/zstd_seekable_compression_format.md
+static const uint32_t s_zstd_seekable_magic = 0x8F92EAB1;
+static const uint32_t s_zstd_skippable_magic = 0x184D2A5E;
+static const size_t s_zstd_seek_footer_size = 9;
+
+static uint32_t get_le32( const uint8_t *p )
+{
+    return p[ 0 ] | ( p[ 1 ] << 8 ) | ( p[ 2 ] << 16 ) | ( ( uint32_t )p[ 3 ] << 24 );
+}
+
+static bool zstd_decode_stream( const std::vector< uint8_t > &in, std::vector< char > &out )
+{
+    ZSTD_DStream *dstream = ZSTD_createDStream();
+    ZSTD_inBuffer inbuf = { in.data(), in.size(), 0 };
+    size_t ret = 0;
+
+    out.resize( std::max< size_t >( ZSTD_DStreamOutSize(), in.size() * 4 ) );
+
+    ZSTD_initDStream( dstream );
+    ZSTD_outBuffer outbuf = { out.data(), out.size(), 0 };
+    for ( ;; )
+    {
+        size_t in_pos = inbuf.pos;
+        size_t out_pos = outbuf.pos;
+
+        if ( outbuf.pos == outbuf.size )
+        {
+            out.resize( out.size() * 2 );
+            outbuf.dst = out.data();
+            outbuf.size = out.size();
+        }
+
+        // Keep going after the input is used up: with a full output buffer
+        //  the decoder can still be holding data it hasn't flushed.
+        ret = ZSTD_decompressStream( dstream, &outbuf, &inbuf );
+        if ( ZSTD_isError( ret ) )
+            break;
+        if ( !ret && ( inbuf.pos == inbuf.size ) )
+            break;
+
+        // No progress with room to write means the last frame is truncated
+        if ( ( inbuf.pos == in_pos ) && ( outbuf.pos == out_pos ) )
+            break;
+    }
+
+    ZSTD_freeDStream( dstream );
+
+    out.resize( outbuf.pos );
+
+    // Non-zero means the last frame was cut short
+    return ( ret == 0 );
+}
+
+static bool zstd_open( trace_zfile_t *zfile, uint64_t file_size )
+{
+    uint8_t footer[ s_zstd_seek_footer_size ];
+
+    if ( ( file_size >= s_zstd_seek_footer_size ) &&
+         read_at( zfile, footer, sizeof( footer ), file_size - sizeof( footer ) ) &&
+         ( get_le32( footer + 5 ) == s_zstd_seekable_magic ) )
+    {
+        uint32_t frames = get_le32( footer );
+        size_t entry_size = ( footer[ 4 ] & 0x80 ) ? 12 : 8;
+        uint64_t table_size = ( uint64_t )frames * entry_size + s_zstd_seek_footer_size;
+        std::vector< uint8_t > table( table_size + 8 );
+        uint64_t coffset = 0;
+        uint64_t uoffset = 0;
+
+        if ( ( file_size < table.size() ) ||
+             !read_at( zfile, table.data(), table.size(), file_size - table.size() ) ||
+             ( get_le32( &table[ 0 ] ) != s_zstd_skippable_magic ) ||
+             ( get_le32( &table[ 4 ] ) != table_size ) )
+        {
+            logf( "[Error] %s: \"%s\" zstd seek table is corrupt.", __func__, zfile->filename.c_str() );
+            return false;
+        }
+
+        for ( uint32_t i = 0; i < frames; i++ )
+        {
+            const uint8_t *entry = &table[ 8 + i * entry_size ];
+            zblock_t block;
+
+            block.coffset = coffset;
+            block.csize = get_le32( entry );
+            block.uoffset = uoffset;
+            block.usize = get_le32( entry + 4 );
+            block.check = 0;
+
+            coffset += block.csize;
+            uoffset += block.usize;
+
+            // Skip empty frames, find_block() wants increasing offsets
+            if ( block.usize )
+                zfile->blocks.push_back( block );
+        }
+
+        zfile->size = uoffset;
+        return true;
+    }
+
+    // No seek table: read the whole compressed file and decode it as one
+    //  block up front, so both sit in memory at once. If the block cache
+    //  evicts it later the whole file gets read and decoded again.
+    std::vector< uint8_t > in( file_size );
+    zdata_t data = std::make_shared< std::vector< char > >();
+
+    logf( "%s: \"%s\" has no zstd seek table, decoding all of it.", __func__, zfile->filename.c_str() );
+
+    if ( !read_at( zfile, in.data(), in.size(), 0 ) || !zstd_decode_stream( in, *data ) )
+    {
+        logf( "[Error] %s: \"%s\" zstd decode failed.", __func__, zfile->filename.c_str() );
+        return false;
+    }
+
+    zblock_t block = { 0, file_size, 0, data->size(), 0 };
+
+    zfile->streamed = true;
+    zfile->size = data->size();
+    zfile->blocks.push_back( block );
+
+    zcache_entry_t &entry = zfile->cache[ 0 ];
+    entry.state = ZBLOCK_Ready;
+    entry.data = data;
+    zfile->bytes = data->size();
+    return true;
+}
+#endif // USE_ZSTD
+
+static zdata_t decode_block( trace_zfile_t *zfile, size_t idx )
+{
+    PROF_SCOPE( PROF_BlockDecompress );
+    const zblock_t &block = zfile->blocks[ idx ];
+    std::vector< uint8_t > in( block.csize );
+    zdata_t data = std::make_shared< std::vector< char > >();
+    bool ok = !in.empty() && read_at( zfile, in.data(), in.size(), block.coffset );
+
+    if ( ok )
+    {
+        switch ( zfile->type )
+        {
+#ifdef USE_LZMA
+        case ZFILE_Xz:
+            ok = xz_decode( block, in, *data );
+            break;
+#endif
+#ifdef USE_ZSTD
+        case ZFILE_Zstd:
+            if ( zfile->streamed )
+            {
+                ok = zstd_decode_stream( in, *data );
+            }
+            else
+            {
+                data->resize( block.usize );
+                size_t ret = ZSTD_decompress( data->data(), data->size(), in.data(), in.size() );
+                ok = !ZSTD_isError( ret ) && ( ret == block.usize );
+            }
+            break;
+#endif
+        default:
+            ok = false;
+            break;
+        }
+    }
+
+    if ( !ok )
+    {
+        logf( "[Error] %s: \"%s\" block %zu at offset %" PRIu64 " failed to decode.",
+              __func__, zfile->filename.c_str(), idx, block.coffset );
+        return NULL;
+    }
+
+    return data;
+}
+
+// Called with zfile->mutex held
+static void store_block( trace_zfile_t *zfile, size_t idx, const zdata_t &data )
+{
+    zcache_entry_t &entry = zfile->cache[ idx ];
+
+    entry.state = data ? ZBLOCK_Ready : ZBLOCK_Failed;
+    entry.tick = ++zfile->tick;
+    entry.data = data;
+
+    if ( data )
+        zfile->bytes += data->size();
+
+    // Drop least recently used blocks to stay under the ceiling
+    while ( zfile->bytes > zfile->bytes_max )
+    {
+        auto lru = zfile->cache.end();
+
+        for ( auto it = zfile->cache.begin(); it != zfile->cache.end(); it++ )
+        {
+            if ( ( it->first != idx ) && ( it->second.state == ZBLOCK_Ready ) &&
+                 ( ( lru == zfile->cache.end() ) || ( it->second.tick < lru->second.tick ) ) )
+                lru = it;
+        }
+        if ( lru == zfile->cache.end() )
+            break;
+
+        zfile->bytes -= lru->second.data->size();
+        zfile->cache.erase( lru );
+    }
+
+    zfile->cond.notify_all();
+}
+
+// Called with zfile->mutex held
+static void queue_readahead( trace_zfile_t *zfile, size_t idx )
+{
+    size_t end = std::min( idx + 1 + zfile->readahead, zfile->blocks.size() );
+    bool queued = false;
+
+    for ( size_t i = idx + 1; i < end; i++ )
+    {
+        if ( zfile->cache.find( i ) == zfile->cache.end() )
+        {
+            zfile->cache[ i ].state = ZBLOCK_Queued;
+            zfile->queue.push_back( i );
+            queued = true;
+        }
+    }
+
+    if ( queued )
+        zfile->cond.notify_all();
+}
+
+static void decode_thread( trace_zfile_t *zfile )
+{
+    std::unique_lock< std::mutex > lock( zfile->mutex );
+
+    for ( ;; )
+    {
+        while ( !zfile->quit && zfile->queue.empty() )
+            zfile->cond.wait( lock );
+        if ( zfile->quit )
+            break;
+
+        size_t idx = zfile->queue.front();
+        zfile->queue.pop_front();
+
+        // Readers take queued blocks they need right away, and they may have
+        //  been evicted since. Only decode ones still waiting on us.
+        auto it = zfile->cache.find( idx );
+        if ( ( it == zfile->cache.end() ) || ( it->second.state != ZBLOCK_Queued ) )
+            continue;
+        it->second.state = ZBLOCK_Decoding;
+
+        lock.unlock();
+        zdata_t data = decode_block( zfile, idx );
+        lock.lock();
+
+        store_block( zfile, idx, data );
+    }
+}
+
+static zdata_t get_block( trace_zfile_t *zfile, size_t idx )
+{
+    std::unique_lock< std::mutex > lock( zfile->mutex );
+
+    queue_readahead( zfile, idx );
+
+    for ( ;; )
+    {
+        auto it = zfile->cache.find( idx );
+
+        if ( ( it == zfile->cache.end() ) || ( it->second.state == ZBLOCK_Queued ) )
+        {
+            // Decode it here instead of waiting behind the readahead
+            zfile->cache[ idx ].state = ZBLOCK_Decoding;
+
+            lock.unlock();
+            zdata_t data = decode_block( zfile, idx );
+            lock.lock();
+
+            store_block( zfile, idx, data );
+            return data;
+        }
+
+        if ( it->second.state == ZBLOCK_Ready )
+        {
+            it->second.tick = ++zfile->tick;
+            return it->second.data;
+        }
+        if ( it->second.state == ZBLOCK_Failed )
+            return NULL;
+
+        // Another thread is decoding it
+        zfile->cond.wait( lock );
+    }
+}
+
+static size_t find_block( trace_zfile_t *zfile, uint64_t offset )
+{
+    auto it = std::upper_bound( zfile->blocks.begin(), zfile->blocks.end(), offset,
+                                []( uint64_t off, const zblock_t &block ) { return off < block.uoffset; } );
+
+    return ( it - zfile->blocks.begin() ) - 1;
+}
+
+zfile_open_t zfile_open( int fd, const char *filename, trace_zfile_t **zfile )
+{
+    static const uint8_t s_xz_magic[] = { 0xFD, '7', 'z', 'X', 'Z', 0x00 };
+    static const uint8_t s_zstd_magic[] = { 0x28, 0xB5, 0x2F, 0xFD };
+    trace_zfile_t *file = new trace_zfile_t;
+    uint8_t magic[ 6 ] = { 0 };
+    bool ok = false;
+
+    *zfile = NULL;
+
+    file->fd = fd;
+    file->filename = filename;
+
+    // read_at() doesn't move the fd file pointer on posix, but windows does
+    read_at( file, magic, sizeof( magic ), 0 );
+    lseek64( fd, 0, SEEK_SET );
+
+    if ( !memcmp( magic, s_xz_magic, sizeof( s_xz_magic ) ) )
+    {
+        file->type = ZFILE_Xz;
+#ifdef USE_LZMA
+        // Compressed data is only read through read_at(), so where this
+        //  leaves the fd file pointer doesn't matter.
+        int64_t file_size = lseek64( fd, 0, SEEK_END );
+
+        ok = xz_open( file, file_size );
+#else
+        logf( "[Error] %s: \"%s\" is xz compressed, gpuvis was built without liblzma.", __func__, filename );
+#endif
+    }
+    else if ( !memcmp( magic, s_zstd_magic, sizeof( s_zstd_magic ) ) )
+    {
+        file->type = ZFILE_Zstd;
+#ifdef USE_ZSTD
+        int64_t file_size = lseek64( fd, 0, SEEK_END );
+
+        ok = zstd_open( file, file_size );
+#else
+        logf( "[Error] %s: \"%s\" is zstd compressed, gpuvis was built without libzstd.", __func__, filename );
+#endif
+    }
+    else
+    {
+        delete file;
+        return ZFILE_Uncompressed;
+    }
+
+    if ( !ok || file->blocks.empty() )
+    {
+        delete file;
+        return ZFILE_Error;
+    }
+
+    if ( file->blocks.size() > 1 )
+    {
+        size_t thread_count = std::min< size_t >( std::max< size_t >( std::thread::hardware_concurrency(), 2 ) - 1, 8 );
+        uint64_t usize_max = 0;
+
+        for ( const zblock_t &block : file->blocks )
+            usize_max = std::max( usize_max, block.usize );
+
+        file->readahead = std::min( thread_count, file->blocks.size() - 1 );
+        file->bytes_max = std::max< size_t >( trace_zfile::s_cache_bytes, ( file->readahead + 2 ) * usize_max );
+
+        for ( size_t i = 0; i < thread_count; i++ )
+            file->threads.push_back( std::thread( decode_thread, file ) );
+    }
+    else
+    {
+        file->bytes_max = file->blocks[ 0 ].usize;
+    }
+
+    *zfile = file;
+    return ZFILE_Compressed;
+}
+
+trace_zfile_t *zfile_ref( trace_zfile_t *zfile )
+{
+    zfile->ref++;
+    return zfile;
+}
+
+void zfile_close( trace_zfile_t *zfile )
+{
+    if ( !zfile || --zfile->ref )
+        return;
+
+    {
+        std::lock_guard< std::mutex > lock( zfile->mutex );
+
+        zfile->quit = true;
+        zfile->cond.notify_all();
+    }
+
+    for ( std::thread &thread : zfile->threads )
+        thread.join();
+
+    delete zfile;
+}
+
+uint64_t zfile_size( trace_zfile_t *zfile )
+{
+    return zfile->size;
+}
+
+ssize_t zfile_pread( trace_zfile_t *zfile, void *data, size_t size, uint64_t offset )
+{
+    char *dst = ( char * )data;
+    size_t copied = 0;
+
+    if ( offset >= zfile->size )
+        return 0;
+
+    size = std::min< uint64_t >( size, zfile->size - offset );
+
+    for ( size_t idx = find_block( zfile, offset ); copied < size; idx++ )
+    {
+        zdata_t block = get_block( zfile, idx );
+        if ( !block )
+            return -1;
+
+        uint64_t block_offset = offset + copied - zfile->blocks[ idx ].uoffset;
+        size_t len = std::min< uint64_t >( size - copied, block->size() - block_offset );
+
+        memcpy( dst + copied, block->data() + block_offset, len );
+        copied += len;
+    }
+
+    return copied;
+}
+
+ssize_t zfile_read( trace_zfile_t *zfile, void *data, size_t size )
+{
+    uint64_t pos;
+
+    {
+        std::lock_guard< std::mutex > lock( zfile->mutex );
+        pos = zfile->pos;
+    }
+
+    ssize_t ret = zfile_pread( zfile, data, size, pos );
+
+    if ( ret > 0 )
+    {
+        std::lock_guard< std::mutex > lock( zfile->mutex );
+        zfile->pos = pos + ret;
+    }
+
+    return ret;
+}
+
+int64_t zfile_seek( trace_zfile_t *zfile, int64_t offset, int whence )
+{
+    std::lock_guard< std::mutex > lock( zfile->mutex );
+    int64_t pos;
+
+    if ( whence == SEEK_SET )
+        pos = offset;
+    else if ( whence == SEEK_CUR )
+        pos = zfile->pos + offset;
+    else if ( whence == SEEK_END )
+        pos = zfile->size + offset;
+    else
+        pos = -1;
+
+    if ( pos < 0 )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    zfile->pos = pos;
+    return pos;
+}
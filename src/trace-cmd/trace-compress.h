@@ -0,0 +1,67 @@
+/*
+ * Copyright 2017 Valve Software
+ *
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef _TRACE_COMPRESS_H_
+#define _TRACE_COMPRESS_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Random access reads of compressed trace files. Files need to be made of
+//  independently compressed blocks so we can seek without decoding from the
+//  start: xz with several blocks (xz -T0 or --block-size) or zstd with a
+//  seekable format seek table. Single block files work too, they're just
+//  decoded up front in one piece, which needs memory for the whole
+//  compressed and decompressed file.
+//
+// Reads go through a cache of decoded blocks, and a small pool of threads
+//  decodes the blocks after each read so sequential readers rarely wait.
+//  All functions are safe to call from several threads at once.
+typedef struct trace_zfile trace_zfile_t;
+
+enum zfile_open_t
+{
+    ZFILE_Uncompressed,     // plain file, read fd as usual
+    ZFILE_Compressed,       // *zfile is set
+    ZFILE_Error,            // compressed but unsupported or corrupt (logged)
+};
+
+// Check the magic of fd and open it as a compressed file if it's one. fd is
+//  left open and owned by the caller and must stay open until zfile_close().
+zfile_open_t zfile_open( int fd, const char *filename, trace_zfile_t **zfile );
+
+// Add a reference. zfile_close() frees the file when the last one is dropped.
+trace_zfile_t *zfile_ref( trace_zfile_t *zfile );
+void zfile_close( trace_zfile_t *zfile );
+
+// Decompressed size
+uint64_t zfile_size( trace_zfile_t *zfile );
+
+// Read at a decompressed offset. Returns bytes read, 0 at end of file, or -1.
+ssize_t zfile_pread( trace_zfile_t *zfile, void *data, size_t size, uint64_t offset );
+
+// read() / lseek() on a file position shared by every reference, like dup'd fds.
+ssize_t zfile_read( trace_zfile_t *zfile, void *data, size_t size );
+int64_t zfile_seek( trace_zfile_t *zfile, int64_t offset, int whence );
+
+#endif // _TRACE_COMPRESS_H_
@@ -0,0 +1,539 @@
+/*
+ * Copyright 2017 Valve Software
+ *
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/utsname.h>
+#endif
+
+#include "../gpuvis_macros.h"
+#include "trace-read.h"
+#include "trace-write.h"
+
+void logf( const char *fmt, ... ) ATTRIBUTE_PRINTF( 1, 2 );
+
+TraceLiveCapture::~TraceLiveCapture()
+{
+    stop();
+    remove_snapshots();
+}
+
+#ifdef WIN32
+
+bool TraceLiveCapture::start( const char *tracefs, size_t max_bytes, int64_t window_ns )
+{
+    logf( "[Error] %s: live capture needs tracefs.", __func__ );
+    return false;
+}
+
+void TraceLiveCapture::stop()
+{
+}
+
+bool TraceLiveCapture::snapshot( const char *filename )
+{
+    return false;
+}
+
+std::string TraceLiveCapture::snapshot_filename( uint32_t slot )
+{
+    return "";
+}
+
+void TraceLiveCapture::remove_snapshots()
+{
+}
+
+size_t TraceLiveCapture::bytes_captured()
+{
+    return 0;
+}
+
+#else
+
+// trace.dat option ids. Same as the TRACECMD_OPTION_* values in trace-read.cpp.
+enum
+{
+    LIVE_OPTION_DONE = 0,
+    LIVE_OPTION_TRACECLOCK = 4,
+    LIVE_OPTION_UNAME = 5,
+};
+
+// How long cpu threads wait for more data when their buffer is empty. This
+//  bounds how far behind the ring is from the kernel.
+static const int s_poll_ms = 20;
+
+struct live_page_t
+{
+    uint32_t cpu;
+    uint64_t ts;                    // page header timestamp
+    std::vector< char > data;       // page_size bytes
+};
+
+struct live_capture_t
+{
+    std::string tracefs;
+    size_t page_size = 0;
+    size_t max_bytes = 0;
+    int64_t window_ns = 0;
+    uint32_t cpus = 0;
+
+    std::atomic< bool > quit{ false };
+    std::vector< std::thread > threads;
+
+    // trace.dat headers from put_format_headers()
+    std::string format_headers;
+
+    // Pages in the order they were read. Pages of one cpu stay in order.
+    std::mutex mutex;
+    std::deque< live_page_t > pages;
+    size_t bytes = 0;
+};
+
+// Read a whole tracefs or proc file. Their st_size is useless, so read to EOF.
+static bool read_file( const std::string &filename, std::string &buf )
+{
+    int fd = open( filename.c_str(), O_RDONLY );
+
+    buf.clear();
+
+    if ( fd < 0 )
+        return false;
+
+    for ( ;; )
+    {
+        char tmp[ 64 * 1024 ];
+        ssize_t ret = read( fd, tmp, sizeof( tmp ) );
+
+        if ( ret < 0 && errno == EINTR )
+            continue;
+        if ( ret <= 0 )
+            break;
+
+        buf.append( tmp, ret );
+    }
+
+    close( fd );
+    return true;
+}
+
+static void add_page( live_capture_t *capture, uint32_t cpu, const std::vector< char > &data )
+{
+    uint64_t ts;
+
+    memcpy( &ts, data.data(), sizeof( ts ) );
+
+    std::lock_guard< std::mutex > lock( capture->mutex );
+
+    capture->pages.push_back( { cpu, ts, data } );
+    capture->bytes += data.size();
+
+    // Drop the oldest pages past our memory cap or time window
+    while ( capture->pages.size() > 1 )
+    {
+        const live_page_t &page = capture->pages.front();
+
+        if ( ( capture->bytes <= capture->max_bytes ) &&
+             ( !capture->window_ns || ( int64_t )( ts - page.ts ) <= capture->window_ns ) )
+        {
+            break;
+        }
+
+        capture->bytes -= page.data.size();
+        capture->pages.pop_front();
+    }
+}
+
+static void capture_cpu_thread( live_capture_t *capture, uint32_t cpu )
+{
+    std::string filename = string_format( "%s/per_cpu/cpu%u/trace_pipe_raw", capture->tracefs.c_str(), cpu );
+    int fd = open( filename.c_str(), O_RDONLY | O_NONBLOCK );
+
+    if ( fd < 0 )
+    {
+        logf( "[Error] %s: open(\"%s\") failed: %s", __func__, filename.c_str(), strerror( errno ) );
+        return;
+    }
+
+    std::vector< char > data( capture->page_size );
+
+    while ( !capture->quit )
+    {
+        // trace_pipe_raw hands back partially filled pages when the writer
+        //  is still on them, so this doesn't wait for pages to fill up.
+        ssize_t ret = read( fd, data.data(), data.size() );
+
+        if ( ret > 0 )
+        {
+            memset( data.data() + ret, 0, data.size() - ret );
+            add_page( capture, cpu, data );
+            continue;
+        }
+
+        if ( ( ret < 0 ) && ( errno != EAGAIN ) && ( errno != EINTR ) )
+        {
+            logf( "[Error] %s: read(\"%s\") failed: %s", __func__, filename.c_str(), strerror( errno ) );
+            break;
+        }
+
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        poll( &pfd, 1, s_poll_ms );
+    }
+
+    close( fd );
+}
+
+// Event format files of a system directory under tracefs/events
+static std::vector< std::string > get_system_formats( const std::string &dir )
+{
+    std::vector< std::string > formats;
+    DIR *pdir = opendir( dir.c_str() );
+
+    if ( pdir )
+    {
+        while ( struct dirent *entry = readdir( pdir ) )
+        {
+            std::string format;
+
+            if ( entry->d_name[ 0 ] == '.' )
+                continue;
+
+            if ( read_file( dir + "/" + entry->d_name + "/format", format ) && !format.empty() )
+                formats.push_back( format );
+        }
+
+        closedir( pdir );
+    }
+
+    return formats;
+}
+
+// Write the trace.dat headers trace-read.cpp expects up through the event
+//  formats, kallsyms and printk formats. These are read once when the capture
+//  starts since reading every event format file takes a while.
+static void put_format_headers( std::string &out, live_capture_t *capture )
+{
+    std::string buf;
+    std::string header_page;
+    std::string header_event;
+    const std::string &dir = capture->tracefs;
+
+    read_file( dir + "/events/header_page", header_page );
+    read_file( dir + "/events/header_event", header_event );
+    trace_put_file_header( out, capture->page_size, sizeof( long ), header_page, header_event );
+
+    std::vector< std::string > ftrace_formats = get_system_formats( dir + "/events/ftrace" );
+
+    trace_put4( out, ftrace_formats.size() );
+    for ( const std::string &format : ftrace_formats )
+    {
+        trace_put8( out, format.size() );
+        out += format;
+    }
+
+    std::vector< std::pair< std::string, std::vector< std::string > > > systems;
+    DIR *pdir = opendir( ( dir + "/events" ).c_str() );
+
+    if ( pdir )
+    {
+        while ( struct dirent *entry = readdir( pdir ) )
+        {
+            if ( ( entry->d_name[ 0 ] == '.' ) || !strcmp( entry->d_name, "ftrace" ) )
+                continue;
+
+            std::vector< std::string > formats = get_system_formats( dir + "/events/" + entry->d_name );
+
+            if ( !formats.empty() )
+                systems.push_back( { entry->d_name, formats } );
+        }
+
+        closedir( pdir );
+    }
+
+    trace_put4( out, systems.size() );
+    for ( const auto &system : systems )
+    {
+        trace_put_str( out, system.first.c_str() );
+        trace_put4( out, system.second.size() );
+
+        for ( const std::string &format : system.second )
+        {
+            trace_put8( out, format.size() );
+            out += format;
+        }
+    }
+
+    read_file( "/proc/kallsyms", buf );
+    trace_put4( out, buf.size() );
+    out += buf;
+
+    read_file( dir + "/printk_formats", buf );
+    trace_put4( out, buf.size() );
+    out += buf;
+}
+
+// Write the rest of the trace.dat headers: cmdlines, options and the flyrecord
+//  cpu data offsets. Pads out to where the cpu data starts.
+static void put_cpu_headers( std::string &out, live_capture_t *capture, const std::vector< size_t > &cpu_sizes )
+{
+    std::string buf;
+    const std::string &dir = capture->tracefs;
+
+    read_file( dir + "/saved_cmdlines", buf );
+    trace_put8( out, buf.size() );
+    out += buf;
+
+    trace_put4( out, capture->cpus );
+
+    out.append( "options  ", 10 );
+
+    struct utsname name;
+    if ( !uname( &name ) )
+    {
+        std::string str = string_format( "%s %s %s %s", name.sysname, name.release, name.version, name.machine );
+
+        trace_put2( out, LIVE_OPTION_UNAME );
+        trace_put4( out, str.size() + 1 );
+        trace_put_str( out, str.c_str() );
+    }
+
+    // trace_clock contents go after the flyrecord cpu offsets
+    trace_put2( out, LIVE_OPTION_TRACECLOCK );
+    trace_put4( out, 0 );
+
+    trace_put2( out, LIVE_OPTION_DONE );
+
+    out.append( "flyrecord", 10 );
+
+    std::string trace_clock;
+    read_file( dir + "/trace_clock", trace_clock );
+
+    // Cpu data starts on the first page boundary after the headers
+    size_t offset = out.size() + capture->cpus * 16 + 8 + trace_clock.size();
+    offset = ( offset + capture->page_size - 1 ) & ~( capture->page_size - 1 );
+
+    for ( size_t size : cpu_sizes )
+    {
+        trace_put8( out, offset );
+        trace_put8( out, size );
+        offset += size;
+    }
+
+    trace_put8( out, trace_clock.size() );
+    out += trace_clock;
+
+    out.resize( ( out.size() + capture->page_size - 1 ) & ~( capture->page_size - 1 ), 0 );
+}
+
+bool TraceLiveCapture::start( const char *tracefs, size_t max_bytes, int64_t window_ns )
+{
+    std::string buf;
+    std::string dir = tracefs;
+
+    stop();
+
+    if ( !read_file( dir + "/events/header_page", buf ) || buf.empty() )
+    {
+        logf( "[Error] %s: %s/events/header_page not found: %s", __func__, tracefs, strerror( errno ) );
+        return false;
+    }
+
+    m_capture = new live_capture_t;
+    m_capture->tracefs = dir;
+    m_capture->max_bytes = max_bytes;
+    m_capture->window_ns = window_ns;
+
+    // Ring buffer sub buffers can be bigger than a page on newer kernels
+    m_capture->page_size = sysconf( _SC_PAGESIZE );
+    if ( read_file( dir + "/buffer_subbuf_size_kb", buf ) && atoi( buf.c_str() ) > 0 )
+        m_capture->page_size = ( size_t )atoi( buf.c_str() ) * 1024;
+
+    for ( ;; )
+    {
+        struct stat st;
+        std::string cpudir = string_format( "%s/per_cpu/cpu%u", tracefs, m_capture->cpus );
+
+        if ( stat( cpudir.c_str(), &st ) || !S_ISDIR( st.st_mode ) )
+            break;
+        m_capture->cpus++;
+    }
+
+    if ( read_file( dir + "/tracing_on", buf ) && ( atoi( buf.c_str() ) == 0 ) )
+        logf( "%s: %s/tracing_on is 0. Nothing will be captured until it's turned on.", __func__, tracefs );
+
+    put_format_headers( m_capture->format_headers, m_capture );
+
+    for ( uint32_t cpu = 0; cpu < m_capture->cpus; cpu++ )
+        m_capture->threads.push_back( std::thread( capture_cpu_thread, m_capture, cpu ) );
+
+    logf( "Live capture of %s started (%u cpus, %.2f MB max)", tracefs,
+          m_capture->cpus, max_bytes / ( 1024.0f * 1024.0f ) );
+    return true;
+}
+
+void TraceLiveCapture::stop()
+{
+    if ( !m_capture )
+        return;
+
+    m_capture->quit = true;
+
+    for ( std::thread &thread : m_capture->threads )
+        thread.join();
+
+    delete m_capture;
+    m_capture = nullptr;
+}
+
+size_t TraceLiveCapture::bytes_captured()
+{
+    if ( !m_capture )
+        return 0;
+
+    std::lock_guard< std::mutex > lock( m_capture->mutex );
+    return m_capture->bytes;
+}
+
+bool TraceLiveCapture::snapshot( const char *filename )
+{
+    if ( !m_capture )
+        return false;
+
+    // Copy the ring so the cpu threads can keep going while we write
+    std::vector< std::vector< live_page_t > > cpu_pages( m_capture->cpus );
+    {
+        std::lock_guard< std::mutex > lock( m_capture->mutex );
+
+        for ( const live_page_t &page : m_capture->pages )
+            cpu_pages[ page.cpu ].push_back( page );
+    }
+
+    std::vector< size_t > cpu_sizes;
+    size_t count = 0;
+
+    for ( const std::vector< live_page_t > &pages : cpu_pages )
+    {
+        cpu_sizes.push_back( pages.size() * m_capture->page_size );
+        count += pages.size();
+    }
+
+    if ( !count )
+    {
+        logf( "[Error] %s: no events captured yet.", __func__ );
+        return false;
+    }
+
+    std::string out = m_capture->format_headers;
+
+    put_cpu_headers( out, m_capture, cpu_sizes );
+
+    // Don't follow a symlink someone else put in our place
+    int fd = open( filename, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600 );
+    FILE *fp = ( fd >= 0 ) ? fdopen( fd, "wb" ) : NULL;
+    if ( !fp )
+    {
+        logf( "[Error] %s: open(\"%s\") failed: %s", __func__, filename, strerror( errno ) );
+        if ( fd >= 0 )
+            close( fd );
+        return false;
+    }
+
+    bool ret = ( fwrite( out.data(), out.size(), 1, fp ) == 1 );
+
+    for ( const std::vector< live_page_t > &pages : cpu_pages )
+    {
+        for ( const live_page_t &page : pages )
+            ret = ret && ( fwrite( page.data.data(), page.data.size(), 1, fp ) == 1 );
+    }
+
+    ret = !fclose( fp ) && ret;
+
+    if ( !ret )
+        logf( "[Error] %s: writing \"%s\" failed: %s", __func__, filename, strerror( errno ) );
+
+    return ret;
+}
+
+std::string TraceLiveCapture::snapshot_filename( uint32_t slot )
+{
+    if ( m_snapshot_dir.empty() )
+    {
+        const char *tmpdir = getenv( "TMPDIR" );
+        std::string dir = string_format( "%s/gpuvis_live.XXXXXX", tmpdir ? tmpdir : "/tmp" );
+
+        // Created 0700, so nobody else can add or replace files in it
+        if ( !mkdtemp( &dir[ 0 ] ) )
+        {
+            logf( "[Error] %s: mkdtemp(\"%s\") failed: %s", __func__, dir.c_str(), strerror( errno ) );
+            return "";
+        }
+
+        m_snapshot_dir = dir;
+    }
+
+    return string_format( "%s/gpuvis_live%u.dat", m_snapshot_dir.c_str(), slot );
+}
+
+void TraceLiveCapture::remove_snapshots()
+{
+    if ( m_snapshot_dir.empty() )
+        return;
+
+    DIR *dir = opendir( m_snapshot_dir.c_str() );
+
+    if ( dir )
+    {
+        struct dirent *entry;
+
+        while ( ( entry = readdir( dir ) ) )
+        {
+            if ( strcmp( entry->d_name, "." ) && strcmp( entry->d_name, ".." ) )
+                unlinkat( dirfd( dir ), entry->d_name, 0 );
+        }
+
+        closedir( dir );
+    }
+
+    rmdir( m_snapshot_dir.c_str() );
+    m_snapshot_dir.clear();
+}
+
+#endif // !WIN32
@@ -23,11 +23,17 @@
 #include <errno.h>
 #include <string>
 #include <vector>
-#include <forward_list>
 #include <csetjmp>
 #include <unordered_map>
 #include <future>
 #include <set>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <algorithm>
+#include <list>
 
 #ifdef WIN32
 #include <io.h>
@@ -35,8 +41,10 @@
 #define open _open
 #define close _close
 #define read _read
+#define write _write
 #define lseek64 _lseeki64
 #define dup _dup
+#define unlink _unlink
 #else
 #define USE_MMAP
 
@@ -52,7 +60,9 @@ extern "C"
 }
 
 #include "../gpuvis_macros.h"
+#include "../gpuvis_prof.h"
 #include "trace-read.h"
+#include "trace-compress.h"
 
 enum
 {
@@ -80,9 +90,7 @@ typedef struct event_format event_format_t;
 
 typedef struct file_info
 {
-    int done;
     tracecmd_input_t *handle;
-    pevent_record_t *record;
 } file_info_t;
 
 typedef struct page
@@ -102,16 +110,84 @@ typedef struct cpu_data
     unsigned long long size = 0;
     unsigned long long timestamp = 0;
 
-    std::forward_list< page_t * > pages;
     pevent_record_t *next_record = nullptr;
     page_t *page = nullptr;
     kbuffer_t *kbuf = nullptr;
+
+    /* whole cpu data region when mmap'd, pages point into this */
+    void *map = nullptr;
+    size_t map_size = 0;
+    unsigned long long map_offset = 0;
+    page_t map_page = { 0, nullptr, nullptr, 0 };
+
+    /* pages allocated with read_page() and not yet freed */
+    int page_count = 0;
+
+    /* freed records kept for reuse, linked through record->priv */
+    pevent_record_t *free_records = nullptr;
 } cpu_data_t;
 
+// Per event format lookups done once before reading so decoding a record
+//  doesn't string compare the system, event and field names.
+typedef struct format_info
+{
+    const char *system = nullptr;           // strpool'd event system
+    const char *name = nullptr;             // strpool'd event name
+    uint32_t flags = 0;                     // TRACE_FLAG_* from system and name
+
+    bool is_ftrace_function = false;        // ftrace:function
+    bool is_printk_function = false;        // ftrace:print
+
+    struct format_field *common_flags = nullptr;
+    struct format_field *timeline = nullptr;
+    struct format_field *context = nullptr;
+    struct format_field *seqno = nullptr;
+    struct format_field *crtc = nullptr;
+    struct format_field *ip = nullptr;
+    struct format_field *parent_ip = nullptr;
+    struct format_field *buf = nullptr;
+
+    // strpool'd field names in event->format.fields order
+    std::vector< const char * > keys;
+} format_info_t;
+
+// Indexed the same as pevent->events
+typedef std::vector< format_info_t > format_table_t;
+
+// Kernel symbol from the kallsyms section. name points into kallsyms_t::buf.
+typedef struct kallsyms_func
+{
+    unsigned long long addr;
+    const char *name;
+} kallsyms_func_t;
+
+typedef struct kallsyms
+{
+    ~kallsyms()
+    {
+        if ( thread.joinable() )
+            thread.join();
+        free( buf );
+    }
+
+    // Unique per table so function caches can't confuse two files
+    uint32_t id = 0;
+
+    char *buf = nullptr;
+    size_t size = 0;
+
+    // Sorted by addr
+    std::vector< kallsyms_func_t > funcs;
+
+    // Parses buf while the rest of the headers are read
+    std::thread thread;
+} kallsyms_t;
+
 typedef struct input_buffer_instance
 {
     char *name;
     size_t offset;
+    size_t option_offset; /* file offset of the option's copy of offset */
 } input_buffer_instance_t;
 
 typedef struct tracecmd_input
@@ -120,18 +196,18 @@ typedef struct tracecmd_input
     tracecmd_input_t *parent = nullptr;
     unsigned long flags = 0;
     int fd = -1;
+    trace_zfile_t *zfile = nullptr; /* set for compressed files, reads go through it */
     int long_size = 0;
     unsigned long page_size = 0;
     int cpus = 0;
     int ref = 0;
     int nr_buffers = 0; /* buffer instances */
     bool use_trace_clock = false;
-#ifdef USE_MMAP
-    bool read_page = false;
-#endif
     cpu_data_t *cpu_data = nullptr;
     unsigned long long ts_offset = 0;
     input_buffer_instance_t *buffers = nullptr;
+    const format_table_t *formats = nullptr;
+    kallsyms_t *kallsyms = nullptr; /* owned by main handle */
 
     std::string file;
     std::string uname;
@@ -143,11 +219,22 @@ typedef struct tracecmd_input
     size_t event_files_start = 0;
     size_t total_file_size = 0;
 
+    /* where the cpu data headers are, for write_trace_slice() */
+    size_t cpus_start = 0;
+    size_t options_start = 0;
+    size_t options_end = 0;
+    size_t trace_clock_start = 0;
+    size_t trace_clock_end = 0;
+
     std::jmp_buf jump_buffer;
 } tracecmd_input_t;
 
 void logf( const char *fmt, ... ) ATTRIBUTE_PRINTF( 1, 2 );
 
+// Set by cpu stream worker threads so die() unwinds to the worker
+//  instead of longjmp'ing onto the reader thread's stack.
+static thread_local std::jmp_buf *t_jump_buffer = nullptr;
+
 [[noreturn]] static void die( tracecmd_input_t *handle, const char *fmt, ... ) ATTRIBUTE_PRINTF( 2, 3 );
 [[noreturn]] static void die( tracecmd_input_t *handle, const char *fmt, ... )
 {
@@ -165,6 +252,9 @@ void logf( const char *fmt, ... ) ATTRIBUTE_PRINTF( 1, 2 );
         free( buf );
     }
 
+    if ( t_jump_buffer )
+        std::longjmp( *t_jump_buffer, -1 );
+
     std::longjmp( handle->jump_buffer, -1 );
 }
 
@@ -186,11 +276,22 @@ static void *trace_realloc( tracecmd_input_t *handle, void *ptr, size_t size )
     return ret;
 }
 
+static off64_t do_lseek( tracecmd_input_t *handle, off64_t offset, int whence )
+{
+    if ( handle->zfile )
+        return zfile_seek( handle->zfile, offset, whence );
+
+    return lseek64( handle->fd, offset, whence );
+}
+
 static size_t do_read( tracecmd_input_t *handle, void *data, size_t size )
 {
     ssize_t ret;
 
-    ret = TEMP_FAILURE_RETRY( read( handle->fd, data, size ) );
+    if ( handle->zfile )
+        ret = zfile_read( handle->zfile, data, size );
+    else
+        ret = TEMP_FAILURE_RETRY( read( handle->fd, data, size ) );
     if ( ret < 0 )
     {
         die( handle, "%s(\"%s\") failed: %s (%d)\n", __func__, handle->file.c_str(),
@@ -249,7 +350,7 @@ static char *read_string( tracecmd_input_t *handle )
 
     /* move the file descriptor to the end of the string */
     off64_t val;
-    val = lseek64( handle->fd, -( int )( r - ( i + 1 ) ), SEEK_CUR );
+    val = do_lseek( handle, -( int )( r - ( i + 1 ) ), SEEK_CUR );
     if ( val < 0 )
         goto fail;
 
@@ -345,7 +446,7 @@ static void read_header_files( tracecmd_input_t *handle )
 
     free( header );
 
-    handle->ftrace_files_start = lseek64( handle->fd, 0, SEEK_CUR );
+    handle->ftrace_files_start = do_lseek( handle, 0, SEEK_CUR );
 }
 
 static void read_ftrace_file( tracecmd_input_t *handle,
@@ -394,7 +495,7 @@ static void read_ftrace_files( tracecmd_input_t *handle )
         read_ftrace_file( handle, size );
     }
 
-    handle->event_files_start = lseek64( handle->fd, 0, SEEK_CUR );
+    handle->event_files_start = do_lseek( handle, 0, SEEK_CUR );
 }
 
 static void read_event_files( tracecmd_input_t *handle )
@@ -426,75 +527,111 @@ static void read_event_files( tracecmd_input_t *handle )
     }
 }
 
-static void parse_proc_kallsyms( pevent_t *pevent, char *file )
+static void parse_proc_kallsyms( kallsyms_t *kallsyms )
 {
-    char *line;
-    char *next = NULL;
+    char *line = kallsyms->buf;
+    char *end = kallsyms->buf + kallsyms->size;
+    std::vector< kallsyms_func_t > &funcs = kallsyms->funcs;
 
-    line = strtok_r( file, "\n", &next );
-    while ( line )
+    // Lines average a bit over 40 bytes
+    funcs.reserve( kallsyms->size / 40 );
+
+    while ( line < end )
     {
-        char *endptr;
-        unsigned long long addr;
+        char *eol = ( char * )memchr( line, '\n', end - line );
+        char *ptr = line;
+        unsigned long long addr = 0;
+
+        if ( !eol )
+            eol = end;
+        *eol = 0;
 
         // Parse lines of this form:
         //   addr             ch            func   mod
         //   ffffffffc07ec678 d descriptor.58652\t[bnep]
-
-        addr = strtoull( line, &endptr, 16 );
-
-        if ( endptr && *endptr == ' ' )
+        for ( ;; ptr++ )
         {
-            char ch;
-            char *mod;
-            char *func;
+            unsigned int c = ( unsigned char )*ptr;
 
-            line = endptr + 1;
+            if ( c - '0' < 10 )
+                addr = ( addr << 4 ) | ( c - '0' );
+            else if ( ( c | 0x20 ) - 'a' < 6 )
+                addr = ( addr << 4 ) | ( ( c | 0x20 ) - 'a' + 10 );
+            else
+                break;
+        }
 
-            ch = *line;
+        if ( *ptr == ' ' )
+        {
+            char ch = ptr[ 1 ];
 
             // Skip: x86-64 reports per-cpu variable offsets as absolute (A)
-            if ( ch && ( ch != 'A' ) && ( line[ 1 ] == ' ' ) && line[ 2 ] )
+            if ( ch && ( ch != 'A' ) && ( ptr[ 2 ] == ' ' ) && ptr[ 3 ] )
             {
-                func = line + 2;
+                char *func = ptr + 3;
+                char *mod = ( char * )memchr( func, '\t', eol - func );
 
-                mod = strchr( func, '\t' );
                 if ( mod && mod[ 1 ] == '[' )
-                {
                     *mod = 0;
-                    mod += 2;
-                    mod[ strlen( mod ) - 1 ] = 0;
-                }
 
-                //$ TODO mikesart PERF: This is adding the item to a func_list
-                // which gets converted to a sorted array afterwords.
-                pevent_register_function( pevent, func, addr, mod );
+                funcs.push_back( { addr, func } );
             }
         }
 
-        line = strtok_r( NULL, "\n", &next );
+        line = eol + 1;
     }
+
+    // kallsyms is mostly in address order already, so usually no sort is needed
+    auto cmp = []( const kallsyms_func_t &lhs, const kallsyms_func_t &rhs )
+    {
+        return lhs.addr < rhs.addr;
+    };
+    if ( !std::is_sorted( funcs.begin(), funcs.end(), cmp ) )
+        std::stable_sort( funcs.begin(), funcs.end(), cmp );
 }
 
 static void read_proc_kallsyms( tracecmd_input_t *handle )
 {
-    char *buf;
+    static std::atomic< uint32_t > s_kallsyms_id( 0 );
     unsigned int size;
-    pevent_t *pevent = handle->pevent;
+    kallsyms_t *kallsyms;
 
     size = read4( handle );
     if ( !size  )
         return; /* OK? */
 
-    buf = ( char * )trace_malloc( handle, size + 1 );
+    kallsyms = new kallsyms_t;
+    kallsyms->id = ++s_kallsyms_id;
+    kallsyms->buf = ( char * )trace_malloc( handle, size + 1 );
+    kallsyms->size = size;
+    handle->kallsyms = kallsyms;
 
-    do_read_check( handle, buf, size );
+    do_read_check( handle, kallsyms->buf, size );
 
-    buf[ size ] = 0;
+    kallsyms->buf[ size ] = 0;
 
-    parse_proc_kallsyms( pevent, buf );
+    // Parse on another thread while the printk formats and cmdlines are read.
+    //  Joined at the end of tracecmd_read_headers().
+    kallsyms->thread = std::thread( parse_proc_kallsyms, kallsyms );
+}
 
-    free( buf );
+// Return kallsyms name of the function containing addr, or NULL.
+static const char *kallsyms_find_function( const kallsyms_t *kallsyms, unsigned long long addr )
+{
+    const std::vector< kallsyms_func_t > &funcs = kallsyms->funcs;
+    auto it = std::upper_bound( funcs.begin(), funcs.end(), addr,
+        []( unsigned long long val, const kallsyms_func_t &func ) { return val < func.addr; } );
+
+    if ( it == funcs.begin() )
+        return NULL;
+
+    --it;
+
+    // Like pevent_find_function(), addresses past the last symbol don't resolve
+    if ( ( it + 1 == funcs.end() ) && ( addr != it->addr ) )
+        return NULL;
+
+    return it->name;
 }
 
 static void parse_ftrace_printk( tracecmd_input_t *handle, pevent_t *pevent, char *file )
@@ -621,88 +758,104 @@ static void tracecmd_read_headers( tracecmd_input_t *handle )
     read_and_parse_cmdlines( handle );
 
     pevent_set_long_size( handle->pevent, handle->long_size );
+
+    if ( handle->kallsyms )
+        handle->kallsyms->thread.join();
 }
 
-static int read_page( tracecmd_input_t *handle, off64_t offset,
-                      int cpu, void *map )
+#ifndef USE_MMAP
+/* without pread the seek + read + seek below shares the fd file pointer with
+   every cpu stream thread, so only one of them gets to move it at a time */
+static std::mutex s_seek_mutex;
+#endif
+
+/* read at offset without moving the file pointer, returns bytes read or -1 */
+static ssize_t do_pread( tracecmd_input_t *handle, void *data, size_t size, off64_t offset )
 {
-    off64_t ret;
-    off64_t save_seek;
+    if ( handle->zfile )
+        return zfile_pread( handle->zfile, data, size, offset );
 
-    /* other parts of the code may expect the pointer to not move */
-    save_seek = lseek64( handle->fd, 0, SEEK_CUR );
+#ifdef USE_MMAP
+    /* pread doesn't touch the shared file pointer, so cpus can read concurrently */
+    return TEMP_FAILURE_RETRY( pread64( handle->fd, data, size, offset ) );
+#else
+    std::lock_guard< std::mutex > lock( s_seek_mutex );
 
-    ret = lseek64( handle->fd, offset, SEEK_SET );
-    if ( ret < 0 )
-        return -1;
+    /* other parts of the code may expect the pointer to not move */
+    off64_t save_seek = lseek64( handle->fd, 0, SEEK_CUR );
+    ssize_t ret = -1;
 
-    ret = TEMP_FAILURE_RETRY( read( handle->fd, map, handle->page_size ) );
-    if ( ret < 0 )
-        return -1;
+    if ( lseek64( handle->fd, offset, SEEK_SET ) >= 0 )
+        ret = TEMP_FAILURE_RETRY( read( handle->fd, data, size ) );
 
     /* reset the file pointer back */
     lseek64( handle->fd, save_seek, SEEK_SET );
-    return 0;
+    return ret;
+#endif
+}
+
+static int read_page( tracecmd_input_t *handle, off64_t offset,
+                      int cpu, void *map )
+{
+    PROF_SCOPE( PROF_PageRead );
+
+    return ( do_pread( handle, map, handle->page_size, offset ) < 0 ) ? -1 : 0;
 }
 
 static page_t *allocate_page( tracecmd_input_t *handle, int cpu, off64_t offset )
 {
     int ret;
+    page_t *page;
     cpu_data_t *cpu_data = &handle->cpu_data[ cpu ];
 
-    for ( page_t *page : cpu_data->pages )
+    if ( cpu_data->map && ( offset + handle->page_size <= cpu_data->map_offset + cpu_data->map_size ) )
     {
-        if ( page->offset == offset )
-        {
-            page->ref_count++;
-            return page;
-        }
+        /*
+         * The cpu region is mapped for the life of the handle, so just
+         * point at the page. Nothing to copy, refcount, or free.
+         */
+        page = &cpu_data->map_page;
+        page->offset = offset;
+        page->handle = handle;
+        page->map = ( char * )cpu_data->map + ( offset - cpu_data->map_offset );
+        return page;
     }
 
-    page_t *page = ( page_t * )trace_malloc( handle, sizeof( *page ) );
+    page = ( page_t * )trace_malloc( handle, sizeof( *page ) );
 
     memset( page, 0, sizeof( *page ) );
 
     page->offset = offset;
     page->handle = handle;
+    page->map = trace_malloc( handle, handle->page_size );
 
-#ifdef USE_MMAP
-    if ( handle->read_page )
-#endif
-    {
-        page->map = trace_malloc( handle, handle->page_size );
-
-        ret = read_page( handle, offset, cpu, page->map );
-        if ( ret < 0 )
-        {
-            free( page->map );
-            page->map = NULL;
-        }
-    }
-#ifdef USE_MMAP
-    else
-    {
-        page->map = mmap( NULL, handle->page_size, PROT_READ, MAP_PRIVATE,
-                          handle->fd, offset );
-        if ( page->map == MAP_FAILED )
-            page->map = NULL;
-    }
-#endif
+    /* The last page can run past the end of the file */
+    memset( page->map, 0, handle->page_size );
 
-    if ( !page->map )
+    ret = read_page( handle, offset, cpu, page->map );
+    if ( ret < 0 )
     {
+        free( page->map );
         free( page );
         return NULL;
     }
 
-    cpu_data->pages.push_front( page );
+    cpu_data->page_count++;
 
     page->ref_count = 1;
     return page;
 }
 
+static bool is_mapped_page( tracecmd_input_t *handle, int cpu, page_t *page )
+{
+    return ( page == &handle->cpu_data[ cpu ].map_page );
+}
+
 static void __free_page( tracecmd_input_t *handle, int cpu, page_t *page )
 {
+    if ( is_mapped_page( handle, cpu, page ) )
+        return;
+
     if ( !page->ref_count )
         die( handle, "%s: Page ref count is zero.\n", __func__ );
 
@@ -710,18 +863,10 @@ static void __free_page( tracecmd_input_t *handle, int cpu, page_t *page )
     if ( page->ref_count )
         return;
 
-#ifdef USE_MMAP
-    if ( handle->read_page )
-#endif
-        free( page->map );
-#ifdef USE_MMAP
-    else
-        munmap( page->map, handle->page_size );
-#endif
-
-    handle->cpu_data[ cpu ].pages.remove( page );
-
+    free( page->map );
     free( page );
+
+    handle->cpu_data[ cpu ].page_count--;
 }
 
 static void free_page( tracecmd_input_t *handle, int cpu )
@@ -736,8 +881,10 @@ static void free_page( tracecmd_input_t *handle, int cpu )
     handle->cpu_data[ cpu ].page = NULL;
 }
 
-static void __free_record( pevent_record_t *record )
+static void __free_record( tracecmd_input_t *handle, pevent_record_t *record )
 {
+    cpu_data_t *cpu_data = &handle->cpu_data[ record->cpu ];
+
     if ( record->priv )
     {
         page_t *page = ( page_t * )record->priv;
@@ -745,7 +892,38 @@ static void __free_record( pevent_record_t *record )
         __free_page( page->handle, record->cpu, page );
     }
 
-    free( record );
+    /*
+     * Records are only allocated and freed by whoever is reading this cpu,
+     * so keep them on the cpu's free list instead of going to the heap
+     * for every event.
+     */
+    record->priv = cpu_data->free_records;
+    cpu_data->free_records = record;
+}
+
+static pevent_record_t *alloc_record( tracecmd_input_t *handle, int cpu )
+{
+    cpu_data_t *cpu_data = &handle->cpu_data[ cpu ];
+    pevent_record_t *record = cpu_data->free_records;
+
+    if ( record )
+        cpu_data->free_records = ( pevent_record_t * )record->priv;
+    else
+        record = ( pevent_record_t * )trace_malloc( handle, sizeof( *record ) );
+
+    memset( record, 0, sizeof( *record ) );
+    return record;
+}
+
+static void free_record_list( cpu_data_t *cpu_data )
+{
+    while ( cpu_data->free_records )
+    {
+        pevent_record_t *record = cpu_data->free_records;
+
+        cpu_data->free_records = ( pevent_record_t * )record->priv;
+        free( record );
+    }
 }
 
 static void free_record( tracecmd_input_t *handle, pevent_record_t *record )
@@ -765,7 +943,7 @@ static void free_record( tracecmd_input_t *handle, pevent_record_t *record )
 
     record->data = NULL;
 
-    __free_record( record );
+    __free_record( handle, record );
 }
 
 static void free_next( tracecmd_input_t *handle, int cpu )
@@ -930,9 +1108,7 @@ read_again:
 
     index = kbuffer_curr_offset( kbuf );
 
-    record = ( pevent_record_t * )trace_malloc( handle, sizeof( *record ) );
-
-    memset( record, 0, sizeof( *record ) );
+    record = alloc_record( handle, cpu );
 
     record->ts = handle->cpu_data[ cpu ].timestamp;
     record->size = kbuffer_event_size( kbuf );
@@ -945,8 +1121,13 @@ read_again:
     handle->cpu_data[ cpu ].next_record = record;
 
     record->record_size = kbuffer_curr_size( kbuf );
-    record->priv = page;
-    page->ref_count++;
+
+    /* mapped pages stay valid until tracecmd_close */
+    if ( !is_mapped_page( handle, cpu, page ) )
+    {
+        record->priv = page;
+        page->ref_count++;
+    }
 
     kbuffer_next_event( kbuf, NULL );
 
@@ -977,83 +1158,6 @@ static pevent_record_t *tracecmd_read_data( tracecmd_input_t *handle, int cpu )
     return record;
 }
 
-/**
- * tracecmd_peek_next_data - return the next record
- * @handle: input handle to the trace.dat file
- * @rec_cpu: return pointer to the CPU that the record belongs to
- *
- * This returns the next record by time. This is different than
- * tracecmd_peek_data in that it looks at all CPUs. It does a peek
- * at each CPU and the record with the earliest time stame is
- * returned. If @rec_cpu is not NULL it gets the CPU id the record was
- * on. It does not increment the CPU iterator.
- */
-static pevent_record_t *tracecmd_peek_next_data( tracecmd_input_t *handle, int *rec_cpu )
-{
-    int cpu;
-    int next_cpu;
-    unsigned long long ts;
-    pevent_record_t *record, *next_record = NULL;
-
-    if ( rec_cpu )
-        *rec_cpu = -1;
-
-    next_cpu = -1;
-    ts = 0;
-
-    for ( cpu = 0; cpu < handle->cpus; cpu++ )
-    {
-        record = tracecmd_peek_data( handle, cpu );
-        if ( record && ( !next_record || record->ts < ts ) )
-        {
-            ts = record->ts;
-            next_cpu = cpu;
-            next_record = record;
-        }
-    }
-
-    if ( next_record )
-    {
-        if ( rec_cpu )
-            *rec_cpu = next_cpu;
-        return next_record;
-    }
-
-    return NULL;
-}
-
-/**
- * tracecmd_read_next_data - read the next record
- * @handle: input handle to the trace.dat file
- * @rec_cpu: return pointer to the CPU that the record belongs to
- *
- * This returns the next record by time. This is different than
- * tracecmd_read_data in that it looks at all CPUs. It does a peek
- * at each CPU and the record with the earliest time stame is
- * returned. If @rec_cpu is not NULL it gets the CPU id the record was
- * on. The CPU cursor of the returned record is moved to the
- * next record.
- *
- * Multiple reads of this function will return a serialized list
- * of all records for all CPUs in order of time stamp.
- *
- * The record returned must be freed.
- */
-static pevent_record_t *tracecmd_read_next_data( tracecmd_input_t *handle, int *rec_cpu )
-{
-    int next_cpu;
-    pevent_record_t *record;
-
-    record = tracecmd_peek_next_data( handle, &next_cpu );
-    if ( !record )
-        return NULL;
-
-    if ( rec_cpu )
-        *rec_cpu = next_cpu;
-
-    return tracecmd_read_data( handle, next_cpu );
-}
-
 static int init_cpu( tracecmd_input_t *handle, int cpu )
 {
     cpu_data_t *cpu_data = &handle->cpu_data[ cpu ];
@@ -1068,35 +1172,46 @@ static int init_cpu( tracecmd_input_t *handle, int cpu )
         return 0;
     }
 
-    cpu_data->page = allocate_page( handle, cpu, cpu_data->offset );
 #ifdef USE_MMAP
-    if ( !cpu_data->page && !handle->read_page )
+    /* Compressed files can't be mapped, pages come from the decoded block cache */
+    if ( !handle->zfile )
     {
-        //$ TODO mikesart: This just should never happen, yes?
-        die( handle, "%s: Can't mmap file, will read instead.\n", __func__ );
-
-        if ( cpu )
+        /*
+         * Map the whole cpu region once and let the page cache do the work.
+         * mmap wants a system page aligned offset, which the trace page size
+         * may not be. If this fails we fall back to reading each page.
+         *
+         * Touching a mapping past the end of the file raises SIGBUS instead of
+         * failing like read() does, so the map stops at the end of the file
+         * (total_file_size is the length on disk for uncompressed files) and
+         * a last trace page cut short by it gets read instead.
+         */
+        unsigned long long sys_page_mask = ( unsigned long long )sysconf( _SC_PAGESIZE ) - 1;
+        unsigned long long map_offset = cpu_data->file_offset & ~sys_page_mask;
+        unsigned long long map_end = cpu_data->file_offset +
+                ( ( cpu_data->file_size + handle->page_size - 1 ) & ~( unsigned long long )( handle->page_size - 1 ) );
+
+        map_end = std::min< unsigned long long >( map_end, handle->total_file_size );
+
+        size_t map_size = map_end - map_offset;
+        void *map = ( cpu_data->file_offset + cpu_data->file_size > handle->total_file_size ) ? MAP_FAILED :
+                mmap( NULL, map_size, PROT_READ, MAP_PRIVATE, handle->fd, map_offset );
+
+        if ( map != MAP_FAILED )
         {
-            /*
-			 * If the other CPUs had size and was able to mmap
-			 * then bail.
-			 */
-            for ( int i = 0; i < cpu; i++ )
-            {
-                if ( handle->cpu_data[ i ].size )
-                    return -1;
-            }
-        }
+            madvise( map, map_size, MADV_SEQUENTIAL );
 
-        /* try again without mmapping, just read it directly */
-        handle->read_page = true;
-        cpu_data->page = allocate_page( handle, cpu, cpu_data->offset );
-        if ( !cpu_data->page )
-            /* Still no luck, bail! */
-            return -1;
+            cpu_data->map = map;
+            cpu_data->map_size = map_size;
+            cpu_data->map_offset = map_offset;
+        }
     }
 #endif
 
+    cpu_data->page = allocate_page( handle, cpu, cpu_data->offset );
+    if ( !cpu_data->page )
+        return -1;
+
     update_page_info( handle, cpu );
     return 0;
 }
@@ -1109,6 +1224,7 @@ static int handle_options( tracecmd_input_t *handle )
         unsigned int size;
         unsigned short option;
         unsigned long long offset;
+        off64_t buf_offset;
 
         do_read_check( handle, &option, 2 );
 
@@ -1121,6 +1237,7 @@ static int handle_options( tracecmd_input_t *handle )
         size = __data2host4( handle->pevent, size );
         buf = ( char * )trace_malloc( handle, size );
 
+        buf_offset = do_lseek( handle, 0, SEEK_CUR );
         do_read_check( handle, buf, size );
 
         switch ( option )
@@ -1168,6 +1285,7 @@ static int handle_options( tracecmd_input_t *handle )
 
             offset = *( unsigned long long * )buf;
             buffer->offset = __data2host8( handle->pevent, offset );
+            buffer->option_offset = buf_offset;
             break;
         }
         case TRACECMD_OPTION_TRACECLOCK:
@@ -1202,9 +1320,13 @@ static void read_cpu_data( tracecmd_input_t *handle )
     // check if this handles options
     if ( strncmp( buf, "options", 7 ) == 0 )
     {
+        handle->options_start = do_lseek( handle, 0, SEEK_CUR );
+
         if ( handle_options( handle ) < 0 )
             die( handle, "%s: handle_options failed.\n", __func__ );
 
+        handle->options_end = do_lseek( handle, 0, SEEK_CUR );
+
         do_read_check( handle, buf, 10 );
     }
 
@@ -1284,12 +1406,16 @@ void tracecmd_init_data( tracecmd_input_t *handle )
 {
     pevent_t *pevent = handle->pevent;
 
+    handle->cpus_start = do_lseek( handle, 0, SEEK_CUR );
     handle->cpus = read4( handle );
 
     pevent_set_cpus( pevent, handle->cpus );
 
     read_cpu_data( handle );
 
+    handle->trace_clock_start = do_lseek( handle, 0, SEEK_CUR );
+    handle->trace_clock_end = handle->trace_clock_start;
+
     if ( handle->use_trace_clock )
     {
         /*
@@ -1300,6 +1426,8 @@ void tracecmd_init_data( tracecmd_input_t *handle )
 		 */
         if ( read_and_parse_trace_clock( handle, pevent ) < 0 )
             pevent_register_trace_clock( pevent, "local" );
+
+        handle->trace_clock_end = do_lseek( handle, 0, SEEK_CUR );
     }
 }
 
@@ -1314,6 +1442,7 @@ static inline int tracecmd_host_bigendian( void )
 /**
  * tracecmd_alloc_fd - create a tracecmd_input handle from a file descriptor
  * @fd: the file descriptor for the trace.dat file
+ * @zfile: compressed reader for fd, or NULL
  *
  * Allocate a tracecmd_input handle from a file descriptor and open the
  * file. This tests if the file is of trace-cmd format and allocates
@@ -1322,7 +1451,7 @@ static inline int tracecmd_host_bigendian( void )
  * The returned pointer is not ready to be read yet. A tracecmd_read_headers()
  * and tracecmd_init_data() still need to be called on the descriptor.
  */
-static tracecmd_input_t *tracecmd_alloc_fd( const char *file, int fd )
+static tracecmd_input_t *tracecmd_alloc_fd( const char *file, int fd, trace_zfile_t *zfile )
 {
     char buf[ 64 ];
     char *version;
@@ -1335,6 +1464,7 @@ static tracecmd_input_t *tracecmd_alloc_fd( const char *file, int fd )
 
     handle->file = file;
     handle->fd = fd;
+    handle->zfile = zfile;
     handle->ref = 1;
 
     if ( setjmp( handle->jump_buffer ) )
@@ -1342,6 +1472,7 @@ static tracecmd_input_t *tracecmd_alloc_fd( const char *file, int fd )
         logf( "%s: setjmp error code called for %s.\n", __func__, file );
 
         delete handle;
+        zfile_close( zfile );
         close( fd );
         return NULL;
     }
@@ -1374,9 +1505,9 @@ static tracecmd_input_t *tracecmd_alloc_fd( const char *file, int fd )
 
     handle->page_size = read4( handle );
 
-    handle->header_files_start = lseek64( handle->fd, 0, SEEK_CUR );
-    handle->total_file_size = lseek64( handle->fd, 0, SEEK_END );
-    handle->header_files_start = lseek64( handle->fd, handle->header_files_start, SEEK_SET );
+    handle->header_files_start = do_lseek( handle, 0, SEEK_CUR );
+    handle->total_file_size = do_lseek( handle, 0, SEEK_END );
+    handle->header_files_start = do_lseek( handle, handle->header_files_start, SEEK_SET );
 
     return handle;
 }
@@ -1395,6 +1526,7 @@ static tracecmd_input_t *tracecmd_alloc_fd( const char *file, int fd )
 static tracecmd_input_t *tracecmd_alloc( const char *file )
 {
     int fd;
+    trace_zfile_t *zfile;
 
     fd = TEMP_FAILURE_RETRY( open( file, O_RDONLY ) );
     if ( fd < 0 )
@@ -1403,7 +1535,14 @@ static tracecmd_input_t *tracecmd_alloc( const char *file )
         return NULL;
     }
 
-    return tracecmd_alloc_fd( file, fd );
+    /* xz and zstd files are read through zfile, transparently to the rest */
+    if ( zfile_open( fd, file, &zfile ) == ZFILE_Error )
+    {
+        close( fd );
+        return NULL;
+    }
+
+    return tracecmd_alloc_fd( file, fd, zfile );
 }
 
 /**
@@ -1435,16 +1574,24 @@ static void tracecmd_close( tracecmd_input_t *handle )
         free_next( handle, cpu );
         free_page( handle, cpu );
 
+        if ( handle->cpu_data )
+            free_record_list( &handle->cpu_data[ cpu ] );
+
         if ( handle->cpu_data && handle->cpu_data[ cpu ].kbuf )
         {
             kbuffer_free( handle->cpu_data[ cpu ].kbuf );
 
-            // if ( !list_empty( &handle->cpu_data[ cpu ].pages ) )
-            if ( !handle->cpu_data[ cpu ].pages.empty() )
+            if ( handle->cpu_data[ cpu ].page_count )
                 die( handle, "%s: pages still allocated on cpu %d\n", __func__, cpu );
         }
+
+#ifdef USE_MMAP
+        if ( handle->cpu_data && handle->cpu_data[ cpu ].map )
+            munmap( handle->cpu_data[ cpu ].map, handle->cpu_data[ cpu ].map_size );
+#endif
     }
 
+    zfile_close( handle->zfile );
     close( handle->fd );
 
     delete [] handle->cpu_data;
@@ -1455,8 +1602,9 @@ static void tracecmd_close( tracecmd_input_t *handle )
     }
     else
     {
-        /* Only main handle frees pevent */
+        /* Only main handle frees pevent and kallsyms */
         pevent_free( handle->pevent );
+        delete handle->kallsyms;
     }
 
     delete handle;
@@ -1488,13 +1636,15 @@ static tracecmd_input_t *tracecmd_buffer_instance_handle( tracecmd_input_t *hand
     handle->ref++;
 
     new_handle->fd = dup( handle->fd );
+    if ( handle->zfile )
+        new_handle->zfile = zfile_ref( handle->zfile );
 
     new_handle->flags |= TRACECMD_FL_BUFFER_INSTANCE;
 
     /* Save where we currently are */
-    offset = lseek64( handle->fd, 0, SEEK_CUR );
+    offset = do_lseek( handle, 0, SEEK_CUR );
 
-    ret = lseek64( handle->fd, buffer->offset, SEEK_SET );
+    ret = do_lseek( handle, buffer->offset, SEEK_SET );
     if ( ret < 0 )
     {
         die( handle, "%s: could not seek to buffer %s offset %lu.\n",
@@ -1503,7 +1653,7 @@ static tracecmd_input_t *tracecmd_buffer_instance_handle( tracecmd_input_t *hand
 
     read_cpu_data( new_handle );
 
-    ret = lseek64( handle->fd, offset, SEEK_SET );
+    ret = do_lseek( handle, offset, SEEK_SET );
     if ( ret < 0 )
         die( handle, "%s: could not seek to back to offset %ld\n", __func__, offset );
 
@@ -1531,130 +1681,368 @@ extern "C" void print_str_arg( struct trace_seq *s, void *data, int size,
               struct event_format *event, const char *format,
               int len_arg, struct print_arg *arg );
 
-static int trace_enum_events( EventCallback &cb, StrPool &strpool, const trace_info_t &trace_info,
-                             tracecmd_input_t *handle, pevent_record_t *record )
+// Same lookup as pevent_find_event_by_record(), minus the pevent->last_event
+//  cache which gets written on every call and isn't safe across threads.
+//  Returns the pevent->events index or -1.
+static int find_event_by_record( pevent_t *pevent, pevent_record_t *record )
 {
-    int ret = 0;
-    event_format_t *event;
-    pevent_t *pevent = handle->pevent;
-
-    event = pevent_find_event_by_record( pevent, record );
-    if ( event )
-    {
-        struct trace_seq seq;
-        trace_event_t trace_event;
-        struct format_field *format;
-        int pid = pevent_data_pid( pevent, record );
-        const char *comm = pevent_data_comm_from_pid( pevent, pid );
-        bool is_ftrace_function = !strcmp( "ftrace", event->system ) && !strcmp( "function", event->name );
-        bool is_printk_function = !strcmp( "ftrace", event->system ) && !strcmp( "print", event->name );
-
-        trace_seq_init( &seq );
-
-        memset( &trace_event, 0, sizeof( trace_event ) );
+    if ( record->size < 0 )
+        return -1;
 
-        trace_event.id = 0;
-        trace_event.pid = pid;
-        trace_event.cpu = record->cpu;
+    int id = pevent_data_type( pevent, record );
+    event_format_t **events_end = pevent->events + pevent->nr_events;
+    event_format_t **it = std::lower_bound( pevent->events, events_end, id,
+        []( const event_format_t *event, int val ) { return event->id < val; } );
 
-        trace_seq_printf( &seq, "%s-%u", comm, pid );
-        trace_event.comm = strpool.getstr( seq.buffer );
+    return ( ( it != events_end ) && ( ( *it )->id == id ) ) ? ( int )( it - pevent->events ) : -1;
+}
 
-        trace_event.ts = record->ts;
+// Classification flags init_new_event() and the graph key off of.
+static uint32_t get_event_name_flags( const char *system, const char *name )
+{
+    // fence_signaled was renamed to dma_fence_signaled post v4.9
+    if ( strstr( name, "fence_signaled" ) )
+        return TRACE_FLAG_FENCE_SIGNALED;
+    else if ( !strcmp( system, "ftrace-print" ) )
+        return TRACE_FLAG_FTRACE_PRINT;
+    else if ( !strcmp( name, "drm_vblank_event" ) )
+        return TRACE_FLAG_IS_VBLANK;
+    else if ( strstr( name, "amdgpu_cs_ioctl" ) )
+        return TRACE_FLAG_IS_SW_QUEUE;
+    else if ( strstr( name, "amdgpu_sched_run_job" ) )
+        return TRACE_FLAG_IS_HW_QUEUE;
+    else if ( !strcmp( name, "sched_switch" ) )
+        return TRACE_FLAG_SCHED_SWITCH;
 
-        trace_event.system = strpool.getstr( event->system );
-        trace_event.name = strpool.getstr( event->name );
+    return 0;
+}
 
-        trace_event.timeline = "";
-        trace_event.context = 0;
-        trace_event.seqno = 0;
-        trace_event.crtc = -1;
-        trace_event.user_comm = trace_event.comm;
-        trace_event.id_start = ( uint32_t )-1;
-        trace_event.graph_row_id = 0;
-        trace_event.duration = 0;
-        trace_event.is_filtered_out = false;
+static void init_format_table( format_table_t &table, pevent_t *pevent, StrPool &strpool )
+{
+    table.resize( pevent->nr_events );
 
-        // Get count of fields for this event.
-        int field_count = 0;
-        format = event->format.fields;
-        for ( ; format; format = format->next )
-            field_count++;
+    for ( int i = 0; i < pevent->nr_events; i++ )
+    {
+        event_format_t *event = pevent->events[ i ];
+        format_info_t &info = table[ i ];
+        bool is_ftrace = !strcmp( "ftrace", event->system );
 
-        // Reserve space in our fields array.
-        trace_event.fields.reserve( field_count );
+        info.is_ftrace_function = is_ftrace && !strcmp( "function", event->name );
+        info.is_printk_function = is_ftrace && !strcmp( "print", event->name );
 
-        format = event->format.common_fields;
-        for ( ; format; format = format->next )
+        for ( struct format_field *format = event->format.common_fields; format; format = format->next )
         {
             if ( !strcmp( format->name, "common_flags" ) )
             {
-                unsigned long long val = pevent_read_number( pevent,
-                        ( char * )record->data + format->offset, format->size );
-
-                // TRACE_FLAG_IRQS_OFF | TRACE_FLAG_HARDIRQ | TRACE_FLAG_SOFTIRQ
-                trace_event.flags = val;
+                info.common_flags = format;
                 break;
             }
         }
 
-        format = event->format.fields;
-        for ( ; format; format = format->next )
+        for ( struct format_field *format = event->format.fields; format; format = format->next )
         {
-            trace_seq_reset( &seq );
-            pevent_print_field( &seq, record->data, format );
-
             if ( !strcmp( format->name, "timeline" ) )
-            {
-                trace_event.timeline = strpool.getstr( seq.buffer );
-            }
+                info.timeline = format;
             else if ( !strcmp( format->name, "context" ) )
-            {
-                unsigned long long val = pevent_read_number( pevent,
-                        ( char * )record->data + format->offset, format->size );
-
-                trace_event.context = val;
-            }
+                info.context = format;
             else if ( !strcmp( format->name, "seqno" ) )
-            {
-                unsigned long long val = pevent_read_number( pevent,
-                        ( char * )record->data + format->offset, format->size );
-
-                trace_event.seqno = val;
-            }
+                info.seqno = format;
             else if ( !strcmp( format->name, "crtc" ) )
-            {
+                info.crtc = format;
+
+            if ( info.is_ftrace_function && !strcmp( format->name, "ip" ) )
+                info.ip = format;
+            else if ( info.is_ftrace_function && !strcmp( format->name, "parent_ip" ) )
+                info.parent_ip = format;
+            else if ( info.is_printk_function && !strcmp( format->name, "buf" ) )
+                info.buf = format;
+
+            info.keys.push_back( strpool.getstr( format->name ) );
+        }
+
+        // ftrace:print events with a buf field are renamed ftrace-print
+        info.system = strpool.getstr( info.buf ? "ftrace-print" : event->system );
+        info.name = strpool.getstr( event->name );
+        info.flags = get_event_name_flags( info.system, info.name );
+    }
+}
+
+// Decoded events with their fields and raw record payloads (if reading lazy
+//  fields) stored in event order.
+struct event_batch_t
+{
+    std::vector< trace_event_t > events;
+    std::vector< event_field_t > fields;
+    std::vector< event_raw_t > raws;
+    std::vector< char > rawdata;
+
+    void clear()
+    {
+        events.clear();
+        fields.clear();
+        raws.clear();
+        rawdata.clear();
+    }
+
+    // Point events at their fields and raws once the arrays are final.
+    void fixup()
+    {
+        event_field_t *field = fields.data();
+        const char *data = rawdata.data();
+
+        for ( size_t i = 0; i < events.size(); i++ )
+        {
+            trace_event_t &event = events[ i ];
+
+            event.fields = field;
+            field += event.numfields;
+
+            if ( !raws.empty() )
+            {
+                raws[ i ].data = data;
+                data += raws[ i ].size;
+
+                event.raw = &raws[ i ];
+            }
+        }
+    }
+};
+
+// Remove trailing whitespace and terminate.
+static void trim_seq( struct trace_seq *seq )
+{
+    while ( ( seq->len > 0 ) &&
+            isspace( seq->buffer[ seq->len - 1 ] ) )
+    {
+        seq->len--;
+    }
+
+    trace_seq_terminate( seq );
+}
+
+// Per thread scratch trace_seq so decoding and formatting don't allocate
+//  a new buffer for every event.
+static struct trace_seq *get_thread_seq()
+{
+    struct thread_seq_t
+    {
+        thread_seq_t() { trace_seq_init( &seq ); }
+        ~thread_seq_t() { trace_seq_destroy( &seq ); }
+
+        struct trace_seq seq;
+    };
+    static thread_local thread_seq_t t_seq;
+
+    trace_seq_reset( &t_seq.seq );
+    return &t_seq.seq;
+}
+
+// Per thread ip to strpool'd function name cache for ftrace:function events.
+//  Most of a function trace is the same few thousand ips over and over.
+typedef struct func_cache_entry
+{
+    uint32_t kallsyms_id = 0;
+    uint32_t flags = 0;                 // get_event_name_flags( "ftrace-function", name )
+    unsigned long long addr = 0;
+    const char *name = nullptr;         // strpool'd, NULL if addr didn't resolve
+} func_cache_entry_t;
+
+static const func_cache_entry_t *find_function( tracecmd_input_t *handle, StrPool &strpool, unsigned long long addr )
+{
+    static const uint32_t s_cache_size = 4096;
+    static thread_local func_cache_entry_t t_cache[ s_cache_size ];
+    const kallsyms_t *kallsyms = handle->kallsyms;
+
+    if ( !kallsyms )
+        return NULL;
+
+    uint32_t slot = ( uint32_t )( ( addr >> 4 ) ^ ( addr >> 16 ) ) & ( s_cache_size - 1 );
+    func_cache_entry_t &entry = t_cache[ slot ];
+
+    if ( ( entry.kallsyms_id != kallsyms->id ) || ( entry.addr != addr ) )
+    {
+        const char *func = kallsyms_find_function( kallsyms, addr );
+
+        entry.kallsyms_id = kallsyms->id;
+        entry.addr = addr;
+        entry.name = func ? strpool.getstr( func ) : NULL;
+        entry.flags = func ? get_event_name_flags( "ftrace-function", entry.name ) : 0;
+    }
+
+    return &entry;
+}
+
+// Trace file offset of record payload
+static uint64_t record_data_offset( tracecmd_input_t *handle, pevent_record_t *record )
+{
+    cpu_data_t *cpu_data = &handle->cpu_data[ record->cpu ];
+
+    if ( record->priv )
+    {
+        page_t *page = ( page_t * )record->priv;
+
+        return page->offset + ( ( char * )record->data - ( char * )page->map );
+    }
+
+    // Records without a page reference point into the mapped cpu region
+    return cpu_data->map_offset + ( ( char * )record->data - ( char * )cpu_data->map );
+}
+
+// Fill in trace_event from record. The event fields (and raw payload if lazy
+//  is set) are appended to batch and batch.fixup() sets the event pointers.
+static bool trace_read_event( trace_event_t &trace_event, event_batch_t &batch, bool lazy,
+                              StrPool &strpool, tracecmd_input_t *handle, pevent_record_t *record )
+{
+    PROF_SCOPE( PROF_RecordDecode );
+    pevent_t *pevent = handle->pevent;
+    int index = find_event_by_record( pevent, record );
+
+    if ( index >= 0 )
+    {
+        struct trace_seq &seq = *get_thread_seq();
+        struct format_field *format;
+        event_format_t *event = pevent->events[ index ];
+        const format_info_t &info = ( *handle->formats )[ index ];
+        int pid = pevent_data_pid( pevent, record );
+        const char *comm = pevent_data_comm_from_pid( pevent, pid );
+        bool is_ftrace_function = info.is_ftrace_function;
+        bool is_printk_function = info.is_printk_function;
+        uint32_t keyidx = 0;
+
+        memset( &trace_event, 0, sizeof( trace_event ) );
+
+        trace_event.id = 0;
+        trace_event.pid = pid;
+        trace_event.cpu = record->cpu;
+
+        trace_seq_printf( &seq, "%s-%u", comm, pid );
+        strpool.getstr( seq.buffer, ( size_t )-1, &trace_event.comm_id );
+
+        trace_event.ts = record->ts;
+
+        trace_event.system = info.system;
+        trace_event.name = info.name;
+
+        trace_event.timeline = "";
+        trace_event.context = 0;
+        trace_event.seqno = 0;
+        trace_event.crtc = -1;
+        trace_event.user_comm_id = trace_event.comm_id;
+        trace_event.id_start = ( uint32_t )-1;
+        trace_event.graph_row_id = 0;
+        trace_event.duration = 0;
+        trace_event.is_filtered_out = false;
+        trace_event.numfields = 0;
+        trace_event.fields = NULL;
+        trace_event.raw = NULL;
+
+        if ( lazy )
+        {
+            event_raw_t raw;
+
+            raw.format = event;
+            raw.strpool = &strpool;
+            raw.data = NULL;
+            raw.size = record->size;
+            raw.offset = record_data_offset( handle, record );
+            raw.pages = NULL;
+            batch.raws.push_back( raw );
+
+            batch.rawdata.insert( batch.rawdata.end(), ( char * )record->data,
+                                  ( char * )record->data + record->size );
+
+            // ftrace function and print fields get special formatting below,
+            //  so do those events up front.
+            lazy = !is_ftrace_function && !is_printk_function;
+        }
+
+        if ( info.common_flags )
+        {
+            format = info.common_flags;
+
+            unsigned long long val = pevent_read_number( pevent,
+                    ( char * )record->data + format->offset, format->size );
+
+            // TRACE_FLAG_IRQS_OFF | TRACE_FLAG_HARDIRQ | TRACE_FLAG_SOFTIRQ
+            trace_event.flags = val;
+        }
+        trace_event.flags |= info.flags;
+
+        format = event->format.fields;
+        for ( ; format; format = format->next )
+        {
+            bool is_timeline = ( format == info.timeline );
+            event_field_t field;
+
+            field.key = info.keys[ keyidx++ ];
+            field.value.store( NULL, std::memory_order_relaxed );
+
+            if ( format == info.context )
+            {
+                unsigned long long val = pevent_read_number( pevent,
+                        ( char * )record->data + format->offset, format->size );
+
+                trace_event.context = val;
+            }
+            else if ( format == info.seqno )
+            {
+                unsigned long long val = pevent_read_number( pevent,
+                        ( char * )record->data + format->offset, format->size );
+
+                trace_event.seqno = val;
+            }
+            else if ( format == info.crtc )
+            {
                 unsigned long long val = pevent_read_number( pevent,
                         ( char * )record->data + format->offset, format->size );
 
                 trace_event.crtc = val;
             }
 
+            // Lazy fields are formatted in trace_event_t::get_field_value().
+            if ( lazy && !is_timeline )
+            {
+                batch.fields.push_back( field );
+                trace_event.numfields++;
+                continue;
+            }
+
+            trace_seq_reset( &seq );
+            pevent_print_field( &seq, record->data, format );
+
+            if ( is_timeline )
+            {
+                trace_event.timeline = strpool.getstr( seq.buffer );
+            }
+
             if ( is_ftrace_function )
             {
-                bool is_ip = !strcmp( format->name, "ip" );
+                bool is_ip = ( format == info.ip );
 
-                if ( is_ip || !strcmp( format->name, "parent_ip" ) )
+                if ( is_ip || ( format == info.parent_ip ) )
                 {
                     unsigned long long val = pevent_read_number( pevent,
                         ( char * )record->data + format->offset, format->size );
-                    const char *func = pevent_find_function( pevent, val );
+                    const func_cache_entry_t *func = find_function( handle, strpool, val );
 
-                    if ( func )
+                    if ( func && func->name )
                     {
-                        trace_seq_printf( &seq, " (%s)", func );
+                        trace_seq_printf( &seq, " (%s)", func->name );
 
                         if ( is_ip )
                         {
                             // If this is a ftrace:function event, set the name
                             //  to be the function name we just found.
                             trace_event.system = "ftrace-function";
-                            trace_event.name = strpool.getstr( func );
+                            trace_event.name = func->name;
+
+                            trace_event.flags &= ~info.flags;
+                            trace_event.flags |= func->flags;
                         }
                     }
                 }
             }
-            else if ( is_printk_function && !strcmp( format->name, "buf" ) )
+            else if ( format == info.buf )
             {
                 struct print_arg *args = event->print_fmt.args;
 
@@ -1670,8 +2058,6 @@ static int trace_enum_events( EventCallback &cb, StrPool &strpool, const trace_i
                 // pretty_print prints IP and print string (buf).
                 //   pretty_print( &seq, record->data, record->size, event );
 
-                trace_event.system = "ftrace-print";
-
                 // Convert all LFs to spaces.
                 for ( unsigned int i = 0; i < seq.len; i++ )
                 {
@@ -1680,139 +2066,1251 @@ static int trace_enum_events( EventCallback &cb, StrPool &strpool, const trace_i
                 }
             }
 
-            // Trim trailing whitespace
-            while ( ( seq.len > 0 ) &&
-                    isspace( seq.buffer[ seq.len - 1 ] ) )
-            {
-                seq.len--;
-            }
+            trim_seq( &seq );
 
-            trace_seq_terminate( &seq );
+            field.value.store( strpool.getstr( seq.buffer ), std::memory_order_relaxed );
+            batch.fields.push_back( field );
+            trace_event.numfields++;
+        }
 
-            event_field_t field;
-            field.key = strpool.getstr( format->name );
-            field.value = strpool.getstr( seq.buffer );
-            trace_event.fields.push_back( field );
+        return true;
+    }
+
+    return false;
+}
+
+static int trace_enum_events( EventCallback &cb, StrPool &strpool, const trace_info_t &trace_info,
+                              event_batch_t &batch, bool lazy, tracecmd_input_t *handle, pevent_record_t *record )
+{
+    trace_event_t trace_event;
+
+    batch.clear();
+    if ( trace_read_event( trace_event, batch, lazy, strpool, handle, record ) )
+    {
+        batch.events.push_back( trace_event );
+        batch.fixup();
+
+        return cb( trace_info, batch.events[ 0 ] );
+    }
+
+    return 0;
+}
+
+const char *trace_event_t::get_field_value( uint32_t index ) const
+{
+    // Several threads may race to format the same field. They intern the same
+    //  string so whichever store lands is fine.
+    std::atomic< const char * > &value = fields[ index ].value;
+    const char *str = value.load( raw ? std::memory_order_acquire : std::memory_order_relaxed );
+
+    if ( !str )
+    {
+        PROF_SCOPE( PROF_FieldFormat );
+
+        struct trace_seq *seq = get_thread_seq();
+        static thread_local std::vector< char > t_payload;
+        struct format_field *format = raw->format->format.fields;
+        const char *data = raw->data;
+
+        for ( uint32_t i = 0; i < index; i++ )
+            format = format->next;
+
+        if ( !data )
+        {
+            if ( !raw->pages || !raw->pages->read_payload( raw, t_payload ) )
+                return "";
+            data = t_payload.data();
         }
 
-        ret = cb( trace_info, trace_event );
+        pevent_print_field( seq, ( void * )data, format );
+        trim_seq( seq );
 
-        trace_seq_destroy( &seq );
+        str = raw->strpool->getstr( seq->buffer );
+        value.store( str, std::memory_order_release );
     }
 
-    return ret;
+    return str;
 }
 
-static pevent_record_t *get_next_record( file_info_t *file_info )
+/*
+ * TraceRawEvents
+ */
+
+// LRU cache of trace file blocks for paged payloads
+struct raw_page_cache_t
+{
+    static const size_t s_block_size = 64 * 1024;
+
+    struct block_t
+    {
+        uint64_t key;
+        std::vector< char > data;
+    };
+
+    std::mutex mutex;
+    size_t bytes_max = 0;
+    size_t bytes = 0;
+
+    // Most recently used blocks first
+    std::list< block_t > lru;
+    std::unordered_map< uint64_t, std::list< block_t >::iterator > blocks;
+
+    // File descriptors of TraceRawEvents::m_files, opened on first use
+    std::vector< int > fds;
+    // Readers of the ones that are compressed
+    std::vector< trace_zfile_t * > zfiles;
+
+    ~raw_page_cache_t()
+    {
+        for ( trace_zfile_t *zfile : zfiles )
+            zfile_close( zfile );
+
+        for ( int fd : fds )
+        {
+            if ( fd >= 0 )
+                close( fd );
+        }
+    }
+
+    const block_t *get_block( const std::string &filename, size_t file, uint64_t block );
+};
+
+const raw_page_cache_t::block_t *raw_page_cache_t::get_block( const std::string &filename, size_t file, uint64_t block )
 {
-    if ( file_info->record )
-        return file_info->record;
+    uint64_t key = ( ( uint64_t )file << 48 ) | block;
+    auto it = blocks.find( key );
+
+    if ( it != blocks.end() )
+    {
+        lru.splice( lru.begin(), lru, it->second );
+        return &lru.front();
+    }
+
+    if ( file >= fds.size() )
+    {
+        fds.resize( file + 1, -1 );
+        zfiles.resize( file + 1, NULL );
+    }
+    if ( fds[ file ] < 0 )
+    {
+        int fd = TEMP_FAILURE_RETRY( open( filename.c_str(), O_RDONLY ) );
+
+        if ( fd < 0 )
+            return NULL;
+        if ( zfile_open( fd, filename.c_str(), &zfiles[ file ] ) == ZFILE_Error )
+        {
+            close( fd );
+            return NULL;
+        }
+        fds[ file ] = fd;
+    }
+
+    block_t new_block;
+    off64_t offset = ( off64_t )( block * s_block_size );
+    ssize_t ret;
+
+    new_block.key = key;
+    new_block.data.resize( s_block_size );
+
+    if ( zfiles[ file ] )
+    {
+        ret = zfile_pread( zfiles[ file ], &new_block.data[ 0 ], s_block_size, offset );
+    }
+    else
+    {
+        // We hold the mutex, so nobody else is using the file pointer
+        if ( lseek64( fds[ file ], offset, SEEK_SET ) < 0 )
+            return NULL;
 
-    if ( file_info->done )
+        ret = TEMP_FAILURE_RETRY( read( fds[ file ], &new_block.data[ 0 ], s_block_size ) );
+    }
+    if ( ret <= 0 )
         return NULL;
+    new_block.data.resize( ret );
 
-    file_info->record = tracecmd_read_next_data( file_info->handle, NULL );
-    if ( !file_info->record )
-        file_info->done = 1;
+    // Drop least recently used blocks to stay under the ceiling
+    while ( !lru.empty() && ( bytes + ret > bytes_max ) )
+    {
+        bytes -= lru.back().data.size();
+        blocks.erase( lru.back().key );
+        lru.pop_back();
+    }
 
-    return file_info->record;
+    bytes += ret;
+    lru.push_front( std::move( new_block ) );
+    blocks[ key ] = lru.begin();
+    return &lru.front();
 }
 
-static void add_file( std::vector< file_info_t * > &file_list, tracecmd_input_t *handle, const char *file )
+TraceRawEvents::~TraceRawEvents()
 {
-    file_info_t *item = ( file_info_t * )trace_malloc( handle, sizeof( *item ) );
+    for ( struct pevent *pevent : m_pevents )
+        pevent_unref( pevent );
 
-    memset( item, 0, sizeof( *item ) );
+    delete m_page_cache;
+}
 
-    item->handle = handle;
-    handle->file = file;
+void TraceRawEvents::set_paged( size_t cache_bytes )
+{
+    if ( !m_page_cache )
+        m_page_cache = new raw_page_cache_t;
 
-    file_list.push_back( item );
+    m_page_cache->bytes_max = cache_bytes;
 }
 
-int read_trace_file( const char *file, StrPool &strpool, EventCallback &cb )
+const event_raw_t *TraceRawEvents::store( const event_raw_t *raw )
 {
-    trace_info_t trace_info;
-    tracecmd_input_t *handle;
-    std::vector< file_info_t * > file_list;
+    if ( !raw )
+        return NULL;
 
-    handle = tracecmd_alloc( file );
-    if ( !handle )
+    event_raw_t *new_raw = m_raws.alloc( 1 );
+
+    *new_raw = *raw;
+
+    if ( m_page_cache )
     {
-        logf( "%s: Open trace file \"%s\" failed.\n", __func__, file );
-        return -1;
+        new_raw->data = NULL;
+        new_raw->pages = this;
     }
+    else
+    {
+        char *data = m_data.alloc( raw->size );
 
-    add_file( file_list, handle, file );
+        memcpy( data, raw->data, raw->size );
+        new_raw->data = data;
+    }
+    return new_raw;
+}
 
-    // Read header information from trace.dat file.
-    tracecmd_read_headers( handle );
+bool TraceRawEvents::read_payload( const event_raw_t *raw, std::vector< char > &buf )
+{
+    static const size_t s_block_size = raw_page_cache_t::s_block_size;
+    auto it = std::find( m_pevents.begin(), m_pevents.end(), raw->format->pevent );
 
-    // Prepare reading the data from trace.dat.
-    tracecmd_init_data( handle );
+    if ( !m_page_cache || ( it == m_pevents.end() ) )
+        return false;
 
-    // We don't support reading latency trace files.
-    if ( handle->flags & TRACECMD_FL_LATENCY )
-        die( handle, "%s: Latency traces not supported.\n", __func__ );
+    size_t file = it - m_pevents.begin();
+    uint64_t offset = raw->offset;
+    size_t done = 0;
 
-    /* Find the kernel_stacktrace if available */
-    // pevent = handle->pevent;
-    // event = pevent_find_event_by_name(pevent, "ftrace", "kernel_stack");
+    std::lock_guard< std::mutex > lock( m_page_cache->mutex );
 
-    /* If this file has buffer instances, get the file_info for them */
-    for ( int i = 0; i < handle->nr_buffers; i++ )
+    buf.resize( raw->size );
+    while ( done < raw->size )
     {
-        tracecmd_input_t *new_handle;
-        const char *name = handle->buffers[ i ].name;
+        uint64_t block = offset / s_block_size;
+        size_t start = offset - block * s_block_size;
+        const raw_page_cache_t::block_t *pblock = m_page_cache->get_block( m_files[ file ], file, block );
 
-        new_handle = tracecmd_buffer_instance_handle( handle, i );
-        if ( !new_handle )
-            die( handle, "%s: could not retrieve handle %s.\n", __func__, name );
+        if ( !pblock || ( start >= pblock->data.size() ) )
+            return false;
 
-        add_file( file_list, new_handle, name );
+        // Payloads don't cross trace pages, but may cross our blocks
+        size_t len = std::min< size_t >( raw->size - done, pblock->data.size() - start );
+
+        memcpy( &buf[ done ], &pblock->data[ start ], len );
+        done += len;
+        offset += len;
     }
 
-    trace_info.cpus = handle->cpus;
-    trace_info.cpustats = handle->cpustats;
-    trace_info.file = handle->file;
-    trace_info.uname = handle->uname;
-    trace_info.timestamp_in_us = is_timestamp_in_us( handle->pevent->trace_clock, handle->use_trace_clock );
+    return true;
+}
 
-    for ( ;; )
-    {
-        file_info_t *last_file_info = NULL;
-        pevent_record_t *last_record = NULL;
+size_t TraceRawEvents::bytes_allocated() const
+{
+    size_t bytes = m_raws.bytes_allocated() + m_data.bytes_allocated();
 
-        for ( file_info_t *file_info : file_list )
-        {
-            pevent_record_t *record = get_next_record( file_info );
+    if ( m_page_cache )
+        bytes += m_page_cache->bytes;
+    return bytes;
+}
 
-            if ( !last_record ||
-                 ( record && record->ts < last_record->ts ) )
-            {
-                last_record = record;
-                last_file_info = file_info;
-            }
-        }
+/*
+ * Loser tree merge
+ *
+ * Merges sorted sources (cpu buffers of every file and buffer instance)
+ * by timestamp. Internal nodes keep the loser of the match played there
+ * and node 0 the overall winner, so after the winner's source advances
+ * only its leaf to root path is replayed: O(log n) compares per event
+ * instead of scanning every source. Ties go to the lower source index.
+ */
+class loser_tree_t
+{
+public:
+    static const uint64_t s_done = ( uint64_t )-1;
 
-        if ( !last_record )
-            break;
+    // Set up count sources with their first keys (s_done if empty).
+    void init( const std::vector< uint64_t > &keys )
+    {
+        m_keys = keys;
+        m_nodes.assign( std::max< size_t >( keys.size(), 1 ), ( size_t )s_empty );
 
-        int ret = trace_enum_events( cb, strpool, trace_info, last_file_info->handle, last_record );
+        for ( size_t i = 0; i < keys.size(); i++ )
+            replay( i, true );
+    }
 
-        free_record( last_file_info->handle, last_file_info->record );
-        last_file_info->record = NULL;
+    // Source with the smallest key, and that key (s_done when all are done).
+    size_t winner() const { return m_nodes[ 0 ]; }
+    uint64_t winner_key() const { return m_keys.empty() ? s_done : m_keys[ m_nodes[ 0 ] ]; }
 
-        if ( ret )
-            break;
+    // Winner's source moved on to key.
+    void update_winner( uint64_t key )
+    {
+        size_t index = m_nodes[ 0 ];
+
+        m_keys[ index ] = key;
+        replay( index, false );
     }
 
-    for ( file_info_t *file_info : file_list )
+protected:
+    bool less( size_t a, size_t b ) const
     {
-        tracecmd_close( file_info->handle );
-        free( file_info );
+        return ( m_keys[ a ] < m_keys[ b ] ) || ( ( m_keys[ a ] == m_keys[ b ] ) && ( a < b ) );
     }
-    file_list.clear();
 
-    return 0;
+    void replay( size_t index, bool building )
+    {
+        size_t winner = index;
+
+        // Leaves sit at m_keys.size() + index, so their parents are internal nodes
+        for ( size_t node = ( m_keys.size() + index ) / 2; node > 0; node /= 2 )
+        {
+            // While building, the first source to reach a node waits there
+            if ( building && ( m_nodes[ node ] == s_empty ) )
+            {
+                m_nodes[ node ] = winner;
+                return;
+            }
+
+            if ( less( m_nodes[ node ], winner ) )
+                std::swap( m_nodes[ node ], winner );
+        }
+
+        m_nodes[ 0 ] = winner;
+    }
+
+protected:
+    static const size_t s_empty = ( size_t )-1;
+
+    std::vector< uint64_t > m_keys;
+    std::vector< size_t > m_nodes;
+};
+
+/*
+ * Parallel cpu stream reader
+ */
+struct cpu_stream_t
+{
+    tracecmd_input_t *handle = nullptr;
+    int cpu = 0;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    // Decoded event batches waiting to be merged. Protected by mutex.
+    std::deque< event_batch_t > batches;
+    // Merged batches handed back so the worker can reuse their arrays.
+    std::vector< event_batch_t > free_batches;
+    bool done = false;
+    bool error = false;
+
+    // Record the worker is decoding, released if die() unwinds it.
+    pevent_record_t *record = nullptr;
+
+    // Batch being merged on the reader thread.
+    event_batch_t merge_batch;
+    size_t merge_index = 0;
+};
+
+struct cpu_stream_reader_t
+{
+    cpu_stream_reader_t( StrPool &strpool_in, bool lazy_in ) :
+        strpool( strpool_in ), lazy( lazy_in ) {}
+
+    StrPool &strpool;
+    bool lazy;
+    std::atomic< bool > stop{ false };
+    std::vector< cpu_stream_t * > streams;
+};
+
+// Events per batch handed from a worker to the merge, and how many batches
+//  a worker can get ahead of the merge before it waits.
+static const size_t s_stream_batch_size = 4096;
+static const size_t s_stream_batch_max = 64;
+
+static void cpu_stream_push_batch( cpu_stream_reader_t *reader, cpu_stream_t *stream,
+                                   event_batch_t &batch, bool done )
+{
+    // Fields were appended in event order and the arrays are final now.
+    batch.fixup();
+
+    std::unique_lock< std::mutex > lock( stream->mutex );
+
+    stream->cv.wait( lock, [reader, stream]
+        { return reader->stop || ( stream->batches.size() < s_stream_batch_max ); } );
+
+    if ( !batch.events.empty() )
+    {
+        stream->batches.push_back( std::move( batch ) );
+        batch.clear();
+
+        if ( !stream->free_batches.empty() )
+        {
+            batch = std::move( stream->free_batches.back() );
+            stream->free_batches.pop_back();
+        }
+    }
+    stream->done = done;
+
+    stream->cv.notify_all();
+}
+
+static void cpu_stream_thread( cpu_stream_reader_t *reader, cpu_stream_t *stream )
+{
+    std::jmp_buf jump_buffer;
+    event_batch_t batch;
+
+    t_jump_buffer = &jump_buffer;
+    if ( setjmp( jump_buffer ) )
+    {
+        // Drop the ref on its page so the handle can still be closed. Cleared
+        //  first in case freeing it dies as well.
+        pevent_record_t *record = stream->record;
+
+        stream->record = nullptr;
+        if ( record )
+            free_record( stream->handle, record );
+
+        std::lock_guard< std::mutex > lock( stream->mutex );
+
+        stream->error = true;
+        stream->done = true;
+        stream->cv.notify_all();
+        return;
+    }
+
+    batch.events.reserve( s_stream_batch_size );
+
+    while ( !reader->stop )
+    {
+        pevent_record_t *record = tracecmd_read_data( stream->handle, stream->cpu );
+
+        if ( !record )
+            break;
+
+        stream->record = record;
+
+        trace_event_t trace_event;
+        if ( trace_read_event( trace_event, batch, reader->lazy, reader->strpool, stream->handle, record ) )
+            batch.events.push_back( trace_event );
+
+        stream->record = nullptr;
+        free_record( stream->handle, record );
+
+        if ( batch.events.size() >= s_stream_batch_size )
+        {
+            cpu_stream_push_batch( reader, stream, batch, false );
+            batch.events.reserve( s_stream_batch_size );
+        }
+    }
+
+    cpu_stream_push_batch( reader, stream, batch, true );
+    t_jump_buffer = nullptr;
+}
+
+// Return the next decoded event for this stream, waiting on its worker if
+//  nothing is queued yet. NULL when the stream is exhausted.
+static trace_event_t *cpu_stream_peek( cpu_stream_t *stream )
+{
+    if ( stream->merge_index < stream->merge_batch.events.size() )
+        return &stream->merge_batch.events[ stream->merge_index ];
+
+    std::unique_lock< std::mutex > lock( stream->mutex );
+
+    // Callbacks are done with the events of the old batch
+    if ( stream->merge_batch.events.capacity() )
+    {
+        stream->merge_batch.clear();
+        stream->free_batches.push_back( std::move( stream->merge_batch ) );
+    }
+
+    stream->cv.wait( lock, [stream] { return stream->done || !stream->batches.empty(); } );
+
+    if ( stream->batches.empty() )
+    {
+        stream->merge_batch = event_batch_t();
+        return NULL;
+    }
+
+    stream->merge_batch = std::move( stream->batches.front() );
+    stream->batches.pop_front();
+    stream->merge_index = 0;
+
+    // Wake the worker if it was waiting on a full queue.
+    stream->cv.notify_all();
+
+    return &stream->merge_batch.events[ 0 ];
+}
+
+// Build the pevent tables which are lazily initialized on first use
+//  (common field offsets, cmdlines, print arg fields) so
+//  the workers only read them.
+static void pevent_prime_lookups( pevent_t *pevent, const std::vector< file_info_t * > &file_list )
+{
+    for ( int i = 0; i < pevent->nr_events; i++ )
+    {
+        event_format_t *event = pevent->events[ i ];
+
+        for ( struct print_arg *arg = event->print_fmt.args; arg; arg = arg->next )
+        {
+            if ( ( arg->type == PRINT_FIELD ) && !arg->field.field )
+                arg->field.field = pevent_find_any_field( event, arg->field.name );
+        }
+    }
+
+    for ( file_info_t *file_info : file_list )
+    {
+        tracecmd_input_t *handle = file_info->handle;
+
+        if ( handle->pevent != pevent )
+            continue;
+
+        for ( int cpu = 0; cpu < handle->cpus; cpu++ )
+        {
+            // The peeked record stays cached in cpu_data[ cpu ].next_record
+            //  and is handed back by the worker's first tracecmd_read_data().
+            pevent_record_t *record = tracecmd_peek_data( handle, cpu );
+
+            if ( record )
+            {
+                pevent_data_type( handle->pevent, record );
+                pevent_data_pid( handle->pevent, record );
+
+                pevent_data_comm_from_pid( handle->pevent, -1 );
+                return;
+            }
+        }
+    }
+}
+
+// Decode each cpu stream of each buffer instance on its own thread, then merge
+//  the streams by timestamp on this thread. Ties go to the lower file_list index
+//  and then the lower cpu which is the same order the serial reader produces.
+static int read_trace_file_parallel( std::vector< file_info_t * > &file_list, StrPool &strpool,
+                                     const trace_info_t &trace_info, EventCallback &cb, bool lazy )
+{
+    int ret = 0;
+    cpu_stream_reader_t reader( strpool, lazy );
+
+    // Each trace file has its own pevent. Buffer instances share their file's.
+    for ( size_t i = 0; i < file_list.size(); i++ )
+    {
+        pevent_t *pevent = file_list[ i ]->handle->pevent;
+        auto lambda_pevent_cmp = [ pevent ]( const file_info_t *file_info )
+                                    { return file_info->handle->pevent == pevent; };
+
+        if ( std::find_if( file_list.begin(), file_list.begin() + i, lambda_pevent_cmp ) == file_list.begin() + i )
+            pevent_prime_lookups( pevent, file_list );
+    }
+
+    for ( file_info_t *file_info : file_list )
+    {
+        for ( int cpu = 0; cpu < file_info->handle->cpus; cpu++ )
+        {
+            cpu_stream_t *stream = new cpu_stream_t;
+
+            stream->handle = file_info->handle;
+            stream->cpu = cpu;
+            reader.streams.push_back( stream );
+        }
+    }
+
+    for ( cpu_stream_t *stream : reader.streams )
+        stream->thread = std::thread( cpu_stream_thread, &reader, stream );
+
+    auto lambda_stream_key = []( cpu_stream_t *stream )
+    {
+        trace_event_t *event = cpu_stream_peek( stream );
+
+        return event ? ( uint64_t )event->ts : loser_tree_t::s_done;
+    };
+
+    loser_tree_t tree;
+    std::vector< uint64_t > keys;
+
+    for ( cpu_stream_t *stream : reader.streams )
+        keys.push_back( lambda_stream_key( stream ) );
+    tree.init( keys );
+
+    while ( tree.winner_key() != loser_tree_t::s_done )
+    {
+        cpu_stream_t *next_stream = reader.streams[ tree.winner() ];
+        int cbret = cb( trace_info, *cpu_stream_peek( next_stream ) );
+
+        next_stream->merge_index++;
+
+        if ( cbret )
+            break;
+
+        tree.update_winner( lambda_stream_key( next_stream ) );
+    }
+
+    reader.stop = true;
+
+    for ( cpu_stream_t *stream : reader.streams )
+    {
+        {
+            std::lock_guard< std::mutex > lock( stream->mutex );
+            stream->cv.notify_all();
+        }
+
+        stream->thread.join();
+
+        if ( stream->error )
+        {
+            logf( "%s: Failed reading %s cpu %d.\n", __func__,
+                  stream->handle->file.c_str(), stream->cpu );
+            ret = -1;
+        }
+
+        delete stream;
+    }
+    reader.streams.clear();
+
+    return ret;
+}
+
+static void add_file( std::vector< file_info_t * > &file_list, tracecmd_input_t *handle, const char *file )
+{
+    file_info_t *item = ( file_info_t * )trace_malloc( handle, sizeof( *item ) );
+
+    memset( item, 0, sizeof( *item ) );
+
+    item->handle = handle;
+    handle->file = file;
+
+    file_list.push_back( item );
+}
+
+static void close_file_list( std::vector< file_info_t * > &file_list )
+{
+    for ( file_info_t *file_info : file_list )
+    {
+        tracecmd_close( file_info->handle );
+        free( file_info );
+    }
+    file_list.clear();
+}
+
+// Close the files of a failed load. A handle left half read can trip die() in
+//  tracecmd_close, so unwind here and leak the rest instead of jumping to a
+//  stale jump_buffer.
+static void close_failed_file_list( std::vector< file_info_t * > &file_list )
+{
+    std::jmp_buf jump_buffer;
+
+    t_jump_buffer = &jump_buffer;
+    if ( !setjmp( jump_buffer ) )
+        close_file_list( file_list );
+    t_jump_buffer = nullptr;
+}
+
+int read_trace_file( const std::vector< std::string > &files, StrPool &strpool, EventCallback &cb,
+                     bool parallel, TraceRawEvents *raw_events )
+{
+    trace_info_t trace_info;
+    std::vector< tracecmd_input_t * > handles;
+    std::vector< file_info_t * > file_list;
+    std::jmp_buf jump_buffer;
+
+    // die() unwinds to here while we read the headers (a truncated file, say)
+    //  and while the serial reader reads events. The handle's own jump_buffer
+    //  is only good during tracecmd_alloc().
+    if ( setjmp( jump_buffer ) )
+    {
+        t_jump_buffer = nullptr;
+        close_failed_file_list( file_list );
+        return -1;
+    }
+
+    for ( const std::string &file : files )
+    {
+        // tracecmd_alloc() catches its own errors
+        t_jump_buffer = nullptr;
+
+        tracecmd_input_t *handle = tracecmd_alloc( file.c_str() );
+        if ( !handle )
+        {
+            logf( "%s: Open trace file \"%s\" failed.\n", __func__, file.c_str() );
+
+            close_file_list( file_list );
+            return -1;
+        }
+
+        t_jump_buffer = &jump_buffer;
+
+        handles.push_back( handle );
+        add_file( file_list, handle, file.c_str() );
+
+        // Read header information from trace.dat file.
+        {
+            PROF_SCOPE( PROF_HeaderParse );
+
+            tracecmd_read_headers( handle );
+        }
+
+        // Prepare reading the data from trace.dat.
+        tracecmd_init_data( handle );
+
+        // We don't support reading latency trace files.
+        if ( handle->flags & TRACECMD_FL_LATENCY )
+            die( handle, "%s: Latency traces not supported.\n", __func__ );
+
+        /* Find the kernel_stacktrace if available */
+        // pevent = handle->pevent;
+        // event = pevent_find_event_by_name(pevent, "ftrace", "kernel_stack");
+
+        /* If this file has buffer instances, get the file_info for them */
+        for ( int i = 0; i < handle->nr_buffers; i++ )
+        {
+            tracecmd_input_t *new_handle;
+            const char *name = handle->buffers[ i ].name;
+
+            new_handle = tracecmd_buffer_instance_handle( handle, i );
+            if ( !new_handle )
+                die( handle, "%s: could not retrieve handle %s.\n", __func__, name );
+
+            add_file( file_list, new_handle, name );
+        }
+    }
+
+    if ( handles.empty() )
+        return -1;
+
+    // Lazy fields still need the event formats after the handles are closed.
+    //  Set these up before reading so fields can be formatted while loading.
+    if ( raw_events )
+    {
+        for ( tracecmd_input_t *input : handles )
+        {
+            pevent_ref( input->pevent );
+            raw_events->m_pevents.push_back( input->pevent );
+            raw_events->m_files.push_back( input->file );
+        }
+    }
+
+    // Each trace file has its own pevent and event formats. Buffer
+    //  instances share their file's.
+    std::unordered_map< pevent_t *, format_table_t > format_tables;
+
+    for ( file_info_t *file_info : file_list )
+    {
+        tracecmd_input_t *input = file_info->handle;
+        format_table_t &table = format_tables[ input->pevent ];
+
+        if ( table.empty() )
+            init_format_table( table, input->pevent, strpool );
+
+        input->formats = &table;
+    }
+
+    // Trace info comes from the first file. Split files are from the same
+    //  machine, but take the largest cpu count in case one was cut short.
+    tracecmd_input_t *handle = handles[ 0 ];
+
+    trace_info.file = handle->file;
+    trace_info.uname = handle->uname;
+    trace_info.timestamp_in_us = is_timestamp_in_us( handle->pevent->trace_clock, handle->use_trace_clock );
+
+    for ( tracecmd_input_t *input : handles )
+    {
+        trace_info.cpus = std::max< uint32_t >( trace_info.cpus, input->cpus );
+        trace_info.cpustats.insert( trace_info.cpustats.end(), input->cpustats.begin(), input->cpustats.end() );
+    }
+
+    // Not worth the threads with a single stream or a single core.
+    if ( parallel && ( std::thread::hardware_concurrency() > 1 ) &&
+         ( file_list.size() * handle->cpus > 1 ) )
+    {
+        // The workers set their own jump buffers
+        t_jump_buffer = nullptr;
+
+        // The workers have all joined when this returns
+        if ( read_trace_file_parallel( file_list, strpool, trace_info, cb, !!raw_events ) < 0 )
+        {
+            close_failed_file_list( file_list );
+            return -1;
+        }
+    }
+    else
+    {
+        struct cursor_t
+        {
+            tracecmd_input_t *handle;
+            int cpu;
+        };
+        event_batch_t batch;
+        loser_tree_t tree;
+        std::vector< cursor_t > cursors;
+        std::vector< uint64_t > keys;
+
+        auto lambda_cursor_key = []( const cursor_t &cursor )
+        {
+            pevent_record_t *record = tracecmd_peek_data( cursor.handle, cursor.cpu );
+
+            return record ? ( uint64_t )record->ts : loser_tree_t::s_done;
+        };
+
+        // Merge every cpu of every file and buffer instance in one tree
+        for ( file_info_t *file_info : file_list )
+        {
+            for ( int cpu = 0; cpu < file_info->handle->cpus; cpu++ )
+            {
+                cursors.push_back( { file_info->handle, cpu } );
+                keys.push_back( lambda_cursor_key( cursors.back() ) );
+            }
+        }
+        tree.init( keys );
+
+        while ( tree.winner_key() != loser_tree_t::s_done )
+        {
+            const cursor_t &cursor = cursors[ tree.winner() ];
+            pevent_record_t *record = tracecmd_read_data( cursor.handle, cursor.cpu );
+
+            int ret = trace_enum_events( cb, strpool, trace_info, batch, !!raw_events,
+                                         cursor.handle, record );
+
+            free_record( cursor.handle, record );
+
+            if ( ret )
+                break;
+
+            tree.update_winner( lambda_cursor_key( cursor ) );
+        }
+    }
+
+    t_jump_buffer = nullptr;
+
+    close_file_list( file_list );
+    return 0;
+}
+
+/*
+ * write_trace_slice
+ */
+
+// Rewritten pages of one cpu when write_trace_slice() has a filter
+typedef struct slice_page
+{
+    std::vector< char > data;
+    size_t used = 0;                    // record bytes after the page header
+    unsigned long long ts = 0;          // raw timestamp of the last record
+} slice_page_t;
+
+static void slice_put4( char *ptr, uint32_t val )
+{
+    memcpy( ptr, &val, 4 );
+}
+
+// Output file of write_trace_slice(). Pages are written as they're built and
+//  the flyrecord offsets patched in afterwards, so the slice never has to
+//  fit in memory.
+struct slice_out_t
+{
+    int fd = -1;
+    uint64_t pos = 0;
+};
+
+static void slice_write( tracecmd_input_t *handle, slice_out_t &out, const void *data, size_t size )
+{
+    const char *ptr = ( const char * )data;
+
+    while ( size )
+    {
+        ssize_t ret = TEMP_FAILURE_RETRY( write( out.fd, ptr, size ) );
+
+        if ( ret <= 0 )
+            die( handle, "%s: write failed: %s\n", __func__, strerror( errno ) );
+
+        ptr += ret;
+        size -= ret;
+        out.pos += ret;
+    }
+}
+
+// Overwrite already written bytes at offset, leaving the file pointer at the end
+static void slice_write_at( tracecmd_input_t *handle, slice_out_t &out, uint64_t offset,
+                            const void *data, size_t size )
+{
+    uint64_t pos = out.pos;
+
+    if ( lseek64( out.fd, offset, SEEK_SET ) < 0 )
+        die( handle, "%s: seek failed: %s\n", __func__, strerror( errno ) );
+
+    out.pos = offset;
+    slice_write( handle, out, data, size );
+
+    if ( lseek64( out.fd, pos, SEEK_SET ) < 0 )
+        die( handle, "%s: seek failed: %s\n", __func__, strerror( errno ) );
+    out.pos = pos;
+}
+
+static void slice_flush_page( tracecmd_input_t *handle, slice_page_t &page, slice_out_t &out )
+{
+    if ( !page.used )
+        return;
+
+    // The commit field right after the timestamp is the size of the data
+    if ( handle->long_size == 8 )
+    {
+        uint64_t commit = page.used;
+        memcpy( &page.data[ 8 ], &commit, 8 );
+    }
+    else
+    {
+        slice_put4( &page.data[ 8 ], page.used );
+    }
+
+    slice_write( handle, out, page.data.data(), page.data.size() );
+
+    std::fill( page.data.begin(), page.data.end(), 0 );
+    page.used = 0;
+}
+
+// Append a record to page the way the kernel ring buffer lays it out
+static void slice_add_record( tracecmd_input_t *handle, slice_page_t &page, slice_out_t &out,
+                              unsigned long long ts, const void *data, uint32_t size )
+{
+    static const uint32_t s_ts_bits = 27;
+    static const uint32_t s_type_time_extend = 30;
+    size_t header_size = 8 + handle->long_size;
+    size_t avail = handle->page_size - header_size;
+    uint32_t len = ( size + 3 ) & ~3;
+    size_t meta = ( len && ( len <= 28 * 4 ) ) ? 4 : 8;
+    unsigned long long delta = page.used ? ( ts - page.ts ) : 0;
+    size_t extend = ( delta >> s_ts_bits ) ? 8 : 0;
+
+    if ( page.used && ( page.used + extend + meta + len > avail ) )
+    {
+        slice_flush_page( handle, page, out );
+        delta = 0;
+        extend = 0;
+    }
+
+    if ( meta + len > avail )
+        return;
+
+    if ( !page.used )
+        memcpy( &page.data[ 0 ], &ts, 8 );
+
+    char *ptr = &page.data[ header_size + page.used ];
+
+    if ( extend )
+    {
+        slice_put4( ptr, s_type_time_extend | ( ( delta & ( ( 1 << s_ts_bits ) - 1 ) ) << 5 ) );
+        slice_put4( ptr + 4, delta >> s_ts_bits );
+        ptr += 8;
+        delta = 0;
+    }
+
+    if ( meta == 4 )
+    {
+        slice_put4( ptr, ( len / 4 ) | ( delta << 5 ) );
+    }
+    else
+    {
+        slice_put4( ptr, delta << 5 );
+        slice_put4( ptr + 4, len + 4 );
+    }
+    memcpy( ptr + meta, data, size );
+
+    page.used += extend + meta + len;
+    page.ts = ts;
+}
+
+// Write the pages of cpu with records in [ts_start, ts_end] to out. With a
+//  filter, the records it keeps are written to new pages instead.
+static void slice_cpu( tracecmd_input_t *handle, int cpu, int64_t ts_start, int64_t ts_end,
+                       const TraceSliceFilter *filter, slice_out_t &out )
+{
+    cpu_data_t *cpu_data = &handle->cpu_data[ cpu ];
+    size_t page_size = handle->page_size;
+    uint64_t pages = ( cpu_data->file_size + page_size - 1 ) / page_size;
+    std::vector< char > data( page_size );
+    slice_page_t new_page;
+    kbuffer_t *kbuf;
+
+    if ( !pages )
+        return;
+
+    kbuf = kbuffer_alloc( ( handle->long_size == 8 ) ? KBUFFER_LSIZE_8 : KBUFFER_LSIZE_4,
+                          handle->pevent->file_bigendian ? KBUFFER_ENDIAN_BIG : KBUFFER_ENDIAN_LITTLE );
+    if ( !kbuf )
+        die( handle, "%s: kbuffer_alloc failed.\n", __func__ );
+    if ( handle->pevent->old_format )
+        kbuffer_set_old_format( kbuf );
+
+    if ( filter )
+        new_page.data.resize( page_size );
+
+    auto lambda_page_ts = [&]( uint64_t page )
+    {
+        unsigned long long ts = 0;
+
+        do_pread( handle, &ts, 8, cpu_data->file_offset + page * page_size );
+        return ( int64_t )( __data2host8( handle->pevent, ts ) + handle->ts_offset );
+    };
+
+    // Pages of a cpu are in time order, so start with the last one beginning
+    //  at or before ts_start.
+    uint64_t lo = 0;
+    uint64_t hi = pages;
+    while ( lo < hi )
+    {
+        uint64_t mid = lo + ( hi - lo ) / 2;
+
+        if ( lambda_page_ts( mid ) <= ts_start )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for ( uint64_t page = lo ? ( lo - 1 ) : 0; page < pages; page++ )
+    {
+        unsigned long long ts;
+        int64_t first_ts = INT64_MAX;
+        int64_t last_ts = INT64_MIN;
+
+        std::fill( data.begin(), data.end(), 0 );
+        if ( do_pread( handle, data.data(), page_size, cpu_data->file_offset + page * page_size ) <= 0 )
+            die( handle, "%s: reading cpu %d page %llu failed.\n", __func__, cpu, ( unsigned long long )page );
+
+        kbuffer_load_subbuffer( kbuf, data.data() );
+
+        for ( void *rec = kbuffer_read_event( kbuf, &ts ); rec; rec = kbuffer_next_event( kbuf, &ts ) )
+        {
+            int64_t event_ts = ts + handle->ts_offset;
+
+            first_ts = std::min( first_ts, event_ts );
+            last_ts = std::max( last_ts, event_ts );
+
+            if ( filter && ( event_ts >= ts_start ) && ( event_ts <= ts_end ) &&
+                 ( *filter )( cpu, event_ts ) )
+            {
+                slice_add_record( handle, new_page, out, ts, rec, kbuffer_event_size( kbuf ) );
+            }
+        }
+
+        if ( first_ts > ts_end )
+            break;
+
+        if ( !filter && ( last_ts >= ts_start ) )
+            slice_write( handle, out, data.data(), page_size );
+    }
+
+    slice_flush_page( handle, new_page, out );
+    kbuffer_free( kbuf );
+}
+
+static void slice_read_raw( tracecmd_input_t *handle, size_t offset, size_t size, std::string &out )
+{
+    size_t pos = out.size();
+
+    out.resize( pos + size );
+    if ( size && ( do_pread( handle, &out[ pos ], size, offset ) != ( ssize_t )size ) )
+        die( handle, "%s: reading %zu bytes at %zu failed.\n", __func__, size, offset );
+}
+
+static void slice_put8( tracecmd_input_t *handle, std::string &out, unsigned long long val )
+{
+    val = __data2host8( handle->pevent, val );
+    out.append( ( const char * )&val, 8 );
+}
+
+// Write a flyrecord section: the cpu offsets and sizes, the trailer that
+//  follows them, and the page aligned pages of each cpu from every file in
+//  handles. The offsets and sizes are patched in once the pages are written.
+//  Returns the number of page bytes written.
+static uint64_t slice_put_buffer( const std::vector< tracecmd_input_t * > &handles, slice_out_t &out,
+                                  const std::string &trailer, int64_t ts_start, int64_t ts_end,
+                                  const TraceSliceFilter *filter )
+{
+    tracecmd_input_t *handle = handles[ 0 ];
+    uint64_t page_size = handle->page_size;
+    uint64_t table_pos = out.pos;
+    std::string table( handle->cpus * 16, 0 );
+
+    slice_write( handle, out, table.data(), table.size() );
+    slice_write( handle, out, trailer.data(), trailer.size() );
+
+    uint64_t data_offset = ( out.pos + page_size - 1 ) & ~( page_size - 1 );
+    std::string pad( data_offset - out.pos, 0 );
+
+    slice_write( handle, out, pad.data(), pad.size() );
+
+    table.clear();
+    for ( int cpu = 0; cpu < handle->cpus; cpu++ )
+    {
+        uint64_t offset = out.pos;
+
+        for ( tracecmd_input_t *input : handles )
+            slice_cpu( input, cpu, ts_start, ts_end, filter, out );
+
+        slice_put8( handle, table, offset );
+        slice_put8( handle, table, out.pos - offset );
+    }
+
+    slice_write_at( handle, out, table_pos, table.data(), table.size() );
+    return out.pos - data_offset;
+}
+
+bool write_trace_slice( const std::vector< std::string > &files, const char *filename,
+                        int64_t ts_start, int64_t ts_end, const TraceSliceFilter *filter )
+{
+    std::vector< tracecmd_input_t * > handles;
+    std::vector< tracecmd_input_t * > instances;
+    slice_out_t out;
+    std::jmp_buf jump_buffer;
+    bool ret = false;
+
+    for ( const std::string &file : files )
+    {
+        tracecmd_input_t *handle = tracecmd_alloc( file.c_str() );
+
+        if ( !handle )
+        {
+            logf( "[Error] %s: Open trace file \"%s\" failed.", __func__, file.c_str() );
+            goto done;
+        }
+        handles.push_back( handle );
+    }
+    if ( handles.empty() )
+        return false;
+
+    // die() unwinds to here while we read the headers and pages
+    t_jump_buffer = &jump_buffer;
+    if ( setjmp( jump_buffer ) )
+    {
+        ret = false;
+        goto done;
+    }
+
+    for ( tracecmd_input_t *handle : handles )
+    {
+        tracecmd_read_headers( handle );
+        tracecmd_init_data( handle );
+
+        if ( handle->flags & TRACECMD_FL_LATENCY )
+            die( handle, "%s: Latency traces not supported.\n", __func__ );
+
+        // Pages get merged by cpu, so split files need to match the first one
+        if ( ( handle->cpus != handles[ 0 ]->cpus ) ||
+             ( handle->page_size != handles[ 0 ]->page_size ) ||
+             ( handle->nr_buffers != handles[ 0 ]->nr_buffers ) ||
+             ( handle->ts_offset != handles[ 0 ]->ts_offset ) )
+        {
+            die( handle, "%s: \"%s\" cpus, page size, buffers or clock differ from \"%s\".\n",
+                 __func__, handle->file.c_str(), handles[ 0 ]->file.c_str() );
+        }
+
+        if ( filter && ( ( handle->pevent->file_bigendian != handle->pevent->host_bigendian ) ||
+                         handle->pevent->old_format ) )
+        {
+            die( handle, "%s: Can't rewrite the pages of \"%s\" to filter events.\n",
+                 __func__, handle->file.c_str() );
+        }
+
+        for ( int i = 0; i < handle->nr_buffers; i++ )
+        {
+            tracecmd_input_t *instance = tracecmd_buffer_instance_handle( handle, i );
+
+            if ( !instance )
+                die( handle, "%s: could not retrieve handle %s.\n", __func__, handle->buffers[ i ].name );
+
+            instances.push_back( instance );
+        }
+    }
+
+    {
+        tracecmd_input_t *handle = handles[ 0 ];
+        size_t options_pos = 0;
+        std::string header;
+        std::string trace_clock;
+        uint64_t page_bytes = 0;
+
+        // Headers, event formats, kallsyms, printk formats, cmdlines and cpu count
+        //  are copied from the first file.
+        slice_read_raw( handle, 0, handle->cpus_start + 4, header );
+
+        if ( handle->options_end )
+        {
+            header.append( "options  ", 10 );
+            options_pos = header.size();
+            slice_read_raw( handle, handle->options_start, handle->options_end - handle->options_start, header );
+        }
+
+        header.append( "flyrecord", 10 );
+        slice_read_raw( handle, handle->trace_clock_start,
+                        handle->trace_clock_end - handle->trace_clock_start, trace_clock );
+
+        out.fd = TEMP_FAILURE_RETRY( open( filename, O_WRONLY | O_CREAT | O_TRUNC, 0666 ) );
+        if ( out.fd < 0 )
+        {
+            logf( "[Error] %s: open(\"%s\") failed: %s", __func__, filename, strerror( errno ) );
+            goto done;
+        }
+
+        slice_write( handle, out, header.data(), header.size() );
+
+        // Top level buffer, then the buffer instances at the offsets in their options
+        for ( int buffer = -1; buffer < handle->nr_buffers; buffer++ )
+        {
+            std::vector< tracecmd_input_t * > buffer_handles;
+
+            for ( size_t i = 0; i < handles.size(); i++ )
+                buffer_handles.push_back( ( buffer < 0 ) ? handles[ i ] : instances[ i * handle->nr_buffers + buffer ] );
+
+            if ( buffer >= 0 )
+            {
+                unsigned long long offset = __data2host8( handle->pevent, out.pos );
+
+                slice_write_at( handle, out, options_pos + handle->buffers[ buffer ].option_offset - handle->options_start,
+                                &offset, 8 );
+                slice_write( handle, out, "flyrecord", 10 );
+            }
+
+            page_bytes += slice_put_buffer( buffer_handles, out, ( buffer < 0 ) ? trace_clock : "",
+                                            ts_start, ts_end, filter );
+        }
+
+        if ( !page_bytes )
+            logf( "[Error] %s: No events found in the selection.", __func__ );
+        else
+            ret = true;
+    }
+
+done:
+    t_jump_buffer = nullptr;
+
+    if ( out.fd >= 0 )
+    {
+        if ( close( out.fd ) && ret )
+        {
+            logf( "[Error] %s: writing \"%s\" failed: %s", __func__, filename, strerror( errno ) );
+            ret = false;
+        }
+
+        // Don't leave a partial slice behind
+        if ( !ret )
+            unlink( filename );
+    }
+
+    for ( tracecmd_input_t *instance : instances )
+        tracecmd_close( instance );
+    for ( tracecmd_input_t *handle : handles )
+        tracecmd_close( handle );
+
+    return ret;
 }
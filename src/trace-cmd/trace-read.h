@@ -72,17 +72,116 @@ public:
     map_t m_map;
 };
 
+// Chunked bump allocator for types with trivial destructors. Returned
+//  entries are default constructed and stay valid until the arena is destroyed.
+template < typename T >
+class util_arena
+{
+public:
+    util_arena( size_t chunk_count = 64 * 1024 ) : m_chunk_count( chunk_count ) {}
+    ~util_arena()
+    {
+        for ( T *chunk : m_chunks )
+            free( chunk );
+    }
+
+    T *alloc( size_t count )
+    {
+        if ( !count )
+            return NULL;
+
+        if ( m_chunks.empty() || ( m_used + count > m_size ) )
+        {
+            m_size = std::max< size_t >( count, m_chunk_count );
+            m_used = 0;
+            m_chunks.push_back( ( T * )malloc( m_size * sizeof( T ) ) );
+
+            m_bytes_allocated += m_size * sizeof( T );
+        }
+
+        T *ret = m_chunks.back() + m_used;
+
+        for ( size_t i = 0; i < count; i++ )
+            new ( ret + i ) T;
+
+        m_used += count;
+        return ret;
+    }
+
+    size_t bytes_allocated() const
+    {
+        return m_bytes_allocated;
+    }
+
+private:
+    util_arena( const util_arena & ) = delete;
+    util_arena &operator=( const util_arena & ) = delete;
+
+private:
+    size_t m_chunk_count;
+    size_t m_size = 0;
+    size_t m_used = 0;
+    size_t m_bytes_allocated = 0;
+    std::vector< T * > m_chunks;
+};
+
+// Interned strings. Each unique string is stored once in an arena and gets a
+//  stable 32-bit id. Strings are matched on full contents, not just hash.
+//  Lookups are lock free and inserts take a mutex, so several threads can
+//  intern at once.
 class StrPool
 {
 public:
-    StrPool() {}
-    ~StrPool() {}
+    StrPool();
+    ~StrPool();
 
-    const char *getstr( const char *str, size_t len = ( size_t )-1 );
+    const char *getstr( const char *str, size_t len = ( size_t )-1, uint32_t *id = NULL );
+
+    // Return first string with this fnv_hashstr32 hash value.
     const char *findstr( uint32_t hashval );
 
-public:
-    util_umap< uint32_t, std::string > m_pool;
+    // Return string from id handed out by getstr().
+    const char *idtostr( uint32_t id )
+    {
+        return m_id_chunks[ id >> s_id_chunk_shift ][ id & ( s_id_chunk_size - 1 ) ];
+    }
+
+    uint32_t count() const
+    {
+        return m_count;
+    }
+
+    size_t bytes_allocated();
+
+private:
+    StrPool( const StrPool & ) = delete;
+    StrPool &operator=( const StrPool & ) = delete;
+
+    // Open addressed hash table, slots are ( hashval << 32 ) | ( id + 1 ).
+    struct table_t
+    {
+        uint32_t mask;
+        std::atomic< uint64_t > *slots;
+    };
+
+    const char *find( const table_t *table, const char *str, size_t len,
+                      uint32_t hashval, uint32_t *id );
+    void insert( table_t *table, uint32_t hashval, uint32_t id );
+    table_t *grow_table( table_t *table );
+
+private:
+    static const uint32_t s_id_chunk_shift = 16;
+    static const uint32_t s_id_chunk_size = 1 << s_id_chunk_shift;
+    static const uint32_t s_id_chunks_max = 4096;
+
+    std::atomic< table_t * > m_table;
+    // Retired tables. Kept around for readers that may still be probing them.
+    std::vector< table_t * > m_old_tables;
+
+    std::mutex m_mutex;
+    uint32_t m_count = 0;
+    util_arena< char > m_chars{ 1024 * 1024 };
+    const char **m_id_chunks[ s_id_chunks_max ] = {};
 };
 
 struct trace_info_t
@@ -96,8 +195,115 @@ struct trace_info_t
 
 struct event_field_t
 {
-    const char *key;
-    const char *value;
+    event_field_t() {}
+    event_field_t( const event_field_t &rhs ) :
+        key( rhs.key ), value( rhs.value.load( std::memory_order_relaxed ) ) {}
+
+    event_field_t &operator=( const event_field_t &rhs )
+    {
+        key = rhs.key;
+        value.store( rhs.value.load( std::memory_order_relaxed ), std::memory_order_relaxed );
+        return *this;
+    }
+
+    const char *key = nullptr;
+    // NULL until formatted if the event has lazy fields. get_field_value()
+    //  fills it in and may race other threads doing the same.
+    std::atomic< const char * > value{ nullptr };
+};
+
+// Raw record payload of an event read with lazy fields. The field values
+//  are formatted from this the first time they're asked for.
+struct event_raw_t
+{
+    struct event_format *format;
+    StrPool *strpool;           // Pool formatted values are interned in
+    const char *data;           // NULL if the payload is paged in from the trace file
+    uint32_t size;
+    uint64_t offset;            // Trace file offset of payload
+    class TraceRawEvents *pages; // Page cache of paged payloads
+};
+
+// Keeps what's needed to format lazy fields after the trace file has been
+//  closed: a reference on the event formats and copies of the record payloads.
+//  In paged mode the payloads stay in the trace files and are read back through
+//  a page cache with a memory ceiling.
+class TraceRawEvents
+{
+public:
+    TraceRawEvents() {}
+    ~TraceRawEvents();
+
+    // Leave payloads in the trace files and keep at most cache_bytes of file
+    //  pages around. Call before reading the trace.
+    void set_paged( size_t cache_bytes );
+
+    // Copy raw event from the reader (only valid during EventCallback).
+    const event_raw_t *store( const event_raw_t *raw );
+
+    // Copy payload of a paged raw event into buf. Safe to call from any thread.
+    bool read_payload( const event_raw_t *raw, std::vector< char > &buf );
+
+    size_t bytes_allocated() const;
+
+public:
+    // Event formats of each file the raw events came from
+    std::vector< struct pevent * > m_pevents;
+    // Trace file of each m_pevents entry
+    std::vector< std::string > m_files;
+
+private:
+    TraceRawEvents( const TraceRawEvents & ) = delete;
+    TraceRawEvents &operator=( const TraceRawEvents & ) = delete;
+
+private:
+    util_arena< event_raw_t > m_raws;
+    util_arena< char > m_data{ 1024 * 1024 };
+
+    // Paged mode file pages
+    struct raw_page_cache_t *m_page_cache = nullptr;
+};
+
+// Captures the tracefs per cpu ring buffers (per_cpu/cpuN/trace_pipe_raw) on
+//  background threads. trace_pipe_raw is a consuming read, so trace-cmd can't
+//  record the same buffers at the same time. Pages are kept in a ring which
+//  drops the oldest past max_bytes or window_ns, and snapshot() writes the ring
+//  out as a trace.dat that read_trace_file() can load.
+class TraceLiveCapture
+{
+public:
+    TraceLiveCapture() {}
+    ~TraceLiveCapture();
+
+    // tracefs is the tracing directory, ie /sys/kernel/tracing. window_ns of 0
+    //  only limits the ring by size.
+    bool start( const char *tracefs, size_t max_bytes, int64_t window_ns );
+    void stop();
+
+    bool is_running() const
+    {
+        return !!m_capture;
+    }
+
+    // Write the captured pages with the current event formats to filename
+    bool snapshot( const char *filename );
+    // Path of snapshot file slot in a private directory (mkdtemp) made on
+    //  first use and removed with the capture, or "" if that failed. Live
+    //  captures usually run as root, so fixed names in /tmp are unsafe.
+    std::string snapshot_filename( uint32_t slot );
+
+    // Bytes of pages in the ring
+    size_t bytes_captured();
+
+private:
+    TraceLiveCapture( const TraceLiveCapture & ) = delete;
+    TraceLiveCapture &operator=( const TraceLiveCapture & ) = delete;
+
+    void remove_snapshots();
+
+private:
+    struct live_capture_t *m_capture = nullptr;
+    std::string m_snapshot_dir;
 };
 
 enum trace_flag_type_t {
@@ -114,6 +320,7 @@ enum trace_flag_type_t {
     TRACE_FLAG_IS_SW_QUEUE = 0x1000, // amdgpu_cs_ioctl
     TRACE_FLAG_IS_HW_QUEUE = 0x2000, // amdgpu_sched_run_job
     TRACE_FLAG_FENCE_SIGNALED = 0x4000, // *fence_signaled
+    TRACE_FLAG_SCHED_SWITCH = 0x8000, // sched_switch
 };
 
 struct trace_event_t
@@ -134,6 +341,10 @@ struct trace_event_t
     {
         return !!( flags & TRACE_FLAG_IS_TIMELINE );
     }
+    bool is_sched_switch() const
+    {
+        return !!( flags & TRACE_FLAG_SCHED_SWITCH );
+    }
     const char *get_timeline_name( const char *def = NULL ) const
     {
         if ( flags & TRACE_FLAG_IS_SW_QUEUE )
@@ -162,16 +373,49 @@ struct trace_event_t
     uint32_t color;
 
     int64_t ts;                 // timestamp
-    const char *comm;           // command line
     const char *system;         // event system (ftrace-print, etc.)
     const char *name;           // event name
     const char *timeline;       // event timeline (gfx, sdma0, ...)
-    const char *user_comm;      // User space comm (if we can figure this out)
 
-    std::vector< event_field_t > fields;
+    // Strpool ids of the command line and user space comm (if we can figure
+    //  this out). Use TraceEvents::comm_str() to get them with renames applied.
+    uint32_t comm_id;
+    uint32_t user_comm_id;
+
+    // Event fields. Points into the reader's buffers during EventCallback,
+    //  and into TraceEvents::m_fields_arena once the event is stored.
+    //  Use get_field_value() to read values since they may not be formatted yet.
+    uint32_t numfields;
+    event_field_t *fields;
+
+    // Record payload if this event was read with lazy fields, otherwise NULL.
+    const event_raw_t *raw;
+
+    // Return value of fields[ index ], formatting it first if needed.
+    //  Safe to call from several threads at once.
+    const char *get_field_value( uint32_t index ) const;
 };
 
 const char *get_event_field_val( const trace_event_t &event, const char *name );
 
 typedef std::function< int ( const trace_info_t &info, const trace_event_t &event ) > EventCallback;
-int read_trace_file( const char *file, StrPool &strpool, EventCallback &cb );
+
+// Events of all files are merged by timestamp, so files need to share a trace
+//  clock (ie split files of one session).
+// If parallel is set, each cpu buffer is decoded on its own thread and the
+//  results merged by timestamp. Event order is the same either way.
+//  If raw_events is set, only the fields gpuvis needs while loading are formatted
+//  and the rest are left for trace_event_t::get_field_value(). raw_events then
+//  must outlive the events.
+int read_trace_file( const std::vector< std::string > &files, StrPool &strpool, EventCallback &cb,
+                     bool parallel = false, TraceRawEvents *raw_events = NULL );
+
+// Return true to keep the record of cpu at reader timestamp ts (trace_event_t::ts)
+typedef std::function< bool ( uint32_t cpu, int64_t ts ) > TraceSliceFilter;
+
+// Write the pages of files with records in [ts_start, ts_end] to filename as a
+//  trace.dat, with the headers, event formats, kallsyms and cmdlines of the first
+//  file. If filter is set, the pages are rewritten with only the records in range
+//  that it keeps. Pages are streamed to filename, which is removed on failure.
+bool write_trace_slice( const std::vector< std::string > &files, const char *filename,
+                        int64_t ts_start, int64_t ts_end, const TraceSliceFilter *filter = NULL );
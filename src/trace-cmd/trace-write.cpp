@@ -0,0 +1,69 @@
+/*
+ * Copyright 2017 Valve Software
+ *
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <string.h>
+
+#include "trace-write.h"
+
+void trace_put2( std::string &out, uint16_t val )
+{
+    out.append( ( const char * )&val, sizeof( val ) );
+}
+
+void trace_put4( std::string &out, uint32_t val )
+{
+    out.append( ( const char * )&val, sizeof( val ) );
+}
+
+void trace_put8( std::string &out, uint64_t val )
+{
+    out.append( ( const char * )&val, sizeof( val ) );
+}
+
+void trace_put_str( std::string &out, const char *str )
+{
+    out.append( str, strlen( str ) + 1 );
+}
+
+void trace_put_file_header( std::string &out, uint32_t page_size, uint32_t long_size,
+                            const std::string &header_page, const std::string &header_event )
+{
+    static const char s_magic[] = { 23, 8, 68 };
+    uint32_t endian = 1;
+
+    out.append( s_magic, sizeof( s_magic ) );
+    out.append( "tracing", 7 );
+    trace_put_str( out, "6" );
+
+    out.push_back( *( char * )&endian ? 0 : 1 ); // file_bigendian
+    out.push_back( ( char )long_size );
+    trace_put4( out, page_size );
+
+    out.append( "header_page", 12 );
+    trace_put8( out, header_page.size() );
+    out += header_page;
+
+    out.append( "header_event", 13 );
+    trace_put8( out, header_event.size() );
+    out += header_event;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright 2017 Valve Software
+ *
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef _TRACE_WRITE_H_
+#define _TRACE_WRITE_H_
+
+#include <stdint.h>
+#include <string>
+
+// Helpers for building trace.dat files in memory, shared by the live capture
+//  snapshots and the synthetic bench traces. Values are written in host byte
+//  order, which trace_put_file_header() records as the file's endianness.
+void trace_put2( std::string &out, uint16_t val );
+void trace_put4( std::string &out, uint32_t val );
+void trace_put8( std::string &out, uint64_t val );
+// str including its nul terminator
+void trace_put_str( std::string &out, const char *str );
+
+// Write the trace.dat header through the header_event section: magic,
+//  version, endianness, long size, page size, and the ring buffer
+//  header_page / header_event format text.
+void trace_put_file_header( std::string &out, uint32_t page_size, uint32_t long_size,
+                            const std::string &header_page, const std::string &header_event );
+
+#endif // _TRACE_WRITE_H_